@@ -6,8 +6,11 @@
 #ifndef CALVIN_COMMON_ATOMIC_H_
 #define CALVIN_COMMON_ATOMIC_H_
 
+#include <atomic>
+#include <functional>
 #include <map>
 #include <queue>
+#include <unordered_map>
 #include <vector>
 #include "btree/btree_map.h"
 #include "common/mutex.h"
@@ -20,9 +23,171 @@ using std::pair;
 using std::queue;
 using std::vector;
 
-// Queue with atomic push and pop operations. One Push and one Pop can occur
-// concurrently, so consumers will not block producers, and producers will not
-// block consumers.
+// Bounded lock-free multi-producer/multi-consumer queue (Dmitry Vyukov's
+// array-based design). Each cell carries a sequence number saying whose turn
+// it is to use it, so Push and Pop each cost one CAS on their own position
+// counter and never block each other.
+//
+// A queue can be closed, after which all Pushes fail. AtomicQueue uses this
+// to chain BoundedAtomicQueues into an unbounded queue.
+//
+template<typename T>
+class BoundedAtomicQueue {
+ public:
+  // 'capacity' is rounded up to a power of two.
+  explicit BoundedAtomicQueue(uint64 capacity) {
+    capacity_ = 1;
+    while (capacity_ < capacity) {
+      capacity_ *= 2;
+    }
+    cells_ = new Cell[capacity_];
+    for (uint64 i = 0; i < capacity_; i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    enqueue_pos_.store(0, std::memory_order_relaxed);
+    dequeue_pos_.store(0, std::memory_order_relaxed);
+  }
+  ~BoundedAtomicQueue() {
+    delete[] cells_;
+  }
+
+  inline uint64 Capacity() {
+    return capacity_;
+  }
+
+  // Returns the number of elements currently in the queue.
+  inline size_t Size() {
+    // Every dequeue position was claimed after the matching enqueue
+    // position, so reading the dequeue position first can't give a negative
+    // size.
+    uint64 front = dequeue_pos_.load(std::memory_order_acquire);
+    uint64 back = enqueue_pos_.load(std::memory_order_acquire) & ~kClosed;
+    return back - front;
+  }
+
+  // Returns true iff the queue is empty.
+  inline bool Empty() {
+    return Size() == 0;
+  }
+
+  // Pushes 'item' and returns true, unless the queue is full or closed, in
+  // which case returns false.
+  inline bool Push(const T& item) {
+    Cell* cell;
+    uint64 pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      if (pos & kClosed) {
+        return false;
+      }
+      cell = &cells_[pos & (capacity_ - 1)];
+      uint64 seq = cell->sequence.load(std::memory_order_acquire);
+      int64 diff = static_cast<int64>(seq) - static_cast<int64>(pos);
+      if (diff == 0) {
+        // Cell is free; claim it. (Fails if the queue was closed meanwhile.)
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // Cell still holds the element from one lap ago: full.
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = item;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // If the queue is non-empty, (atomically) sets '*result' equal to the front
+  // element, pops the front element from the queue, and returns true,
+  // otherwise returns false.
+  inline bool Pop(T* result) {
+    Cell* cell;
+    uint64 pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & (capacity_ - 1)];
+      uint64 seq = cell->sequence.load(std::memory_order_acquire);
+      int64 diff = static_cast<int64>(seq) - static_cast<int64>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // Empty (or the front element's Push hasn't finished yet).
+        return false;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    *result = cell->data;
+    cell->sequence.store(pos + capacity_, std::memory_order_release);
+    return true;
+  }
+
+  // Sets *result equal to the front element and returns true, unless the
+  // queue is empty, in which case does nothing and returns false. Only safe
+  // if the caller is the queue's only consumer (or holds a lock that all
+  // consumers take), since a concurrent Pop could free the cell for reuse.
+  inline bool Front(T* result) {
+    uint64 pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Cell* cell = &cells_[pos & (capacity_ - 1)];
+    if (cell->sequence.load(std::memory_order_acquire) != pos + 1) {
+      return false;
+    }
+    *result = cell->data;
+    return true;
+  }
+
+  // Makes all future Pushes fail.
+  inline void Close() {
+    enqueue_pos_.fetch_or(kClosed, std::memory_order_acq_rel);
+  }
+
+  // Returns true if the queue is closed and every element pushed before it
+  // was closed has been popped.
+  inline bool Drained() {
+    uint64 back = enqueue_pos_.load(std::memory_order_acquire);
+    return (back & kClosed) &&
+           dequeue_pos_.load(std::memory_order_acquire) == (back & ~kClosed);
+  }
+
+ private:
+  // Flag in enqueue_pos_ marking a closed queue.
+  static const uint64 kClosed = 1ULL << 63;
+
+  struct Cell {
+    std::atomic<uint64> sequence;
+    T data;
+  };
+
+  Cell* cells_;
+  uint64 capacity_;
+
+  // Producer and consumer positions, kept on separate cache lines.
+  char pad0_[64];
+  std::atomic<uint64> enqueue_pos_;
+  char pad1_[64];
+  std::atomic<uint64> dequeue_pos_;
+  char pad2_[64];
+
+  // DISALLOW_COPY_AND_ASSIGN
+  BoundedAtomicQueue(const BoundedAtomicQueue<T>&);
+  BoundedAtomicQueue& operator=(const BoundedAtomicQueue<T>&);
+};
+
+// Unbounded lock-free multi-producer/multi-consumer queue, built as a chain
+// of BoundedAtomicQueue segments. A producer that finds the last segment full
+// closes it and appends a segment twice its size; consumers move on to the
+// next segment once theirs is closed and drained, so FIFO order holds across
+// segments.
+//
+// Drained segments are kept until the queue is destroyed (so no thread can be
+// left holding a pointer to a freed segment). Since each segment is twice the
+// size of the one before, all of them together take less than twice the
+// memory of the largest one, just like a doubling ring buffer.
 //
 // Note: Elements are not guaranteed to have their destructors called
 //       immeduately upon removal from the queue.
@@ -31,86 +196,239 @@ template<typename T>
 class AtomicQueue {
  public:
   AtomicQueue() {
-    queue_.resize(256);
-    size_ = 256;
-    front_ = 0;
-    back_ = 0;
+    first_ = new Segment(256);
+    head_.store(first_, std::memory_order_relaxed);
+    tail_.store(first_, std::memory_order_relaxed);
+  }
+  ~AtomicQueue() {
+    while (first_ != NULL) {
+      Segment* next = first_->next.load(std::memory_order_relaxed);
+      delete first_;
+      first_ = next;
+    }
   }
 
   // Returns the number of elements currently in the queue.
   inline size_t Size() {
-    Lock l(&size_mutex_);
-    return (back_ + size_ - front_) % size_;
+    size_t size = 0;
+    for (Segment* s = head_.load(std::memory_order_acquire); s != NULL;
+         s = s->next.load(std::memory_order_acquire)) {
+      size += s->queue.Size();
+    }
+    return size;
   }
 
   // Returns true iff the queue is empty.
   inline bool Empty() {
-    return front_ == back_;
+    return Size() == 0;
   }
 
   // Atomically pushes 'item' onto the queue.
   inline void Push(const T& item) {
-    Lock l(&back_mutex_);
-    // Check if the buffer has filled up. Acquire all locks and resize if so.
-    if (front_ == (back_+1) % size_) {
-      Lock m(&front_mutex_);
-      Lock n(&size_mutex_);
-      uint32 count = (back_ + size_ - front_) % size_;
-      queue_.resize(size_ * 2);
-      for (uint32 i = 0; i < count; i++) {
-        queue_[size_+i] = queue_[(front_ + i) % size_];
+    while (true) {
+      Segment* tail = tail_.load(std::memory_order_acquire);
+      if (tail->queue.Push(item)) {
+        return;
+      }
+      // Full (or already closed by another producer). Close it and move on to
+      // its successor, appending one if there is none yet.
+      tail->queue.Close();
+      Segment* next = tail->next.load(std::memory_order_acquire);
+      if (next == NULL) {
+        Segment* grown = new Segment(tail->queue.Capacity() * 2);
+        if (tail->next.compare_exchange_strong(next, grown,
+                                               std::memory_order_acq_rel)) {
+          next = grown;
+        } else {
+          delete grown;
+        }
       }
-      front_ = size_;
-      back_ = size_ + count;
-      size_ *= 2;
+      tail_.compare_exchange_strong(tail, next, std::memory_order_acq_rel);
     }
-    // Push item to back of queue.
-    queue_[back_] = item;
-    back_ = (back_ + 1) % size_;
   }
 
   // If the queue is non-empty, (atomically) sets '*result' equal to the front
   // element, pops the front element from the queue, and returns true,
   // otherwise returns false.
   inline bool Pop(T* result) {
-    Lock l(&front_mutex_);
-    if (front_ != back_) {
-      *result = queue_[front_];
-      front_ = (front_ + 1) % size_;
-      return true;
+    while (true) {
+      Segment* head = head_.load(std::memory_order_acquire);
+      if (head->queue.Pop(result)) {
+        return true;
+      }
+      if (!Advance(head)) {
+        return false;
+      }
     }
-    return false;
   }
 
   // Sets *result equal to the front element and returns true, unless the
-  // queue is empty, in which case does nothing and returns false.
+  // queue is empty, in which case does nothing and returns false. Only safe
+  // if the caller is the queue's only consumer (or holds a lock that all
+  // consumers take).
   inline bool Front(T* result) {
-    Lock l(&front_mutex_);
-    if (front_ != back_) {
-      *result = queue_[front_];
-      return true;
+    while (true) {
+      Segment* head = head_.load(std::memory_order_acquire);
+      if (head->queue.Front(result)) {
+        return true;
+      }
+      if (!Advance(head)) {
+        return false;
+      }
     }
-    return false;
   }
 
  private:
-  vector<T> queue_;  // Circular buffer containing elements.
-  uint32 size_;      // Allocated size of queue_, not number of elements.
-  uint32 front_;     // Offset of first (oldest) element.
-  uint32 back_;      // First offset following all elements.
+  struct Segment {
+    explicit Segment(uint64 capacity) : queue(capacity), next(NULL) {}
+    BoundedAtomicQueue<T> queue;
+    std::atomic<Segment*> next;
+  };
 
-  // Mutexes for synchronization.
-  Mutex front_mutex_;
-  Mutex back_mutex_;
-  Mutex size_mutex_;
+  // Moves head_ past 'head' if nothing more can be popped from it. Returns
+  // false if 'head' may still receive elements.
+  inline bool Advance(Segment* head) {
+    Segment* next = head->next.load(std::memory_order_acquire);
+    if (next == NULL || !head->queue.Drained()) {
+      return false;
+    }
+    head_.compare_exchange_strong(head, next, std::memory_order_acq_rel);
+    return true;
+  }
+
+  // Oldest segment, segment consumers pop from, and segment producers push to.
+  Segment* first_;
+  std::atomic<Segment*> head_;
+  char pad_[64];
+  std::atomic<Segment*> tail_;
 
   // DISALLOW_COPY_AND_ASSIGN
   AtomicQueue(const AtomicQueue<T>&);
   AtomicQueue& operator=(const AtomicQueue<T>&);
 };
 
-// TODO(agt): This could be implemented with fewer mutexes....
+// Unbounded lock-free queue for exactly one producer thread and one consumer
+// thread. Needs no atomic read-modify-write operations at all: each side
+// only writes its own position. Elements live in a chain of fixed-size ring
+// segments; the consumer frees each segment once the producer has moved on
+// from it.
+//
+// Same interface as AtomicQueue, so the two are interchangeable on paths
+// that have a single producer and a single consumer.
+//
 template<typename T>
+class SPSCQueue {
+ public:
+  SPSCQueue() {
+    head_ = tail_ = new Segment();
+  }
+  ~SPSCQueue() {
+    while (head_ != NULL) {
+      Segment* next = head_->next.load(std::memory_order_relaxed);
+      delete head_;
+      head_ = next;
+    }
+  }
+
+  // Returns the number of elements currently in the queue. Must only be called
+  // by the consumer.
+  inline size_t Size() {
+    size_t size = 0;
+    for (Segment* s = head_; s != NULL;
+         s = s->next.load(std::memory_order_acquire)) {
+      size += s->back.load(std::memory_order_acquire) -
+              s->front.load(std::memory_order_acquire);
+    }
+    return size;
+  }
+
+  // Returns true iff the queue is empty.
+  inline bool Empty() {
+    return Size() == 0;
+  }
+
+  // Pushes 'item' onto the queue. Must only be called by the producer.
+  inline void Push(const T& item) {
+    Segment* tail = tail_;
+    uint64 back = tail->back.load(std::memory_order_relaxed);
+    if (back - tail->front.load(std::memory_order_acquire) == kSegmentSize) {
+      // Full. Continue in a new segment; the consumer frees this one once it
+      // has drained it.
+      Segment* next = new Segment();
+      next->data[0] = item;
+      next->back.store(1, std::memory_order_relaxed);
+      tail->next.store(next, std::memory_order_release);
+      tail_ = next;
+      return;
+    }
+    tail->data[back % kSegmentSize] = item;
+    tail->back.store(back + 1, std::memory_order_release);
+  }
+
+  // If the queue is non-empty, sets '*result' equal to the front element,
+  // pops it, and returns true, otherwise returns false. Must only be called
+  // by the consumer.
+  inline bool Pop(T* result) {
+    if (!Front(result)) {
+      return false;
+    }
+    head_->front.store(head_->front.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_release);
+    return true;
+  }
+
+  // Sets *result equal to the front element and returns true, unless the
+  // queue is empty, in which case does nothing and returns false. Must only
+  // be called by the consumer.
+  inline bool Front(T* result) {
+    while (true) {
+      uint64 front = head_->front.load(std::memory_order_relaxed);
+      if (front != head_->back.load(std::memory_order_acquire)) {
+        *result = head_->data[front % kSegmentSize];
+        return true;
+      }
+      Segment* next = head_->next.load(std::memory_order_acquire);
+      if (next == NULL) {
+        return false;
+      }
+      // The producer never writes to a segment again after linking its
+      // successor, so if 'head_' is still empty now, it can be freed.
+      if (front != head_->back.load(std::memory_order_acquire)) {
+        continue;
+      }
+      delete head_;
+      head_ = next;
+    }
+  }
+
+ private:
+  static const uint64 kSegmentSize = 256;
+
+  struct Segment {
+    Segment() : front(0), back(0), next(NULL) {}
+    T data[kSegmentSize];
+    std::atomic<uint64> front;
+    char pad[64];
+    std::atomic<uint64> back;
+    std::atomic<Segment*> next;
+  };
+
+  // Segment the consumer pops from, and segment the producer pushes to.
+  Segment* head_;
+  char pad_[64];
+  Segment* tail_;
+
+  // DISALLOW_COPY_AND_ASSIGN
+  SPSCQueue(const SPSCQueue<T>&);
+  SPSCQueue& operator=(const SPSCQueue<T>&);
+};
+
+// Queue whose elements only become poppable 'delay' seconds after they were
+// pushed. 'Queue' may be SPSCQueue if there is a single producer and a single
+// consumer.
+//
+// TODO(agt): This could be implemented with fewer mutexes....
+template<typename T, template<typename> class Queue = AtomicQueue>
 class DelayQueue {
  public:
   DelayQueue() : delay_(0) {}
@@ -132,12 +450,12 @@ class DelayQueue {
 
  private:
   double delay_;
-  AtomicQueue<pair<T, double> > queue_;
+  Queue<pair<T, double> > queue_;
   Mutex mutex_;
 
   // DISALLOW_COPY_AND_ASSIGN
-  DelayQueue(const DelayQueue<T>&);
-  DelayQueue& operator=(const DelayQueue<T>&);
+  DelayQueue(const DelayQueue<T, Queue>&);
+  DelayQueue& operator=(const DelayQueue<T, Queue>&);
 };
 
 template<typename K, typename V>
@@ -193,5 +511,85 @@ class AtomicMap {
   AtomicMap& operator=(const AtomicMap<K, V>&);
 };
 
+// Concurrent hash map with the same interface as AtomicMap. Keys are spread
+// over kStripes independently locked hash tables, so operations on different
+// keys rarely contend, and lookups cost a hash and a short bucket scan rather
+// than a tree walk. Use instead of AtomicMap on hot paths that don't need
+// ordered keys.
+template<typename K, typename V, typename Hash = std::hash<K> >
+class AtomicHashMap {
+ public:
+  AtomicHashMap() {}
+  ~AtomicHashMap() {}
+
+  inline bool Lookup(const K& k, V* v) {
+    Stripe* stripe = StripeFor(k);
+    ReadLock l(&stripe->mutex);
+    typename std::unordered_map<K, V, Hash>::const_iterator lookup =
+        stripe->map.find(k);
+    if (lookup == stripe->map.end()) {
+      return false;
+    }
+    *v = lookup->second;
+    return true;
+  }
+
+  // Like AtomicMap::Put, leaves an existing record for k unchanged.
+  inline void Put(const K& k, const V& v) {
+    Stripe* stripe = StripeFor(k);
+    WriteLock l(&stripe->mutex);
+    stripe->map.insert(std::make_pair(k, v));
+  }
+
+  inline void Erase(const K& k) {
+    Stripe* stripe = StripeFor(k);
+    WriteLock l(&stripe->mutex);
+    stripe->map.erase(k);
+  }
+
+  // Puts (k, v) if there is no record for k. Returns the value of v that is
+  // associated with k afterwards (either the inserted value or the one that
+  // was there already).
+  inline V PutNoClobber(const K& k, const V& v) {
+    Stripe* stripe = StripeFor(k);
+    WriteLock l(&stripe->mutex);
+    return stripe->map.insert(std::make_pair(k, v)).first->second;
+  }
+
+  inline uint32 Size() {
+    uint32 size = 0;
+    for (int i = 0; i < kStripes; i++) {
+      ReadLock l(&stripes_[i].mutex);
+      size += stripes_[i].map.size();
+    }
+    return size;
+  }
+
+ private:
+  static const int kStripes = 64;
+
+  // One lock and table per stripe, padded so that neighboring stripes' locks
+  // don't share a cache line.
+  struct Stripe {
+    MutexRW mutex;
+    std::unordered_map<K, V, Hash> map;
+    char pad[64];
+  };
+
+  inline Stripe* StripeFor(const K& k) {
+    // Mix the hash (std::hash is the identity for integers), then use its top
+    // bits, leaving the low bits to pick the bucket within the stripe.
+    uint64 h = static_cast<uint64>(hash_(k)) * 0x9E3779B97F4A7C15ULL;
+    return &stripes_[h >> 58];
+  }
+
+  Hash hash_;
+  Stripe stripes_[kStripes];
+
+  // DISALLOW_COPY_AND_ASSIGN
+  AtomicHashMap(const AtomicHashMap<K, V, Hash>&);
+  AtomicHashMap& operator=(const AtomicHashMap<K, V, Hash>&);
+};
+
 #endif  // CALVIN_COMMON_ATOMIC_H_
 
@@ -32,6 +32,233 @@ TEST(AtomicQueueTest, AtomicQueueCorrectnessTest) {
   }
 }
 
+TEST(AtomicQueueTest, BoundedAtomicQueue) {
+  BoundedAtomicQueue<int> queue(100);
+  EXPECT_EQ(128, queue.Capacity());
+  for (int i = 0; i < 128; i++) {
+    EXPECT_TRUE(queue.Push(i));
+  }
+  // Full.
+  EXPECT_FALSE(queue.Push(128));
+  EXPECT_EQ(128, queue.Size());
+
+  int test;
+  for (int i = 0; i < 64; i++) {
+    EXPECT_TRUE(queue.Front(&test));
+    EXPECT_EQ(i, test);
+    EXPECT_TRUE(queue.Pop(&test));
+    EXPECT_EQ(i, test);
+  }
+  EXPECT_TRUE(queue.Push(128));
+
+  // Closed.
+  queue.Close();
+  EXPECT_FALSE(queue.Push(129));
+  EXPECT_FALSE(queue.Drained());
+  for (int i = 64; i <= 128; i++) {
+    EXPECT_TRUE(queue.Pop(&test));
+    EXPECT_EQ(i, test);
+  }
+  EXPECT_FALSE(queue.Pop(&test));
+  EXPECT_TRUE(queue.Drained());
+  EXPECT_TRUE(queue.Empty());
+}
+
+TEST(AtomicQueueTest, SPSCQueue) {
+  SPSCQueue<int> queue;
+  int test;
+  EXPECT_FALSE(queue.Pop(&test));
+  // Interleave pushes and pops across several segments.
+  int pushed = 0;
+  int popped = 0;
+  for (int round = 0; round < 100; round++) {
+    for (int i = 0; i < round * 10; i++) {
+      queue.Push(pushed++);
+    }
+    EXPECT_EQ(pushed - popped, queue.Size());
+    for (int i = 0; i < round * 5; i++) {
+      EXPECT_TRUE(queue.Front(&test));
+      EXPECT_EQ(popped, test);
+      EXPECT_TRUE(queue.Pop(&test));
+      EXPECT_EQ(popped++, test);
+    }
+  }
+  while (queue.Pop(&test)) {
+    EXPECT_EQ(popped++, test);
+  }
+  EXPECT_EQ(pushed, popped);
+  EXPECT_TRUE(queue.Empty());
+}
+
+// Elements pushed by the concurrent tests encode their producer and sequence
+// number.
+const int kProducerShift = 24;
+
+struct ConcurrentTestArgs {
+  AtomicQueue<int>* mpmc;
+  SPSCQueue<int>* spsc;
+  int producer;
+  int count;
+  atomic<int>* remaining;
+  vector<int> popped;
+};
+
+void* ConcurrentPushThread(void* arg) {
+  ConcurrentTestArgs* args = reinterpret_cast<ConcurrentTestArgs*>(arg);
+  for (int i = 0; i < args->count; i++) {
+    int item = (args->producer << kProducerShift) | i;
+    if (args->mpmc != NULL) {
+      args->mpmc->Push(item);
+    } else {
+      args->spsc->Push(item);
+    }
+  }
+  return NULL;
+}
+
+void* ConcurrentPopThread(void* arg) {
+  ConcurrentTestArgs* args = reinterpret_cast<ConcurrentTestArgs*>(arg);
+  int item;
+  while (*args->remaining > 0) {
+    bool popped = args->mpmc != NULL ? args->mpmc->Pop(&item)
+                                     : args->spsc->Pop(&item);
+    if (popped) {
+      args->popped.push_back(item);
+      --*args->remaining;
+    }
+  }
+  return NULL;
+}
+
+// Checks that every element was popped exactly once, and that each consumer
+// saw each producer's elements in order.
+void CheckPopped(const vector<ConcurrentTestArgs>& consumers,
+                 int producers,
+                 int count) {
+  vector<int> seen(producers, 0);
+  for (uint32 i = 0; i < consumers.size(); i++) {
+    vector<int> last(producers, -1);
+    for (uint32 j = 0; j < consumers[i].popped.size(); j++) {
+      int item = consumers[i].popped[j];
+      int producer = item >> kProducerShift;
+      int sequence = item & ((1 << kProducerShift) - 1);
+      ASSERT_LT(producer, producers);
+      EXPECT_LT(last[producer], sequence);
+      last[producer] = sequence;
+      seen[producer]++;
+    }
+  }
+  for (int i = 0; i < producers; i++) {
+    EXPECT_EQ(count, seen[i]);
+  }
+}
+
+void RunConcurrentTest(int producers, int consumers, bool spsc) {
+  const int kCount = 200000;
+  AtomicQueue<int> mpmc;
+  SPSCQueue<int> spsc_queue;
+  atomic<int> remaining(producers * kCount);
+  vector<ConcurrentTestArgs> args(producers + consumers);
+  vector<pthread_t> threads(producers + consumers);
+  for (int i = 0; i < producers + consumers; i++) {
+    args[i].mpmc = spsc ? NULL : &mpmc;
+    args[i].spsc = &spsc_queue;
+    args[i].producer = i;
+    args[i].count = kCount;
+    args[i].remaining = &remaining;
+  }
+  for (int i = 0; i < producers + consumers; i++) {
+    pthread_create(&threads[i],
+                   NULL,
+                   i < producers ? ConcurrentPushThread : ConcurrentPopThread,
+                   reinterpret_cast<void*>(&args[i]));
+  }
+  for (int i = 0; i < producers + consumers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  CheckPopped(vector<ConcurrentTestArgs>(args.begin() + producers, args.end()),
+              producers,
+              kCount);
+  EXPECT_TRUE(spsc ? spsc_queue.Empty() : mpmc.Empty());
+}
+
+TEST(AtomicQueueTest, ConcurrentMPMC) {
+  RunConcurrentTest(4, 4, false);
+  RunConcurrentTest(1, 6, false);
+  RunConcurrentTest(6, 1, false);
+}
+
+TEST(AtomicQueueTest, ConcurrentSPSC) {
+  RunConcurrentTest(1, 1, true);
+}
+
+TEST(AtomicHashMapTest, Basic) {
+  AtomicHashMap<string, int> map;
+  int v;
+  EXPECT_FALSE(map.Lookup("a", &v));
+  map.Put("a", 1);
+  EXPECT_TRUE(map.Lookup("a", &v));
+  EXPECT_EQ(1, v);
+
+  // Neither Put nor PutNoClobber overwrites an existing record.
+  map.Put("a", 2);
+  EXPECT_EQ(1, map.PutNoClobber("a", 3));
+  EXPECT_EQ(4, map.PutNoClobber("b", 4));
+  EXPECT_TRUE(map.Lookup("a", &v));
+  EXPECT_EQ(1, v);
+  EXPECT_EQ(2, map.Size());
+
+  map.Erase("a");
+  EXPECT_FALSE(map.Lookup("a", &v));
+  EXPECT_EQ(1, map.Size());
+}
+
+struct HashMapTestArgs {
+  AtomicHashMap<uint64, uint64>* map;
+  int thread;
+  atomic<int>* winners;
+};
+
+void* HashMapTestThread(void* arg) {
+  HashMapTestArgs* args = reinterpret_cast<HashMapTestArgs*>(arg);
+  for (uint64 i = 0; i < 10000; i++) {
+    // Every thread races to claim each shared key; each also owns some keys.
+    if (args->map->PutNoClobber(i, args->thread) ==
+        static_cast<uint64>(args->thread)) {
+      ++*args->winners;
+    }
+    uint64 own = (static_cast<uint64>(args->thread + 1) << 32) | i;
+    args->map->Put(own, i);
+    uint64 v;
+    EXPECT_TRUE(args->map->Lookup(own, &v));
+    EXPECT_EQ(i, v);
+    if (i % 2 == 0) {
+      args->map->Erase(own);
+    }
+  }
+  return NULL;
+}
+
+TEST(AtomicHashMapTest, Concurrent) {
+  const int kThreads = 8;
+  AtomicHashMap<uint64, uint64> map;
+  atomic<int> winners(0);
+  vector<HashMapTestArgs> args(kThreads);
+  vector<pthread_t> threads(kThreads);
+  for (int i = 0; i < kThreads; i++) {
+    args[i].map = &map;
+    args[i].thread = i;
+    args[i].winners = &winners;
+    pthread_create(&threads[i], NULL, HashMapTestThread, &args[i]);
+  }
+  for (int i = 0; i < kThreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  // Each shared key was claimed exactly once.
+  EXPECT_EQ(10000, winners.load());
+  EXPECT_EQ(10000 + kThreads * 5000, map.Size());
+}
+
 ///////////////////////   atomic primitive benchmarks   ////////////////////////
 
 void BenchmarkAtomicQueue() {
@@ -20,6 +20,7 @@
 #define CALVIN_COMMON_MUTEX_H_
 
 #include <pthread.h>
+#include <time.h>
 #include <glog/logging.h>
 
 class Mutex {
@@ -31,6 +32,7 @@ class Mutex {
 
  private:
   friend class Lock;
+  friend class CondVar;
   // Actual pthread mutex wrapped by Mutex class.
   pthread_mutex_t mutex_;
 
@@ -59,6 +61,55 @@ class Lock {
   Lock& operator=(const Lock&);
 };
 
+// Condition variable, used together with a Mutex:
+//
+//    Lock l(&m);
+//    while (!<condition>) {
+//      cv.Wait(&m);
+//    }
+//
+class CondVar {
+ public:
+  CondVar() {
+    pthread_cond_init(&cond_, NULL);
+  }
+  ~CondVar() {
+    pthread_cond_destroy(&cond_);
+  }
+
+  // Atomically releases 'mutex' (which the caller must hold via a Lock) and
+  // blocks until signaled, then reacquires 'mutex'. May wake up spuriously.
+  void Wait(Mutex* mutex) {
+    pthread_cond_wait(&cond_, &mutex->mutex_);
+  }
+
+  // Like Wait, but gives up at 'deadline' (in seconds since the epoch, as
+  // returned by GetTime()). Returns false if the deadline passed.
+  bool WaitUntil(Mutex* mutex, double deadline) {
+    struct timespec ts;
+    ts.tv_sec = static_cast<time_t>(deadline);
+    ts.tv_nsec = static_cast<long>((deadline - ts.tv_sec) * 1e9);  // NOLINT
+    return pthread_cond_timedwait(&cond_, &mutex->mutex_, &ts) == 0;
+  }
+
+  // Wakes one waiting thread.
+  void Signal() {
+    pthread_cond_signal(&cond_);
+  }
+
+  // Wakes all waiting threads.
+  void SignalAll() {
+    pthread_cond_broadcast(&cond_);
+  }
+
+ private:
+  pthread_cond_t cond_;
+
+  // DISALLOW_COPY_AND_ASSIGN
+  CondVar(const CondVar&);
+  CondVar& operator=(const CondVar&);
+};
+
 class MutexRW {
  public:
   // Mutexes come into the world unlocked.
@@ -0,0 +1,193 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+// Thread-local free lists for small, frequently allocated objects, backed by
+// a shared depot.
+//
+// A class opts in by routing its allocation through a Pool:
+//
+//   class Foo {
+//    public:
+//     static void* operator new(size_t size) {
+//       return Pool<Foo>::Allocate(size);
+//     }
+//     static void operator delete(void* p, size_t size) {
+//       Pool<Foo>::Release(p, size);
+//     }
+//     ...
+//   };
+//
+// Each thread keeps up to kMaxCached released objects of each pooled type and
+// reuses them for its next allocations. Objects are often released by a
+// different thread than the one that allocated them (e.g. messages are
+// allocated on receiver threads and freed on worker threads), so a thread
+// whose cache is full moves a batch of kBatchSize objects to a depot shared by
+// all threads, and a thread whose cache is empty refills it with a batch from
+// the depot. Steady-state churn thus reaches malloc rarely even when objects
+// flow one way between threads, and takes the depot's lock once per batch.
+//
+// Pools are bypassed in AddressSanitizer builds, so that use-after-free bugs
+// in pooled objects are still caught.
+
+#ifndef CALVIN_COMMON_POOL_H_
+#define CALVIN_COMMON_POOL_H_
+
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <vector>
+#include "common/mutex.h"
+
+template<typename T>
+class Pool {
+ public:
+  // Returns storage for a T. 'size' is the size passed to T's operator new,
+  // which exceeds sizeof(T) for subclasses of T; those are never pooled.
+  static void* Allocate(size_t size) {
+#ifndef __SANITIZE_ADDRESS__
+    Cache* cache = GetCache();
+    if (size == sizeof(T) && cache->head == NULL && cache->alive) {
+      Refill(cache);
+    }
+    if (size == sizeof(T) && cache->head != NULL) {
+      Block* block = cache->head;
+      cache->head = block->next;
+      cache->count--;
+      return block;
+    }
+#endif
+    void* p = malloc(size < sizeof(Block) ? sizeof(Block) : size);
+    if (p == NULL) {
+      throw std::bad_alloc();
+    }
+    return p;
+  }
+
+  // Returns storage obtained from Allocate(size) to the pool.
+  static void Release(void* p, size_t size) {
+    if (p == NULL) {
+      return;
+    }
+#ifndef __SANITIZE_ADDRESS__
+    Cache* cache = GetCache();
+    if (size == sizeof(T) && cache->alive) {
+      if (cache->count == kMaxCached) {
+        Spill(cache);
+      }
+      Block* block = reinterpret_cast<Block*>(p);
+      block->next = cache->head;
+      cache->head = block;
+      cache->count++;
+      return;
+    }
+#endif
+    free(p);
+  }
+
+  // Returns the number of objects cached by the calling thread.
+  static int Cached() {
+    return GetCache()->count;
+  }
+
+  // Returns the number of objects held in the shared depot.
+  static int Deposited() {
+    Depot* depot = GetDepot();
+    Lock l(&depot->mutex);
+    return depot->batches.size() * kBatchSize;
+  }
+
+ private:
+  static const int kMaxCached = 1024;
+  static const int kBatchSize = 64;
+  static const int kMaxDepotBatches = 64;
+
+  // A free object, linked into the calling thread's cache.
+  union Block {
+    Block* next;
+    char storage[sizeof(T)];
+  };
+
+  struct Cache {
+    Cache() : head(NULL), count(0), alive(true) {}
+
+    // Frees cached objects when the thread exits. Objects released after
+    // that (by other thread-local destructors) go straight to free().
+    ~Cache() {
+      alive = false;
+      while (head != NULL) {
+        Block* next = head->next;
+        free(head);
+        head = next;
+      }
+      count = 0;
+    }
+
+    Block* head;
+    int count;
+    bool alive;
+  };
+
+  // Batches of kBatchSize free objects, each a linked list. 'size' mirrors
+  // batches.size(), so that threads can skip the lock when there are none.
+  struct Depot {
+    Depot() : size(0) {}
+    Mutex mutex;
+    std::vector<Block*> batches;
+    std::atomic<int> size;
+  };
+
+  static Cache* GetCache() {
+    static thread_local Cache cache;
+    return &cache;
+  }
+
+  // Never destroyed, since threads may release objects during exit.
+  static Depot* GetDepot() {
+    static Depot* depot = new Depot();
+    return depot;
+  }
+
+  // Moves a batch from the depot into the (empty) cache, if there is one.
+  static void Refill(Cache* cache) {
+    Depot* depot = GetDepot();
+    if (depot->size == 0) {
+      return;
+    }
+    Lock l(&depot->mutex);
+    if (!depot->batches.empty()) {
+      cache->head = depot->batches.back();
+      cache->count = kBatchSize;
+      depot->batches.pop_back();
+      depot->size--;
+    }
+  }
+
+  // Moves a batch from the (full) cache into the depot, or frees it if the
+  // depot is full.
+  static void Spill(Cache* cache) {
+    Block* batch = cache->head;
+    Block* last = batch;
+    for (int i = 1; i < kBatchSize; i++) {
+      last = last->next;
+    }
+    cache->head = last->next;
+    cache->count -= kBatchSize;
+    last->next = NULL;
+    {
+      Depot* depot = GetDepot();
+      Lock l(&depot->mutex);
+      if (static_cast<int>(depot->batches.size()) < kMaxDepotBatches) {
+        depot->batches.push_back(batch);
+        depot->size++;
+        return;
+      }
+    }
+    while (batch != NULL) {
+      Block* next = batch->next;
+      free(batch);
+      batch = next;
+    }
+  }
+};
+
+#endif  // CALVIN_COMMON_POOL_H_
+
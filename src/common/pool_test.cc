@@ -0,0 +1,128 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+
+#include "common/pool.h"
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <set>
+#include <vector>
+
+using std::set;
+using std::vector;
+
+class Pooled {
+ public:
+  explicit Pooled(int x) : x_(x) {}
+  virtual ~Pooled() {}
+  int x() const { return x_; }
+
+  static void* operator new(size_t size) {
+    return Pool<Pooled>::Allocate(size);
+  }
+  static void operator delete(void* p, size_t size) {
+    Pool<Pooled>::Release(p, size);
+  }
+
+ private:
+  int x_;
+};
+
+// Larger than Pooled, so never pooled.
+class Derived : public Pooled {
+ public:
+  Derived() : Pooled(-1) {
+    padding_[0] = 0;
+  }
+  virtual ~Derived() {}
+
+ private:
+  char padding_[100];
+};
+
+#ifndef __SANITIZE_ADDRESS__
+
+TEST(PoolTest, ReusesReleasedObjects) {
+  int cached = Pool<Pooled>::Cached();
+  vector<Pooled*> objects;
+  set<Pooled*> addresses;
+  for (int i = 0; i < 100; i++) {
+    objects.push_back(new Pooled(i));
+    addresses.insert(objects.back());
+  }
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(i, objects[i]->x());
+    delete objects[i];
+  }
+  EXPECT_EQ(cached + 100, Pool<Pooled>::Cached());
+
+  // New objects come from the cache.
+  for (int i = 0; i < 100; i++) {
+    objects[i] = new Pooled(i);
+    EXPECT_TRUE(addresses.count(objects[i]));
+  }
+  EXPECT_EQ(cached, Pool<Pooled>::Cached());
+  for (int i = 0; i < 100; i++) {
+    delete objects[i];
+  }
+}
+
+TEST(PoolTest, SubclassesBypassPool) {
+  int cached = Pool<Pooled>::Cached();
+  Pooled* derived = new Derived();
+  EXPECT_EQ(-1, derived->x());
+  delete derived;
+  EXPECT_EQ(cached, Pool<Pooled>::Cached());
+}
+
+void* AllocateMany(void* arg) {
+  vector<Pooled*>* objects = reinterpret_cast<vector<Pooled*>*>(arg);
+  for (int i = 0; i < 5000; i++) {
+    objects->push_back(new Pooled(i));
+  }
+  return NULL;
+}
+
+TEST(PoolTest, CrossThreadRelease) {
+  // Objects allocated by another thread join this thread's cache, up to its
+  // limit. The rest go to the depot in batches.
+  vector<Pooled*> objects;
+  pthread_t thread;
+  pthread_create(&thread, NULL, AllocateMany, &objects);
+  pthread_join(thread, NULL);
+  set<Pooled*> addresses(objects.begin(), objects.end());
+  for (int i = 0; i < static_cast<int>(objects.size()); i++) {
+    EXPECT_EQ(i, objects[i]->x());
+    delete objects[i];
+  }
+  EXPECT_GE(1024, Pool<Pooled>::Cached());
+  EXPECT_LT(1024 - 64, Pool<Pooled>::Cached());
+  EXPECT_LT(0, Pool<Pooled>::Deposited());
+
+  // A thread with an empty cache (like a message receiver thread) refills it
+  // from the depot.
+  int deposited = Pool<Pooled>::Deposited();
+  objects.clear();
+  pthread_create(&thread, NULL, AllocateMany, &objects);
+  pthread_join(thread, NULL);
+  int reused = 0;
+  for (int i = 0; i < static_cast<int>(objects.size()); i++) {
+    reused += addresses.count(objects[i]);
+    delete objects[i];
+  }
+  EXPECT_LE(deposited, reused);
+}
+
+#endif  // __SANITIZE_ADDRESS__
+
+TEST(PoolTest, AllocateAndFree) {
+  for (int i = 0; i < 10000; i++) {
+    Pooled* p = new Pooled(i);
+    EXPECT_EQ(i, p->x());
+    delete p;
+  }
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,338 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+// ProtobufReader extracts individual fields from a serialized protocol buffer
+// without parsing the whole message. Looking up one field costs a linear scan
+// over the encoded tags (skipping over the bodies of all other fields), which
+// is much cheaper than ParseFromString for messages with large repeated
+// fields, and performs no allocation when reading into a Slice or a nested
+// ProtobufReader.
+//
+// Example:
+//
+//   ProtobufReader reader(serialized_entry);
+//   uint32 type;
+//   if (reader.ReadField<uint32>(5, &type)) { ... }
+//   int children = reader.CountRepeatedField(7);
+//
+// Readers never own the bytes they point at; the encoded buffer must outlive
+// the reader (and any Slices or nested readers obtained from it).
+//
+// Malformed input never causes a crash: all accessors simply return false
+// (or -1 / the count so far) once an unparseable tag or value is reached.
+//
+// AppendLengthDelimitedField goes the other way, splicing a new occurrence of
+// a repeated string/bytes/message field onto an existing encoding. Because the
+// protobuf wire format concatenates repeated fields, this is equivalent to
+// parsing, calling add_<field>(), and reserializing.
+
+#ifndef CALVIN_COMMON_PROTOBUF_READER_H_
+#define CALVIN_COMMON_PROTOBUF_READER_H_
+
+#include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <leveldb/slice.h>
+
+#include <string>
+
+#include "common/types.h"
+#include "common/varint.h"
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormat;
+using google::protobuf::internal::WireFormatLite;
+using leveldb::Slice;
+using std::string;
+
+class ProtobufReader {
+ public:
+  ProtobufReader() {}
+  explicit ProtobufReader(const Slice& encoded) : encoded_(encoded) {}
+
+  // Reads the first occurrence of 'field' into '*value'. Returns false if the
+  // field is absent, has the wrong wire type, or the encoding is malformed.
+  template<typename T>
+  bool ReadField(uint32 field, T* value) const;
+
+  // Reads the 'index'th occurrence of 'field' into '*value'.
+  template<typename T>
+  bool ReadRepeatedField(uint32 field, int index, T* value) const;
+
+  // Returns true iff at least one occurrence of 'field' is present.
+  bool HasField(uint32 field) const;
+
+  // Returns the number of occurrences of 'field'.
+  int CountRepeatedField(uint32 field) const;
+
+  // Returns the index of the first occurrence of 'field' whose value equals
+  // 'value', or -1 if there is none. Single pass, unlike repeated calls to
+  // ReadRepeatedField.
+  template<typename T>
+  int FindRepeatedField(uint32 field, const T& value) const;
+
+  const Slice& encoded() const { return encoded_; }
+
+ private:
+  template<typename T>
+  bool ReadValue(CodedInputStream* input, T* value) const;
+
+  // Advances '*input' just past the tag of the next occurrence of 'field'
+  // whose wire type is compatible with T. Returns false at the end of the
+  // buffer or on malformed input.
+  template<typename T>
+  bool SeekField(CodedInputStream* input, uint32 field) const;
+
+  Slice encoded_;
+
+  // Intentionally copyable.
+};
+
+// Appends a single occurrence of length-delimited field 'field' (a string,
+// bytes or embedded message field) with contents 'value' to '*encoded'.
+inline void AppendLengthDelimitedField(
+    uint32 field,
+    const Slice& value,
+    string* encoded) {
+  varint::Append64(encoded, WireFormatLite::MakeTag(
+      field, WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+  varint::Append64(encoded, value.size());
+  encoded->append(value.data(), value.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+inline bool CheckTag(uint32 tag) {
+  LOG(FATAL) << "CheckTag<T>: unknown template type";
+  return false;
+}
+
+// Specialization: uint32
+template<>
+inline bool CheckTag<uint32>(uint32 tag) {
+  return WireFormatLite::GetTagWireType(tag) ==
+         WireFormatLite::WIRETYPE_VARINT;
+}
+
+// Specialization: uint64
+template<>
+inline bool CheckTag<uint64>(uint32 tag) {
+  return WireFormatLite::GetTagWireType(tag) ==
+         WireFormatLite::WIRETYPE_VARINT;
+}
+
+// Specialization: bool
+template<>
+inline bool CheckTag<bool>(uint32 tag) {
+  return WireFormatLite::GetTagWireType(tag) ==
+         WireFormatLite::WIRETYPE_VARINT;
+}
+
+// Specialization: string
+template<>
+inline bool CheckTag<string>(uint32 tag) {
+  return WireFormatLite::GetTagWireType(tag) ==
+         WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+}
+
+// Specialization: Slice
+template<>
+inline bool CheckTag<Slice>(uint32 tag) {
+  return WireFormatLite::GetTagWireType(tag) ==
+         WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+}
+
+// Specialization: ProtobufReader
+template<>
+inline bool CheckTag<ProtobufReader>(uint32 tag) {
+  return WireFormatLite::GetTagWireType(tag) ==
+         WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+}
+
+template<typename T>
+inline bool ProtobufReader::ReadValue(CodedInputStream* input, T* value) const {
+  LOG(FATAL) << "ReadValue<T>: unknown template type";
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Specialization: uint32
+template<>
+inline bool ProtobufReader::ReadValue<uint32>(
+    CodedInputStream* input,
+    uint32* value) const {
+  return input->ReadVarint32(value);
+}
+
+// Specialization: uint64
+template<>
+inline bool ProtobufReader::ReadValue<uint64>(
+    CodedInputStream* input,
+    uint64* value) const {
+  google::protobuf::uint64 v;
+  if (!input->ReadVarint64(&v)) return false;
+  *value = v;
+  return true;
+}
+
+// Specialization: bool
+template<>
+inline bool ProtobufReader::ReadValue<bool>(
+    CodedInputStream* input,
+    bool* value) const {
+  uint32 v;
+  if (!input->ReadVarint32(&v)) return false;
+  *value = (v != 0);
+  return true;
+}
+
+// Specialization: string
+template<>
+inline bool ProtobufReader::ReadValue<string>(
+    CodedInputStream* input,
+    string* value) const {
+  uint32 length;
+  if (!input->ReadVarint32(&length)) return false;
+  if (length > encoded_.size() - input->CurrentPosition()) return false;
+  value->assign(encoded_.data() + input->CurrentPosition(), length);
+  return input->Skip(length);
+}
+
+// Specialization: Slice
+template<>
+inline bool ProtobufReader::ReadValue<Slice>(
+    CodedInputStream* input,
+    Slice* value) const {
+  uint32 length;
+  if (!input->ReadVarint32(&length)) return false;
+  if (length > encoded_.size() - input->CurrentPosition()) return false;
+  *value = Slice(encoded_.data() + input->CurrentPosition(), length);
+  return input->Skip(length);
+}
+
+// Specialization: ProtobufReader
+template<>
+inline bool ProtobufReader::ReadValue<ProtobufReader>(
+    CodedInputStream* input,
+    ProtobufReader* value) const {
+  uint32 length;
+  if (!input->ReadVarint32(&length)) return false;
+  if (length > encoded_.size() - input->CurrentPosition()) return false;
+  *value = ProtobufReader(Slice(encoded_.data() + input->CurrentPosition(),
+                          length));
+  return input->Skip(length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+bool ProtobufReader::SeekField(CodedInputStream* input, uint32 field) const {
+  while (input->CurrentPosition() < static_cast<int>(encoded_.size())) {
+    uint32 tag = input->ReadTag();
+    if (tag == 0) {
+      return false;  // Malformed tag.
+    }
+    if (tag >> 3 == field && CheckTag<T>(tag)) {
+      return true;
+    }
+    if (!WireFormat::SkipField(input, tag, NULL)) {
+      return false;
+    }
+  }
+  return false;
+}
+
+template<typename T>
+bool ProtobufReader::ReadField(uint32 field, T* value) const {
+  CodedInputStream input(
+      reinterpret_cast<const uint8*>(encoded_.data()),
+      encoded_.size());
+  if (!SeekField<T>(&input, field)) {
+    return false;
+  }
+  if (value == NULL) {
+    return true;
+  }
+  return ReadValue<T>(&input, value);
+}
+
+template<typename T>
+bool ProtobufReader::ReadRepeatedField(
+    uint32 field,
+    int index,
+    T* value) const {
+  CodedInputStream input(
+      reinterpret_cast<const uint8*>(encoded_.data()),
+      encoded_.size());
+  T scratch;
+  for (int current = 0; SeekField<T>(&input, field); current++) {
+    if (current == index) {
+      return value == NULL ? true : ReadValue<T>(&input, value);
+    }
+    if (!ReadValue<T>(&input, &scratch)) {
+      return false;
+    }
+  }
+  return false;
+}
+
+template<typename T>
+int ProtobufReader::FindRepeatedField(uint32 field, const T& value) const {
+  CodedInputStream input(
+      reinterpret_cast<const uint8*>(encoded_.data()),
+      encoded_.size());
+  T current;
+  for (int index = 0; SeekField<T>(&input, field); index++) {
+    if (!ReadValue<T>(&input, &current)) {
+      return -1;
+    }
+    if (current == value) {
+      return index;
+    }
+  }
+  return -1;
+}
+
+inline bool ProtobufReader::HasField(uint32 field) const {
+  CodedInputStream input(
+      reinterpret_cast<const uint8*>(encoded_.data()),
+      encoded_.size());
+  while (input.CurrentPosition() < static_cast<int>(encoded_.size())) {
+    uint32 tag = input.ReadTag();
+    if (tag == 0) {
+      return false;
+    }
+    if (tag >> 3 == field) {
+      return true;
+    }
+    if (!WireFormat::SkipField(&input, tag, NULL)) {
+      return false;
+    }
+  }
+  return false;
+}
+
+inline int ProtobufReader::CountRepeatedField(uint32 field) const {
+  int count = 0;
+  CodedInputStream input(
+      reinterpret_cast<const uint8*>(encoded_.data()),
+      encoded_.size());
+  while (input.CurrentPosition() < static_cast<int>(encoded_.size())) {
+    uint32 tag = input.ReadTag();
+    if (tag == 0) {
+      break;
+    }
+    if (tag >> 3 == field) {
+      count++;
+    }
+    if (!WireFormat::SkipField(&input, tag, NULL)) {
+      break;
+    }
+  }
+  return count;
+}
+
+#endif  // CALVIN_COMMON_PROTOBUF_READER_H_
+
@@ -1,7 +1,7 @@
 // Author: Alexander Thomson <thomson@cs.yale.edu>
 //
 
-#include "experimental/protobuf_reader.h"
+#include "common/protobuf_reader.h"
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -110,6 +110,73 @@ TEST(ProtobufReaderTest, ReadFields) {
   EXPECT_FALSE(ProtobufReader(e).ReadRepeatedField<Slice>(2, 2, &sl));
 }
 
+TEST(ProtobufReaderTest, RepeatedFieldHelpers) {
+  string e;
+  A a;
+  a.add_x(7);
+  a.add_s("foo");
+  a.add_s("bar");
+  a.add_s("baz");
+  a.SerializeToString(&e);
+
+  ProtobufReader reader(e);
+  EXPECT_TRUE(reader.HasField(1));
+  EXPECT_TRUE(reader.HasField(2));
+  EXPECT_FALSE(reader.HasField(3));
+  EXPECT_EQ(1, reader.CountRepeatedField(1));
+  EXPECT_EQ(3, reader.CountRepeatedField(2));
+  EXPECT_EQ(0, reader.FindRepeatedField<Slice>(2, Slice("foo")));
+  EXPECT_EQ(2, reader.FindRepeatedField<Slice>(2, Slice("baz")));
+  EXPECT_EQ(-1, reader.FindRepeatedField<Slice>(2, Slice("qux")));
+  EXPECT_EQ(0, reader.FindRepeatedField<uint32>(1, 7));
+  EXPECT_EQ(-1, reader.FindRepeatedField<uint32>(1, 8));
+
+  // Fields read with the wrong wire type are treated as absent.
+  uint32 x;
+  EXPECT_FALSE(reader.ReadField<uint32>(2, &x));
+  EXPECT_FALSE(reader.ReadField<Slice>(1, NULL));
+}
+
+TEST(ProtobufReaderTest, AppendLengthDelimitedField) {
+  string e;
+  A a;
+  a.add_x(3);
+  a.add_s("foo");
+  a.SerializeToString(&e);
+
+  AppendLengthDelimitedField(2, "bar", &e);
+  AppendLengthDelimitedField(2, string(300, 'z'), &e);
+
+  A b;
+  EXPECT_TRUE(b.ParseFromString(e));
+  EXPECT_EQ(1, b.x_size());
+  EXPECT_EQ(3, b.s_size());
+  EXPECT_EQ("foo", b.s(0));
+  EXPECT_EQ("bar", b.s(1));
+  EXPECT_EQ(string(300, 'z'), b.s(2));
+  EXPECT_EQ(3, ProtobufReader(e).CountRepeatedField(2));
+}
+
+TEST(ProtobufReaderTest, Malformed) {
+  string e;
+  A a;
+  a.add_x(1);
+  a.add_s("hello world");
+  a.SerializeToString(&e);
+
+  // Truncate in the middle of the string field.
+  string truncated(e, 0, e.size() - 3);
+  Slice sl;
+  EXPECT_FALSE(ProtobufReader(truncated).ReadField<Slice>(2, &sl));
+  EXPECT_EQ(-1, ProtobufReader(truncated).FindRepeatedField<Slice>(2, sl));
+
+  // A zero tag terminates the scan instead of looping forever.
+  string zero(4, '\0');
+  EXPECT_FALSE(ProtobufReader(zero).ReadField<uint32>(1, NULL));
+  EXPECT_FALSE(ProtobufReader(zero).HasField(1));
+  EXPECT_EQ(0, ProtobufReader(zero).CountRepeatedField(1));
+}
+
 // BENCHMARKS_A
 
 double Time() {
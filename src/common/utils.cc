@@ -3,6 +3,7 @@
 
 #include "common/utils.h"
 
+#include <string.h>
 #include <cstdio>
 
 template<typename T> string TypeName() {
@@ -50,6 +51,105 @@ uint32 FNVModHash(const Slice& key) {
   return hash;
 }
 
+namespace {
+
+const uint32 kSHA256RoundConstants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+inline uint32 RotateRight32(uint32 x, int r) {
+  return (x >> r) | (x << (32 - r));
+}
+
+// Applies the SHA-256 compression function to the 64-byte 'block'.
+void SHA256Block(const unsigned char* block, uint32 state[8]) {
+  uint32 w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (static_cast<uint32>(block[4 * i]) << 24) |
+           (static_cast<uint32>(block[4 * i + 1]) << 16) |
+           (static_cast<uint32>(block[4 * i + 2]) << 8) |
+           static_cast<uint32>(block[4 * i + 3]);
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32 s0 = RotateRight32(w[i - 15], 7) ^ RotateRight32(w[i - 15], 18) ^
+                (w[i - 15] >> 3);
+    uint32 s1 = RotateRight32(w[i - 2], 17) ^ RotateRight32(w[i - 2], 19) ^
+                (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32 a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32 e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32 s1 = RotateRight32(e, 6) ^ RotateRight32(e, 11) ^
+                RotateRight32(e, 25);
+    uint32 ch = (e & f) ^ (~e & g);
+    uint32 t1 = h + s1 + ch + kSHA256RoundConstants[i] + w[i];
+    uint32 s0 = RotateRight32(a, 2) ^ RotateRight32(a, 13) ^
+                RotateRight32(a, 22);
+    uint32 maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32 t2 = s0 + maj;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+}  // namespace
+
+void SHA256(const Slice& data, uint64 digest[4]) {
+  uint32 state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data());
+  uint64 len = data.size();
+  for (; len >= 64; p += 64, len -= 64) {
+    SHA256Block(p, state);
+  }
+
+  // Pad with a one bit, zeros, and the message length in bits (big-endian),
+  // spilling into a second block if the length doesn't fit.
+  unsigned char tail[128];
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, p, len);
+  tail[len] = 0x80;
+  int tail_size = (len < 56) ? 64 : 128;
+  uint64 bits = static_cast<uint64>(data.size()) * 8;
+  for (int i = 0; i < 8; i++) {
+    tail[tail_size - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+  }
+  for (int i = 0; i < tail_size; i += 64) {
+    SHA256Block(tail + i, state);
+  }
+
+  for (int i = 0; i < 4; i++) {
+    digest[i] = (static_cast<uint64>(state[2 * i]) << 32) | state[2 * i + 1];
+  }
+}
+
 void Spin(double duration) {
   usleep(1000000 * duration);
 }
@@ -38,6 +38,10 @@ double GetTime();
 uint32 FNVHash(const Slice& key);
 uint32 FNVModHash(const Slice& key);
 
+// Sets 'digest' to the SHA-256 digest of 'data', as four 64-bit words in
+// big-endian order (so digest[0] holds the digest's first eight bytes).
+void SHA256(const Slice& data, uint64 digest[4]);
+
 // Busy-wait (or yield) for 'duration' seconds.
 void Spin(double duration);
 
@@ -5,6 +5,7 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <cstdio>
 #include <string>
 #include <vector>
 
@@ -37,6 +38,34 @@ TEST(UtilsTest, SplitString) {
   EXPECT_EQ(Vec<string>() | "a" | "" || "b", SplitString("a  b", ' '));
 }
 
+// Returns the SHA-256 digest of 'data' in hex.
+string SHA256Hex(const string& data) {
+  uint64 digest[4];
+  SHA256(data, digest);
+  char hex[65];
+  snprintf(hex, sizeof(hex), "%016llx%016llx%016llx%016llx",
+           static_cast<unsigned long long>(digest[0]),  // NOLINT
+           static_cast<unsigned long long>(digest[1]),  // NOLINT
+           static_cast<unsigned long long>(digest[2]),  // NOLINT
+           static_cast<unsigned long long>(digest[3]));  // NOLINT
+  return hex;
+}
+
+TEST(UtilsTest, SHA256) {
+  // FIPS 180-2 test vectors, plus messages whose padding just does and just
+  // doesn't fit in their last block.
+  EXPECT_EQ("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+            SHA256Hex(""));
+  EXPECT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+            SHA256Hex("abc"));
+  EXPECT_EQ("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+            SHA256Hex(string(1000000, 'a')));
+  EXPECT_EQ("9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318",
+            SHA256Hex(string(55, 'a')));
+  EXPECT_EQ("b35439a4ac6f0948b6d6f9e3c6af0f5f590ce20f1bde7090ef7970686ec6738a",
+            SHA256Hex(string(56, 'a')));
+}
+
 TEST(UtilsTest, StringToInt) {
   EXPECT_EQ(10, StringToInt("10"));
   ASSERT_DEATH({ StringToInt(""); }, "invalid numeric string: ");
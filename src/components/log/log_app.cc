@@ -16,6 +16,7 @@
 REGISTER_APP(LogApp) {
   return new LogApp(new LocalMemLog());
 }
+REGISTER_APP_NAMES(LogApp, "log", "NEW_READER", "GET");
 
 LogApp::~LogApp() {
   for (auto it = remote_readers_.begin(); it != remote_readers_.end(); ++it) {
@@ -25,26 +26,29 @@ LogApp::~LogApp() {
 }
 
 bool LogApp::HandleRemoteReaderMessage(Header* header, MessageBuffer* message) {
-  if (header->rpc() == "NEW_READER") {
-    Lock l(&rr_mutex_);
-    remote_readers_[make_pair(header->from(), header->data_channel())] =
-        log_->GetReader();
-    machine()->SendReplyMessage(header, message);
-
-  } else if (header->rpc() == "GET") {
-    Log::Reader* r =
-        remote_readers_[make_pair(header->from(), header->data_channel())];
-    if (r->Next()) {
-      message->Append(r->Entry());
-      message->Append(new string(UInt64ToString(r->Version())));
+  switch (RpcID(*header)) {
+    case WireID("NEW_READER"): {
+      Lock l(&rr_mutex_);
+      remote_readers_[make_pair(header->from(), header->data_channel())] =
+          log_->GetReader();
+      machine()->SendReplyMessage(header, message);
+      return true;
     }
-    machine()->SendReplyMessage(header, message);
 
-  } else {
-    return false;
-  }
+    case WireID("GET"): {
+      Log::Reader* r =
+          remote_readers_[make_pair(header->from(), header->data_channel())];
+      if (r->Next()) {
+        message->Append(r->Entry());
+        message->Append(new string(UInt64ToString(r->Version())));
+      }
+      machine()->SendReplyMessage(header, message);
+      return true;
+    }
 
-  return true;
+    default:
+      return false;
+  }
 }
 
 void LogApp::Append(const Slice& entry, uint64 count) {
@@ -84,11 +88,8 @@ SPECIALIZED_CONSTRUCTOR(PairSequence)
 
 template<class T>
 void RemoteLogSource<T>::Init() {
-  // Get inbox ptr.
-  inbox_ = machine_->DataChannel(
-      source_app_name_ + UInt64ToString(source_machine_));
-
-  // Request new session from source app.
+  // Request new session from source app. (The data channel name identifies
+  // the session.)
   Header* header = new Header();
   header->set_from(machine_->machine_id());
   header->set_to(source_machine_);
@@ -96,14 +97,7 @@ void RemoteLogSource<T>::Init() {
   header->set_app(source_app_name_);
   header->set_rpc("NEW_READER");
   header->set_data_channel(source_app_name_ + UInt64ToString(source_machine_));
-  machine_->SendMessage(header, new MessageBuffer());
-
-  // Wait for response.
-  MessageBuffer* m = NULL;
-  while (!inbox_->Pop(&m)) {
-    usleep(10);
-  }
-  delete m;
+  delete machine_->Call(header, new MessageBuffer()).Get();
 }
 
 // Helper method for Get.
@@ -157,27 +151,19 @@ T* ParseFromMessageBuffer(MessageBuffer* m) {
 
 template<class T>
 bool RemoteLogSource<T>::Get(T** t) {
-  // Maybe there is already an entry in the queue.
-  MessageBuffer* m = NULL;
-  if (!inbox_->Pop(&m)) {
-    // Nope. Request new entry from source app.
-    Header* header = new Header();
-    header->set_from(machine_->machine_id());
-    header->set_to(source_machine_);
-    header->set_type(Header::RPC);
-    header->set_app(source_app_name_);
-    header->set_rpc("GET");
-    header->set_data_channel(source_app_name_ + UInt64ToString(source_machine_));
-    machine_->SendMessage(header, new MessageBuffer());
-
-    // Wait for something to show up.
-    while (!inbox_->Pop(&m)) {
-      usleep(10);
-    }
-  }
+  // Request new entry from source app.
+  Header* header = new Header();
+  header->set_from(machine_->machine_id());
+  header->set_to(source_machine_);
+  header->set_type(Header::RPC);
+  header->set_app(source_app_name_);
+  header->set_rpc("GET");
+  header->set_data_channel(source_app_name_ + UInt64ToString(source_machine_));
+  MessageBuffer* m = machine_->Call(header, new MessageBuffer()).Get();
 
-  // Parse response.
-  if (m->size() != 0) {
+  // Parse response. (The call completes with NULL if it is cancelled, e.g.
+  // while the machine shuts down.)
+  if (m != NULL && m->size() != 0) {
     *t = ParseFromMessageBuffer<T>(m);
     delete m;
     return true;
@@ -90,9 +90,6 @@ class RemoteLogSource : public Source<T*> {
 
   // Name of app on source machine.
   string source_app_name_;
-
-  // Local machine's data channel on which to receive entries.
-  AtomicQueue<MessageBuffer*>* inbox_;
 };
 
 #endif  // CALVIN_COMPONENTS_LOG_LOG_APP_H_
@@ -43,6 +43,7 @@ REGISTER_APP(Paxos2App2) {
   }
   return new Paxos2App(new LocalMemLog(), participants);
 }
+REGISTER_APP_NAMES(Paxos2App, "paxos2", "APPEND");
 
 Paxos2App::Paxos2App(Log* log, const vector<uint64>& participants)
     : participants_(participants), go_(true), going_(false), count_(0) {
@@ -93,7 +94,7 @@ void Paxos2App::Stop() {
 }
 
 void Paxos2App::HandleOtherMessages(Header* header, MessageBuffer* message) {
-  if (header->rpc() == "APPEND") {
+  if (RpcID(*header) == WireID("APPEND")) {
     Lock l(&mutex_);
     UInt64Pair* p = sequence_.add_pairs();
     p->set_first(header->misc_int(0));
@@ -90,6 +90,17 @@ void BTreeStore::Delete(const string& key) {
   records_.erase(key);
 }
 
+void BTreeStore::BulkLoad(const vector<pair<string, string> >& records) {
+  WriteLock l(&mutex_);
+  // Records arrive in key order, so hinting each insertion at end() lets the
+  // btree append to its rightmost leaf rather than descending from the root.
+  for (size_t i = 0; i < records.size(); i++) {
+    btree_map<string, string>::iterator it =
+        records_.insert(records_.end(), records[i]);
+    it->second = records[i].second;
+  }
+}
+
 int BTreeStore::Size() {
   ReadLock l(&mutex_);
   return records_.size();
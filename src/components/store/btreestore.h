@@ -19,6 +19,7 @@ class BTreeStore : public KVStore {
   virtual void Put(const string& key, const string& value);
   virtual bool Get(const string& key, string* value);
   virtual void Delete(const string& key);
+  virtual void BulkLoad(const vector<pair<string, string> >& records);
   virtual int Size();
   virtual KVStore::Iterator* GetIterator();
 
@@ -49,6 +49,12 @@ bool KVStore::IsLocal(const string& path) {
   return true;
 }
 
+void KVStore::BulkLoad(const vector<pair<string, string> >& records) {
+  for (size_t i = 0; i < records.size(); i++) {
+    Put(records[i].first, records[i].second);
+  }
+}
+
 void KVStore::Run(Action* action) {
   KVStoreAction::Type type =
       static_cast<KVStoreAction::Type>(action->action_type());
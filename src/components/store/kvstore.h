@@ -8,9 +8,13 @@
 #define CALVIN_COMPONENTS_STORE_KVSTORE_H_
 
 #include <string>
+#include <utility>
+#include <vector>
 #include "components/store/store.h"
 
+using std::pair;
 using std::string;
+using std::vector;
 
 class KVStore : public Store {
  public:
@@ -36,6 +40,14 @@ class KVStore : public Store {
   // Erases record with key 'key'.
   virtual void Delete(const string& key) = 0;
 
+  // Inserts every record in 'records', overwriting any existing records with
+  // the same keys. Equivalent to calling Put() on each record, but stores may
+  // override this to build their underlying structures directly from sorted
+  // input.
+  //
+  // Requires: 'records' is sorted by key and contains no duplicate keys.
+  virtual void BulkLoad(const vector<pair<string, string> >& records);
+
 
   virtual bool IsLocal(const string& path);
 
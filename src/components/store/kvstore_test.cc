@@ -12,10 +12,14 @@
 #include <glog/logging.h>
 #include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "common/utils.h"
 
 using std::map;
+using std::pair;
+using std::vector;
 
 template<class KVStoreType>
 void TestInsertDelete() {
@@ -85,12 +89,44 @@ void TestIterator() {
   // TODO(agt): Also test thread safety.
 }
 
+template<class KVStoreType>
+void TestBulkLoad() {
+  KVStoreType s;
+  s.Put("k0005", "old");
+  s.Put("zzz", "untouched");
+
+  map<string, string> m;
+  for (int i = 0; i < 1000; i++) {
+    char key[6];
+    snprintf(key, sizeof(key), "k%04d", i);
+    m[key] = RandomString(100);
+  }
+  vector<pair<string, string> > records(m.begin(), m.end());
+  s.BulkLoad(records);
+  m["zzz"] = "untouched";
+
+  KVStore::Iterator* i = s.GetIterator();
+  i->Next();
+  for (auto j = m.begin(); j != m.end(); ++j) {
+    EXPECT_TRUE(i->Valid());
+    EXPECT_EQ(j->first, i->Key());
+    EXPECT_EQ(j->second, i->Value());
+    i->Next();
+  }
+  EXPECT_FALSE(i->Valid());
+
+  delete i;
+}
+
 TEST(BTreeStoreTest, InsertDelete) {
   TestInsertDelete<BTreeStore>();
 }
 TEST(BTreeStoreTest, Iterator) {
   TestIterator<BTreeStore>();
 }
+TEST(BTreeStoreTest, BulkLoad) {
+  TestBulkLoad<BTreeStore>();
+}
 
 TEST(LevelDBStoreTest, InsertDelete) {
   TestInsertDelete<LevelDBStore>();
@@ -98,6 +134,9 @@ TEST(LevelDBStoreTest, InsertDelete) {
 TEST(LevelDBStoreTest, Iterator) {
   TestIterator<LevelDBStore>();
 }
+TEST(LevelDBStoreTest, BulkLoad) {
+  TestBulkLoad<LevelDBStore>();
+}
 
 int main(int argc, char **argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
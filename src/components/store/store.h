@@ -8,6 +8,10 @@
 #include "common/types.h"
 
 class Action;  // (lawsuit)
+class Header;
+class MessageBuffer;
+class StoreApp;
+template<typename T> class AtomicQueue;
 
 class Store {
  public:
@@ -15,6 +19,25 @@ class Store {
   virtual void GetRWSets(Action* action) = 0;
   virtual void Run(Action* action) = 0;
   virtual bool IsLocal(const string& path) = 0;
+
+  // Runs 'action' on behalf of 'app', then calls
+  // 'app->ActionDone(action, queue)'. Stores whose actions may have to wait
+  // for data from other machines can override this to park the action and
+  // finish it from whichever thread delivers that data, rather than blocking
+  // the calling thread. The default implementation calls Run() and then
+  // ActionDone(). (Defined in store_app.cc.)
+  virtual void RunAsync(
+      Action* action,
+      AtomicQueue<Action*>* queue,
+      StoreApp* app);
+
+  // Handles an RPC addressed to 'app' that StoreApp itself does not
+  // recognize. Takes ownership of '*header' and '*message'. The default
+  // implementation dies. (Defined in store_app.cc.)
+  virtual void HandleMessage(
+      Header* header,
+      MessageBuffer* message,
+      StoreApp* app);
 };
 
 #endif  // CALVIN_COMPONENTS_STORE_STORE_H_
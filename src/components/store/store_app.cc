@@ -6,6 +6,8 @@
 #include "components/store/kvstore.h"
 #include "machine/app/app.h"
 
+REGISTER_APP_NAMES(StoreApp, "GETRWSETS", "RUN", "RUNLOCAL");
+
 StoreApp::~StoreApp() {
   delete store_;
 }
@@ -15,38 +17,47 @@ void StoreApp::HandleMessage(Header* header, MessageBuffer* message) {
 }
 
 void StoreApp::HandleMessageBase(Header* header, MessageBuffer* message) {
-  if (header->rpc() == "GETRWSETS") {
-    // Parse Action.
-    Action* action = new Action();
-    action->ParseFromArray((*message)[0].data(), (*message)[0].size());
-    // Compute action's read write sets.
-    store_->GetRWSets(action);
-    // Reply to request with updated action state.
-    machine()->SendReplyMessage(header, new MessageBuffer(*action));
-    delete action;
-
-  } else if (header->rpc() == "RUN") {
-    // Parse Action.
-    Action* action = new Action();
-    action->ParseFromArray((*message)[0].data(), (*message)[0].size());
-    // Run action.
-    Run(action);
-    machine()->SendReplyMessage(header, new MessageBuffer(*action));
-
-  } else if (header->rpc() == "RUNLOCAL") {
-    // Parse Action.
-    Action* action = reinterpret_cast<Action*>(header->misc_int(0));
-
-    // Get result queue.
-    AtomicQueue<Action*>* queue =
-        reinterpret_cast<AtomicQueue<Action*>*>(header->misc_int(1));
-
-    // Run action and push onto queue.
-    Run(action);
-    queue->Push(action);
-
-  } else {
-    LOG(FATAL) << "unknown RPC type";
+  switch (RpcID(*header)) {
+    case WireID("GETRWSETS"): {
+      // Parse Action.
+      Action* action = new Action();
+      action->ParseFromArray((*message)[0].data(), (*message)[0].size());
+      // Compute action's read write sets.
+      store_->GetRWSets(action);
+      // Reply to request with updated action state.
+      machine()->SendReplyMessage(header, new MessageBuffer(*action));
+      delete action;
+      break;
+    }
+
+    case WireID("RUN"): {
+      // Parse Action.
+      Action* action = new Action();
+      action->ParseFromArray((*message)[0].data(), (*message)[0].size());
+      // Run action.
+      Run(action);
+      machine()->SendReplyMessage(header, new MessageBuffer(*action));
+      break;
+    }
+
+    case WireID("RUNLOCAL"): {
+      // Parse Action.
+      Action* action = reinterpret_cast<Action*>(header->misc_int(0));
+
+      // Get result queue.
+      AtomicQueue<Action*>* queue =
+          reinterpret_cast<AtomicQueue<Action*>*>(header->misc_int(1));
+
+      // Run action. The store pushes it onto the queue (via ActionDone) once
+      // it completes, which may be after this call returns.
+      store_->RunAsync(action, queue, this);
+      break;
+    }
+
+    default:
+      // Store-specific RPC.
+      store_->HandleMessage(header, message, this);
+      return;
   }
 
   delete message;
@@ -62,7 +73,15 @@ bool StoreApp::IsLocal(const string& path) {
 
 void StoreApp::Run(Action* action) {
   store_->Run(action);
+  SendResult(action);
+}
 
+void StoreApp::ActionDone(Action* action, AtomicQueue<Action*>* queue) {
+  SendResult(action);
+  queue->Push(action);
+}
+
+void StoreApp::SendResult(Action* action) {
   // Send results to client.
   if (action->has_client_machine()) {
     Header* header = new Header();
@@ -91,3 +110,21 @@ void StoreApp::RunAsync(Action* action, AtomicQueue<Action*>* queue) {
   machine()->SendMessage(header, new MessageBuffer());
 }
 
+
+////////////////////////////////////////////////////////////////////////////////
+// Default implementations of asynchronous Store methods (see store.h).
+
+void Store::RunAsync(
+    Action* action,
+    AtomicQueue<Action*>* queue,
+    StoreApp* app) {
+  Run(action);
+  app->ActionDone(action, queue);
+}
+
+void Store::HandleMessage(
+    Header* header,
+    MessageBuffer* message,
+    StoreApp* app) {
+  LOG(FATAL) << "unknown RPC type: " << header->rpc();
+}
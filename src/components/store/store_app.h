@@ -28,6 +28,11 @@ class StoreApp : public App {
   // after it is completed.
   void RunAsync(Action* action, AtomicQueue<Action*>* queue);
 
+  // Called by the store (see Store::RunAsync) once it has finished running
+  // 'action'. Sends results to the client (if any) and pushes the action to
+  // '*queue'.
+  void ActionDone(Action* action, AtomicQueue<Action*>* queue);
+
   // TODO(agt): This is currently needed for testing, but code should be
   //            restructured to remove this.
   Store* store() { return store_; }
@@ -36,6 +41,9 @@ class StoreApp : public App {
   StoreApp() {}
   void HandleMessageBase(Header* header, MessageBuffer* message);
 
+  // Sends 'action' (including its results) to its client, if it has one.
+  void SendResult(Action* action);
+
   // Main store.
   Store* store_;
 };
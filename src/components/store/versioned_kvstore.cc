@@ -296,3 +296,59 @@ void VersionedKVStore::Delete(const string& key, uint64 version) {
   Put(key, "", version, kDeletedFlag);
 }
 
+void VersionedKVStore::BulkLoad(
+    vector<pair<string, string> >* records,
+    uint64 version) {
+  // Appending the same version to every key preserves their relative order,
+  // since the '\0' separator sorts before any byte allowed in a key.
+  for (size_t i = 0; i < records->size(); i++) {
+    AppendVersion(&(*records)[i].first, version);
+  }
+
+  // Records would have to be split by FNVHash(key) across the underlying
+  // stores if there were more than one.
+  CHECK_EQ(kStoreCount, 1);
+  records_[0]->BulkLoad(*records);
+}
+
+void VersionedKVStore::Scan(uint64 version, ScanFunction visit, void* arg) {
+  CHECK_EQ(kStoreCount, 1);
+
+  // Holding an iterator read-locks the underlying store, so a new iterator is
+  // started every kScanBatch keys. Every version of a key sorts between
+  // "key\0" and "key\1", so the next batch starts at the last key plus "\1".
+  string resume;
+  while (true) {
+    KVStore::Iterator* it = records_[0]->GetIterator();
+    if (resume.empty()) {
+      it->Next();
+    } else {
+      it->Seek(resume);
+    }
+
+    for (int keys = 0; keys < kScanBatch && it->Valid(); keys++) {
+      Slice versionless = StripVersion(it->Key());
+      string key(versionless.data(), versionless.size());
+
+      // Versions are sorted newest first.
+      bool found = false;
+      while (it->Valid() && StripVersion(it->Key()) == Slice(key)) {
+        uint64 flags;
+        if (!found && ParseVersion(it->Key(), &flags) < version) {
+          found = true;
+          if (!(flags & kDeletedFlag)) {
+            visit(key, it->Value(), arg);
+          }
+        }
+        it->Next();
+      }
+      resume = key + '\1';
+    }
+
+    bool done = !it->Valid();
+    delete it;
+    if (done) {
+      return;
+    }
+  }
+}
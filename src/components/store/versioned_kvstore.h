@@ -50,6 +50,23 @@ class VersionedKVStore : public Store {
   // Erases record with key 'key' at version 'version'.
   void Delete(const string& key, uint64 version);
 
+  // Inserts every record in '*records' at time 'version'. Keys in '*records'
+  // are rewritten in place to their versioned form.
+  //
+  // Requires: '*records' is sorted by key and contains no duplicate keys.
+  void BulkLoad(vector<pair<string, string> >* records, uint64 version);
+
+  // Calls 'visit(key, value, arg)' for every record that exists at time
+  // 'version', in key order. The underlying store is read-locked while
+  // 'visit' runs (so it must not write to this store), but only for
+  // kScanBatch keys at a time, so writes may proceed during long scans; keys
+  // written concurrently may or may not be visited.
+  typedef void (*ScanFunction)(
+      const Slice& key,
+      const Slice& value,
+      void* arg);
+  void Scan(uint64 version, ScanFunction visit, void* arg);
+
 
   virtual bool IsLocal(const string& path);
 
@@ -62,6 +79,9 @@ class VersionedKVStore : public Store {
   // TODO(agt): Make this configurable?
   static const int kStoreCount = 1;
 
+  // Number of keys visited per iterator by Scan.
+  static const int kScanBatch = 1000;
+
   // Underlying KVStore(s) in which records are stored.
   KVStore* records_[kStoreCount];
 };
@@ -14,8 +14,10 @@
 #include "components/store/btreestore.h"
 #include "components/store/leveldbstore.h"
 
+using std::make_pair;
 using std::pair;
 using std::string;
+using std::vector;
 
 DEFINE_bool(benchmark, false, "Run benchmarks instead of unit tests.");
 
@@ -124,6 +126,51 @@ class VersionedKVStoreTest {
     }
   }
 
+  static void AppendRecord(const Slice& key, const Slice& value, void* arg) {
+    reinterpret_cast<vector<pair<string, string> >*>(arg)->push_back(
+        make_pair(key.ToString(), value.ToString()));
+  }
+
+  void Scan() {
+    Reset();
+    store_->Put("alpha", "alice", 1);
+    store_->Put("alpha/x", "x", 1);
+    store_->Put("bravo", "bob", 2);
+    store_->Put("alpha", "alfred", 3);
+    store_->Delete("bravo", 4);
+    store_->Put("", "root", 1);
+
+    vector<pair<string, string> > records;
+    store_->Scan(1, &AppendRecord, &records);
+    EXPECT_EQ(0, records.size());
+
+    store_->Scan(3, &AppendRecord, &records);
+    ASSERT_EQ(4, records.size());
+    EXPECT_EQ(make_pair(string(""), string("root")), records[0]);
+    EXPECT_EQ(make_pair(string("alpha"), string("alice")), records[1]);
+    EXPECT_EQ(make_pair(string("alpha/x"), string("x")), records[2]);
+    EXPECT_EQ(make_pair(string("bravo"), string("bob")), records[3]);
+
+    records.clear();
+    store_->Scan(100, &AppendRecord, &records);
+    ASSERT_EQ(3, records.size());
+    EXPECT_EQ(make_pair(string("alpha"), string("alfred")), records[1]);
+
+    // Enough keys to need several batches.
+    Reset();
+    for (int i = 0; i < 2500; i++) {
+      store_->Put(IntToString(i), "v", 1);
+      store_->Put(IntToString(i), "w", 2);
+    }
+    records.clear();
+    store_->Scan(100, &AppendRecord, &records);
+    EXPECT_EQ(2500, records.size());
+    for (uint32 i = 1; i < records.size(); i++) {
+      EXPECT_LT(records[i - 1].first, records[i].first);
+      EXPECT_EQ("w", records[i].second);
+    }
+  }
+
   void GetMany() {
     for (int r = 0; r < kRecords; r++) {
       EXPECT_NO_RECORD(IntToString(r), 0);
@@ -145,12 +192,14 @@ TEST(VersionedKVStoreTest, BTreeStore) {
   t.PutGetDelete();
   t.PutMany();
   t.GetMany();
+  t.Scan();
 }
 TEST(VersionedKVStoreTest, LevelDBStore) {
   VersionedKVStoreTest<LevelDBStore> t;
   t.PutGetDelete();
   t.PutMany();
   t.GetMany();
+  t.Scan();
 }
 
 int main(int argc, char **argv) {
@@ -0,0 +1,158 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+
+#include "fs/block_cache.h"
+
+#include <glog/logging.h>
+
+#include "common/mutex.h"
+#include "common/types.h"
+
+BlockCache::BlockCache(uint64 capacity, int shards) {
+  CHECK_GT(shards, 0);
+  for (int i = 0; i < shards; i++) {
+    shards_.push_back(new Shard());
+  }
+  shard_capacity_ = capacity / shards;
+}
+
+BlockCache::~BlockCache() {
+  for (uint32 i = 0; i < shards_.size(); i++) {
+    Shard* shard = shards_[i];
+    for (btree::btree_map<Key, Entry*>::iterator it = shard->index.begin();
+         it != shard->index.end(); ++it) {
+      Unref(it->second);
+    }
+    delete shard;
+  }
+}
+
+MessagePart* BlockCache::Lookup(uint64 block_id, uint64 offset, uint64 length) {
+  Shard* shard = ShardFor(block_id);
+  Lock l(&shard->mutex);
+  btree::btree_map<Key, Entry*>::iterator it =
+      shard->index.find(Key(block_id, offset, length));
+  if (it == shard->index.end()) {
+    return NULL;
+  }
+  Entry* entry = it->second;
+  if (entry->freq < 3) {
+    entry->freq++;
+  }
+  ++entry->refs;
+  return new MessagePart(Slice(entry->data), &Unref, entry);
+}
+
+void BlockCache::Insert(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length,
+    const Slice& data) {
+  if (data.size() > shard_capacity_ / 8) {
+    return;
+  }
+
+  Key key(block_id, offset, length);
+  Shard* shard = ShardFor(block_id);
+  Lock l(&shard->mutex);
+  if (shard->index.count(key) != 0) {
+    return;
+  }
+
+  Entry* entry = new Entry(key, data);
+  shard->index[key] = entry;
+  if (shard->ghosts.erase(key) != 0) {
+    // Evicted too soon last time.
+    shard->main.push_back(entry);
+    shard->main_bytes += entry->data.size();
+  } else {
+    shard->small.push_back(entry);
+    shard->small_bytes += entry->data.size();
+  }
+  Evict(shard);
+}
+
+uint64 BlockCache::size() {
+  uint64 total = 0;
+  for (uint32 i = 0; i < shards_.size(); i++) {
+    Lock l(&shards_[i]->mutex);
+    total += shards_[i]->small_bytes + shards_[i]->main_bytes;
+  }
+  return total;
+}
+
+BlockCache::Shard* BlockCache::ShardFor(uint64 block_id) {
+  // Block ids are GUIDs, whose low bits are not well distributed.
+  uint64 h = block_id;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return shards_[h % shards_.size()];
+}
+
+void BlockCache::Evict(Shard* shard) {
+  while (shard->small_bytes + shard->main_bytes > shard_capacity_) {
+    if (!shard->small.empty() &&
+        (shard->small_bytes > shard_capacity_ / 10 || shard->main.empty())) {
+      Entry* entry = shard->small.front();
+      shard->small.pop_front();
+      shard->small_bytes -= entry->data.size();
+      if (entry->freq > 0) {
+        // Promote.
+        entry->freq = 0;
+        shard->main.push_back(entry);
+        shard->main_bytes += entry->data.size();
+      } else {
+        // Evict, remembering the key.
+        shard->index.erase(entry->key);
+        uint64 seq = shard->next_ghost++;
+        shard->ghost.push_back(make_pair(entry->key, seq));
+        shard->ghosts[entry->key] = seq;
+        TrimGhosts(shard);
+        Unref(entry);
+      }
+    } else {
+      Entry* entry = shard->main.front();
+      shard->main.pop_front();
+      if (entry->freq > 0) {
+        // Reinsert.
+        entry->freq--;
+        shard->main.push_back(entry);
+      } else {
+        shard->main_bytes -= entry->data.size();
+        shard->index.erase(entry->key);
+        Unref(entry);
+      }
+    }
+  }
+}
+
+void BlockCache::TrimGhosts(Shard* shard) {
+  // Remember about as many keys as the shard holds entries. Stale records
+  // don't count towards that, but are dropped once they reach the front, and
+  // may make up at most half the queue so that keys that keep cycling through
+  // the cache can't grow it without bound.
+  uint64 limit = static_cast<uint64>(shard->index.size()) + 1;
+  while (!shard->ghost.empty()) {
+    const pair<Key, uint64>& oldest = shard->ghost.front();
+    btree::btree_map<Key, uint64>::iterator it =
+        shard->ghosts.find(oldest.first);
+    bool live = (it != shard->ghosts.end() && it->second == oldest.second);
+    if (live &&
+        shard->ghosts.size() <= limit &&
+        shard->ghost.size() <= 2 * limit) {
+      break;
+    }
+    if (live) {
+      shard->ghosts.erase(it);
+    }
+    shard->ghost.pop_front();
+  }
+}
+
+void BlockCache::Unref(void* arg) {
+  Entry* entry = reinterpret_cast<Entry*>(arg);
+  if (--entry->refs == 0) {
+    delete entry;
+  }
+}
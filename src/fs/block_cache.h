@@ -0,0 +1,135 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+// In-memory cache of block ranges fetched from other machines. Blocks are
+// never modified once written (each block id is a fresh GUID), so cached
+// ranges never need to be invalidated.
+//
+// The cache is split into independently locked shards (by block id), each of
+// which is bounded in bytes and managed with the S3-FIFO policy:
+//
+//   - New ranges enter a small FIFO queue holding ~10% of the shard.
+//   - Ranges evicted from the small queue move to the main FIFO queue if they
+//     were hit while in it, and are otherwise dropped, leaving only their key
+//     in a 'ghost' queue.
+//   - Ranges whose keys are found in the ghost queue are admitted directly to
+//     the main queue.
+//   - Ranges evicted from the main queue are reinserted (CLOCK-style) if they
+//     were hit since they were last inserted.
+//
+// This keeps one-hit wonders (e.g. a large sequential scan) from flushing the
+// ranges that are actually being reused.
+//
+// Lookups return MessageParts that point directly at the cached bytes, so hits
+// can be sent or returned without copying. A range stays in memory until both
+// the cache and every such part have released it.
+
+#ifndef CALVIN_FS_BLOCK_CACHE_H_
+#define CALVIN_FS_BLOCK_CACHE_H_
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+#include "btree/btree_map.h"
+#include "common/mutex.h"
+#include "common/types.h"
+#include "machine/message_buffer.h"
+
+using std::atomic;
+using std::deque;
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::vector;
+
+class BlockCache {
+ public:
+  // 'capacity' bounds the total size (in bytes) of all cached ranges.
+  explicit BlockCache(uint64 capacity, int shards = kDefaultShards);
+  ~BlockCache();
+
+  // Returns a part containing the cached contents of the given range, or NULL
+  // if it is not cached. Caller takes ownership of the returned part.
+  MessagePart* Lookup(uint64 block_id, uint64 offset, uint64 length);
+
+  // Caches 'data' as the contents of the given range. Ranges larger than an
+  // eighth of a shard are not cached.
+  void Insert(uint64 block_id, uint64 offset, uint64 length, const Slice& data);
+
+  // Returns the total size of all cached ranges.
+  uint64 size();
+
+  static const int kDefaultShards = 16;
+
+ private:
+  struct Key {
+    Key() : block_id(0), offset(0), length(0) {}
+    Key(uint64 b, uint64 o, uint64 l) : block_id(b), offset(o), length(l) {}
+    bool operator<(const Key& other) const {
+      if (block_id != other.block_id) return block_id < other.block_id;
+      if (offset != other.offset) return offset < other.offset;
+      return length < other.length;
+    }
+    uint64 block_id;
+    uint64 offset;
+    uint64 length;
+  };
+
+  struct Entry {
+    Entry(const Key& k, const Slice& d)
+        : key(k), data(d.data(), d.size()), refs(1), freq(0) {
+    }
+    Key key;
+    string data;
+
+    // One reference is held by the cache, one by each outstanding part.
+    atomic<int> refs;
+
+    // Hits since insertion (or since last moved), saturating at 3.
+    int freq;
+  };
+
+  struct Shard {
+    Shard() : small_bytes(0), main_bytes(0), next_ghost(0) {}
+
+    Mutex mutex;
+    btree::btree_map<Key, Entry*> index;
+    deque<Entry*> small;
+    deque<Entry*> main;
+    uint64 small_bytes;
+    uint64 main_bytes;
+
+    // Keys recently evicted from 'small', oldest first, each tagged with the
+    // sequence number of its eviction. 'ghosts' maps each remembered key to
+    // the sequence number of its newest record; older records for a key (which
+    // has since been readmitted, and perhaps evicted again) are stale.
+    deque<pair<Key, uint64> > ghost;
+    btree::btree_map<Key, uint64> ghosts;
+    uint64 next_ghost;
+  };
+
+  // Returns the shard responsible for 'block_id'.
+  Shard* ShardFor(uint64 block_id);
+
+  // Evicts entries from 'shard' until it fits in 'shard_capacity_'.
+  // Requires: shard->mutex held.
+  void Evict(Shard* shard);
+
+  // Forgets the oldest ghost keys (and any stale records ahead of them) until
+  // the ghost queue is back within bounds.
+  // Requires: shard->mutex held.
+  void TrimGhosts(Shard* shard);
+
+  // Drops one reference to '*arg' (an Entry), deleting it if it was the last.
+  static void Unref(void* arg);
+
+  vector<Shard*> shards_;
+  uint64 shard_capacity_;
+
+  // DISALLOW_COPY_AND_ASSIGN
+  BlockCache(const BlockCache&);
+  BlockCache& operator=(const BlockCache&);
+};
+
+#endif  // CALVIN_FS_BLOCK_CACHE_H_
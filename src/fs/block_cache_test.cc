@@ -0,0 +1,130 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+
+#include "fs/block_cache.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <string>
+
+#include "common/utils.h"
+
+// Returns true iff the given range is cached with contents 'expected'.
+bool Cached(BlockCache* cache, uint64 block_id, const string& expected) {
+  MessagePart* part = cache->Lookup(block_id, 0, expected.size());
+  if (part == NULL) {
+    return false;
+  }
+  bool match = (part->buffer() == Slice(expected));
+  delete part;
+  return match;
+}
+
+TEST(BlockCacheTest, InsertLookup) {
+  BlockCache cache(1 << 20);
+  EXPECT_TRUE(cache.Lookup(1, 0, 4) == NULL);
+
+  cache.Insert(1, 0, 4, "asdf");
+  cache.Insert(1, 1, 2, "sd");
+  EXPECT_TRUE(Cached(&cache, 1, "asdf"));
+  EXPECT_EQ(6, cache.size());
+
+  // Ranges are cached independently.
+  MessagePart* part = cache.Lookup(1, 1, 2);
+  ASSERT_TRUE(part != NULL);
+  EXPECT_EQ("sd", part->buffer().ToString());
+  delete part;
+  EXPECT_TRUE(cache.Lookup(1, 1, 3) == NULL);
+  EXPECT_TRUE(cache.Lookup(2, 0, 4) == NULL);
+
+  // Blocks never change, so reinserting a cached range is a no-op.
+  cache.Insert(1, 0, 4, "qwer");
+  EXPECT_TRUE(Cached(&cache, 1, "asdf"));
+
+  // Oversized ranges are not admitted.
+  string big((1 << 20) / BlockCache::kDefaultShards, 'x');
+  cache.Insert(2, 0, big.size(), big);
+  EXPECT_FALSE(Cached(&cache, 2, big));
+}
+
+TEST(BlockCacheTest, BoundedSize) {
+  BlockCache cache(64 * 1024, 4);
+  string data(100, 'x');
+  for (uint64 i = 1; i <= 10000; i++) {
+    cache.Insert(i, 0, data.size(), data);
+    EXPECT_LE(cache.size(), 64 * 1024);
+  }
+  EXPECT_GT(cache.size(), 32 * 1024);
+}
+
+TEST(BlockCacheTest, ScanResistance) {
+  // One shard holding 100 blocks of 100 bytes.
+  BlockCache cache(100 * 100, 1);
+  string data(100, 'x');
+
+  // A working set of 50 blocks, each read a few times.
+  for (int round = 0; round < 3; round++) {
+    for (uint64 i = 1; i <= 50; i++) {
+      if (!Cached(&cache, i, data)) {
+        cache.Insert(i, 0, data.size(), data);
+      }
+    }
+  }
+
+  // A long scan of blocks that are never read again.
+  for (uint64 i = 1000; i < 11000; i++) {
+    cache.Insert(i, 0, data.size(), data);
+  }
+
+  // The working set survives the scan.
+  int hits = 0;
+  for (uint64 i = 1; i <= 50; i++) {
+    if (Cached(&cache, i, data)) {
+      hits++;
+    }
+  }
+  EXPECT_EQ(50, hits);
+}
+
+TEST(BlockCacheTest, GhostHitsKeepHistory) {
+  // One shard holding 10 blocks of 100 bytes.
+  BlockCache cache(10 * 100, 1);
+  string data(100, 'x');
+
+  // Blocks 1-10 pass through the small queue and are evicted as ghosts.
+  for (uint64 i = 1; i <= 20; i++) {
+    cache.Insert(i, 0, data.size(), data);
+  }
+
+  // Ghost hits on the newest ghosts (each of which evicts another block) must
+  // not make the cache forget the older ones.
+  for (uint64 i = 10; i >= 6; i--) {
+    cache.Insert(i, 0, data.size(), data);
+  }
+
+  // Block 1 is still remembered, so it is admitted to the main queue and
+  // survives a scan.
+  cache.Insert(1, 0, data.size(), data);
+  for (uint64 i = 1000; i < 1100; i++) {
+    cache.Insert(i, 0, data.size(), data);
+  }
+  EXPECT_TRUE(Cached(&cache, 1, data));
+}
+
+TEST(BlockCacheTest, PartOutlivesCache) {
+  BlockCache* cache = new BlockCache(100 * 100, 1);
+  cache->Insert(1, 0, 4, "asdf");
+  MessagePart* part = cache->Lookup(1, 0, 4);
+  ASSERT_TRUE(part != NULL);
+  delete cache;
+  EXPECT_EQ("asdf", part->buffer().ToString());
+  delete part;
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
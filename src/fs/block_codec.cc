@@ -0,0 +1,132 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+
+#include "fs/block_codec.h"
+
+#include <glog/logging.h>
+#include <snappy.h>
+#include <math.h>
+#include <string>
+
+#include "common/types.h"
+#include "common/varint.h"
+
+namespace {
+
+// Blocks smaller than this aren't worth compressing.
+const uint32 kMinCompressSize = 64;
+
+// Number of bytes sampled by ChooseBlockCodec.
+const uint32 kSampleSize = 1024;
+
+// Samples with more bits of entropy per byte than this are assumed to be
+// incompressible.
+const double kMaxEntropy = 7.0;
+
+}  // namespace
+
+BlockCodec ChooseBlockCodec(const Slice& raw) {
+  if (raw.size() < kMinCompressSize) {
+    return CODEC_NONE;
+  }
+
+  // Sample evenly spaced runs of 8 bytes, so that short repeated patterns are
+  // seen as such.
+  uint32 counts[256] = {0};
+  uint32 samples = 0;
+  uint64 stride =
+      raw.size() <= kSampleSize ? 8 : raw.size() / (kSampleSize / 8);
+  for (uint64 run = 0; run + 8 <= raw.size() && samples < kSampleSize;
+       run += stride) {
+    for (uint64 i = run; i < run + 8; i++) {
+      counts[static_cast<unsigned char>(raw[i])]++;
+      samples++;
+    }
+  }
+  if (samples == 0) {
+    return CODEC_NONE;
+  }
+
+  double entropy = 0;
+  for (int i = 0; i < 256; i++) {
+    if (counts[i] != 0) {
+      double p = static_cast<double>(counts[i]) / samples;
+      entropy -= p * log2(p);
+    }
+  }
+  return entropy > kMaxEntropy ? CODEC_NONE : CODEC_SNAPPY;
+}
+
+void EncodeBlock(const Slice& raw, string* encoded) {
+  BlockCodec codec = ChooseBlockCodec(raw);
+  EncodeBlockWith(codec, raw, encoded);
+  if (codec != CODEC_NONE && encoded->size() > raw.size() - raw.size() / 8) {
+    EncodeBlockWith(CODEC_NONE, raw, encoded);
+  }
+}
+
+void EncodeBlockWith(BlockCodec codec, const Slice& raw, string* encoded) {
+  encoded->clear();
+  encoded->push_back(static_cast<char>(codec));
+  varint::Append64(encoded, raw.size());
+  switch (codec) {
+    case CODEC_NONE:
+      encoded->append(raw.data(), raw.size());
+      break;
+
+    case CODEC_SNAPPY: {
+      string compressed;
+      snappy::Compress(raw.data(), raw.size(), &compressed);
+      encoded->append(compressed);
+      break;
+    }
+
+    default:
+      LOG(FATAL) << "unsupported block codec: " << codec;
+  }
+}
+
+bool DecodeBlock(const Slice& encoded, string* raw) {
+  if (encoded.empty()) {
+    return false;
+  }
+  BlockCodec codec = static_cast<BlockCodec>(encoded[0]);
+
+  // Parse raw size. (varint::Parse64 doesn't bounds-check, so find the end of
+  // the varint first. Its ninth byte, if any, is always the last.)
+  const char* pos = encoded.data() + 1;
+  const char* end = encoded.data() + encoded.size();
+  const char* last = pos;
+  while (last < end && last - pos < 8 && (*last & 0x80)) {
+    last++;
+  }
+  if (last >= end) {
+    return false;
+  }
+  uint64 size;
+  pos = varint::Parse64(pos, &size);
+  Slice payload(pos, end - pos);
+
+  switch (codec) {
+    case CODEC_NONE:
+      if (payload.size() != size) {
+        return false;
+      }
+      raw->assign(payload.data(), payload.size());
+      return true;
+
+    case CODEC_SNAPPY: {
+      size_t length;
+      if (!snappy::GetUncompressedLength(payload.data(), payload.size(),
+                                         &length) ||
+          length != size) {
+        return false;
+      }
+      return snappy::Uncompress(payload.data(), payload.size(), raw);
+    }
+
+    default:
+      LOG(ERROR) << "unsupported block codec: " << codec;
+      return false;
+  }
+}
@@ -0,0 +1,46 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+// Optional per-block compression (see the 'compress_blocks' field of
+// CalvinFSConfig). Blocks are compressed by the client that writes them and
+// decompressed by the client that reads them, so block stores, replication
+// and reads all move compressed bytes.
+//
+// An encoded block consists of a one-byte codec id, the varint-encoded size of
+// the raw block, and the (possibly compressed) payload. The codec for each
+// block is chosen by ChooseBlockCodec from a small sample of the raw data, and
+// blocks that don't compress well are stored uncompressed.
+
+#ifndef CALVIN_FS_BLOCK_CODEC_H_
+#define CALVIN_FS_BLOCK_CODEC_H_
+
+#include <string>
+#include "common/types.h"
+
+using std::string;
+
+enum BlockCodec {
+  CODEC_NONE = 0,
+  CODEC_SNAPPY = 1,
+  // Reserved; not yet supported by this build.
+  CODEC_LZ4 = 2,
+  CODEC_ZSTD = 3,
+};
+
+// Picks a codec for 'raw' by estimating the entropy of a sample of its bytes.
+// Small and high-entropy (e.g. already compressed) blocks get CODEC_NONE.
+BlockCodec ChooseBlockCodec(const Slice& raw);
+
+// Sets '*encoded' to the encoding of 'raw' using the codec chosen by
+// ChooseBlockCodec, falling back to CODEC_NONE if compression saves less than
+// an eighth of the block.
+void EncodeBlock(const Slice& raw, string* encoded);
+
+// Sets '*encoded' to the encoding of 'raw' using 'codec'.
+// Requires: 'codec' is supported.
+void EncodeBlockWith(BlockCodec codec, const Slice& raw, string* encoded);
+
+// Sets '*raw' to the contents of encoded block 'encoded'. Returns false if
+// the block is malformed or uses an unsupported codec.
+bool DecodeBlock(const Slice& encoded, string* raw);
+
+#endif  // CALVIN_FS_BLOCK_CODEC_H_
@@ -0,0 +1,84 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+
+#include "fs/block_codec.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <string>
+
+#include "common/utils.h"
+
+TEST(BlockCodecTest, ChooseCodec) {
+  // Too small.
+  EXPECT_EQ(CODEC_NONE, ChooseBlockCodec("aaaaaaaa"));
+
+  // Text and repetitive data compress.
+  string text;
+  while (text.size() < 100000) {
+    text.append("the quick brown fox jumps over the lazy dog\n");
+  }
+  EXPECT_EQ(CODEC_SNAPPY, ChooseBlockCodec(text));
+  EXPECT_EQ(CODEC_SNAPPY, ChooseBlockCodec(string(5000, '\0')));
+
+  // Random bytes don't.
+  EXPECT_EQ(CODEC_NONE, ChooseBlockCodec(RandomBytes(100000)));
+}
+
+TEST(BlockCodecTest, RoundTrip) {
+  string blocks[] = {
+    "",
+    "asdf",
+    string(100000, 'x'),
+    RandomString(3000),
+    RandomBytes(100000),
+  };
+  for (uint32 i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+    string encoded, decoded;
+    EncodeBlock(blocks[i], &encoded);
+    EXPECT_TRUE(DecodeBlock(encoded, &decoded));
+    EXPECT_EQ(blocks[i], decoded);
+
+    EncodeBlockWith(CODEC_NONE, blocks[i], &encoded);
+    EXPECT_TRUE(DecodeBlock(encoded, &decoded));
+    EXPECT_EQ(blocks[i], decoded);
+
+    EncodeBlockWith(CODEC_SNAPPY, blocks[i], &encoded);
+    EXPECT_TRUE(DecodeBlock(encoded, &decoded));
+    EXPECT_EQ(blocks[i], decoded);
+  }
+
+  // Compressible blocks shrink; incompressible ones grow by at most a few
+  // header bytes.
+  string encoded;
+  EncodeBlock(string(100000, 'x'), &encoded);
+  EXPECT_GT(50000, encoded.size());
+  EncodeBlock(RandomBytes(100000), &encoded);
+  EXPECT_GE(100010, encoded.size());
+}
+
+TEST(BlockCodecTest, Malformed) {
+  string decoded;
+  EXPECT_FALSE(DecodeBlock("", &decoded));
+
+  // Truncated size.
+  EXPECT_FALSE(DecodeBlock(string(1, CODEC_NONE) + "\x80", &decoded));
+
+  // Wrong size.
+  string encoded;
+  EncodeBlockWith(CODEC_NONE, "asdf", &encoded);
+  EXPECT_FALSE(DecodeBlock(encoded.substr(0, encoded.size() - 1), &decoded));
+  EXPECT_FALSE(DecodeBlock(encoded + "x", &decoded));
+
+  // Unsupported codec.
+  encoded[0] = CODEC_ZSTD;
+  EXPECT_FALSE(DecodeBlock(encoded, &decoded));
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
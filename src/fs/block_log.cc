@@ -18,4 +18,5 @@ using std::vector;
 REGISTER_APP(BlockLogApp) {
   return new BlockLogApp();
 }
+REGISTER_APP_NAMES(BlockLogApp, "blocklog", "BATCH", "VOTE", "SUBBATCH");
 
@@ -14,6 +14,7 @@
 #include "components/log/log_app.h"
 #include "components/log/paxos2.h"
 #include "fs/batch.pb.h"
+#include "fs/block_codec.h"
 #include "fs/block_store.h"
 #include "fs/calvinfs.h"
 #include "machine/app/app.h"
@@ -131,6 +132,11 @@ class BlockLogApp : public App {
         // Avoid multiple allocation.
         string* block = new string();
         batch.SerializeToString(block);
+        if (config_->config().compress_blocks()) {
+          string serialized;
+          serialized.swap(*block);
+          EncodeBlock(serialized, block);
+        }
 
         // Choose block_id.
         uint64 block_id =
@@ -195,83 +201,102 @@ class BlockLogApp : public App {
       }
     }
 
-    if (header->rpc() == "BATCH") {
-      // Write batch block to local block store.
-      uint64 block_id = header->misc_int(0);
-      blocks_->Put(block_id, (*message)[0]);
-
-      // Parse batch.
-      ActionBatch batch;
-      batch.ParseFromArray((*message)[0].data(), (*message)[0].size());
-
-      // Send paxos proposal.
-      Header* header = new Header();
-      header->set_from(machine()->machine_id());
-      header->set_to(0);  // Paxos leader.
-      header->set_type(Header::RPC);
-      header->set_app(name());
-      header->set_rpc("VOTE");
-      header->add_misc_int(block_id);
-      header->add_misc_int(batch.entries_size());
-      machine()->SendMessage(header, new MessageBuffer());
-
-      // Forward sub-batches to relevant readers (same replica only).
-      map<uint64, ActionBatch> subbatches;
-      for (int i = 0; i < batch.entries_size(); i++) {
-        set<uint64> recipients;
-        for (int j = 0; j < batch.entries(i).readset_size(); j++) {
-          uint64 mds = config_->HashFileName(batch.entries(i).readset(j));
-          recipients.insert(config_->LookupMetadataShard(mds, replica_));
-        }
-        for (int j = 0; j < batch.entries(i).writeset_size(); j++) {
-          uint64 mds = config_->HashFileName(batch.entries(i).writeset(j));
-          recipients.insert(config_->LookupMetadataShard(mds, replica_));
-        }
-        for (auto it = recipients.begin(); it != recipients.end(); ++it) {
-          subbatches[*it].add_entries()->CopyFrom(batch.entries(i));
+    switch (RpcID(*header)) {
+      case WireID("BATCH"): {
+        // Write batch block to local block store.
+        uint64 block_id = header->misc_int(0);
+        blocks_->Put(block_id, (*message)[0]);
+
+        // Parse batch.
+        ActionBatch batch;
+        if (config_->config().compress_blocks()) {
+          string serialized;
+          CHECK(DecodeBlock((*message)[0], &serialized));
+          batch.ParseFromString(serialized);
+        } else {
+          batch.ParseFromArray((*message)[0].data(), (*message)[0].size());
         }
-      }
-      for (auto it = mds_.begin(); it != mds_.end(); ++it) {
-        header = new Header();
+
+        // Send paxos proposal.
+        Header* header = new Header();
         header->set_from(machine()->machine_id());
-        header->set_to(*it);
+        header->set_to(0);  // Paxos leader.
         header->set_type(Header::RPC);
         header->set_app(name());
-        header->set_rpc("SUBBATCH");
+        header->set_rpc("VOTE");
         header->add_misc_int(block_id);
-        machine()->SendMessage(header, new MessageBuffer(subbatches[*it]));
+        header->add_misc_int(batch.entries_size());
+        machine()->SendMessage(header, new MessageBuffer());
+
+        // Forward sub-batches to relevant readers (same replica only).
+        map<uint64, ActionBatch> subbatches;
+        for (int i = 0; i < batch.entries_size(); i++) {
+          const Action& a = batch.entries(i);
+          // Use the shards cached by MetadataStore::GetRWSets if present.
+          bool cached = a.readset_shards_size() == a.readset_size() &&
+                        a.writeset_shards_size() == a.writeset_size();
+          set<uint64> recipients;
+          for (int j = 0; j < a.readset_size(); j++) {
+            uint64 mds = cached ? a.readset_shards(j)
+                                : config_->HashMetadataKey(a.readset(j));
+            recipients.insert(config_->LookupMetadataShard(mds, replica_));
+          }
+          for (int j = 0; j < a.writeset_size(); j++) {
+            uint64 mds = cached ? a.writeset_shards(j)
+                                : config_->HashMetadataKey(a.writeset(j));
+            recipients.insert(config_->LookupMetadataShard(mds, replica_));
+          }
+          for (auto it = recipients.begin(); it != recipients.end(); ++it) {
+            subbatches[*it].add_entries()->CopyFrom(batch.entries(i));
+          }
+        }
+        for (auto it = mds_.begin(); it != mds_.end(); ++it) {
+          header = new Header();
+          header->set_from(machine()->machine_id());
+          header->set_to(*it);
+          header->set_type(Header::RPC);
+          header->set_app(name());
+          header->set_rpc("SUBBATCH");
+          header->add_misc_int(block_id);
+          machine()->SendMessage(header, new MessageBuffer(subbatches[*it]));
+        }
+        break;
       }
 
-    } else if (header->rpc() == "VOTE") {
-      CHECK(machine()->machine_id() == 0);
+      case WireID("VOTE"): {
+        CHECK(machine()->machine_id() == 0);
 
-      uint64 block_id = header->misc_int(0);
-      uint32 votes;
-      {
-        Lock l(&batch_votes_mutex_);
-        votes = ++batch_votes_[block_id];
+        uint64 block_id = header->misc_int(0);
+        uint32 votes;
+        {
+          Lock l(&batch_votes_mutex_);
+          votes = ++batch_votes_[block_id];
 
-        // Remove from map if all servers are accounted for.
-        if (votes == config_->config().block_replication_factor()) {
-          batch_votes_.erase(block_id);
+          // Remove from map if all servers are accounted for.
+          if (votes == config_->config().block_replication_factor()) {
+            batch_votes_.erase(block_id);
+          }
         }
-      }
 
-      // If block is now written to (exactly) a majority of replicas, submit
-      // to paxos leader.
-      if (votes == config_->config().block_replication_factor() / 2 + 1) {
-        uint64 count = header->misc_int(1);
-        paxos_leader_->Append(block_id, count);
+        // If block is now written to (exactly) a majority of replicas, submit
+        // to paxos leader.
+        if (votes == config_->config().block_replication_factor() / 2 + 1) {
+          uint64 count = header->misc_int(1);
+          paxos_leader_->Append(block_id, count);
+        }
+        break;
       }
 
-    } else if (header->rpc() == "SUBBATCH") {
-      uint64 block_id = header->misc_int(0);
-      ActionBatch* batch = new ActionBatch();
-      batch->ParseFromArray((*message)[0].data(), (*message)[0].size());
-      subbatches_.Put(block_id, batch);
+      case WireID("SUBBATCH"): {
+        uint64 block_id = header->misc_int(0);
+        ActionBatch* batch = new ActionBatch();
+        batch->ParseFromArray((*message)[0].data(), (*message)[0].size());
+        subbatches_.Put(block_id, batch);
+        break;
+      }
 
-    } else {
-      LOG(FATAL) << "unknown RPC type: " << header->rpc();
+      default:
+        LOG(FATAL) << "unknown RPC type: " << header->rpc();
     }
   }
 
@@ -306,7 +331,7 @@ class BlockLogApp : public App {
   Mutex batch_votes_mutex_;
 
   // Subbatches received.
-  AtomicMap<uint64, ActionBatch*> subbatches_;
+  AtomicHashMap<uint64, ActionBatch*> subbatches_;
 
   // Paxos log output.
   Source<UInt64Pair*>* batch_sequence_;
@@ -314,9 +339,9 @@ class BlockLogApp : public App {
   // Pending append requests.
   AtomicQueue<Action*> queue_;
 
-  // Delayed deallocation queue.
+  // Delayed deallocation queue. Only used by the main loop thread.
   // TODO(agt): Ugh this is horrible, we should replace this with ref counting!
-  DelayQueue<string*> to_delete_;
+  DelayQueue<string*, SPSCQueue> to_delete_;
 
   friend class ActionSource;
   class ActionSource : public Source<Action*> {
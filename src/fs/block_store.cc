@@ -3,21 +3,40 @@
 
 #include "fs/block_store.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <glog/logging.h>
 #include <leveldb/db.h>
 #include <leveldb/env.h>
 #include <leveldb/slice.h>
+#include <leveldb/write_batch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 #include "common/types.h"
 #include "common/utils.h"
+#include "common/varint.h"
 #include "machine/app/app.h"
+#include "machine/future.h"
+#include "fs/block_cache.h"
 #include "fs/calvinfs.h"
+#include "fs/erasure_code.h"
 
 using leveldb::Env;
 using leveldb::Slice;
 using leveldb::ReadFileToString;
 using leveldb::WriteStringToFile;
+using std::make_pair;
+using std::pair;
 using std::string;
 using std::vector;
 
@@ -28,6 +47,90 @@ REGISTER_APP(BlockStore) {
 REGISTER_APP(DistributedBlockStore) {
   return new DistributedBlockStoreApp(new HybridBlockStore());
 }
+REGISTER_APP_NAMES(
+    DistributedBlockStore,
+    "blockstore", "EXISTS", "GET", "GET_RANGE", "PUT", "MULTIGET");
+
+namespace {
+
+// Reads (or writes) all of 'iov' at 'offset', retrying short transfers.
+// Returns false on error or (for reads) end of file.
+bool TransferFully(
+    bool write,
+    int fd,
+    struct iovec* iov,
+    int iovcnt,
+    uint64 offset) {
+  while (true) {
+    // Skip over completed (or empty) buffers.
+    while (iovcnt > 0 && iov->iov_len == 0) {
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt == 0) {
+      return true;
+    }
+    ssize_t n = write ? pwritev(fd, iov, iovcnt, offset)
+                      : preadv(fd, iov, iovcnt, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    offset += n;
+    for (; n > 0; iov++, iovcnt--) {
+      if (static_cast<uint64>(n) < iov->iov_len) {
+        iov->iov_base = reinterpret_cast<char*>(iov->iov_base) + n;
+        iov->iov_len -= n;
+        break;
+      }
+      n -= iov->iov_len;
+    }
+  }
+}
+
+bool ReadAt(int fd, void* buf, uint64 size, uint64 offset) {
+  struct iovec iov = { buf, size };
+  return TransferFully(false, fd, &iov, 1, offset);
+}
+
+}  // namespace
+
+/////////////////////////////     BlockStore     /////////////////////////////
+
+bool BlockStore::GetRange(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length,
+    string* data) {
+  if (!Get(block_id, data)) {
+    return false;
+  }
+  offset = std::min(offset, static_cast<uint64>(data->size()));
+  length = std::min(length, data->size() - offset);
+  data->erase(0, offset);
+  data->resize(length);
+  return true;
+}
+
+MessagePart* BlockStore::GetRangePart(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length) {
+  string* data = new string();
+  if (!GetRange(block_id, offset, length, data)) {
+    delete data;
+    return NULL;
+  }
+  return new MessagePart(data);
+}
+
+void BlockStore::DeleteBlocks(const vector<uint64>& block_ids) {
+  for (uint32 i = 0; i < block_ids.size(); i++) {
+    Delete(block_ids[i]);
+  }
+}
 
 /////////////////////////     LocalFileBlockStore     /////////////////////////
 
@@ -82,6 +185,48 @@ bool LocalFileBlockStore::Get(uint64 block_id, string* data) {
   return s.ok();
 }
 
+bool LocalFileBlockStore::GetRange(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length,
+    string* data) {
+  string path(path_prefix_);
+  EncodeBlockID(block_id, &path);
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  CHECK_EQ(0, fstat(fd, &st));
+  uint64 size = st.st_size;
+  offset = std::min(offset, size);
+  length = std::min(length, size - offset);
+  data->resize(length);
+  bool ok = ReadAt(fd, const_cast<char*>(data->data()), length, offset);
+  close(fd);
+  return ok;
+}
+
+void LocalFileBlockStore::Delete(uint64 block_id) {
+  string path(path_prefix_);
+  EncodeBlockID(block_id, &path);
+  Env::Default()->DeleteFile(path);
+}
+
+void LocalFileBlockStore::ListBlocks(vector<uint64>* block_ids) {
+  for (uint32 i = 0; i < kDirCount; i++) {
+    char dir[5];
+    snprintf(dir, sizeof(dir), "/%03u", i);
+    vector<string> children;
+    Env::Default()->GetChildren(path_prefix_ + dir, &children);
+    for (uint32 j = 0; j < children.size(); j++) {
+      if (children[j].size() == 16) {
+        block_ids->push_back(strtoull(children[j].c_str(), NULL, 16));
+      }
+    }
+  }
+}
+
 //////////////////////////     LevelDBBlockStore     //////////////////////////
 
 LevelDBBlockStore::LevelDBBlockStore() {
@@ -127,178 +272,2090 @@ bool LevelDBBlockStore::Get(uint64 block_id, string* data) {
       data).ok();
 }
 
-///////////////////////////     HybridBlockStore     ///////////////////////////
+void LevelDBBlockStore::Delete(uint64 block_id) {
+  CHECK(blocks_->Delete(
+      leveldb::WriteOptions(),
+      UInt64ToString(block_id)).ok());
+}
 
-bool HybridBlockStore::Exists(uint64 block_id) {
-  if (block_id % 2 == 0) {
-    return small_blocks_.Exists(block_id);
-  } else {
-    return large_blocks_.Exists(block_id);
+void LevelDBBlockStore::ListBlocks(vector<uint64>* block_ids) {
+  leveldb::Iterator* it = blocks_->NewIterator(leveldb::ReadOptions());
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    block_ids->push_back(strtoull(it->key().ToString().c_str(), NULL, 10));
   }
+  delete it;
 }
 
-void HybridBlockStore::Put(uint64 block_id, const Slice& data) {
-  if (block_id % 2 == 0) {
-    small_blocks_.Put(block_id, data);
-  } else {
-    large_blocks_.Put(block_id, data);
+void LevelDBBlockStore::DeleteBlocks(const vector<uint64>& block_ids) {
+  // Keys are decimal strings, so the ids don't form key ranges; a batch is
+  // the next best thing. LevelDB reclaims the space as it compacts.
+  leveldb::WriteBatch batch;
+  for (uint32 i = 0; i < block_ids.size(); i++) {
+    batch.Delete(UInt64ToString(block_ids[i]));
   }
+  CHECK(blocks_->Write(leveldb::WriteOptions(), &batch).ok());
 }
 
-bool HybridBlockStore::Get(uint64 block_id, string* data) {
-  if (block_id % 2 == 0) {
-    return small_blocks_.Get(block_id, data);
-  } else {
-    return large_blocks_.Get(block_id, data);
+//////////////////////////     PackedBlockStore     ///////////////////////////
+//
+// Segment files are named 'segment-<id>' and consist of back-to-back
+// records, each a RecordHeader followed by the block's data. Segments are
+// preallocated (so zero-filled past the last record); a zero magic number
+// marks the end of a segment's records. Tombstone records (for deletions)
+// carry no data; their data_checksum field instead holds the id of the
+// segment that held the record they delete. Compaction carries a tombstone
+// forward for as long as that segment exists, since replaying the segment
+// without the tombstone would resurrect the block.
+//
+// The INDEX checkpoint file holds a CheckpointHeader, then one
+// CheckpointEntry per block in block id order, then a checksum of all of the
+// preceding bytes. It is replaced atomically by writing INDEX.tmp and
+// renaming it.
+
+namespace {
+
+struct RecordHeader {
+  uint32 magic;
+  uint32 flags;
+  uint64 block_id;
+  uint64 length;
+  uint64 data_checksum;
+  uint64 header_checksum;  // Checksum of all preceding header fields.
+};
+
+struct CheckpointHeader {
+  uint64 magic;
+  uint32 segment;   // Log position up to which the checkpoint is complete.
+  uint32 padding;
+  uint64 offset;
+  uint64 count;     // Number of CheckpointEntries that follow.
+};
+
+struct CheckpointEntry {
+  uint64 block_id;
+  uint32 segment;
+  uint32 length;
+  uint64 offset;
+};
+
+const uint32 kRecordMagic = 0x4b4c4250;  // "PBLK"
+const uint32 kTombstone = 1;
+const uint64 kHeaderSize = sizeof(RecordHeader);
+const uint64 kIndexMagic = 0x58444e494b4c4250ULL;  // "PBLKINDX"
+
+// Checkpoint once this many bytes have been appended since the last one.
+const uint64 kCheckpointInterval = 16 << 20;
+
+// Fast 64-bit checksum, processed a word at a time.
+uint64 Checksum(const char* data, uint64 size) {
+  const uint64 k1 = 0x87c37b91114253d5ULL;
+  const uint64 k2 = 0x4cf5ad432745937fULL;
+  uint64 h = 0x9e3779b97f4a7c15ULL ^ size;
+  uint64 w;
+  for (; size >= 8; data += 8, size -= 8) {
+    memcpy(&w, data, 8);
+    h ^= w * k1;
+    h = ((h << 31) | (h >> 33)) * k2;
+  }
+  if (size > 0) {
+    w = 0;
+    memcpy(&w, data, size);
+    h ^= w * k1;
+    h = ((h << 31) | (h >> 33)) * k2;
   }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
 }
 
-////////////////////////////     BlockStoreApp     ////////////////////////////
+uint64 HeaderChecksum(const RecordHeader& h) {
+  return Checksum(reinterpret_cast<const char*>(&h),
+                  offsetof(RecordHeader, header_checksum));
+}
 
-BlockStoreApp::~BlockStoreApp() {
-  delete blocks_;
+void SyncDir(const string& dir) {
+  int fd = open(dir.c_str(), O_RDONLY);
+  CHECK_GE(fd, 0) << "open " << dir << ": " << strerror(errno);
+  fsync(fd);
+  close(fd);
 }
 
-bool BlockStoreApp::Exists(uint64 block_id) {
-  return blocks_->Exists(block_id);
+// Writes 'contents' to 'path' and syncs it, replacing any existing file
+// atomically.
+void WriteFileDurably(const string& dir,
+                      const string& path,
+                      const string& contents) {
+  string tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK_GE(fd, 0) << "open " << tmp << ": " << strerror(errno);
+  struct iovec iov = { const_cast<char*>(contents.data()), contents.size() };
+  CHECK(TransferFully(true, fd, &iov, 1, 0))
+      << "write " << tmp << ": " << strerror(errno);
+  CHECK_EQ(0, fdatasync(fd)) << "sync " << tmp << ": " << strerror(errno);
+  close(fd);
+  CHECK_EQ(0, rename(tmp.c_str(), path.c_str()))
+      << "rename " << tmp << ": " << strerror(errno);
+  SyncDir(dir);
 }
 
-void BlockStoreApp::Put(uint64 block_id, const Slice& data) {
-  blocks_->Put(block_id, data);
+}  // namespace
+
+PackedBlockStore::PackedBlockStore()
+    : segment_size_(kDefaultSegmentSize), sync_(false) {
+  // Temporary stores are wiped on startup, so there is nothing to make
+  // durable.
+  Env::Default()->GetTestDirectory(&dir_);
+  dir_.append("/packed-blocks-");
+  static atomic<int> guid(0);
+  dir_.append(IntToString(guid++));
+
+  // Destroy any previous instantiation of the store.
+  CHECK_EQ(0, system((string("rm -fr ") + dir_).c_str()));
+  Open();
 }
 
-bool BlockStoreApp::Get(uint64 block_id, string* data) {
-  return blocks_->Get(block_id, data);
+PackedBlockStore::PackedBlockStore(
+    const string& dir,
+    uint64 segment_size,
+    bool sync)
+    : dir_(dir), segment_size_(segment_size), sync_(sync) {
+  Open();
 }
 
-void BlockStoreApp::HandleMessage(Header* header, MessageBuffer* message) {
-  LOG(FATAL) << "RPC request sent to BlockStoreApp";
+PackedBlockStore::~PackedBlockStore() {
+  stopped_ = true;
+  pthread_join(background_thread_, NULL);
+  Checkpoint();
+  for (auto it = segments_.begin(); it != segments_.end(); ++it) {
+    close(it->second.fd);
+    Unpin(it->second.mapping);
+  }
 }
 
-///////////////////////     DistributedBlockStoreApp     ///////////////////////
+void PackedBlockStore::Open() {
+  appended_seq_ = 0;
+  synced_seq_ = 0;
+  syncing_ = false;
+  uncheckpointed_bytes_ = 0;
+  stopped_ = false;
 
-DistributedBlockStoreApp::DistributedBlockStoreApp(BlockStore* blocks) {
-  blocks_ = blocks;
-}
+  Env::Default()->CreateDir(dir_);  // Ok if it already exists.
 
-bool DistributedBlockStoreApp::Exists(uint64 block_id) {
-  if (IsLocal(block_id)) {
-    return blocks_->Exists(block_id);
+  // Open existing segments.
+  vector<string> children;
+  CHECK(Env::Default()->GetChildren(dir_, &children).ok());
+  for (uint32 i = 0; i < children.size(); i++) {
+    if (children[i].compare(0, 8, "segment-") != 0) {
+      continue;
+    }
+    uint32 id = strtoul(children[i].c_str() + 8, NULL, 10);
+    Segment seg;
+    seg.fd = open(SegmentPath(id).c_str(), O_RDWR);
+    CHECK_GE(seg.fd, 0) << "open " << SegmentPath(id) << ": "
+                        << strerror(errno);
+    struct stat st;
+    CHECK_EQ(0, fstat(seg.fd, &st));
+    seg.capacity = st.st_size;
+    seg.mapping = Map(seg.fd, seg.capacity);
+    seg.end = seg.capacity;
+    seg.live_bytes = 0;
+    segments_[id] = seg;
   }
 
-  // Nonlocal file. Send request to the that owns it (for this replica).
-  Header* header = new Header();
-  header->set_from(machine()->machine_id());
-  header->set_to(
-      config_->LookupBlucket(config_->HashBlockID(block_id), replica_));
-  header->set_type(Header::RPC);
-  header->set_app(name());
-  header->set_rpc("EXISTS");
-  header->add_misc_int(block_id);
-  MessageBuffer* m = NULL;
-  header->set_data_ptr(reinterpret_cast<uint64>(&m));
-  machine()->SendMessage(header, new MessageBuffer());
+  // Load the checkpoint and replay everything appended after it. Without a
+  // checkpoint, the whole log is replayed.
+  uint32 checkpoint_segment = 0;
+  uint64 checkpoint_offset = 0;
+  if (!LoadCheckpoint(&checkpoint_segment, &checkpoint_offset)) {
+    index_.clear();
+    checkpoint_segment = segments_.empty() ? 0 : segments_.begin()->first;
+    checkpoint_offset = 0;
+  }
+  CHECK(segments_.empty() || segments_.count(checkpoint_segment) != 0)
+      << "missing segment " << checkpoint_segment << " in " << dir_;
+  for (auto it = segments_.lower_bound(checkpoint_segment);
+       it != segments_.end(); ++it) {
+    it->second.end = Replay(
+        it->first,
+        it->first == checkpoint_segment ? checkpoint_offset : 0);
+  }
+
+  // Tally live bytes per segment.
+  for (auto it = index_.begin(); it != index_.end(); ++it) {
+    auto seg = segments_.find(it->second.segment);
+    CHECK(seg != segments_.end())
+        << "index references missing segment " << it->second.segment;
+    seg->second.live_bytes += kHeaderSize + it->second.length;
+  }
 
-  // Wait for response.
-  SpinUntilNE<MessageBuffer*>(m, NULL);
+  // Sealed segments left with no live blocks (e.g. by a crash between
+  // compacting a segment and unlinking it) may still hold tombstones, so
+  // they are left for the background thread to compact.
 
-  bool result = !m->empty();
-  delete m;
-  return result;
+  // Resume appending at the end of the last segment.
+  if (segments_.empty()) {
+    Segment seg;
+    seg.fd = CreateSegment(0, segment_size_);
+    seg.capacity = segment_size_;
+    seg.mapping = Map(seg.fd, seg.capacity);
+    seg.end = 0;
+    seg.live_bytes = 0;
+    segments_[0] = seg;
+  }
+  active_ = segments_.rbegin()->first;
+
+  pthread_create(&background_thread_, NULL, RunBackgroundThread,
+                 reinterpret_cast<void*>(this));
 }
 
-// TODO(agt): Return after fewer than 'kBlockReplicationFactor' acks!
-void DistributedBlockStoreApp::Put(uint64 block_id, const Slice& data) {
-  atomic<int>* acks = new atomic<int>(0);
-  for (uint32 i = 0; i < config_->config().block_replication_factor(); i++) {
-    Header* header = new Header();
-    header->set_from(machine()->machine_id());
-    header->set_to(config_->LookupBlucket(config_->HashBlockID(block_id), i));
-    header->set_type(Header::RPC);
-    header->set_app(name());
-    header->set_rpc("PUT");
-    header->add_misc_int(block_id);
-    header->set_ack_counter(reinterpret_cast<uint64>(acks));
-    machine()->SendMessage(header, new MessageBuffer(data));
+bool PackedBlockStore::LoadCheckpoint(uint32* segment, uint64* offset) {
+  string contents;
+  if (!ReadFileToString(Env::Default(), dir_ + "/INDEX", &contents).ok()) {
+    return false;
+  }
+  if (contents.size() < sizeof(CheckpointHeader) + sizeof(uint64)) {
+    LOG(ERROR) << "truncated index checkpoint in " << dir_;
+    return false;
+  }
+  CheckpointHeader header;
+  memcpy(&header, contents.data(), sizeof(header));
+  uint64 checksum;
+  memcpy(&checksum, contents.data() + contents.size() - sizeof(checksum),
+         sizeof(checksum));
+  if (header.magic != kIndexMagic ||
+      contents.size() != sizeof(header) +
+                         header.count * sizeof(CheckpointEntry) +
+                         sizeof(checksum) ||
+      checksum != Checksum(contents.data(),
+                           contents.size() - sizeof(checksum))) {
+    LOG(ERROR) << "corrupt index checkpoint in " << dir_;
+    return false;
   }
 
-  // Wait for acks
-  while (acks->load() < (int)config_->config().block_replication_factor()/2 + 1) {
-    usleep(10);
+  const char* pos = contents.data() + sizeof(header);
+  for (uint64 i = 0; i < header.count; i++) {
+    CheckpointEntry e;
+    memcpy(&e, pos, sizeof(e));
+    pos += sizeof(e);
+    Location loc;
+    loc.segment = e.segment;
+    loc.length = e.length;
+    loc.offset = e.offset;
+    // Entries are sorted, so each belongs at the end.
+    index_.insert(index_.end(), make_pair(e.block_id, loc));
   }
+  *segment = header.segment;
+  *offset = header.offset;
+  return true;
 }
 
-bool DistributedBlockStoreApp::Get(uint64 block_id, string* data) {
-  if (IsLocal(block_id)) {
-    return blocks_->Get(block_id, data);
+uint64 PackedBlockStore::Replay(uint32 id, uint64 offset) {
+  const Segment& seg = segments_[id];
+  string data;
+  RecordHeader h;
+  while (offset + kHeaderSize <= seg.capacity) {
+    if (!ReadAt(seg.fd, &h, kHeaderSize, offset) ||
+        h.magic != kRecordMagic ||
+        h.header_checksum != HeaderChecksum(h) ||
+        h.length > seg.capacity - offset - kHeaderSize) {
+      break;
+    }
+    if (h.flags & kTombstone) {
+      index_.erase(h.block_id);
+    } else {
+      data.resize(h.length);
+      if (!ReadAt(seg.fd, const_cast<char*>(data.data()), h.length,
+                  offset + kHeaderSize) ||
+          h.data_checksum != Checksum(data.data(), data.size())) {
+        break;
+      }
+      Location loc;
+      loc.segment = id;
+      loc.length = h.length;
+      loc.offset = offset;
+      index_[h.block_id] = loc;
+    }
+    offset += kHeaderSize + h.length;
   }
+  return offset;
+}
 
-  // Nonlocal file. Send request to the that owns it (for this replica).
-  Header* header = new Header();
-  header->set_from(machine()->machine_id());
-  header->set_to(
-      config_->LookupBlucket(config_->HashBlockID(block_id), replica_));
-  header->set_type(Header::RPC);
-  header->set_app(name());
-  header->set_rpc("GET");
-  header->add_misc_int(block_id);
-  MessageBuffer* m = NULL;
-  header->set_data_ptr(reinterpret_cast<uint64>(&m));
-  machine()->SendMessage(header, new MessageBuffer());
+bool PackedBlockStore::Exists(uint64 block_id) {
+  ReadLock l(&index_mutex_);
+  return index_.find(block_id) != index_.end();
+}
 
-  // Wait for response.
-  SpinUntilNE<MessageBuffer*>(m, NULL);
+void PackedBlockStore::Put(uint64 block_id, const Slice& data) {
+  CHECK_LE(data.size(), 0xffffffffULL) << "block too large";
+  uint64 seq;
+  {
+    Lock l(&append_mutex_);
+    seq = AppendLocked(block_id, &data, NULL, NULL);
+  }
+  WaitForSync(seq);
+}
 
-  bool found = !m->empty();
-  if (found) {
-    data->assign((*m)[0].data(), (*m)[0].size());
+bool PackedBlockStore::Get(uint64 block_id, string* data) {
+  ReadLock l(&index_mutex_);
+  auto it = index_.find(block_id);
+  if (it == index_.end()) {
+    return false;
   }
-  delete m;
-  return found;
+  return ReadLocked(block_id, it->second, data);
 }
 
-void DistributedBlockStoreApp::HandleMessage(
-    Header* header,
-    MessageBuffer* message) {
+bool PackedBlockStore::GetRange(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length,
+    string* data) {
+  ReadLock l(&index_mutex_);
+  auto it = index_.find(block_id);
+  if (it == index_.end()) {
+    return false;
+  }
+  const Location& loc = it->second;
+  offset = std::min(offset, static_cast<uint64>(loc.length));
+  length = std::min(length, loc.length - offset);
+  data->resize(length);
+  CHECK(ReadAt(segments_.find(loc.segment)->second.fd,
+               const_cast<char*>(data->data()),
+               length,
+               loc.offset + kHeaderSize + offset))
+      << "read " << SegmentPath(loc.segment) << ": " << strerror(errno);
+  return true;
+}
 
-  // Get request's block id.
-  uint64 block_id = header->misc_int(0);
-  CHECK(IsLocal(block_id)) << "RPC request for non-local block";
+MessagePart* PackedBlockStore::GetRangePart(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length) {
+  ReadLock l(&index_mutex_);
+  auto it = index_.find(block_id);
+  if (it == index_.end()) {
+    return NULL;
+  }
+  const Location& loc = it->second;
+  offset = std::min(offset, static_cast<uint64>(loc.length));
+  length = std::min(length, loc.length - offset);
+  Mapping* mapping = segments_.find(loc.segment)->second.mapping;
+  ++mapping->refs;
+  return new MessagePart(
+      Slice(mapping->base + loc.offset + kHeaderSize + offset, length),
+      &PackedBlockStore::Unpin,
+      mapping);
+}
 
-  if (header->rpc() == "EXISTS") {
-    CHECK(message->empty());
-    if (blocks_->Exists(block_id)) {
-      message->Append(new string("e"));
+void PackedBlockStore::Delete(uint64 block_id) {
+  uint64 seq;
+  {
+    Lock l(&append_mutex_);
+    if (index_.find(block_id) == index_.end()) {
+      return;
     }
-    machine()->SendReplyMessage(header, message);
+    seq = AppendLocked(block_id, NULL, NULL, NULL);
+  }
+  WaitForSync(seq);
+}
 
-  } else if (header->rpc() == "GET") {
-    CHECK(message->empty());
-    string* data = new string();
-    if (blocks_->Get(block_id, data)) {
-      message->Append(data);
+void PackedBlockStore::ListBlocks(vector<uint64>* block_ids) {
+  ReadLock l(&index_mutex_);
+  for (btree::btree_map<uint64, Location>::iterator it = index_.begin();
+       it != index_.end(); ++it) {
+    block_ids->push_back(it->first);
+  }
+}
+
+void PackedBlockStore::DeleteBlocks(const vector<uint64>& block_ids) {
+  uint64 seq = 0;
+  {
+    Lock l(&append_mutex_);
+    for (uint32 i = 0; i < block_ids.size(); i++) {
+      if (index_.find(block_ids[i]) != index_.end()) {
+        seq = AppendLocked(block_ids[i], NULL, NULL, NULL);
+      }
+    }
+  }
+  if (seq == 0) {
+    return;
+  }
+  WaitForSync(seq);
+}
+
+bool PackedBlockStore::ReadLocked(
+    uint64 block_id,
+    const Location& loc,
+    string* data) {
+  auto seg_it = segments_.find(loc.segment);
+  CHECK(seg_it != segments_.end()) << "missing segment " << loc.segment;
+  const Segment& seg = seg_it->second;
+  RecordHeader h;
+  data->resize(loc.length);
+  struct iovec iov[2];
+  iov[0].iov_base = &h;
+  iov[0].iov_len = kHeaderSize;
+  iov[1].iov_base = const_cast<char*>(data->data());
+  iov[1].iov_len = loc.length;
+  CHECK(TransferFully(false, seg.fd, iov, 2, loc.offset))
+      << "read " << SegmentPath(loc.segment) << ": " << strerror(errno);
+  CHECK(h.magic == kRecordMagic && h.block_id == block_id &&
+        h.length == loc.length)
+      << "corrupt record for block " << block_id << " in "
+      << SegmentPath(loc.segment);
+  return true;
+}
+
+uint64 PackedBlockStore::AppendLocked(
+    uint64 block_id,
+    const Slice* data,
+    const Location* expected,
+    const uint32* shadowed) {
+  auto old = index_.find(block_id);
+  if (expected != NULL &&
+      (old == index_.end() ||
+       old->second.segment != expected->segment ||
+       old->second.offset != expected->offset)) {
+    return 0;
+  }
+  uint32 shadowed_segment = 0;
+  if (shadowed != NULL) {
+    shadowed_segment = *shadowed;
+  } else if (old != index_.end()) {
+    shadowed_segment = old->second.segment;
+  }
+
+  uint64 length = (data == NULL) ? 0 : data->size();
+  uint64 size = kHeaderSize + length;
+  if (segments_[active_].end + size > segments_[active_].capacity) {
+    RollSegment(size);
+  }
+  Segment* seg = &segments_[active_];
+
+  // Write record.
+  RecordHeader h;
+  h.magic = kRecordMagic;
+  h.flags = (data == NULL) ? kTombstone : 0;
+  h.block_id = block_id;
+  h.length = length;
+  h.data_checksum =
+      (data == NULL) ? shadowed_segment : Checksum(data->data(), length);
+  h.header_checksum = HeaderChecksum(h);
+  struct iovec iov[2];
+  iov[0].iov_base = &h;
+  iov[0].iov_len = kHeaderSize;
+  iov[1].iov_base = const_cast<char*>(data == NULL ? NULL : data->data());
+  iov[1].iov_len = length;
+  CHECK(TransferFully(true, seg->fd, iov, 2, seg->end))
+      << "write " << SegmentPath(active_) << ": " << strerror(errno);
+
+  // Update index.
+  {
+    WriteLock l(&index_mutex_);
+    auto it = index_.find(block_id);
+    if (it != index_.end()) {
+      segments_[it->second.segment].live_bytes -=
+          kHeaderSize + it->second.length;
+    }
+    if (data == NULL) {
+      index_.erase(block_id);
     } else {
-      delete data;
+      Location loc;
+      loc.segment = active_;
+      loc.length = length;
+      loc.offset = seg->end;
+      index_[block_id] = loc;
+      seg->live_bytes += size;
     }
-    machine()->SendReplyMessage(header, message);
+  }
+  seg->end += size;
+  uncheckpointed_bytes_ += size;
 
-  } else if (header->rpc() == "PUT") {
-    blocks_->Put(block_id, (*message)[0]);
-    message->clear();
-    machine()->SendReplyMessage(header, message);
+  if (unsynced_.empty() || unsynced_.back() != active_) {
+    unsynced_.push_back(active_);
+  }
+  return ++appended_seq_;
+}
+
+void PackedBlockStore::RollSegment(uint64 size) {
+  uint32 id = active_ + 1;
+  Segment seg;
+  seg.capacity = std::max(segment_size_, size);
+  seg.fd = CreateSegment(id, seg.capacity);
+  seg.mapping = Map(seg.fd, seg.capacity);
+  seg.end = 0;
+  seg.live_bytes = 0;
+  {
+    WriteLock l(&index_mutex_);
+    segments_[id] = seg;
+  }
+  active_ = id;
+}
+
+int PackedBlockStore::CreateSegment(uint32 id, uint64 capacity) {
+  string path = SegmentPath(id);
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  CHECK_GE(fd, 0) << "open " << path << ": " << strerror(errno);
+  if (posix_fallocate(fd, 0, capacity) != 0) {
+    // Not supported by all filesystems.
+    CHECK_EQ(0, ftruncate(fd, capacity))
+        << "truncate " << path << ": " << strerror(errno);
+  }
+  if (sync_) {
+    SyncDir(dir_);
+  }
+  return fd;
+}
+
+PackedBlockStore::Mapping* PackedBlockStore::Map(int fd, uint64 size) {
+  Mapping* mapping = new Mapping();
+  mapping->base = reinterpret_cast<char*>(
+      mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0));
+  CHECK(mapping->base != MAP_FAILED) << "mmap: " << strerror(errno);
+  mapping->size = size;
+  mapping->refs = 1;
+  return mapping;
+}
+
+void PackedBlockStore::Unpin(void* arg) {
+  Mapping* mapping = reinterpret_cast<Mapping*>(arg);
+  if (--mapping->refs == 0) {
+    munmap(mapping->base, mapping->size);
+    delete mapping;
+  }
+}
+
+void PackedBlockStore::WaitForSync(uint64 seq) {
+  if (!sync_) {
+    return;
+  }
+  while (synced_seq_.load() < seq) {
+    {
+      // If another writer is syncing, it may well cover this record.
+      Lock l(&sync_mutex_);
+      while (syncing_ && synced_seq_.load() < seq) {
+        sync_cv_.Wait(&sync_mutex_);
+      }
+      if (synced_seq_.load() >= seq) {
+        return;
+      }
+      syncing_ = true;
+    }
+
+    // Sync everything appended so far, letting other writers keep appending
+    // in the meantime.
+    vector<int> fds;
+    uint64 target;
+    {
+      Lock l(&append_mutex_);
+      target = appended_seq_;
+      for (uint32 i = 0; i < unsynced_.size(); i++) {
+        fds.push_back(segments_[unsynced_[i]].fd);
+      }
+      unsynced_.clear();
+    }
+    for (uint32 i = 0; i < fds.size(); i++) {
+      CHECK_EQ(0, fdatasync(fds[i])) << "sync: " << strerror(errno);
+    }
+    synced_seq_ = target;
+    ReleaseSync();
+  }
+}
+
+void PackedBlockStore::AcquireSync() {
+  Lock l(&sync_mutex_);
+  while (syncing_) {
+    sync_cv_.Wait(&sync_mutex_);
+  }
+  syncing_ = true;
+}
+
+void PackedBlockStore::ReleaseSync() {
+  Lock l(&sync_mutex_);
+  syncing_ = false;
+  // Wakes both threads waiting for the sync right and writers waiting for
+  // synced_seq_ to advance.
+  sync_cv_.SignalAll();
+}
+
+void PackedBlockStore::SyncLocked() {
+  if (sync_) {
+    for (uint32 i = 0; i < unsynced_.size(); i++) {
+      CHECK_EQ(0, fdatasync(segments_[unsynced_[i]].fd))
+          << "sync: " << strerror(errno);
+    }
+  }
+  unsynced_.clear();
+  synced_seq_ = appended_seq_;
+}
+
+void PackedBlockStore::Checkpoint() {
+  AcquireSync();
+  string contents;
+  {
+    Lock l(&append_mutex_);
+    SyncLocked();
+    CheckpointHeader header;
+    header.magic = kIndexMagic;
+    header.segment = active_;
+    header.padding = 0;
+    header.offset = segments_[active_].end;
+    header.count = index_.size();
+    contents.reserve(sizeof(header) + index_.size() * sizeof(CheckpointEntry)
+                     + sizeof(uint64));
+    contents.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (auto it = index_.begin(); it != index_.end(); ++it) {
+      CheckpointEntry e;
+      e.block_id = it->first;
+      e.segment = it->second.segment;
+      e.length = it->second.length;
+      e.offset = it->second.offset;
+      contents.append(reinterpret_cast<const char*>(&e), sizeof(e));
+    }
+    uncheckpointed_bytes_ = 0;
+  }
+  uint64 checksum = Checksum(contents.data(), contents.size());
+  contents.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+  WriteFileDurably(dir_, dir_ + "/INDEX", contents);
+  ReleaseSync();
+}
+
+int PackedBlockStore::Compact() {
+  Lock c(&compact_mutex_);
+
+  // Find sealed segments that are less than half live.
+  vector<uint32> victims;
+  {
+    Lock l(&append_mutex_);
+    for (auto it = segments_.begin(); it != segments_.end(); ++it) {
+      if (it->first != active_ &&
+          (it->second.live_bytes * 2 < it->second.end ||
+           it->second.live_bytes == 0)) {
+        victims.push_back(it->first);
+      }
+    }
+  }
+  for (uint32 i = 0; i < victims.size(); i++) {
+    CompactSegment(victims[i]);
+  }
+  return victims.size();
+}
+
+void PackedBlockStore::CompactSegment(uint32 id) {
+  // Find the segment's live blocks. Only compaction removes segments, so
+  // the segment (if it still exists) stays put until this returns.
+  vector<pair<uint64, Location> > live;
+  const Mapping* mapping;
+  uint64 end;
+  {
+    ReadLock l(&index_mutex_);
+    auto seg = segments_.find(id);
+    if (seg == segments_.end()) {
+      return;
+    }
+    mapping = seg->second.mapping;
+    end = std::min(seg->second.end, mapping->size);
+    for (auto it = index_.begin(); it != index_.end(); ++it) {
+      if (it->second.segment == id) {
+        live.push_back(*it);
+      }
+    }
+  }
+
+  // Copy them to the end of the log. Blocks that are overwritten or deleted
+  // in the meantime are skipped.
+  string data;
+  for (uint32 i = 0; i < live.size(); i++) {
+    {
+      ReadLock l(&index_mutex_);
+      ReadLocked(live[i].first, live[i].second, &data);
+    }
+    Slice slice(data);
+    Lock l(&append_mutex_);
+    AppendLocked(live[i].first, &slice, &live[i].second, NULL);
+  }
+
+  // Carry forward tombstones that still shadow a record in another segment,
+  // unless the block has since been written again. The segment is sealed, so
+  // its records can be read through the mapping without locks.
+  vector<pair<uint64, uint32> > tombstones;
+  RecordHeader h;
+  for (uint64 offset = 0; offset + kHeaderSize <= end;
+       offset += kHeaderSize + h.length) {
+    memcpy(&h, mapping->base + offset, kHeaderSize);
+    if (h.magic != kRecordMagic ||
+        h.header_checksum != HeaderChecksum(h) ||
+        h.length > end - offset - kHeaderSize) {
+      break;
+    }
+    if (h.flags & kTombstone) {
+      tombstones.push_back(make_pair(h.block_id,
+                                     static_cast<uint32>(h.data_checksum)));
+    }
+  }
+  for (uint32 i = 0; i < tombstones.size(); i++) {
+    Lock l(&append_mutex_);
+    if (tombstones[i].second != id &&
+        segments_.count(tombstones[i].second) != 0 &&
+        index_.find(tombstones[i].first) == index_.end()) {
+      AppendLocked(tombstones[i].first, NULL, NULL, &tombstones[i].second);
+    }
+  }
+
+  // Make the copies (and an index that no longer references the segment)
+  // durable before removing it.
+  Checkpoint();
+  AcquireSync();
+  {
+    Lock l(&append_mutex_);
+    WriteLock m(&index_mutex_);
+    Segment& seg = segments_.find(id)->second;
+    CHECK_EQ(0, seg.live_bytes);
+    close(seg.fd);
+    // Blocks still being served from the segment keep it mapped.
+    Unpin(seg.mapping);
+    segments_.erase(id);
+  }
+  unlink(SegmentPath(id).c_str());
+  ReleaseSync();
+}
+
+int PackedBlockStore::segment_count() {
+  ReadLock l(&index_mutex_);
+  return segments_.size();
+}
+
+string PackedBlockStore::SegmentPath(uint32 id) {
+  char name[32];
+  snprintf(name, sizeof(name), "/segment-%08u", id);
+  return dir_ + name;
+}
+
+void* PackedBlockStore::RunBackgroundThread(void* arg) {
+  PackedBlockStore* store = reinterpret_cast<PackedBlockStore*>(arg);
+  while (!store->stopped_) {
+    // Wake up about once per second.
+    for (int i = 0; i < 100 && !store->stopped_; i++) {
+      usleep(10000);
+    }
+    if (store->stopped_) {
+      break;
+    }
+    store->Compact();
+    if (store->uncheckpointed_bytes_ > kCheckpointInterval) {
+      store->Checkpoint();
+    }
+  }
+  return NULL;
+}
+
+///////////////////////////     HybridBlockStore     ///////////////////////////
 
+bool HybridBlockStore::Exists(uint64 block_id) {
+  if (block_id % 2 == 0) {
+    return small_blocks_.Exists(block_id);
   } else {
-    LOG(FATAL) << "unrecognized RPC type: " << header->rpc();
+    return large_blocks_.Exists(block_id);
   }
 }
 
-void DistributedBlockStoreApp::Start() {
-  config_ = new CalvinFSConfigMap(machine());
-  replica_ = config_->LookupReplica(machine()->machine_id());
+void HybridBlockStore::Put(uint64 block_id, const Slice& data) {
+  if (block_id % 2 == 0) {
+    small_blocks_.Put(block_id, data);
+  } else {
+    large_blocks_.Put(block_id, data);
+  }
 }
 
-bool DistributedBlockStoreApp::IsLocal(uint64 block_id) {
-  return config_->LookupMetadataShard(config_->HashBlockID(block_id), replica_)
+bool HybridBlockStore::Get(uint64 block_id, string* data) {
+  if (block_id % 2 == 0) {
+    return small_blocks_.Get(block_id, data);
+  } else {
+    return large_blocks_.Get(block_id, data);
+  }
+}
+
+bool HybridBlockStore::GetRange(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length,
+    string* data) {
+  if (block_id % 2 == 0) {
+    return small_blocks_.GetRange(block_id, offset, length, data);
+  } else {
+    return large_blocks_.GetRange(block_id, offset, length, data);
+  }
+}
+
+MessagePart* HybridBlockStore::GetRangePart(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length) {
+  if (block_id % 2 == 0) {
+    return small_blocks_.GetRangePart(block_id, offset, length);
+  } else {
+    return large_blocks_.GetRangePart(block_id, offset, length);
+  }
+}
+
+void HybridBlockStore::Delete(uint64 block_id) {
+  if (block_id % 2 == 0) {
+    small_blocks_.Delete(block_id);
+  } else {
+    large_blocks_.Delete(block_id);
+  }
+}
+
+void HybridBlockStore::ListBlocks(vector<uint64>* block_ids) {
+  small_blocks_.ListBlocks(block_ids);
+  large_blocks_.ListBlocks(block_ids);
+}
+
+void HybridBlockStore::DeleteBlocks(const vector<uint64>& block_ids) {
+  vector<uint64> small;
+  vector<uint64> large;
+  for (uint32 i = 0; i < block_ids.size(); i++) {
+    if (block_ids[i] % 2 == 0) {
+      small.push_back(block_ids[i]);
+    } else {
+      large.push_back(block_ids[i]);
+    }
+  }
+  small_blocks_.DeleteBlocks(small);
+  large_blocks_.DeleteBlocks(large);
+}
+
+///////////////////////////     DedupBlockStore     ///////////////////////////
+
+void EncodeBlockIDList(const vector<uint64>& block_ids, string* out) {
+  out->clear();
+  uint64 previous = 0;
+  for (uint32 i = 0; i < block_ids.size(); i++) {
+    CHECK(i == 0 || block_ids[i] > previous) << "block ids not sorted";
+    varint::Append64(out, block_ids[i] - previous);
+    previous = block_ids[i];
+  }
+}
+
+bool DecodeBlockIDList(const Slice& in, vector<uint64>* block_ids) {
+  block_ids->clear();
+  const char* pos = in.data();
+  const char* end = in.data() + in.size();
+  uint64 previous = 0;
+  while (pos < end) {
+    // Parse64 doesn't bounds-check, so make sure the varint is complete.
+    const char* last = pos;
+    while (last < end && last - pos < 8 && (*last & 0x80)) {
+      last++;
+    }
+    if (last >= end) {
+      return false;
+    }
+    uint64 delta;
+    pos = varint::Parse64(pos, &delta);
+    previous += delta;
+    block_ids->push_back(previous);
+  }
+  return true;
+}
+
+namespace {
+
+// Derives a content-addressed block id from the SHA-256 digest of a block of
+// 'size' bytes.
+uint64 ContentBlockIDFromDigest(const uint64 digest[4], uint64 size) {
+  return (1ULL << 63) | (digest[0] & 0x7ffffffffffffffeULL) |
+         (size > 1024 ? 1 : 0);
+}
+
+}  // namespace
+
+uint64 ContentBlockID(const Slice& data) {
+  uint64 digest[4];
+  SHA256(data, digest);
+  return ContentBlockIDFromDigest(digest, data.size());
+}
+
+const uint64 DedupBlockStore::kPinned;
+
+bool DedupBlockStore::Exists(uint64 block_id) {
+  return blocks_->Exists(block_id);
+}
+
+void DedupBlockStore::Put(uint64 block_id, const Slice& data) {
+  if (!TryPut(block_id, data)) {
+    LOG(ERROR) << "rejected put of content block " << block_id;
+  }
+}
+
+bool DedupBlockStore::TryPut(uint64 block_id, const Slice& data) {
+  if (!IsContentBlockID(block_id)) {
+    blocks_->Put(block_id, data);
+    return true;
+  }
+  uint64 digest[4];
+  SHA256(data, digest);
+  if (ContentBlockIDFromDigest(digest, data.size()) != block_id) {
+    LOG(ERROR) << "wrong content block id " << block_id;
+    return false;
+  }
+
+  // Add a reference if the block is already stored. Otherwise claim the
+  // right to write it.
+  {
+    Lock l(&mutex_);
+    while (true) {
+      btree::btree_map<uint64, Ref>::iterator it = refs_.find(block_id);
+      if (it == refs_.end()) {
+        refs_[block_id] = Ref(1, digest[1], digest[2], true, epoch_);
+        break;
+      }
+      if (!it->second.writing) {
+        if (it->second.check1 != digest[1] || it->second.check2 != digest[2]) {
+          LOG(ERROR) << "content block id collision on " << block_id;
+          return false;
+        }
+        if (it->second.count != kPinned) {
+          it->second.count++;
+        }
+        it->second.epoch = epoch_;
+        return true;
+      }
+      written_.Wait(&mutex_);
+    }
+  }
+
+  // The block may have been stored before a restart.
+  string existing;
+  bool existed = blocks_->Get(block_id, &existing);
+  bool collided = false;
+  if (existed) {
+    uint64 existing_digest[4];
+    SHA256(existing, existing_digest);
+    collided = (existing_digest[1] != digest[1] ||
+                existing_digest[2] != digest[2]);
+  } else {
+    blocks_->Put(block_id, data);
+  }
+
+  Lock l(&mutex_);
+  if (collided) {
+    // Leave the stored block alone (and untracked, as if pinned).
+    LOG(ERROR) << "content block id collision on " << block_id;
+    refs_.erase(block_id);
+  } else {
+    Ref* ref = &refs_[block_id];
+    ref->writing = false;
+    if (existed) {
+      ref->count = kPinned;
+    }
+  }
+  written_.SignalAll();
+  return !collided;
+}
+
+bool DedupBlockStore::Get(uint64 block_id, string* data) {
+  return blocks_->Get(block_id, data);
+}
+
+bool DedupBlockStore::GetRange(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length,
+    string* data) {
+  return blocks_->GetRange(block_id, offset, length, data);
+}
+
+MessagePart* DedupBlockStore::GetRangePart(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length) {
+  return blocks_->GetRangePart(block_id, offset, length);
+}
+
+void DedupBlockStore::Delete(uint64 block_id) {
+  if (!IsContentBlockID(block_id)) {
+    blocks_->Delete(block_id);
+    return;
+  }
+
+  // The underlying delete happens under the lock so that a concurrent Put
+  // can't mistake the dying block for a pinned one.
+  Lock l(&mutex_);
+  btree::btree_map<uint64, Ref>::iterator it = refs_.find(block_id);
+  if (it == refs_.end() || it->second.count == kPinned) {
+    return;
+  }
+  if (--it->second.count == 0) {
+    CHECK(!it->second.writing) << "Delete of block still being written";
+    refs_.erase(it);
+    blocks_->Delete(block_id);
+  }
+}
+
+void DedupBlockStore::ListBlocks(vector<uint64>* block_ids) {
+  blocks_->ListBlocks(block_ids);
+}
+
+void DedupBlockStore::DeleteBlocks(const vector<uint64>& block_ids) {
+  Lock l(&mutex_);
+  vector<uint64> doomed;
+  for (uint32 i = 0; i < block_ids.size(); i++) {
+    if (IsContentBlockID(block_ids[i])) {
+      btree::btree_map<uint64, Ref>::iterator it = refs_.find(block_ids[i]);
+      if (it != refs_.end()) {
+        if (it->second.writing || it->second.epoch == epoch_) {
+          continue;
+        }
+        refs_.erase(it);
+      }
+    }
+    doomed.push_back(block_ids[i]);
+  }
+  blocks_->DeleteBlocks(doomed);
+  epoch_++;
+}
+
+uint64 DedupBlockStore::RefCount(uint64 block_id) {
+  Lock l(&mutex_);
+  btree::btree_map<uint64, Ref>::iterator it = refs_.find(block_id);
+  return it == refs_.end() ? 0 : it->second.count;
+}
+
+////////////////////////////     BlockStoreApp     ////////////////////////////
+
+BlockStoreApp::~BlockStoreApp() {
+  delete blocks_;
+}
+
+bool BlockStoreApp::Exists(uint64 block_id) {
+  return blocks_->Exists(block_id);
+}
+
+void BlockStoreApp::Put(uint64 block_id, const Slice& data) {
+  blocks_->Put(block_id, data);
+}
+
+bool BlockStoreApp::Get(uint64 block_id, string* data) {
+  return blocks_->Get(block_id, data);
+}
+
+bool BlockStoreApp::GetRange(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length,
+    string* data) {
+  return blocks_->GetRange(block_id, offset, length, data);
+}
+
+void BlockStoreApp::HandleMessage(Header* header, MessageBuffer* message) {
+  LOG(FATAL) << "RPC request sent to BlockStoreApp";
+}
+
+///////////////////////     DistributedBlockStoreApp     ///////////////////////
+
+DistributedBlockStoreApp::DistributedBlockStoreApp(BlockStore* blocks)
+    : dedup_(NULL), cache_(NULL), erasure_(NULL), gc_running_(false),
+      gc_stopped_(false) {
+  blocks_ = blocks;
+}
+
+namespace {
+
+// Each stored fragment of an erasure-coded block consists of the varint
+// fragment index, the varint size of the whole block, and the fragment itself.
+void EncodeFragment(int index, uint64 size, const string& shard, string* out) {
+  out->clear();
+  varint::Append64(out, index);
+  varint::Append64(out, size);
+  out->append(shard);
+}
+
+bool ParseFragment(const Slice& in, uint64* index, uint64* size, Slice* shard) {
+  // Parse64 doesn't bounds-check, so make sure both varints are complete.
+  const char* pos = in.data();
+  const char* end = in.data() + in.size();
+  for (int i = 0; i < 2; i++) {
+    const char* last = pos;
+    while (last < end && last - pos < 8 && (*last & 0x80)) {
+      last++;
+    }
+    if (last >= end) {
+      return false;
+    }
+    pos = last + 1;
+  }
+  pos = varint::Parse64(in.data(), index);
+  pos = varint::Parse64(pos, size);
+  *shard = Slice(pos, end - pos);
+  return true;
+}
+
+}  // namespace
+
+bool DistributedBlockStoreApp::Exists(uint64 block_id) {
+  if (erasure_ != NULL) {
+    // Any of the first m+1 fragments will do, since at least one of them must
+    // survive for the block to be readable.
+    vector<uint64> holders;
+    FragmentHolders(block_id, &holders);
+    for (int i = 0; i <= erasure_->parity_fragments(); i++) {
+      Header* header = new Header();
+      header->set_from(machine()->machine_id());
+      header->set_to(holders[i]);
+      header->set_type(Header::RPC);
+      header->set_app(name());
+      header->set_rpc("EXISTS");
+      header->add_misc_int(block_id);
+      MessageBuffer* m = machine()->Call(header, new MessageBuffer()).Get();
+      bool result = (m != NULL && !m->empty());
+      delete m;
+      if (result) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  if (IsLocal(block_id)) {
+    return blocks_->Exists(block_id);
+  }
+
+  // Nonlocal file. Send request to the that owns it (for this replica).
+  Header* header = new Header();
+  header->set_from(machine()->machine_id());
+  header->set_to(
+      config_->LookupBlucket(config_->HashBlockID(block_id), replica_));
+  header->set_type(Header::RPC);
+  header->set_app(name());
+  header->set_rpc("EXISTS");
+  header->add_misc_int(block_id);
+  MessageBuffer* m = machine()->Call(header, new MessageBuffer()).Get();
+
+  // NULL if the request was rejected or cancelled.
+  bool result = (m != NULL && !m->empty());
+  delete m;
+  return result;
+}
+
+struct DistributedBlockStoreApp::PendingPut {
+  // Identifies the replica whose reply a PUT callback is for.
+  struct Reply {
+    PendingPut* put;
+    int replica;
+  };
+
+  explicit PendingPut(int replicas)
+      : app(NULL), acks(replicas), replies(replicas), parts(0) {
+    for (int i = 0; i < replicas; i++) {
+      replies[i].put = this;
+      replies[i].replica = i;
+    }
+  }
+
+  // App that issued the put.
+  DistributedBlockStoreApp* app;
+
+  uint64 block_id;
+
+  // Copy of the block contents, shared by the messages sent to all replicas.
+  string data;
+
+  // With erasure coding, the encoded fragments sent to each holder instead.
+  vector<string> fragments;
+
+  // Number of acks needed for the put to be done.
+  int quorum;
+
+  // Destination machine and reply flag for each replica. OnPutReply sets
+  // acks[i] when replica i's reply arrives, after it is done with the put.
+  vector<uint64> machines;
+  vector<atomic<int> > acks;
+  vector<Reply> replies;
+
+  // Number of replicas that have stored the block, and number that have
+  // rejected it. 'quorum_reached' is signalled when the put is decided either
+  // way.
+  int acked;
+  int failed;
+  Mutex mutex;
+  CondVar quorum_reached;
+
+  // True if too many replicas rejected the put for it to reach quorum.
+  // Requires: 'mutex' is held.
+  bool QuorumLost() {
+    return failed > static_cast<int>(acks.size()) - quorum;
+  }
+
+  // Number of live MessageParts that point into 'data'.
+  atomic<int> parts;
+
+  // Time at which the put was issued.
+  double issued;
+
+  // True once this put's stragglers have been recorded.
+  bool reported;
+};
+
+const double DistributedBlockStoreApp::kStragglerTimeout = 5.0;
+const double DistributedBlockStoreApp::kPutTimeout = 10.0;
+const double DistributedBlockStoreApp::kGCTimeout = 30.0;
+
+DistributedBlockStoreApp::~DistributedBlockStoreApp() {
+  if (gc_running_) {
+    gc_stopped_ = true;
+    pthread_join(gc_thread_, NULL);
+  }
+  delete cache_;
+  delete erasure_;
+  for (uint32 i = 0; i < retired_puts_.size(); i++) {
+    delete retired_puts_[i];
+  }
+  for (uint32 i = 0; i < free_puts_.size(); i++) {
+    delete free_puts_[i];
+  }
+}
+
+void DistributedBlockStoreApp::Put(uint64 block_id, const Slice& data) {
+  PendingPut* put = PutAsync(block_id, data);
+  while (!WaitForQuorum(put, kPutTimeout)) {
+    {
+      Lock l(&put->mutex);
+      if (put->QuorumLost()) {
+        LOG(ERROR) << "put of block " << block_id << " rejected";
+        break;
+      }
+    }
+    LOG(WARNING) << "put of block " << block_id << " still awaiting a quorum";
+  }
+  WaitForPut(put, 0);
+}
+
+DistributedBlockStoreApp::PendingPut* DistributedBlockStoreApp::PutAsync(
+    uint64 block_id,
+    const Slice& data) {
+  int replicas = config_->config().block_replication_factor();
+  if (erasure_ != NULL) {
+    replicas = erasure_->data_fragments() + erasure_->parity_fragments();
+  }
+  PendingPut* put = NULL;
+  {
+    Lock l(&puts_mutex_);
+    SweepRetiredPuts();
+    if (!free_puts_.empty()) {
+      put = free_puts_.back();
+      free_puts_.pop_back();
+    }
+  }
+  if (put == NULL) {
+    put = new PendingPut(replicas);
+  }
+
+  put->app = this;
+  put->block_id = block_id;
+  put->machines.clear();
+  if (erasure_ == NULL) {
+    put->data.assign(data.data(), data.size());
+    for (int i = 0; i < replicas; i++) {
+      put->machines.push_back(
+          config_->LookupBlucket(config_->HashBlockID(block_id), i));
+    }
+    put->quorum = replicas / 2 + 1;
+  } else {
+    put->data.clear();
+    vector<string> shards;
+    erasure_->Encode(data, &shards);
+    put->fragments.resize(replicas);
+    for (int i = 0; i < replicas; i++) {
+      EncodeFragment(i, data.size(), shards[i], &put->fragments[i]);
+    }
+    FragmentHolders(block_id, &put->machines);
+    put->quorum =
+        erasure_->data_fragments() + (erasure_->parity_fragments() + 1) / 2;
+  }
+  for (int i = 0; i < replicas; i++) {
+    put->acks[i] = 0;
+  }
+  put->acked = 0;
+  put->failed = 0;
+  put->parts = replicas;
+  put->issued = GetTime();
+  put->reported = false;
+
+  for (int i = 0; i < replicas; i++) {
+    Header* header = new Header();
+    header->set_from(machine()->machine_id());
+    header->set_to(put->machines[i]);
+    header->set_type(Header::RPC);
+    header->set_app(name());
+    header->set_rpc("PUT");
+    header->add_misc_int(block_id);
+    MessageBuffer* m = new MessageBuffer();
+    Slice payload(erasure_ == NULL ? put->data : put->fragments[i]);
+    m->AppendPart(new MessagePart(payload, &ReleasePutData, put));
+    machine()->Call(header, m).Then(&OnPutReply, &put->replies[i]);
+  }
+  return put;
+}
+
+void DistributedBlockStoreApp::OnPutReply(
+    Future<MessageBuffer*>* reply,
+    void* arg) {
+  PendingPut::Reply* r = reinterpret_cast<PendingPut::Reply*>(arg);
+  PendingPut* put = r->put;
+  MessageBuffer* m = reply->Get();
+  // A NULL reply means the PUT was rejected (e.g. as overloaded) or
+  // cancelled, so the replica has failed the put and needs repair.
+  bool rejected = (m == NULL);
+  bool stored = (!rejected && m->empty());
+  delete m;
+  if (rejected) {
+    DistributedBlockStoreApp* app = put->app;
+    Lock l(&app->puts_mutex_);
+    app->stragglers_.push_back(
+        make_pair(put->block_id, put->machines[r->replica]));
+  }
+  {
+    Lock l(&put->mutex);
+    if (stored) {
+      put->acked++;
+    } else {
+      put->failed++;
+    }
+    if ((stored && put->acked == put->quorum) ||
+        (!stored && put->QuorumLost())) {
+      put->quorum_reached.SignalAll();
+    }
+  }
+  // Last, since the put may be recycled as soon as every replica has replied.
+  put->acks[r->replica] = 1;
+}
+
+bool DistributedBlockStoreApp::PutDone(PendingPut* put) {
+  Lock l(&put->mutex);
+  return put->acked >= put->quorum;
+}
+
+bool DistributedBlockStoreApp::WaitForQuorum(PendingPut* put, double timeout) {
+  double deadline = GetTime() + timeout;
+  Lock l(&put->mutex);
+  while (put->acked < put->quorum) {
+    if (put->QuorumLost()) {
+      return false;
+    }
+    if (!put->quorum_reached.WaitUntil(&put->mutex, deadline) &&
+        GetTime() >= deadline) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DistributedBlockStoreApp::WaitForPut(PendingPut* put, double timeout) {
+  bool done = WaitForQuorum(put, timeout);
+  // Remaining replicas may still ack (and still hold references to
+  // put->data), so the put can't be reused until they do.
+  Lock l(&puts_mutex_);
+  retired_puts_.push_back(put);
+  return done;
+}
+
+void DistributedBlockStoreApp::TakeStragglers(
+    vector<pair<uint64, uint64> >* stragglers) {
+  Lock l(&puts_mutex_);
+  SweepRetiredPuts();
+  stragglers->insert(stragglers->end(), stragglers_.begin(), stragglers_.end());
+  stragglers_.clear();
+}
+
+void DistributedBlockStoreApp::ReleasePutData(void* arg) {
+  --reinterpret_cast<PendingPut*>(arg)->parts;
+}
+
+void DistributedBlockStoreApp::SweepRetiredPuts() {
+  double now = GetTime();
+  uint32 kept = 0;
+  for (uint32 i = 0; i < retired_puts_.size(); i++) {
+    PendingPut* put = retired_puts_[i];
+    bool finished = (put->parts.load() == 0);
+    for (uint32 j = 0; finished && j < put->acks.size(); j++) {
+      finished = (put->acks[j].load() > 0);
+    }
+
+    if (finished) {
+      free_puts_.push_back(put);
+      continue;
+    }
+
+    if (!put->reported && now - put->issued > kStragglerTimeout) {
+      for (uint32 j = 0; j < put->acks.size(); j++) {
+        if (put->acks[j].load() == 0) {
+          stragglers_.push_back(make_pair(put->block_id, put->machines[j]));
+        }
+      }
+      put->reported = true;
+    }
+    retired_puts_[kept++] = put;
+  }
+  retired_puts_.resize(kept);
+}
+
+bool DistributedBlockStoreApp::Get(uint64 block_id, string* data) {
+  if (erasure_ != NULL) {
+    return GetCoded(block_id, data);
+  }
+  if (IsLocal(block_id)) {
+    return blocks_->Get(block_id, data);
+  }
+  if (LookupCache(block_id, 0, ~0ULL, data)) {
+    return true;
+  }
+
+  // Nonlocal file. Send request to the that owns it (for this replica).
+  Header* header = new Header();
+  header->set_from(machine()->machine_id());
+  header->set_to(
+      config_->LookupBlucket(config_->HashBlockID(block_id), replica_));
+  header->set_type(Header::RPC);
+  header->set_app(name());
+  header->set_rpc("GET");
+  header->add_misc_int(block_id);
+  MessageBuffer* m = machine()->Call(header, new MessageBuffer()).Get();
+
+  // NULL if the request was rejected or cancelled.
+  bool found = (m != NULL && !m->empty());
+  if (found) {
+    data->assign((*m)[0].data(), (*m)[0].size());
+    if (cache_ != NULL) {
+      cache_->Insert(block_id, 0, ~0ULL, (*m)[0]);
+    }
+  }
+  delete m;
+  return found;
+}
+
+bool DistributedBlockStoreApp::GetRange(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length,
+    string* data) {
+  if (erasure_ != NULL) {
+    if (LookupCache(block_id, offset, length, data)) {
+      return true;
+    }
+    if (!GetCoded(block_id, data)) {
+      return false;
+    }
+    uint64 start = std::min(offset, static_cast<uint64>(data->size()));
+    uint64 size = std::min(length, data->size() - start);
+    if (cache_ != NULL) {
+      cache_->Insert(
+          block_id, offset, length, Slice(data->data() + start, size));
+    }
+    data->erase(0, start);
+    data->resize(size);
+    return true;
+  }
+  if (IsLocal(block_id)) {
+    return blocks_->GetRange(block_id, offset, length, data);
+  }
+  if (LookupCache(block_id, offset, length, data)) {
+    return true;
+  }
+
+  // Nonlocal file. Send request to the that owns it (for this replica).
+  Header* header = new Header();
+  header->set_from(machine()->machine_id());
+  header->set_to(
+      config_->LookupBlucket(config_->HashBlockID(block_id), replica_));
+  header->set_type(Header::RPC);
+  header->set_app(name());
+  header->set_rpc("GET_RANGE");
+  header->add_misc_int(block_id);
+  header->add_misc_int(offset);
+  header->add_misc_int(length);
+  MessageBuffer* m = machine()->Call(header, new MessageBuffer()).Get();
+
+  // NULL if the request was rejected or cancelled.
+  bool found = (m != NULL && !m->empty());
+  if (found) {
+    data->assign((*m)[0].data(), (*m)[0].size());
+    if (cache_ != NULL) {
+      cache_->Insert(block_id, offset, length, (*m)[0]);
+    }
+  }
+  delete m;
+  return found;
+}
+
+void DistributedBlockStoreApp::HandleMessage(
+    Header* header,
+    MessageBuffer* message) {
+  uint32 rpc = RpcID(*header);
+  if (rpc == WireID("MULTIGET")) {
+    // misc_int: tag, then (block_id, offset, length) for each range.
+    //
+    // Reply: a status part (varint tag followed by one byte per range, 1 if
+    // the range's block was found) followed by one part per found range.
+    CHECK(message->empty());
+    CHECK(header->misc_int_size() % 3 == 1);
+    string* status = new string();
+    varint::Append64(status, header->misc_int(0));
+    vector<MessagePart*> parts;
+    for (int i = 1; i < header->misc_int_size(); i += 3) {
+      uint64 block_id = header->misc_int(i);
+      CHECK(IsLocal(block_id)) << "RPC request for non-local block";
+      MessagePart* part = blocks_->GetRangePart(
+          block_id,
+          header->misc_int(i + 1),
+          header->misc_int(i + 2));
+      status->append(1, part != NULL ? 1 : 0);
+      if (part != NULL) {
+        parts.push_back(part);
+      }
+    }
+    // A MessagePart's Slice is fixed when it is created, so the status string
+    // must be complete before it is appended.
+    message->Append(status);
+    for (uint32 i = 0; i < parts.size(); i++) {
+      message->AppendPart(parts[i]);
+    }
+    machine()->SendReplyMessage(header, message);
+    return;
+  }
+
+  // Get request's block id. (Fragments of erasure-coded blocks aren't stored
+  // by the block's blucket owner.)
+  uint64 block_id = header->misc_int(0);
+  CHECK(erasure_ != NULL || IsLocal(block_id))
+      << "RPC request for non-local block";
+
+  switch (rpc) {
+    case WireID("EXISTS"):
+      CHECK(message->empty());
+      if (blocks_->Exists(block_id)) {
+        message->Append(new string("e"));
+      }
+      machine()->SendReplyMessage(header, message);
+      break;
+
+    case WireID("GET"):
+    case WireID("GET_RANGE"): {
+      // misc_int: block_id[, offset, length]
+      CHECK(message->empty());
+      uint64 offset = 0;
+      uint64 length = ~0ULL;
+      if (rpc == WireID("GET_RANGE")) {
+        offset = header->misc_int(1);
+        length = header->misc_int(2);
+      }
+      // Served without copying where the store supports it.
+      MessagePart* part = blocks_->GetRangePart(block_id, offset, length);
+      if (part != NULL) {
+        message->AppendPart(part);
+      }
+      machine()->SendReplyMessage(header, message);
+      break;
+    }
+
+    case WireID("PUT"): {
+      // The reply is empty if the block was stored, and holds a part if it
+      // was rejected (see DedupBlockStore::TryPut).
+      bool stored = true;
+      if (dedup_ != NULL) {
+        if (IsContentBlockID(block_id)) {
+          Lock l(&put_since_gc_mutex_);
+          put_since_gc_.insert(block_id);
+        }
+        stored = dedup_->TryPut(block_id, (*message)[0]);
+      } else {
+        blocks_->Put(block_id, (*message)[0]);
+      }
+      message->clear();
+      if (!stored) {
+        message->Append(new string("rejected"));
+      }
+      machine()->SendReplyMessage(header, message);
+      break;
+    }
+
+    default:
+      LOG(FATAL) << "unrecognized RPC type: " << header->rpc();
+  }
+}
+
+void DistributedBlockStoreApp::Start() {
+  config_ = new CalvinFSConfigMap(machine());
+  replica_ = config_->LookupReplica(machine()->machine_id());
+  // Fragments don't hash to their block's content id, so erasure-coded stores
+  // can't check or count references. (Identical blocks still map to the same
+  // fragments on the same machines.)
+  if (config_->config().content_addressed_blocks() &&
+      config_->config().erasure_code_data_fragments() == 0) {
+    dedup_ = new DedupBlockStore(blocks_);
+    blocks_ = dedup_;
+  }
+  if (config_->config().block_cache_bytes() > 0) {
+    cache_ = new BlockCache(config_->config().block_cache_bytes());
+  }
+  if (config_->config().erasure_code_data_fragments() > 0) {
+    erasure_ = new ReedSolomon(
+        config_->config().erasure_code_data_fragments(),
+        config_->config().erasure_code_parity_fragments());
+  }
+  if (config_->config().block_gc_interval() > 0) {
+    gc_running_ = true;
+    pthread_create(&gc_thread_, NULL, RunGCThread,
+                   reinterpret_cast<void*>(this));
+  }
+}
+
+// Waits up to kGCTimeout seconds for all 'calls' to complete, and then (if
+// they all did) sets '*replies' to their replies and returns true. Otherwise
+// cancels the calls, frees any replies and returns false.
+static bool WaitForGCReplies(
+    const vector<Future<MessageBuffer*> >& calls,
+    vector<MessageBuffer*>* replies) {
+  Future<vector<MessageBuffer*> > all = WhenAll(calls);
+  if (!all.Wait(DistributedBlockStoreApp::kGCTimeout)) {
+    // Cancelling the calls completes 'all', which frees any replies.
+    for (uint32 i = 0; i < calls.size(); i++) {
+      Future<MessageBuffer*>(calls[i]).Cancel();
+    }
+    return false;
+  }
+  *replies = all.Get();
+  bool complete = true;
+  for (uint32 i = 0; i < replies->size(); i++) {
+    if ((*replies)[i] == NULL) {
+      complete = false;
+    }
+  }
+  if (!complete) {
+    for (uint32 i = 0; i < replies->size(); i++) {
+      delete (*replies)[i];
+    }
+    replies->clear();
+  }
+  return complete;
+}
+
+bool DistributedBlockStoreApp::CollectGCVersions(uint64* low, uint64* high) {
+  vector<uint64> mds;
+  for (auto it = config_->mds().begin(); it != config_->mds().end(); ++it) {
+    if (std::find(mds.begin(), mds.end(), it->second) == mds.end()) {
+      mds.push_back(it->second);
+    }
+  }
+  vector<Future<MessageBuffer*> > calls;
+  for (uint32 i = 0; i < mds.size(); i++) {
+    Header* header = new Header();
+    header->set_from(machine()->machine_id());
+    header->set_to(mds[i]);
+    header->set_type(Header::RPC);
+    header->set_app("metadata");
+    header->set_rpc("GC_VERSIONS");
+    calls.push_back(machine()->Call(header, new MessageBuffer()));
+  }
+  vector<MessageBuffer*> replies;
+  if (!WaitForGCReplies(calls, &replies)) {
+    return false;
+  }
+
+  // Each reply holds a machine's low- and high-water versions.
+  bool complete = true;
+  *low = ~0ULL;
+  *high = 0;
+  for (uint32 i = 0; i < replies.size(); i++) {
+    MessageBuffer* m = replies[i];
+    uint64 versions[2];
+    if (m->size() != 1 || (*m)[0].size() != sizeof(versions)) {
+      complete = false;
+    } else {
+      memcpy(versions, (*m)[0].data(), sizeof(versions));
+      *low = std::min(*low, versions[0]);
+      *high = std::max(*high, versions[1]);
+    }
+    delete m;
+  }
+  if (!complete) {
+    LOG(ERROR) << "[" << machine()->machine_id() << "] "
+               << "malformed GC_VERSIONS reply";
+  }
+  return complete;
+}
+
+int DistributedBlockStoreApp::CollectGarbage() {
+  Lock l(&gc_mutex_);
+
+  // Nothing read or pinned anywhere before 'low_water' can still be read.
+  uint64 low_water, high_water;
+  if (!CollectGCVersions(&low_water, &high_water)) {
+    LOG(ERROR) << "[" << machine()->machine_id() << "] "
+               << "no low-water version; skipping GC round";
+    return 0;
+  }
+
+  vector<uint64> blocks;
+  blocks_->ListBlocks(&blocks);
+  std::sort(blocks.begin(), blocks.end());
+  blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+  // Ask every metadata shard in this replica which blocks it refers to. Each
+  // replies with one bit per block (see MetadataStore::FindReferencedBlocks).
+  vector<uint64> mds;
+  for (auto it = config_->mds().begin(); it != config_->mds().end(); ++it) {
+    if (it->first.second == replica_ &&
+        std::find(mds.begin(), mds.end(), it->second) == mds.end()) {
+      mds.push_back(it->second);
+    }
+  }
+  string request;
+  EncodeBlockIDList(blocks, &request);
+  vector<Future<MessageBuffer*> > calls;
+  for (uint32 i = 0; i < mds.size(); i++) {
+    Header* header = new Header();
+    header->set_from(machine()->machine_id());
+    header->set_to(mds[i]);
+    header->set_type(Header::RPC);
+    header->set_app("metadata");
+    header->set_rpc("REFERENCED_BLOCKS");
+    calls.push_back(
+        machine()->Call(header, new MessageBuffer(new string(request))));
+  }
+  vector<MessageBuffer*> replies;
+  if (!WaitForGCReplies(calls, &replies)) {
+    LOG(ERROR) << "[" << machine()->machine_id() << "] "
+               << "REFERENCED_BLOCKS timed out; skipping GC round";
+    return 0;
+  }
+
+  vector<bool> referenced(blocks.size(), false);
+  bool complete = true;
+  for (uint32 i = 0; i < mds.size(); i++) {
+    MessageBuffer* m = replies[i];
+    if (m->size() != 1 || (*m)[0].size() != (blocks.size() + 7) / 8) {
+      complete = false;
+    } else {
+      const char* bits = (*m)[0].data();
+      for (uint32 j = 0; j < blocks.size(); j++) {
+        if (bits[j / 8] & (1 << (j % 8))) {
+          referenced[j] = true;
+        }
+      }
+    }
+    delete m;
+  }
+  if (!complete) {
+    LOG(ERROR) << "[" << machine()->machine_id() << "] "
+               << "malformed REFERENCED_BLOCKS reply; skipping GC round";
+    return 0;
+  }
+
+  // Stamp newly unreferenced blocks with a version no older than any that
+  // was read or pinned during the scans.
+  uint64 ignored;
+  if (!CollectGCVersions(&ignored, &high_water)) {
+    LOG(ERROR) << "[" << machine()->machine_id() << "] "
+               << "no high-water version; skipping GC round";
+    return 0;
+  }
+
+  // Delete blocks last seen referenced (or pinned) before 'low_water'.
+  vector<uint64> doomed;
+  btree::btree_map<uint64, uint64> unreferenced;
+  for (uint32 i = 0; i < blocks.size(); i++) {
+    if (referenced[i]) {
+      continue;
+    }
+    auto it = unreferenced_.find(blocks[i]);
+    if (it == unreferenced_.end()) {
+      unreferenced[blocks[i]] = high_water;
+    } else if (it->second < low_water) {
+      doomed.push_back(blocks[i]);
+    } else {
+      unreferenced.insert(*it);
+    }
+  }
+
+  // Blocks Put again since the last round may be about to be referenced by
+  // writers that pinned versions above their stamps, so they start over.
+  // (DedupBlockStore::DeleteBlocks spares blocks Put after this.)
+  {
+    Lock p(&put_since_gc_mutex_);
+    vector<uint64> deletable;
+    for (uint32 i = 0; i < doomed.size(); i++) {
+      if (put_since_gc_.count(doomed[i]) == 0) {
+        deletable.push_back(doomed[i]);
+      }
+    }
+    doomed.swap(deletable);
+    for (auto it = put_since_gc_.begin(); it != put_since_gc_.end(); ++it) {
+      unreferenced.erase(*it);
+    }
+    put_since_gc_.clear();
+  }
+  blocks_->DeleteBlocks(doomed);
+  unreferenced_.swap(unreferenced);
+  return doomed.size();
+}
+
+void* DistributedBlockStoreApp::RunGCThread(void* arg) {
+  DistributedBlockStoreApp* app =
+      reinterpret_cast<DistributedBlockStoreApp*>(arg);
+  double interval = app->config_->config().block_gc_interval();
+  while (!app->gc_stopped_) {
+    double next = GetTime() + interval;
+    while (GetTime() < next && !app->gc_stopped_) {
+      usleep(10000);
+    }
+    if (app->gc_stopped_) {
+      break;
+    }
+    int deleted = app->CollectGarbage();
+    LOG(ERROR) << "[" << app->machine()->machine_id() << "] "
+               << "garbage collection deleted " << deleted << " blocks";
+  }
+  return NULL;
+}
+
+void DistributedBlockStoreApp::FragmentHolders(
+    uint64 block_id,
+    vector<uint64>* machines) {
+  // Walk the bluckets starting at the block's own, first in replica 0, then in
+  // replica 1, etc., skipping machines that already hold a fragment.
+  uint64 fragments = erasure_->data_fragments() + erasure_->parity_fragments();
+  uint64 bluckets = config_->config().blucket_count();
+  uint64 replicas = config_->config().block_replication_factor();
+  uint64 start = config_->HashBlockID(block_id);
+  machines->clear();
+  for (uint64 i = 0; i < bluckets * replicas && machines->size() < fragments;
+       i++) {
+    uint64 m = config_->LookupBlucket((start + i) % bluckets, i / bluckets);
+    if (std::find(machines->begin(), machines->end(), m) == machines->end()) {
+      machines->push_back(m);
+    }
+  }
+  CHECK_EQ(fragments, machines->size())
+      << "too few machines for " << fragments << " fragments per block";
+}
+
+bool DistributedBlockStoreApp::GetCoded(uint64 block_id, string* data) {
+  if (LookupCache(block_id, 0, ~0ULL, data)) {
+    return true;
+  }
+  vector<uint64> holders;
+  FragmentHolders(block_id, &holders);
+  uint32 k = erasure_->data_fragments();
+
+  // Request the data fragments, then as many parity fragments as are needed
+  // to replace any that are missing. All requests of a round are in flight at
+  // once.
+  map<int, string> fragments;
+  uint64 size = 0;
+  uint32 next = 0;
+  while (fragments.size() < k && next < holders.size()) {
+    uint32 end = std::min<uint32>(next + k - fragments.size(), holders.size());
+    vector<Future<MessageBuffer*> > calls;
+    for (uint32 i = next; i < end; i++) {
+      Header* header = new Header();
+      header->set_from(machine()->machine_id());
+      header->set_to(holders[i]);
+      header->set_type(Header::RPC);
+      header->set_app(name());
+      header->set_rpc("GET");
+      header->add_misc_int(block_id);
+      calls.push_back(machine()->Call(header, new MessageBuffer()));
+    }
+
+    vector<MessageBuffer*> replies = WhenAll(calls).Get();
+    for (uint32 i = next; i < end; i++) {
+      MessageBuffer* m = replies[i - next];
+      uint64 index, fragment_size;
+      Slice shard;
+      if (m != NULL && !m->empty() &&
+          ParseFragment((*m)[0], &index, &fragment_size, &shard) &&
+          index == i && (fragments.empty() || fragment_size == size)) {
+        size = fragment_size;
+        fragments[i].assign(shard.data(), shard.size());
+      }
+      delete m;
+    }
+    next = end;
+  }
+
+  if (fragments.empty() || !erasure_->Decode(fragments, size, data)) {
+    return false;
+  }
+  if (cache_ != NULL) {
+    cache_->Insert(block_id, 0, ~0ULL, *data);
+  }
+  return true;
+}
+
+bool DistributedBlockStoreApp::LookupCache(
+    uint64 block_id,
+    uint64 offset,
+    uint64 length,
+    string* data) {
+  if (cache_ == NULL) {
+    return false;
+  }
+  MessagePart* part = cache_->Lookup(block_id, offset, length);
+  if (part == NULL) {
+    return false;
+  }
+  data->assign(part->buffer().data(), part->buffer().size());
+  delete part;
+  return true;
+}
+
+bool DistributedBlockStoreApp::IsLocal(uint64 block_id) {
+  return config_->LookupMetadataShard(config_->HashBlockID(block_id), replica_)
          == machine()->machine_id();
 }
 
+///////////////////////         BlockRangeReader         ///////////////////////
+
+BlockRangeReader::BlockRangeReader(
+    DistributedBlockStoreApp* blocks,
+    const vector<BlockRange>& ranges)
+    : blocks_(blocks), machine_(blocks->machine()), cache_(blocks->cache_),
+      ranges_(ranges),
+      batch_of_(ranges.size(), -1), parts_(ranges.size(), NULL),
+      received_(ranges.size(), false), found_(ranges.size(), false),
+      next_(0) {
+  // Group ranges by the machine (within this replica) that stores them.
+  map<uint64, vector<int> > by_machine;
+  for (uint32 i = 0; i < ranges.size(); i++) {
+    if (ranges[i].block_id == 0) {
+      // Implicit all-zero block!
+      parts_[i] = new MessagePart(new string(ranges[i].length, '\0'));
+      received_[i] = true;
+      found_[i] = true;
+      continue;
+    }
+    if (blocks->erasure_ != NULL) {
+      // Erasure-coded blocks are fetched one at a time by Next.
+      continue;
+    }
+
+    uint64 owner = blocks->config_->LookupBlucket(
+        blocks->config_->HashBlockID(ranges[i].block_id),
+        blocks->replica_);
+    if (owner != machine_->machine_id() && cache_ != NULL) {
+      parts_[i] = cache_->Lookup(
+          ranges[i].block_id,
+          ranges[i].offset,
+          ranges[i].length);
+      if (parts_[i] != NULL) {
+        received_[i] = true;
+        found_[i] = true;
+        continue;
+      }
+    }
+    by_machine[owner].push_back(i);
+  }
+
+  // Send up to kMaxBatch ranges per message. Each machine's batches are sent
+  // in file order so that the earliest ranges tend to arrive first.
+  for (map<uint64, vector<int> >::iterator it = by_machine.begin();
+       it != by_machine.end(); ++it) {
+    for (uint32 start = 0; start < it->second.size(); start += kMaxBatch) {
+      uint32 end = std::min<uint32>(start + kMaxBatch, it->second.size());
+      Header* header = new Header();
+      header->set_from(machine_->machine_id());
+      header->set_to(it->first);
+      header->set_type(Header::RPC);
+      header->set_app(blocks->name());
+      header->set_rpc("MULTIGET");
+      header->add_misc_int(batches_.size());
+      batches_.push_back(vector<int>());
+      remote_.push_back(it->first != machine_->machine_id());
+      for (uint32 j = start; j < end; j++) {
+        int index = it->second[j];
+        header->add_misc_int(ranges[index].block_id);
+        header->add_misc_int(ranges[index].offset);
+        header->add_misc_int(ranges[index].length);
+        batches_.back().push_back(index);
+        batch_of_[index] = batches_.size() - 1;
+      }
+      replies_.push_back(machine_->Call(header, new MessageBuffer()));
+    }
+  }
+}
+
+BlockRangeReader::~BlockRangeReader() {
+  // Replies still in flight are discarded by their futures.
+  for (uint32 i = next_; i < parts_.size(); i++) {
+    delete parts_[i];
+  }
+}
+
+bool BlockRangeReader::Next(MessagePart** part) {
+  if (next_ == parts_.size()) {
+    return false;
+  }
+  if (!received_[next_] && blocks_->erasure_ != NULL) {
+    const BlockRange& range = ranges_[next_];
+    string* data = new string();
+    if (blocks_->GetRange(range.block_id, range.offset, range.length, data)) {
+      parts_[next_] = new MessagePart(data);
+      found_[next_] = true;
+    } else {
+      delete data;
+    }
+    received_[next_] = true;
+  }
+  if (!received_[next_]) {
+    Receive(batch_of_[next_]);
+  }
+  *part = found_[next_] ? parts_[next_] : NULL;
+  parts_[next_] = NULL;
+  next_++;
+  return true;
+}
+
+void BlockRangeReader::Receive(int tag) {
+  const vector<int>& batch = batches_[tag];
+  MessageBuffer* m = replies_[tag].Get();
+  if (m == NULL) {
+    // The call was cancelled, so the batch's blocks can't be found.
+    for (uint32 i = 0; i < batch.size(); i++) {
+      received_[batch[i]] = true;
+    }
+    return;
+  }
+
+  // Parse status part.
+  CHECK(!m->empty());
+  const Slice& status = (*m)[0];
+  uint64 reply_tag;
+  const char* pos = varint::Parse64(status.data(), &reply_tag);
+  CHECK_EQ(static_cast<uint64>(tag), reply_tag);
+  CHECK(status.data() + status.size() - pos ==
+        static_cast<int>(batch.size()));
+
+  // File parts.
+  uint32 next_part = 1;
+  for (uint32 i = 0; i < batch.size(); i++) {
+    if (pos[i]) {
+      parts_[batch[i]] = m->StealPart(next_part++);
+      found_[batch[i]] = true;
+      if (remote_[tag] && cache_ != NULL) {
+        const BlockRange& range = ranges_[batch[i]];
+        cache_->Insert(
+            range.block_id,
+            range.offset,
+            range.length,
+            parts_[batch[i]]->buffer());
+      }
+    }
+    received_[batch[i]] = true;
+  }
+  CHECK(next_part == m->size());
+  delete m;
+}
+
@@ -6,9 +6,24 @@
 
 #include <leveldb/db.h>
 #include <leveldb/slice.h>
+#include <pthread.h>
+#include <atomic>
+#include <map>
 #include <string>
+#include <utility>
+#include <vector>
+#include "btree/btree_map.h"
+#include "btree/btree_set.h"
+#include "common/mutex.h"
 #include "common/types.h"
 #include "machine/app/app.h"
+#include "machine/future.h"
+#include "machine/message_buffer.h"
+
+using std::atomic;
+using std::map;
+using std::pair;
+using std::vector;
 
 class BlockStore {
  public:
@@ -16,6 +31,34 @@ class BlockStore {
   virtual bool Exists(uint64 block_id) = 0;
   virtual void Put(uint64 block_id, const Slice& value) = 0;
   virtual bool Get(uint64 block_id, string* value) = 0;
+  virtual void Delete(uint64 block_id) = 0;
+
+  // Sets '*value' to the 'length' bytes of the block starting at 'offset'
+  // (fewer if the block ends sooner). Returns false if the block does not
+  // exist. The default implementation reads the whole block.
+  virtual bool GetRange(
+      uint64 block_id,
+      uint64 offset,
+      uint64 length,
+      string* value);
+
+  // Like GetRange, but returns the bytes as a MessagePart suitable for
+  // sending, or NULL if the block does not exist. Stores that can serve
+  // blocks without copying them should override this. The default
+  // implementation wraps the result of GetRange.
+  virtual MessagePart* GetRangePart(
+      uint64 block_id,
+      uint64 offset,
+      uint64 length);
+
+  // Appends the ids of all stored blocks to '*block_ids', in no particular
+  // order.
+  virtual void ListBlocks(vector<uint64>* block_ids) = 0;
+
+  // Deletes every block in 'block_ids'. Stores that can delete many blocks
+  // more cheaply than one at a time should override this. The default
+  // implementation calls Delete for each block.
+  virtual void DeleteBlocks(const vector<uint64>& block_ids);
 };
 
 class LocalFileBlockStore : public BlockStore {
@@ -25,6 +68,13 @@ class LocalFileBlockStore : public BlockStore {
   virtual bool Exists(uint64 block_id);
   virtual void Put(uint64 block_id, const Slice& data);
   virtual bool Get(uint64 block_id, string* data);
+  virtual bool GetRange(
+      uint64 block_id,
+      uint64 offset,
+      uint64 length,
+      string* data);
+  virtual void Delete(uint64 block_id);
+  virtual void ListBlocks(vector<uint64>* block_ids);
 
  private:
   string path_prefix_;
@@ -37,11 +87,226 @@ class LevelDBBlockStore : public BlockStore {
   virtual bool Exists(uint64 block_id);
   virtual void Put(uint64 block_id, const Slice& data);
   virtual bool Get(uint64 block_id, string* data);
+  virtual void Delete(uint64 block_id);
+  virtual void ListBlocks(vector<uint64>* block_ids);
+
+  // Deletes all blocks in a single write batch.
+  virtual void DeleteBlocks(const vector<uint64>& block_ids);
 
  private:
   leveldb::DB* blocks_;
 };
 
+// Log-structured block store. Blocks are appended to large preallocated
+// segment files, and an in-memory index maps each block id to the segment,
+// offset and length of its latest version. This costs no file creation (and
+// no inode) per block.
+//
+// Durability: Put and Delete return only once their records are on disk.
+// Concurrent writers share fdatasync calls (group commit): whichever writer
+// finds no sync in progress syncs every record appended so far on behalf of
+// all of them.
+//
+// Recovery: the index is periodically checkpointed to an INDEX file in the
+// store's directory. On startup the checkpoint is loaded and any records
+// appended after it are replayed. Every record carries checksums, so a torn
+// record at the tail of the log simply ends replay.
+//
+// Segments are also memory-mapped, so GetRangePart can serve blocks straight
+// from the page cache: the returned MessagePart points into the mapping and
+// pins it until the part is destroyed (e.g. when ZMQ finishes sending it).
+//
+// Deleted and overwritten blocks leave dead records behind. A background
+// thread compacts sealed segments that are mostly dead by copying their live
+// blocks to the end of the log and then unlinking them.
+class PackedBlockStore : public BlockStore {
+ public:
+  // Creates an empty store in a fresh temporary directory.
+  PackedBlockStore();
+
+  // Opens the store in directory 'dir', recovering any blocks it already
+  // contains. If 'sync' is false, writes are not fsynced (for testing).
+  explicit PackedBlockStore(
+      const string& dir,
+      uint64 segment_size = kDefaultSegmentSize,
+      bool sync = true);
+
+  // Checkpoints the index before closing.
+  virtual ~PackedBlockStore();
+
+  virtual bool Exists(uint64 block_id);
+  virtual void Put(uint64 block_id, const Slice& data);
+  virtual bool Get(uint64 block_id, string* data);
+  virtual bool GetRange(
+      uint64 block_id,
+      uint64 offset,
+      uint64 length,
+      string* data);
+  virtual MessagePart* GetRangePart(
+      uint64 block_id,
+      uint64 offset,
+      uint64 length);
+  virtual void Delete(uint64 block_id);
+  virtual void ListBlocks(vector<uint64>* block_ids);
+
+  // Appends tombstones for all blocks with a single sync. Segments left
+  // mostly dead are compacted later by the background thread.
+  virtual void DeleteBlocks(const vector<uint64>& block_ids);
+
+  // Syncs all segments and writes a checkpoint of the index. Called
+  // periodically by the background thread.
+  void Checkpoint();
+
+  // Compacts every sealed segment less than half of which holds live blocks.
+  // Returns the number of segments removed. Called periodically by the
+  // background thread; concurrent calls are serialized.
+  int Compact();
+
+  // Returns the number of segment files currently in use.
+  int segment_count();
+
+  static const uint64 kDefaultSegmentSize = 64 << 20;
+
+ private:
+  // Location of the latest record of a block.
+  struct Location {
+    uint32 segment;
+    uint32 length;   // length of block data
+    uint64 offset;   // offset of record header within segment
+  };
+
+  // Read-only mapping of a segment file. Referenced by the segment table
+  // and by every MessagePart serving data from it; unmapped when the last
+  // reference is dropped.
+  struct Mapping {
+    char* base;
+    uint64 size;
+    atomic<int> refs;
+  };
+
+  struct Segment {
+    int fd;
+    Mapping* mapping;
+    uint64 capacity;    // preallocated size
+    uint64 end;         // bytes of records written
+    uint64 live_bytes;  // bytes of records still referenced by the index
+  };
+
+  // Shared setup for both constructors.
+  void Open();
+
+  // Reads the INDEX checkpoint, if any, into index_. Sets '*segment' and
+  // '*offset' to the log position up to which the checkpoint is complete.
+  // Returns false if there is no valid checkpoint.
+  bool LoadCheckpoint(uint32* segment, uint64* offset);
+
+  // Scans segment 'id' from 'offset', applying records to the index until
+  // the end of valid records. Returns the offset just past the last valid
+  // record.
+  uint64 Replay(uint32 id, uint64 offset);
+
+  // Appends a record (a tombstone if 'data' is NULL). If 'expected' is
+  // non-NULL, appends nothing (returning 0) unless the block's current
+  // location matches '*expected'. Otherwise returns a sequence number to
+  // pass to WaitForSync. A tombstone records '*shadowed' (by default, the
+  // block's current segment) as the segment holding the record it deletes.
+  // Requires: append_mutex_ is held.
+  uint64 AppendLocked(
+      uint64 block_id,
+      const Slice* data,
+      const Location* expected,
+      const uint32* shadowed);
+
+  // Seals the active segment and starts a new one with room for at least
+  // 'size' bytes. Requires: append_mutex_ is held.
+  void RollSegment(uint64 size);
+
+  // Creates and preallocates segment file 'id'.
+  int CreateSegment(uint32 id, uint64 capacity);
+
+  // Maps the first 'size' bytes of segment file 'fd'.
+  static Mapping* Map(int fd, uint64 size);
+
+  // Drops a reference to '*mapping' (a Mapping*).
+  static void Unpin(void* mapping);
+
+  // Blocks until every record with sequence number <= 'seq' is durable.
+  void WaitForSync(uint64 seq);
+
+  // Grants exclusive right to fdatasync (and to close) segment files.
+  void AcquireSync();
+  void ReleaseSync();
+
+  // Syncs all segments appended to since the last sync. Requires: the caller
+  // holds the sync right.
+  void SyncLocked();
+
+  // Copies live blocks (and tombstones still needed) out of segment 'id' and
+  // then removes it. Does nothing if the segment is already gone.
+  // Requires: compact_mutex_ is held.
+  void CompactSegment(uint32 id);
+
+  // Reads the record at 'loc' into '*data'. Requires: index_mutex_ is held.
+  bool ReadLocked(uint64 block_id, const Location& loc, string* data);
+
+  string SegmentPath(uint32 id);
+
+  // Background compaction/checkpoint thread.
+  static void* RunBackgroundThread(void* arg);
+
+  // Directory holding segments and index checkpoint.
+  string dir_;
+
+  // Size of newly created segments.
+  uint64 segment_size_;
+
+  // False if writes should not be fsynced.
+  bool sync_;
+
+  // Block id -> location of latest record. Modified only while holding both
+  // append_mutex_ and a write lock on index_mutex_.
+  btree::btree_map<uint64, Location> index_;
+
+  // Segment id -> segment. Modified only while holding both append_mutex_
+  // and a write lock on index_mutex_.
+  map<uint32, Segment> segments_;
+  MutexRW index_mutex_;
+
+  // Serializes appends.
+  Mutex append_mutex_;
+
+  // Segment currently being appended to.
+  uint32 active_;
+
+  // Segments appended to since they were last synced (protected by
+  // append_mutex_).
+  vector<uint32> unsynced_;
+
+  // Number of records appended, and number known to be durable.
+  uint64 appended_seq_;
+  atomic<uint64> synced_seq_;
+
+  // True while some thread holds the sync right (protected by sync_mutex_).
+  // sync_cv_ is signalled whenever the right is released, which is also
+  // when synced_seq_ advances.
+  bool syncing_;
+  Mutex sync_mutex_;
+  CondVar sync_cv_;
+
+  // Serializes compactions.
+  Mutex compact_mutex_;
+
+  // Bytes appended since the last checkpoint.
+  atomic<uint64> uncheckpointed_bytes_;
+
+  pthread_t background_thread_;
+  atomic<bool> stopped_;
+
+  // DISALLOW_COPY_AND_ASSIGN
+  PackedBlockStore(const PackedBlockStore&);
+  PackedBlockStore& operator=(const PackedBlockStore&);
+};
+
 class HybridBlockStore : public BlockStore {
  public:
   HybridBlockStore() {}
@@ -49,12 +314,134 @@ class HybridBlockStore : public BlockStore {
   virtual bool Exists(uint64 block_id);
   virtual void Put(uint64 block_id, const Slice& data);
   virtual bool Get(uint64 block_id, string* data);
+  virtual bool GetRange(
+      uint64 block_id,
+      uint64 offset,
+      uint64 length,
+      string* data);
+  virtual MessagePart* GetRangePart(
+      uint64 block_id,
+      uint64 offset,
+      uint64 length);
+  virtual void Delete(uint64 block_id);
+  virtual void ListBlocks(vector<uint64>* block_ids);
+  virtual void DeleteBlocks(const vector<uint64>& block_ids);
 
  private:
-  LocalFileBlockStore large_blocks_;
+  PackedBlockStore large_blocks_;
   LevelDBBlockStore small_blocks_;
 };
 
+// Returns the content-addressed block id of 'data', derived from its SHA-256
+// digest. Content-addressed ids always have the high bit set (so they never
+// collide with GUID-based ids) and, like GUID-based ids, have the low bit set
+// iff the block is larger than 1KB.
+uint64 ContentBlockID(const Slice& data);
+
+inline bool IsContentBlockID(uint64 block_id) {
+  return (block_id >> 63) != 0;
+}
+
+// Encodes 'block_ids', which must be sorted and distinct, as varint deltas.
+// Used in the REFERENCED_BLOCKS requests of garbage collection.
+void EncodeBlockIDList(const vector<uint64>& block_ids, string* out);
+
+// Inverse of EncodeBlockIDList. Returns false if 'in' is malformed.
+bool DecodeBlockIDList(const Slice& in, vector<uint64>* block_ids);
+
+// Wraps another block store, storing each distinct content-addressed block
+// only once (see the 'content_addressed_blocks' field of CalvinFSConfig).
+//
+// Putting a content-addressed block that already exists adds a reference to
+// it rather than rewriting it, and Delete only deletes the block once every
+// Put has been matched by a Delete. Blocks with ordinary ids pass through
+// unchanged.
+//
+// Reference counts are kept in memory only. Content-addressed blocks found
+// in the underlying store after a restart are pinned: Delete never removes
+// them, leaving them to be reclaimed by garbage collection (DeleteBlocks).
+//
+// Since ids keep only 62 bits of the digest, a dedup hit is confirmed against
+// 128 more bits of the content's digest before a reference is added. Puts
+// whose id doesn't match their contents, or that collide with a different
+// stored block, are rejected (see TryPut); writers then fall back to a
+// GUID-based id.
+class DedupBlockStore : public BlockStore {
+ public:
+  // Takes ownership of 'blocks'.
+  explicit DedupBlockStore(BlockStore* blocks) : blocks_(blocks), epoch_(1) {}
+  virtual ~DedupBlockStore() { delete blocks_; }
+
+  virtual bool Exists(uint64 block_id);
+
+  // Like TryPut, but only logs rejections.
+  virtual void Put(uint64 block_id, const Slice& data);
+
+  // Puts a block, returning false (and storing nothing) if 'block_id' is a
+  // content-addressed id that is not ContentBlockID(data), or that is already
+  // held by a block with different contents.
+  bool TryPut(uint64 block_id, const Slice& data);
+
+  virtual bool Get(uint64 block_id, string* data);
+  virtual bool GetRange(
+      uint64 block_id,
+      uint64 offset,
+      uint64 length,
+      string* data);
+  virtual MessagePart* GetRangePart(
+      uint64 block_id,
+      uint64 offset,
+      uint64 length);
+  virtual void Delete(uint64 block_id);
+  virtual void ListBlocks(vector<uint64>* block_ids);
+
+  // Deletes blocks regardless of their reference counts, except for
+  // content-addressed blocks that have been Put since the previous call to
+  // DeleteBlocks (which may have gained a reference that the caller did not
+  // know of when it chose them).
+  virtual void DeleteBlocks(const vector<uint64>& block_ids);
+
+  // Returns the number of outstanding references to 'block_id', 0 if it is
+  // not stored, or kPinned.
+  uint64 RefCount(uint64 block_id);
+
+  static const uint64 kPinned = ~0ULL;
+
+ private:
+  struct Ref {
+    Ref() : count(0), check1(0), check2(0), writing(false), epoch(0) {}
+    Ref(uint64 c, uint64 h1, uint64 h2, bool w, uint64 e)
+        : count(c), check1(h1), check2(h2), writing(w), epoch(e) {}
+    uint64 count;
+
+    // Digest bits not included in the block id.
+    uint64 check1;
+    uint64 check2;
+
+    // True while the first Put of the block is writing it. Later Puts of the
+    // same block wait (on written_) for that write to finish.
+    bool writing;
+
+    // Value of epoch_ at the block's latest Put.
+    uint64 epoch;
+  };
+
+  BlockStore* blocks_;
+  btree::btree_map<uint64, Ref> refs_;
+
+  // Number of DeleteBlocks calls so far, plus one.
+  uint64 epoch_;
+
+  Mutex mutex_;
+
+  // Signalled whenever a Ref stops 'writing'.
+  CondVar written_;
+
+  // DISALLOW_COPY_AND_ASSIGN
+  DedupBlockStore(const DedupBlockStore&);
+  DedupBlockStore& operator=(const DedupBlockStore&);
+};
+
 // App wrapping a block store.
 class BlockStoreApp : public App {
  public:
@@ -63,6 +450,11 @@ class BlockStoreApp : public App {
   virtual bool Exists(uint64 block_id);
   virtual void Put(uint64 block_id, const Slice& data);
   virtual bool Get(uint64 block_id, string* data);
+  virtual bool GetRange(
+      uint64 block_id,
+      uint64 offset,
+      uint64 length,
+      string* data);
   virtual void HandleMessage(Header* header, MessageBuffer* message);
 
  protected:
@@ -75,22 +467,166 @@ class BlockStoreApp : public App {
   BlockStoreApp() {}
 };
 
+class BlockCache;
 class CalvinFSConfigMap;
+class ReedSolomon;
+
+// Block store spread over the blucket owners of a CalvinFS cluster.
+//
+// By default every block is fully replicated: replica r of block b is stored
+// by the owner of blucket HashBlockID(b) in replica r. If the
+// 'erasure_code_data_fragments' (k) field of CalvinFSConfig is nonzero, each
+// block is instead Reed-Solomon coded into k data and
+// 'erasure_code_parity_fragments' (m) parity fragments (see
+// fs/erasure_code.h), stored by k+m distinct machines starting at the owner
+// of blucket HashBlockID(b) in replica 0. Reads fetch the data fragments and
+// fall back to parity fragments only for those that are missing, so a block
+// survives the loss of any m of its fragments at a storage cost of (k+m)/k
+// rather than the replication factor.
+//
+// Blocks that no file refers to any more are reclaimed by CollectGarbage,
+// which runs every 'block_gc_interval' seconds (see CalvinFSConfig).
 class DistributedBlockStoreApp : public BlockStoreApp {
  public:
   explicit DistributedBlockStoreApp(BlockStore* blocks);
-  virtual ~DistributedBlockStoreApp() {}
+  virtual ~DistributedBlockStoreApp();
+
+  // Tracks a single replicated write started by PutAsync.
+  struct PendingPut;
 
   virtual bool Exists(uint64 block_id);
+
+  // Like WaitForPut(PutAsync(block_id, data)), but never gives up (logging
+  // a warning every kPutTimeout seconds without a quorum).
   virtual void Put(uint64 block_id, const Slice& data);
+
+  // Sends 'data' to every replica of block 'block_id' and returns without
+  // waiting for any of them. 'data' is copied, so the caller need not keep it
+  // alive. The returned token must be passed to WaitForPut exactly once.
+  PendingPut* PutAsync(uint64 block_id, const Slice& data);
+
+  // Returns true once a majority of replicas have acknowledged 'put'. (With
+  // erasure coding, once all but m/2 of the k+m fragments have.)
+  bool PutDone(PendingPut* put);
+
+  // Blocks until a majority of replicas have acknowledged 'put' (see
+  // PutDone), enough of them have rejected it (see DedupBlockStore::TryPut)
+  // that it can't succeed, or 'timeout' seconds have passed. Then returns
+  // 'put' to the app. Returns false unless the put succeeded.
+  // Acks from the remaining replicas are collected later.
+  bool WaitForPut(PendingPut* put, double timeout = kPutTimeout);
+
+  // Appends to '*stragglers' a (block_id, machine) pair for each replica that
+  // has failed to acknowledge a put within kStragglerTimeout seconds, or whose
+  // PUT was rejected or cancelled without a reply, so that it can be
+  // repaired. Each straggler is reported only once.
+  void TakeStragglers(vector<pair<uint64, uint64> >* stragglers);
+
+  static const double kStragglerTimeout;
+  static const double kPutTimeout;
+
   virtual bool Get(uint64 block_id, string* data);
+  virtual bool GetRange(
+      uint64 block_id,
+      uint64 offset,
+      uint64 length,
+      string* data);
 
   virtual void HandleMessage(Header* header, MessageBuffer* message);
   virtual void Start();
 
+  // Returns the store holding this machine's blocks (or, with erasure
+  // coding, fragments).
+  BlockStore* local_store() { return blocks_; }
+
+  // Runs one round of garbage collection over this machine's blocks and
+  // returns the number of blocks deleted.
+  //
+  // Each round asks every metadata shard in this machine's replica which of
+  // the local blocks its entries (at their latest versions) refer to. A
+  // block that a round finds unreferenced is stamped with that round's
+  // high-water version H: the newest version any metadata machine had
+  // executed or was reading at once the scans were done. It is deleted by a
+  // later round that still finds it unreferenced and whose low-water version
+  // L, taken before its scans, exceeds H. L is the oldest version at which
+  // any metadata machine may still read, or that a client writing a block
+  // has pinned (see MetadataStore::PinWriteVersion), so no read or pending
+  // append can still need the block. Rounds therefore make progress only as
+  // every metadata machine's versions advance. Log batch blocks, which no
+  // metadata entry refers to, are reclaimed the same way. A round that
+  // cannot hear from every metadata machine within kGCTimeout seconds
+  // deletes nothing.
+  int CollectGarbage();
+
+  static const double kGCTimeout;
+
  private:
+  friend class BlockRangeReader;
+
   bool IsLocal(uint64 block_id);
 
+  // Sets '*machines' to the machines storing each fragment of erasure-coded
+  // block 'block_id', in fragment order.
+  void FragmentHolders(uint64 block_id, vector<uint64>* machines);
+
+  // Fetches and decodes erasure-coded block 'block_id'.
+  bool GetCoded(uint64 block_id, string* data);
+
+  // Calls CollectGarbage every 'block_gc_interval' seconds until gc_stopped_.
+  static void* RunGCThread(void* arg);
+
+  // Copies a cached range into '*data'. Returns false on a cache miss.
+  bool LookupCache(uint64 block_id, uint64 offset, uint64 length, string* data);
+
+  // Called when the last MessagePart referencing a PendingPut's data dies.
+  static void ReleasePutData(void* arg);
+
+  // Records a replica's reply to a PUT ('arg' is a PendingPut::Reply*).
+  static void OnPutReply(Future<MessageBuffer*>* reply, void* arg);
+
+  // Like WaitForPut, but leaves 'put' with the caller.
+  bool WaitForQuorum(PendingPut* put, double timeout);
+
+  // Recycles finished puts and records stragglers. Requires: puts_mutex_ held.
+  void SweepRetiredPuts();
+
+  // Puts that have reached quorum but may still be awaiting acks (or message
+  // part releases), and puts that are ready for reuse.
+  vector<PendingPut*> retired_puts_;
+  vector<PendingPut*> free_puts_;
+  vector<pair<uint64, uint64> > stragglers_;
+  Mutex puts_mutex_;
+
+  // blocks_, if it deduplicates content-addressed blocks; otherwise NULL.
+  DedupBlockStore* dedup_;
+
+  // Cache of ranges read from other machines, or NULL if disabled.
+  BlockCache* cache_;
+
+  // Erasure code used for all blocks, or NULL if blocks are replicated.
+  ReedSolomon* erasure_;
+
+  // Asks every metadata machine (in all replicas) for its low- and
+  // high-water versions, and sets '*low' to the lowest low-water version and
+  // '*high' to the highest high-water version. Returns false if some machine
+  // did not reply in time.
+  bool CollectGCVersions(uint64* low, uint64* high);
+
+  // Local blocks found unreferenced by garbage collection, each mapped to the
+  // high-water version of the first round that found it so.
+  btree::btree_map<uint64, uint64> unreferenced_;
+  Mutex gc_mutex_;
+
+  // Content-addressed blocks Put since the last garbage collection round.
+  // Their writers may not have referenced them yet, so they are restamped.
+  btree::btree_set<uint64> put_since_gc_;
+  Mutex put_since_gc_mutex_;
+
+  // Background garbage collection thread (if gc_running_).
+  pthread_t gc_thread_;
+  bool gc_running_;
+  atomic<bool> gc_stopped_;
+
   // Replica to which the local machine belongs.
   uint64 replica_;
 
@@ -98,5 +634,81 @@ class DistributedBlockStoreApp : public BlockStoreApp {
   CalvinFSConfigMap* config_;
 };
 
+// A byte range within a block. Block 0 is the implicit all-zero block.
+struct BlockRange {
+  BlockRange(uint64 b, uint64 o, uint64 l)
+      : block_id(b), offset(o), length(l) {
+  }
+  uint64 block_id;
+  uint64 offset;
+  uint64 length;
+};
+
+// Fetches a sequence of block ranges in parallel and hands them back in order.
+//
+// All requests are sent from the constructor, batched into MULTIGET messages
+// of up to kMaxBatch ranges per destination machine and sent with
+// Machine::Call. Next blocks only on the reply holding the next range, so the
+// first ranges can be consumed while later ones are still in flight. Ranges
+// of block 0 are synthesized locally, and ranges found in the app's
+// BlockCache (if any) are not requested at all. Ranges of erasure-coded
+// blocks are instead fetched one by one as Next reaches them.
+//
+// Example:
+//
+//   BlockRangeReader reader(blocks, ranges);
+//   MessagePart* part;
+//   while (reader.Next(&part)) {
+//     if (part == NULL) { /* block missing */ }
+//     ...
+//   }
+class BlockRangeReader {
+ public:
+  BlockRangeReader(
+      DistributedBlockStoreApp* blocks,
+      const vector<BlockRange>& ranges);
+
+  ~BlockRangeReader();
+
+  // Returns false once every range has been returned. Otherwise blocks until
+  // the next range (in order) is available and sets '*part' to its contents,
+  // or to NULL if its block does not exist. Caller takes ownership of
+  // '*part'.
+  bool Next(MessagePart** part);
+
+  static const int kMaxBatch = 64;
+
+ private:
+  // Waits for the reply to MULTIGET 'tag' and files its parts.
+  void Receive(int tag);
+
+  DistributedBlockStoreApp* blocks_;
+  Machine* machine_;
+  BlockCache* cache_;
+  vector<BlockRange> ranges_;
+
+  // Indexes of the ranges requested by each MULTIGET, its reply, and whether
+  // it went to another machine, by tag.
+  vector<vector<int> > batches_;
+  vector<Future<MessageBuffer*> > replies_;
+  vector<bool> remote_;
+
+  // Tag of the MULTIGET requesting each range, or -1 if none did.
+  vector<int> batch_of_;
+
+  // Received ranges not yet returned by Next, and whether each range's block
+  // was found. Both are indexed like the constructor's 'ranges'.
+  vector<MessagePart*> parts_;
+  vector<bool> received_;
+  vector<bool> found_;
+
+  // Index of the next range to be returned.
+  uint32 next_;
+
+  // DISALLOW_COPY_AND_ASSIGN
+  BlockRangeReader(const BlockRangeReader&);
+  BlockRangeReader& operator=(const BlockRangeReader&);
+};
+
 #endif  // CALVIN_FS_BLOCK_STORE_H_
 
@@ -6,9 +6,20 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <leveldb/env.h>
+#include <algorithm>
+#include <map>
 
 #include "common/utils.h"
+#include "components/store/store_app.h"
 #include "fs/calvinfs.h"
+#include "fs/metadata.pb.h"
+#include "fs/metadata_store.h"
+
+using leveldb::Env;
+using leveldb::ReadFileToString;
+using leveldb::WriteStringToFile;
+using std::map;
 
 DEFINE_bool(benchmark, false, "Run benchmarks instead of unit tests.");
 DEFINE_uint64(count, 1000, "Benchmark size");
@@ -48,6 +59,474 @@ TEST(BlockStoreTest, Overwrite) {
   EXPECT_EQ("blargh", s);
 }
 
+// Checks ranged reads of a block "0123456789" stored as block 11.
+void ExpectRanges(BlockStore* bs) {
+  string s;
+  EXPECT_TRUE(bs->GetRange(11, 0, 10, &s));
+  EXPECT_EQ("0123456789", s);
+  EXPECT_TRUE(bs->GetRange(11, 3, 4, &s));
+  EXPECT_EQ("3456", s);
+  EXPECT_TRUE(bs->GetRange(11, 8, 100, &s));
+  EXPECT_EQ("89", s);
+  EXPECT_TRUE(bs->GetRange(11, 20, 5, &s));
+  EXPECT_EQ("", s);
+  EXPECT_FALSE(bs->GetRange(13, 0, 10, &s));
+}
+
+TEST(BlockStoreTest, GetRange) {
+  LocalFileBlockStore local;
+  local.Put(11, "0123456789");
+  ExpectRanges(&local);
+
+  PackedBlockStore packed;
+  packed.Put(11, "0123456789");
+  ExpectRanges(&packed);
+
+  LevelDBBlockStore leveldb;
+  leveldb.Put(11, "0123456789");
+  ExpectRanges(&leveldb);
+}
+
+// Returns a fresh, empty directory for a PackedBlockStore.
+string PackedBlockStoreTestDir() {
+  string dir;
+  Env::Default()->GetTestDirectory(&dir);
+  dir.append("/packed-blocks-test");
+  CHECK_EQ(0, system((string("rm -fr ") + dir).c_str()));
+  return dir;
+}
+
+// Checks that 'bs' holds exactly the blocks in 'blocks' (among ids < 'max').
+void ExpectBlocks(
+    BlockStore* bs,
+    const map<uint64, string>& blocks,
+    uint64 max) {
+  string s;
+  for (uint64 i = 0; i < max; i++) {
+    if (blocks.count(i) != 0) {
+      EXPECT_TRUE(bs->Exists(i));
+      EXPECT_TRUE(bs->Get(i, &s));
+      EXPECT_EQ(blocks.find(i)->second, s);
+    } else {
+      EXPECT_FALSE(bs->Exists(i));
+      EXPECT_FALSE(bs->Get(i, &s));
+    }
+  }
+}
+
+TEST(PackedBlockStoreTest, PutGetDelete) {
+  PackedBlockStore bs;
+  string s;
+
+  EXPECT_FALSE(bs.Exists(10));
+  bs.Put(10, "asdf");
+  bs.Put(11, "");
+  EXPECT_TRUE(bs.Exists(10));
+  EXPECT_TRUE(bs.Get(10, &s));
+  EXPECT_EQ("asdf", s);
+  EXPECT_TRUE(bs.Get(11, &s));
+  EXPECT_EQ("", s);
+
+  bs.Put(10, "blargh");
+  EXPECT_TRUE(bs.Get(10, &s));
+  EXPECT_EQ("blargh", s);
+
+  bs.Delete(10);
+  bs.Delete(12);
+  EXPECT_FALSE(bs.Exists(10));
+  EXPECT_FALSE(bs.Get(10, &s));
+  EXPECT_TRUE(bs.Exists(11));
+}
+
+TEST(PackedBlockStoreTest, Recovery) {
+  string dir = PackedBlockStoreTestDir();
+  map<uint64, string> blocks;
+
+  // Write enough to span several segments, including a block larger than a
+  // whole segment.
+  {
+    PackedBlockStore bs(dir, 4096);
+    for (uint64 i = 0; i < 100; i++) {
+      blocks[i] = RandomString(rand() % 300);
+      bs.Put(i, blocks[i]);
+    }
+    blocks[100] = RandomString(10000);
+    bs.Put(100, blocks[100]);
+    for (uint64 i = 0; i < 100; i += 3) {
+      bs.Delete(i);
+      blocks.erase(i);
+    }
+    EXPECT_LT(1, bs.segment_count());
+  }
+
+  // Recover from the checkpoint.
+  string checkpoint;
+  {
+    PackedBlockStore bs(dir, 4096);
+    ExpectBlocks(&bs, blocks, 110);
+    CHECK(ReadFileToString(Env::Default(), dir + "/INDEX", &checkpoint).ok());
+
+    // Make changes after the checkpoint was read.
+    for (uint64 i = 1; i < 100; i += 3) {
+      blocks[i] = RandomString(rand() % 300);
+      bs.Put(i, blocks[i]);
+    }
+    bs.Delete(2);
+    blocks.erase(2);
+    blocks[105] = "new";
+    bs.Put(105, blocks[105]);
+  }
+
+  // Recover from a stale checkpoint plus the log after it.
+  CHECK(WriteStringToFile(Env::Default(), checkpoint, dir + "/INDEX").ok());
+  {
+    PackedBlockStore bs(dir, 4096);
+    ExpectBlocks(&bs, blocks, 110);
+  }
+
+  // Recover from the log alone.
+  CHECK(Env::Default()->DeleteFile(dir + "/INDEX").ok());
+  {
+    PackedBlockStore bs(dir, 4096);
+    ExpectBlocks(&bs, blocks, 110);
+  }
+}
+
+TEST(PackedBlockStoreTest, Compaction) {
+  string dir = PackedBlockStoreTestDir();
+  map<uint64, string> blocks;
+  {
+    PackedBlockStore bs(dir, 4096, false);
+    for (uint64 i = 0; i < 200; i++) {
+      blocks[i] = RandomString(100);
+      bs.Put(i, blocks[i]);
+    }
+    int before = bs.segment_count();
+    for (uint64 i = 0; i < 200; i++) {
+      if (i % 10 != 0) {
+        bs.Delete(i);
+        blocks.erase(i);
+      }
+    }
+    EXPECT_LT(0, bs.Compact());
+    EXPECT_GT(before, bs.segment_count());
+    ExpectBlocks(&bs, blocks, 200);
+  }
+
+  // Compacted state survives reopening.
+  {
+    PackedBlockStore bs(dir, 4096, false);
+    ExpectBlocks(&bs, blocks, 200);
+  }
+}
+
+TEST(PackedBlockStoreTest, CompactionKeepsTombstones) {
+  string dir = PackedBlockStoreTestDir();
+  map<uint64, string> blocks;
+  {
+    PackedBlockStore bs(dir, 4096, false);
+    // The first segment stays mostly live.
+    for (uint64 i = 0; i < 20; i++) {
+      blocks[i] = RandomString(100);
+      bs.Put(i, blocks[i]);
+    }
+    // Block 0's tombstone lands among short-lived blocks, in a segment that
+    // gets compacted away.
+    for (uint64 i = 100; i < 200; i++) {
+      bs.Put(i, RandomString(100));
+    }
+    bs.Delete(0);
+    blocks.erase(0);
+    for (uint64 i = 100; i < 200; i++) {
+      bs.Delete(i);
+    }
+    for (uint64 i = 200; i < 250; i++) {
+      blocks[i] = RandomString(100);
+      bs.Put(i, blocks[i]);
+    }
+    int before = bs.segment_count();
+    bs.Compact();
+    EXPECT_GT(before, bs.segment_count());
+    ExpectBlocks(&bs, blocks, 300);
+  }
+
+  // Replaying the first segment without the tombstone would resurrect
+  // block 0.
+  CHECK(Env::Default()->DeleteFile(dir + "/INDEX").ok());
+  {
+    PackedBlockStore bs(dir, 4096, false);
+    ExpectBlocks(&bs, blocks, 300);
+  }
+}
+
+TEST(PackedBlockStoreTest, GetRangePart) {
+  string dir = PackedBlockStoreTestDir();
+  PackedBlockStore bs(dir, 4096, false);
+  bs.Put(1, "0123456789");
+  EXPECT_TRUE(bs.GetRangePart(2, 0, 10) == NULL);
+
+  MessagePart* whole = bs.GetRangePart(1, 0, 100);
+  MessagePart* part = bs.GetRangePart(1, 2, 3);
+  EXPECT_EQ("0123456789", whole->buffer());
+  EXPECT_EQ("234", part->buffer());
+  delete whole;
+
+  // Mapped data remains readable after the block is deleted and its
+  // segment is compacted away.
+  for (uint64 i = 2; i < 100; i++) {
+    bs.Put(i, RandomString(100));
+  }
+  for (uint64 i = 1; i < 50; i++) {
+    bs.Delete(i);
+  }
+  int before = bs.segment_count();
+  bs.Compact();
+  EXPECT_GT(before, bs.segment_count());
+  EXPECT_EQ("234", part->buffer());
+  delete part;
+}
+
+TEST(DedupBlockStoreTest, RefCounting) {
+  string dir = PackedBlockStoreTestDir();
+  string small = "asdf";
+  string large = RandomString(5000);
+  uint64 small_id = ContentBlockID(small);
+  uint64 large_id = ContentBlockID(large);
+  EXPECT_TRUE(IsContentBlockID(small_id));
+  EXPECT_FALSE(IsContentBlockID(12));
+  EXPECT_EQ(0, small_id % 2);
+  EXPECT_EQ(1, large_id % 2);
+  EXPECT_NE(small_id, ContentBlockID("asdg"));
+
+  {
+    DedupBlockStore bs(new PackedBlockStore(dir, 4096));
+    bs.Put(small_id, small);
+    bs.Put(small_id, small);
+    bs.Put(large_id, large);
+    EXPECT_EQ(2, bs.RefCount(small_id));
+    EXPECT_EQ(1, bs.RefCount(large_id));
+
+    // The block is only deleted once every reference is dropped.
+    string s;
+    bs.Delete(small_id);
+    EXPECT_TRUE(bs.Get(small_id, &s));
+    EXPECT_EQ(small, s);
+    bs.Delete(small_id);
+    EXPECT_FALSE(bs.Exists(small_id));
+    EXPECT_EQ(0, bs.RefCount(small_id));
+
+    // Ordinary block ids pass straight through.
+    bs.Put(12, "blargh");
+    bs.Put(12, "blargh2");
+    EXPECT_TRUE(bs.Get(12, &s));
+    EXPECT_EQ("blargh2", s);
+    bs.Delete(12);
+    EXPECT_FALSE(bs.Exists(12));
+  }
+
+  // After a restart, blocks that were already stored are pinned.
+  {
+    DedupBlockStore bs(new PackedBlockStore(dir, 4096));
+    bs.Put(large_id, large);
+    EXPECT_EQ(DedupBlockStore::kPinned, bs.RefCount(large_id));
+    bs.Delete(large_id);
+    string s;
+    EXPECT_TRUE(bs.Get(large_id, &s));
+    EXPECT_EQ(large, s);
+
+    // ... until garbage collection deletes them (in a later pass than the
+    // one during which they were last Put).
+    vector<uint64> doomed;
+    doomed.push_back(large_id);
+    bs.DeleteBlocks(vector<uint64>());
+    bs.DeleteBlocks(doomed);
+    EXPECT_FALSE(bs.Exists(large_id));
+  }
+}
+
+TEST(DedupBlockStoreTest, RejectsMismatchedContent) {
+  string block = "asdf";
+  uint64 id = ContentBlockID(block);
+
+  // A block already stored under the id (standing in for a digest collision
+  // with a block written before a restart).
+  PackedBlockStore* packed = new PackedBlockStore();
+  packed->Put(id, "other");
+  DedupBlockStore bs(packed);
+  EXPECT_FALSE(bs.TryPut(id, block));
+  EXPECT_EQ(0, bs.RefCount(id));
+  string s;
+  EXPECT_TRUE(bs.Get(id, &s));
+  EXPECT_EQ("other", s);
+
+  // Ids that aren't the content's own are rejected outright.
+  uint64 other_id = ContentBlockID("asdg");
+  EXPECT_FALSE(bs.TryPut(other_id, block));
+  EXPECT_FALSE(bs.Exists(other_id));
+  EXPECT_TRUE(bs.TryPut(other_id, "asdg"));
+  EXPECT_EQ(1, bs.RefCount(other_id));
+}
+
+TEST(DedupBlockStoreTest, DeleteBlocksSparesNewReferences) {
+  DedupBlockStore bs(new PackedBlockStore());
+  string block = RandomString(5000);
+  uint64 id = ContentBlockID(block);
+  vector<uint64> doomed;
+  doomed.push_back(id);
+
+  // A block Put since the last DeleteBlocks call survives one more call.
+  bs.Put(id, block);
+  bs.DeleteBlocks(doomed);
+  EXPECT_TRUE(bs.Exists(id));
+  bs.DeleteBlocks(doomed);
+  EXPECT_FALSE(bs.Exists(id));
+  EXPECT_EQ(0, bs.RefCount(id));
+
+  bs.Put(id, block);
+  bs.DeleteBlocks(vector<uint64>());
+  bs.Put(id, block);
+  bs.DeleteBlocks(doomed);
+  EXPECT_TRUE(bs.Exists(id));
+}
+
+// Checks that ListBlocks and DeleteBlocks agree with Put.
+void ExpectListAndDelete(BlockStore* bs) {
+  for (uint64 i = 1; i <= 100; i++) {
+    bs->Put(i * 1000 + i % 2, "block" + UInt64ToString(i));
+  }
+  vector<uint64> blocks;
+  bs->ListBlocks(&blocks);
+  std::sort(blocks.begin(), blocks.end());
+  ASSERT_EQ(100, blocks.size());
+  for (uint64 i = 1; i <= 100; i++) {
+    EXPECT_EQ(i * 1000 + i % 2, blocks[i - 1]);
+  }
+
+  vector<uint64> doomed;
+  for (uint64 i = 1; i <= 100; i += 3) {
+    doomed.push_back(i * 1000 + i % 2);
+  }
+  doomed.push_back(7);  // Never stored.
+  bs->DeleteBlocks(doomed);
+  for (uint64 i = 1; i <= 100; i++) {
+    EXPECT_EQ(i % 3 != 1, bs->Exists(i * 1000 + i % 2));
+  }
+  blocks.clear();
+  bs->ListBlocks(&blocks);
+  EXPECT_EQ(66, blocks.size());
+}
+
+TEST(BlockStoreTest, ListAndDeleteBlocks) {
+  LocalFileBlockStore local;
+  ExpectListAndDelete(&local);
+  PackedBlockStore packed;
+  ExpectListAndDelete(&packed);
+  LevelDBBlockStore leveldb;
+  ExpectListAndDelete(&leveldb);
+  HybridBlockStore hybrid;
+  ExpectListAndDelete(&hybrid);
+}
+
+TEST(BlockStoreTest, BlockIDList) {
+  vector<uint64> ids;
+  ids.push_back(0);
+  ids.push_back(5);
+  ids.push_back(1000000);
+  ids.push_back(ContentBlockID("asdf"));
+  ids.push_back(~0ULL);
+  string encoded;
+  EncodeBlockIDList(ids, &encoded);
+  vector<uint64> decoded;
+  EXPECT_TRUE(DecodeBlockIDList(encoded, &decoded));
+  EXPECT_EQ(ids, decoded);
+
+  EXPECT_TRUE(DecodeBlockIDList("", &decoded));
+  EXPECT_TRUE(decoded.empty());
+  EXPECT_FALSE(DecodeBlockIDList(encoded.substr(0, encoded.size() - 1),
+                                 &decoded));
+}
+
+// Runs a metadata action of type 'type' with input 'input' at 'version'.
+void RunMetadataAction(
+    StoreApp* metadata,
+    MetadataAction::Type type,
+    const google::protobuf::Message& input,
+    uint64 version) {
+  Action a;
+  a.set_action_type(type);
+  a.set_version(version);
+  input.SerializeToString(a.mutable_input());
+  metadata->GetRWSets(&a);
+  metadata->Run(&a);
+}
+
+TEST(DistributedBlockStore, CollectGarbage) {
+  Machine m;
+  string fsconfig;
+  MakeCalvinFSConfig().SerializeToString(&fsconfig);
+  m.AppData()->Put("calvinfs-config", fsconfig);
+  m.AddApp("DistributedBlockStore", "blockstore");
+  m.AddApp("MetadataStoreApp", "metadata");
+  DistributedBlockStoreApp* bs =
+      reinterpret_cast<DistributedBlockStoreApp*>(m.GetApp("blockstore"));
+  StoreApp* metadata = reinterpret_cast<StoreApp*>(m.GetApp("metadata"));
+  reinterpret_cast<MetadataStore*>(metadata->store())->SetMachine(&m);
+
+  bs->Put(11, "eleven");
+  bs->Put(12, "twelve");
+  bs->Put(13, "thirteen");
+
+  // /f consists of blocks 11 and 13.
+  MetadataAction::CreateFileInput create;
+  create.set_path("/f");
+  create.mutable_permissions();
+  create.set_type(DATA);
+  RunMetadataAction(metadata, MetadataAction::CREATE_FILE, create, 1);
+  MetadataAction::AppendInput append;
+  append.set_path("/f");
+  append.mutable_permissions();
+  FilePart* part = append.add_data();
+  part->set_block_id(11);
+  part->set_length(6);
+  part = append.add_data();
+  part->set_block_id(13);
+  part->set_length(8);
+  RunMetadataAction(metadata, MetadataAction::APPEND, append, 2);
+
+  // Block 12 is stamped by the first round that finds it unreferenced, and
+  // deleted once a later round's low-water version has passed the stamp.
+  EXPECT_EQ(0, bs->CollectGarbage());
+  EXPECT_TRUE(bs->Exists(12));
+  EXPECT_EQ(0, bs->CollectGarbage());
+  EXPECT_TRUE(bs->Exists(12));
+  MetadataAction::CreateFileInput create_g;
+  create_g.set_path("/g");
+  create_g.mutable_permissions();
+  create_g.set_type(DATA);
+  RunMetadataAction(metadata, MetadataAction::CREATE_FILE, create_g, 3);
+  EXPECT_EQ(1, bs->CollectGarbage());
+  EXPECT_FALSE(bs->Exists(12));
+  EXPECT_TRUE(bs->Exists(11));
+  EXPECT_TRUE(bs->Exists(13));
+
+  // Erasing /f makes its blocks garbage too, but not while a writer holds a
+  // pin at an older version.
+  MetadataAction::EraseInput erase;
+  erase.set_path("/f");
+  erase.mutable_permissions();
+  RunMetadataAction(metadata, MetadataAction::ERASE, erase, 4);
+  MetadataStore* mds = reinterpret_cast<MetadataStore*>(metadata->store());
+  uint64 pin = mds->PinWriteVersion();
+  EXPECT_EQ(0, bs->CollectGarbage());
+  RunMetadataAction(metadata, MetadataAction::CREATE_FILE, create, 5);
+  EXPECT_EQ(0, bs->CollectGarbage());
+  EXPECT_TRUE(bs->Exists(11));
+  mds->UnpinWriteVersion(pin);
+  EXPECT_EQ(2, bs->CollectGarbage());
+  EXPECT_FALSE(bs->Exists(11));
+  EXPECT_FALSE(bs->Exists(13));
+}
+
 TEST(DistributedBlockStore, OneMachine) {
   Machine m;
   string fsconfig;
@@ -105,6 +584,212 @@ TEST(DistributedBlockStore, ThreeMachines) {
   EXPECT_TRUE(dbs[2]->Get(10, &s));
   EXPECT_EQ("blargh", s);
 
+  // Ranged reads from every machine.
+  for (int i = 0; i < 3; i++) {
+    EXPECT_TRUE(dbs[i]->GetRange(10, 1, 3, &s));
+    EXPECT_EQ("lar", s);
+    EXPECT_FALSE(dbs[i]->GetRange(12, 1, 3, &s));
+  }
+
+  for (uint32 i = 0; i < m.size(); i++) {
+    delete m[i];
+  }
+}
+
+TEST(DistributedBlockStore, AsyncPut) {
+  string fsconfig;
+  MakeCalvinFSConfig(3).SerializeToString(&fsconfig);
+
+  vector<Machine*> m;
+  for (int i = 0; i < 3; i++) {
+    m.push_back(new Machine(i, ClusterConfig::LocalCluster(3)));
+    m[i]->AppData()->Put("calvinfs-config", fsconfig);
+    m[i]->AddApp("DistributedBlockStore", "blockstore");
+  }
+
+  vector<DistributedBlockStoreApp*> dbs;
+  for (int i = 0; i < 3; i++) {
+    dbs.push_back(
+      reinterpret_cast<DistributedBlockStoreApp*>(m[i]->GetApp("blockstore")));
+  }
+
+  // Many puts in flight at once. The source strings are discarded right away,
+  // since PutAsync copies them.
+  vector<DistributedBlockStoreApp::PendingPut*> puts;
+  for (uint64 i = 1; i <= 100; i++) {
+    string data = "block" + UInt64ToString(i);
+    puts.push_back(dbs[i % 3]->PutAsync(i, data));
+  }
+  for (uint64 i = 1; i <= 100; i++) {
+    EXPECT_TRUE(dbs[i % 3]->WaitForPut(puts[i - 1]));
+  }
+
+  // Wait for all replicas so that reads from any machine see every block.
+  Spin(0.1);
+  for (uint64 i = 1; i <= 100; i++) {
+    string s;
+    EXPECT_TRUE(dbs[rand() % 3]->Get(i, &s));
+    EXPECT_EQ("block" + UInt64ToString(i), s);
+  }
+
+  // Every replica answered, so there is nothing to repair and later puts
+  // reuse the tracking state of the earlier ones.
+  for (int i = 0; i < 3; i++) {
+    vector<pair<uint64, uint64> > stragglers;
+    dbs[i]->TakeStragglers(&stragglers);
+    EXPECT_TRUE(stragglers.empty());
+    dbs[i]->Put(1000 + i, "again");
+  }
+
+  for (uint32 i = 0; i < m.size(); i++) {
+    delete m[i];
+  }
+}
+
+TEST(DistributedBlockStore, ErasureCoded) {
+  CalvinFSConfig config = MakeCalvinFSConfig(5);
+  config.set_erasure_code_data_fragments(3);
+  config.set_erasure_code_parity_fragments(2);
+  string fsconfig;
+  config.SerializeToString(&fsconfig);
+
+  vector<Machine*> m;
+  for (int i = 0; i < 5; i++) {
+    m.push_back(new Machine(i, ClusterConfig::LocalCluster(5)));
+    m[i]->AppData()->Put("calvinfs-config", fsconfig);
+    m[i]->AddApp("DistributedBlockStore", "blockstore");
+  }
+
+  vector<DistributedBlockStoreApp*> dbs;
+  for (int i = 0; i < 5; i++) {
+    dbs.push_back(
+      reinterpret_cast<DistributedBlockStoreApp*>(m[i]->GetApp("blockstore")));
+  }
+
+  map<uint64, string> blocks;
+  for (uint64 i = 1; i <= 20; i++) {
+    blocks[i] = RandomBytes(rand() % 5000);
+    dbs[i % 5]->Put(i, blocks[i]);
+  }
+  Spin(0.1);
+
+  // Every machine stores exactly one fragment of each block.
+  for (uint64 i = 1; i <= 20; i++) {
+    for (int j = 0; j < 5; j++) {
+      EXPECT_TRUE(dbs[j]->local_store()->Exists(i));
+    }
+    EXPECT_TRUE(dbs[rand() % 5]->Exists(i));
+  }
+  EXPECT_FALSE(dbs[0]->Exists(21));
+
+  // Lose the fragments stored on two machines. Every block is still readable.
+  for (uint64 i = 1; i <= 20; i++) {
+    dbs[1]->local_store()->Delete(i);
+    dbs[3]->local_store()->Delete(i);
+  }
+  for (uint64 i = 1; i <= 20; i++) {
+    string s;
+    EXPECT_TRUE(dbs[i % 5]->Get(i, &s));
+    EXPECT_EQ(blocks[i], s);
+    EXPECT_TRUE(dbs[i % 5]->GetRange(i, 10, 100, &s));
+    EXPECT_EQ(blocks[i].substr(std::min<uint64>(10, blocks[i].size()), 100),
+              s);
+  }
+
+  vector<BlockRange> ranges;
+  ranges.push_back(BlockRange(7, 0, 20));
+  ranges.push_back(BlockRange(0, 0, 5));
+  ranges.push_back(BlockRange(21, 0, 5));
+  BlockRangeReader reader(dbs[0], ranges);
+  MessagePart* part;
+  ASSERT_TRUE(reader.Next(&part));
+  ASSERT_TRUE(part != NULL);
+  EXPECT_EQ(blocks[7].substr(0, 20), part->buffer().ToString());
+  delete part;
+  ASSERT_TRUE(reader.Next(&part));
+  ASSERT_TRUE(part != NULL);
+  EXPECT_EQ(string(5, '\0'), part->buffer().ToString());
+  delete part;
+  ASSERT_TRUE(reader.Next(&part));
+  EXPECT_TRUE(part == NULL);
+  EXPECT_FALSE(reader.Next(&part));
+
+  // A third loss is one too many.
+  for (uint64 i = 1; i <= 20; i++) {
+    dbs[4]->local_store()->Delete(i);
+  }
+  string s;
+  EXPECT_FALSE(dbs[0]->Get(1, &s));
+
+  for (uint32 i = 0; i < m.size(); i++) {
+    delete m[i];
+  }
+}
+
+TEST(DistributedBlockStore, BlockRangeReader) {
+  string fsconfig;
+  MakeCalvinFSConfig(3).SerializeToString(&fsconfig);
+
+  vector<Machine*> m;
+  for (int i = 0; i < 3; i++) {
+    m.push_back(new Machine(i, ClusterConfig::LocalCluster(3)));
+    m[i]->AppData()->Put("calvinfs-config", fsconfig);
+    m[i]->AddApp("DistributedBlockStore", "blockstore");
+  }
+
+  vector<DistributedBlockStoreApp*> dbs;
+  for (int i = 0; i < 3; i++) {
+    dbs.push_back(
+      reinterpret_cast<DistributedBlockStoreApp*>(m[i]->GetApp("blockstore")));
+  }
+
+  for (uint64 i = 1; i <= 10; i++) {
+    dbs[0]->Put(i, "block" + UInt64ToString(i));
+  }
+
+  // Enough ranges that each machine receives several batches, interleaved
+  // with zero blocks.
+  vector<BlockRange> ranges;
+  string expected;
+  for (int i = 0; i < 500; i++) {
+    if (i % 7 == 0) {
+      ranges.push_back(BlockRange(0, 0, 3));
+      expected.append(3, '\0');
+    } else {
+      uint64 block_id = 1 + i % 10;
+      ranges.push_back(BlockRange(block_id, 1, 4));
+      expected.append(("block" + UInt64ToString(block_id)).substr(1, 4));
+    }
+  }
+
+  for (int i = 0; i < 3; i++) {
+    BlockRangeReader reader(dbs[i], ranges);
+    string actual;
+    MessagePart* part;
+    while (reader.Next(&part)) {
+      ASSERT_TRUE(part != NULL);
+      actual.append(part->buffer().data(), part->buffer().size());
+      delete part;
+    }
+    EXPECT_EQ(expected, actual);
+  }
+
+  // Missing blocks are reported in place. Abandoning a reader early is fine.
+  ranges.clear();
+  ranges.push_back(BlockRange(1, 0, 100));
+  ranges.push_back(BlockRange(12, 0, 100));
+  ranges.push_back(BlockRange(2, 0, 100));
+  {
+    BlockRangeReader reader(dbs[1], ranges);
+    MessagePart* part;
+    EXPECT_TRUE(reader.Next(&part));
+    ASSERT_TRUE(part != NULL);
+    EXPECT_EQ("block1", part->buffer().ToString());
+    delete part;
+    EXPECT_TRUE(reader.Next(&part));
+    EXPECT_TRUE(part == NULL);
+  }
+
   for (uint32 i = 0; i < m.size(); i++) {
     delete m[i];
   }
@@ -150,13 +835,18 @@ TEST(DistributedBlockStore, ThreeMachinesMoreBlocks) {
   }
 }
 
+ADD_TYPE_NAME(LocalFileBlockStore);
+ADD_TYPE_NAME(PackedBlockStore);
+
+template<typename BlockStoreType>
 void Benchmark() {
   string data;
   for (int i = 0; i < 1024; i++) {
     data.append(1, '0' + rand() % 10);
   }
 
-  LocalFileBlockStore bs;
+  BlockStoreType bs;
+  LOG(ERROR) << TypeName<BlockStoreType>() << ":";
   double start = GetTime();
   for (uint64 i = 0; i < FLAGS_count; i++) {
     bs.Put(i, data);
@@ -180,7 +870,8 @@ int main(int argc, char** argv) {
   google::InitGoogleLogging(argv[0]);
   ::testing::InitGoogleTest(&argc, argv);
   if (FLAGS_benchmark) {
-    Benchmark();
+    Benchmark<LocalFileBlockStore>();
+    Benchmark<PackedBlockStore>();
     return 0;
   } else {
     return RUN_ALL_TESTS();
@@ -12,6 +12,7 @@
 #include "components/store/kvstore.h"
 #include "components/store/versioned_kvstore.h"
 #include "fs/block_store.h"
+#include "fs/dentry_cache.h"
 #include "fs/calvinfs_config.pb.h"
 #include "fs/metadata.pb.h"
 #include "fs/metadata_store.h"
@@ -47,6 +48,13 @@ uint64 CalvinFSConfigMap::HashFileName(const Slice& filename) {
   return FNVHash(filename) % config_.metadata_shard_count();
 }
 
+uint64 CalvinFSConfigMap::HashMetadataKey(const Slice& key) {
+  if (config_.inode_keys() && IsInodeKey(key)) {
+    return DecodeInodeKey(key) % config_.metadata_shard_count();
+  }
+  return HashFileName(key);
+}
+
 uint64 CalvinFSConfigMap::LookupBlucket(uint64 id, uint64 replica) {
   auto it = bluckets_.find(make_pair(id, replica));
   if (it == bluckets_.end()) {
@@ -218,15 +226,16 @@ Status LocalCalvinFS::ReadFileToString(const string& path, string* data) {
       // Implicit all-zero block!
       data->append(out.entry().file_parts(i).length(), '\0');
     } else {
-      // Block from block store.
+      // Part of block from block store.
       string block;
-      if (!blocks_->Get(out.entry().file_parts(i).block_id(), &block)) {
+      if (!blocks_->GetRange(
+              out.entry().file_parts(i).block_id(),
+              out.entry().file_parts(i).block_offset(),
+              out.entry().file_parts(i).length(),
+              &block)) {
         return Status::Error("block lookup error");
       }
-      data->append(
-          block,
-          out.entry().file_parts(i).block_offset(),
-          out.entry().file_parts(i).length());
+      data->append(block);
     }
   }
 
@@ -34,6 +34,10 @@ class CalvinFSConfigMap {
   // Map filename to mds id.
   uint64 HashFileName(const Slice& filename);
 
+  // Map metadata store key to mds id. Under config().inode_keys(), entries
+  // are placed by inode id, and dentries by hash (like paths otherwise).
+  uint64 HashMetadataKey(const Slice& key);
+
   // Lookup machine containing blucket (id, replica).
   uint64 LookupBlucket(uint64 id, uint64 replica = 0);
 
@@ -7,25 +7,42 @@
 REGISTER_APP(CalvinFSClientApp) {
   return new CalvinFSClientApp();
 }
+REGISTER_APP_NAMES(
+    CalvinFSClientApp,
+    "client", "LOOKUP", "LS", "READ_FILE", "CREATE_FILE", "APPEND",
+    "COPY_FILE", "RENAME_FILE", "CB", "DONE");
 
 MessageBuffer* CalvinFSClientApp::GetMetadataEntry(const Slice& path) {
+  Action a;
+  a.set_action_type(MetadataAction::LOOKUP);
+  MetadataAction::LookupInput in;
+  in.set_path(path.data(), path.size());
+  in.SerializeToString(a.mutable_input());
+  metadata_->GetRWSets(&a);
+  LookupMetadataEntry(&a);
+
+  // Under inode keys, 'path' may have been resolved through stale dentries.
+  if (metadata_->ForgetStaleResolutions(a)) {
+    a.clear_input_keys();
+    a.clear_output();
+    metadata_->GetRWSets(&a);
+    LookupMetadataEntry(&a);
+  }
+  return new MessageBuffer(a);
+}
+
+void CalvinFSClientApp::LookupMetadataEntry(Action* a) {
   // Find out what machine to run this on.
   uint64 mds_machine =
-      config_->LookupMetadataShard(config_->HashFileName(path), replica_);
+      config_->LookupMetadataShard(a->readset_shards(0), replica_);
 
   // Run if local.
   if (mds_machine == machine()->machine_id()) {
-    Action a;
-    a.set_version(scheduler_->SafeVersion());
-    a.set_action_type(MetadataAction::LOOKUP);
-    MetadataAction::LookupInput in;
-    in.set_path(path.data(), path.size());
-    in.SerializeToString(a.mutable_input());
-    metadata_->GetRWSets(&a);
-    metadata_->Run(&a);
-    return new MessageBuffer(a);
+    a->set_version(scheduler_->SafeVersion());
+    metadata_->Run(a);
 
   // If not local, get result from the right machine (within this replica).
+  // The action is sent as resolved here, so it is not resolved again there.
   } else {
     Header* header = new Header();
     header->set_from(machine()->machine_id());
@@ -33,43 +50,66 @@ MessageBuffer* CalvinFSClientApp::GetMetadataEntry(const Slice& path) {
     header->set_type(Header::RPC);
     header->set_app(name());
     header->set_rpc("LOOKUP");
-    header->add_misc_string(path.data(), path.size());
-    MessageBuffer* m = NULL;
-    header->set_data_ptr(reinterpret_cast<uint64>(&m));
-    machine()->SendMessage(header, new MessageBuffer());
-    while (m == NULL) {
-      usleep(10);
-      Noop<MessageBuffer*>(m);
+    MessageBuffer* m = machine()->Call(header, new MessageBuffer(*a)).Get();
+    if (m == NULL) {
+      // Rejected or cancelled: the lookup fails.
+      MetadataAction::LookupOutput out;
+      out.set_success(false);
+      out.SerializeToString(a->mutable_output());
+      return;
     }
-    return m;
+    a->ParseFromArray((*m)[0].data(), (*m)[0].size());
+    delete m;
   }
 }
 
-MessageBuffer* CalvinFSClientApp::CreateFile(const Slice& path, FileType type) {
+void CalvinFSClientApp::AppendAndWait(Action* action, Action* result) {
   string channel_name = "action-result-" + UInt64ToString(machine()->GetGUID());
   auto channel = machine()->DataChannel(channel_name);
   CHECK(!channel->Pop(NULL));
+  action->set_client_machine(machine()->machine_id());
+  action->set_client_channel(channel_name);
+
+  // Keep a copy of actions with resolved paths, in case they were resolved
+  // through stale dentries and must be resubmitted.
+  Action* resubmit = NULL;
+  if (action->input_keys_size() != 0) {
+    resubmit = new Action(*action);
+  }
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    log_->Append(action);
+
+    MessageBuffer* m = NULL;
+    while (!channel->Pop(&m)) {
+      // Wait for action to complete and be sent back.
+      usleep(100);
+    }
+    result->ParseFromArray((*m)[0].data(), (*m)[0].size());
+    delete m;
+
+    if (resubmit == NULL || !metadata_->ForgetStaleResolutions(*result)) {
+      break;
+    }
+    action = resubmit;
+    resubmit = NULL;
+    action->clear_input_keys();
+    metadata_->GetRWSets(action);
+  }
+  delete resubmit;
+}
 
+MessageBuffer* CalvinFSClientApp::CreateFile(const Slice& path, FileType type) {
   Action* a = new Action();
-  a->set_client_machine(machine()->machine_id());
-  a->set_client_channel(channel_name);
   a->set_action_type(MetadataAction::CREATE_FILE);
   MetadataAction::CreateFileInput in;
   in.set_path(path.data(), path.size());
   in.set_type(type);
   in.SerializeToString(a->mutable_input());
   metadata_->GetRWSets(a);
-  log_->Append(a);
-
-  MessageBuffer* m = NULL;
-  while (!channel->Pop(&m)) {
-    // Wait for action to complete and be sent back.
-    usleep(100);
-  }
 
   Action result;
-  result.ParseFromArray((*m)[0].data(), (*m)[0].size());
-  delete m;
+  AppendAndWait(a, &result);
   MetadataAction::AppendOutput out;
   out.ParseFromString(result.output());
 
@@ -83,18 +123,29 @@ MessageBuffer* CalvinFSClientApp::CreateFile(const Slice& path, FileType type) {
 MessageBuffer* CalvinFSClientApp::AppendStringToFile(
     const Slice& data,
     const Slice& path) {
-  // Write data block.
-  uint64 block_id = machine()->GetGUID() * 2 + (data.size() > 1024 ? 1 : 0);
-  blocks_->Put(block_id, data);
+  // Compress the block (maybe).
+  string encoded;
+  Slice block = data;
+  if (config_->config().compress_blocks()) {
+    EncodeBlock(data, &encoded);
+    block = encoded;
+  }
 
-  string channel_name = "action-result-" + UInt64ToString(machine()->GetGUID());
-  auto channel = machine()->DataChannel(channel_name);
-  CHECK(!channel->Pop(NULL));
+  // Start writing the data block, and build the metadata action while the
+  // replicas store it.
+  uint64 block_id;
+  if (config_->config().content_addressed_blocks()) {
+    block_id = ContentBlockID(block);
+  } else {
+    block_id = machine()->GetGUID() * 2 + (block.size() > 1024 ? 1 : 0);
+  }
+  // Garbage collection spares the block until the append has committed.
+  uint64 pin = metadata_->PinWriteVersion();
+  DistributedBlockStoreApp::PendingPut* put =
+      blocks_->PutAsync(block_id, block);
 
   // Update metadata.
   Action* a = new Action();
-  a->set_client_machine(machine()->machine_id());
-  a->set_client_channel(channel_name);
   a->set_action_type(MetadataAction::APPEND);
   MetadataAction::AppendInput in;
   in.set_path(path.data(), path.size());
@@ -103,17 +154,31 @@ MessageBuffer* CalvinFSClientApp::AppendStringToFile(
   in.mutable_data(0)->set_block_id(block_id);
   in.SerializeToString(a->mutable_input());
   metadata_->GetRWSets(a);
-  log_->Append(a);
 
-  MessageBuffer* m = NULL;
-  while (!channel->Pop(&m)) {
-    // Wait for action to complete and be sent back.
-    usleep(100);
+  // The block must be durable on a majority of replicas before any metadata
+  // refers to it.
+  if (!blocks_->WaitForPut(put)) {
+    // Replicas reject content-addressed ids that collide with a different
+    // stored block, so retry under a GUID-based id. (The action's read/write
+    // sets depend only on the path.)
+    if (!IsContentBlockID(block_id)) {
+      delete a;
+      metadata_->UnpinWriteVersion(pin);
+      return new MessageBuffer(new string("error writing block\n"));
+    }
+    block_id = machine()->GetGUID() * 2 + (block.size() > 1024 ? 1 : 0);
+    if (!blocks_->WaitForPut(blocks_->PutAsync(block_id, block))) {
+      delete a;
+      metadata_->UnpinWriteVersion(pin);
+      return new MessageBuffer(new string("error writing block\n"));
+    }
+    in.mutable_data(0)->set_block_id(block_id);
+    in.SerializeToString(a->mutable_input());
   }
 
   Action result;
-  result.ParseFromArray((*m)[0].data(), (*m)[0].size());
-  delete m;
+  AppendAndWait(a, &result);
+  metadata_->UnpinWriteVersion(pin);
   MetadataAction::AppendOutput out;
   out.ParseFromString(result.output());
 
@@ -125,6 +190,23 @@ MessageBuffer* CalvinFSClientApp::AppendStringToFile(
 }
 
 MessageBuffer* CalvinFSClientApp::ReadFile(const Slice& path) {
+  // If the file is erased while it is being read, garbage collection may
+  // delete its blocks before they are fetched (see
+  // DistributedBlockStoreApp::CollectGarbage), so a missing block is retried
+  // once with a fresh lookup.
+  bool missing_block;
+  MessageBuffer* result = ReadFileOnce(path, &missing_block);
+  if (missing_block) {
+    delete result;
+    result = ReadFileOnce(path, &missing_block);
+  }
+  return result;
+}
+
+MessageBuffer* CalvinFSClientApp::ReadFileOnce(
+    const Slice& path,
+    bool* missing_block) {
+  *missing_block = false;
   MessageBuffer* serialized = GetMetadataEntry(path);
   Action a;
   a.ParseFromArray((*serialized)[0].data(), (*serialized)[0].size());
@@ -134,35 +216,43 @@ MessageBuffer* CalvinFSClientApp::ReadFile(const Slice& path) {
   out.ParseFromString(a.output());
 
   if (out.success() && out.entry().type() == DATA) {
-    vector<MessageBuffer*> blocks(out.entry().file_parts_size(), NULL);
+    // Compressed blocks are fetched whole and decompressed here, so that only
+    // compressed bytes cross the network.
+    bool compressed = config_->config().compress_blocks();
+    vector<BlockRange> ranges;
     for (int i = 0; i < out.entry().file_parts_size(); i++) {
-      Header* header = new Header();
-      header->set_from(machine()->machine_id());
-      header->set_to(config_->LookupBlucket(config_->HashBlockID(
-          out.entry().file_parts(i).block_id()),
-          replica_));
-      header->set_type(Header::RPC);
-      header->set_app("blockstore");
-      header->set_rpc("GET");
-      header->add_misc_int(out.entry().file_parts(i).block_id());
-      header->set_data_ptr(reinterpret_cast<uint64>(&blocks[i]));
-      machine()->SendMessage(header, new MessageBuffer());
-    }
-    bool done = false;
-    while (!done) {
-      done = true;
-      for (int i = 0; i < out.entry().file_parts_size(); i++) {
-        Noop<MessageBuffer*>(blocks[i]);
-        if (blocks[i] == NULL) {
-          done = false;
-          break;
-        }
+      const FilePart& fp = out.entry().file_parts(i);
+      if (compressed && fp.block_id() != 0) {
+        ranges.push_back(BlockRange(fp.block_id(), 0, ~0ULL));
+      } else {
+        ranges.push_back(
+            BlockRange(fp.block_id(), fp.block_offset(), fp.length()));
       }
     }
 
     MessageBuffer* result = new MessageBuffer(out.entry());
-    for (int i = 0; i < out.entry().file_parts_size(); i++) {
-      result->AppendPart(blocks[i]->PopBack());
+    BlockRangeReader reader(blocks_, ranges);
+    MessagePart* part;
+    for (int i = 0; reader.Next(&part); i++) {
+      if (part == NULL) {
+        delete result;
+        *missing_block = true;
+        return new MessageBuffer(new string("block lookup error\n"));
+      }
+      const FilePart& fp = out.entry().file_parts(i);
+      if (compressed && fp.block_id() != 0) {
+        string raw;
+        bool ok = DecodeBlock(part->buffer(), &raw);
+        delete part;
+        if (!ok) {
+          delete result;
+          return new MessageBuffer(new string("block decode error\n"));
+        }
+        uint64 offset = fp.block_offset() < raw.size() ? fp.block_offset()
+                                                       : raw.size();
+        part = new MessagePart(new string(raw, offset, fp.length()));
+      }
+      result->AppendPart(part);
     }
     return result;
 
@@ -193,14 +283,7 @@ MessageBuffer* CalvinFSClientApp::LS(const Slice& path) {
 }
 
 MessageBuffer* CalvinFSClientApp::CopyFile(const Slice& from_path, const Slice& to_path) {
-  uint64 distinct_id = machine()->GetGUID();
-  string channel_name = "action-result-" + UInt64ToString(distinct_id);
-  auto channel = machine()->DataChannel(channel_name);
-  CHECK(!channel->Pop(NULL));
-
   Action* a = new Action();
-  a->set_client_machine(machine()->machine_id());
-  a->set_client_channel(channel_name);
   a->set_action_type(MetadataAction::COPY);
 
   MetadataAction::CopyInput in;
@@ -208,17 +291,9 @@ MessageBuffer* CalvinFSClientApp::CopyFile(const Slice& from_path, const Slice&
   in.set_to_path(to_path.data(), to_path.size());
   in.SerializeToString(a->mutable_input());
   metadata_->GetRWSets(a);
-  log_->Append(a);
-
-  MessageBuffer* m = NULL;
-  while (!channel->Pop(&m)) {
-    // Wait for action to complete and be sent back.
-    usleep(100);
-  }
 
   Action result;
-  result.ParseFromArray((*m)[0].data(), (*m)[0].size());
-  delete m;
+  AppendAndWait(a, &result);
   MetadataAction::CopyOutput out;
   out.ParseFromString(result.output());
 
@@ -230,14 +305,7 @@ MessageBuffer* CalvinFSClientApp::CopyFile(const Slice& from_path, const Slice&
 }
 
 MessageBuffer* CalvinFSClientApp::RenameFile(const Slice& from_path, const Slice& to_path) {
-  uint64 distinct_id = machine()->GetGUID();
-  string channel_name = "action-result-" + UInt64ToString(distinct_id);
-  auto channel = machine()->DataChannel(channel_name);
-  CHECK(!channel->Pop(NULL));
-
   Action* a = new Action();
-  a->set_client_machine(machine()->machine_id());
-  a->set_client_channel(channel_name);
   a->set_action_type(MetadataAction::RENAME);
 
   MetadataAction::RenameInput in;
@@ -245,17 +313,9 @@ MessageBuffer* CalvinFSClientApp::RenameFile(const Slice& from_path, const Slice
   in.set_to_path(to_path.data(), to_path.size());
   in.SerializeToString(a->mutable_input());
   metadata_->GetRWSets(a);
-  log_->Append(a);
-
-  MessageBuffer* m = NULL;
-  while (!channel->Pop(&m)) {
-    // Wait for action to complete and be sent back.
-    usleep(100);
-  }
 
   Action result;
-  result.ParseFromArray((*m)[0].data(), (*m)[0].size());
-  delete m;
+  AppendAndWait(a, &result);
   MetadataAction::RenameOutput out;
   out.ParseFromString(result.output());
 
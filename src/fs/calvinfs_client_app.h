@@ -9,6 +9,7 @@
 #include "components/scheduler/scheduler.h"
 #include "components/store/store.h"
 #include "components/store/store_app.h"
+#include "fs/block_codec.h"
 #include "fs/block_log.h"
 #include "fs/calvinfs.h"
 #include "fs/metadata.pb.h"
@@ -59,6 +60,7 @@ class CalvinFSClientApp : public App {
     Spin(1);
 
     capacity_ = kMaxCapacity;
+    rejected_ = 0;
 
     switch(experiment) {
       case 0:
@@ -110,82 +112,114 @@ class CalvinFSClientApp : public App {
   }
 
   virtual void HandleMessage(Header* header, MessageBuffer* message) {
-    // INTERNAL metadata lookup
-    if (header->rpc() == "LOOKUP") {
-      machine()->SendReplyMessage(
-          header,
-          GetMetadataEntry(header->misc_string(0)));
-
-    // EXTERNAL LS
-    } else if (header->rpc() == "LS") {
-      machine()->SendReplyMessage(header, LS(header->misc_string(0)));
-
-    // EXTERNAL read file
-    } else if (header->rpc() == "READ_FILE") {
-      machine()->SendReplyMessage(header, ReadFile(header->misc_string(0)));
-
-    // EXTERNAL file/dir creation
-    } else if (header->rpc() == "CREATE_FILE") {
-      machine()->SendReplyMessage(header, CreateFile(
-          header->misc_string(0),
-          header->misc_bool(0) ? DIR : DATA));
-
-    // EXTERNAL file append
-    } else if (header->rpc() == "APPEND") {
-      machine()->SendReplyMessage(header, AppendStringToFile(
-          (*message)[0],
-          header->misc_string(0)));
-   // EXTERNAL file copy
-   } else if (header->rpc() == "COPY_FILE") {
-     machine()->SendReplyMessage(header, CopyFile(
-         header->misc_string(0),
-         header->misc_string(1)));
-     
-   // EXTERNAL file copy
-   } else if (header->rpc() == "RENAME_FILE") {
-     machine()->SendReplyMessage(header, RenameFile(
-         header->misc_string(0),
-         header->misc_string(1)));
-
-    // Callback for recording latency stats
-    } else if (header->rpc() == "CB") {
-      double end = GetTime();
-      int misc_size = header->misc_string_size();
-      string category = header->misc_string(misc_size-1);
-      if (category == "cat") {
-        if ((*message)[0] == "metadata lookup error\n") {
-          latencies_["cat0"]->Push(
-              end - header->misc_double(0));
+    switch (RpcID(*header)) {
+      // INTERNAL metadata lookup
+      case WireID("LOOKUP"): {
+        Action a;
+        a.ParseFromArray((*message)[0].data(), (*message)[0].size());
+        delete message;
+        LookupMetadataEntry(&a);
+        machine()->SendReplyMessage(header, new MessageBuffer(a));
+        break;
+      }
+
+      // EXTERNAL LS
+      case WireID("LS"):
+        machine()->SendReplyMessage(header, LS(header->misc_string(0)));
+        break;
+
+      // EXTERNAL read file
+      case WireID("READ_FILE"):
+        machine()->SendReplyMessage(header, ReadFile(header->misc_string(0)));
+        break;
+
+      // EXTERNAL file/dir creation
+      case WireID("CREATE_FILE"):
+        machine()->SendReplyMessage(header, CreateFile(
+            header->misc_string(0),
+            header->misc_bool(0) ? DIR : DATA));
+        break;
+
+      // EXTERNAL file append
+      case WireID("APPEND"):
+        machine()->SendReplyMessage(header, AppendStringToFile(
+            (*message)[0],
+            header->misc_string(0)));
+        break;
+
+      // EXTERNAL file copy
+      case WireID("COPY_FILE"):
+        machine()->SendReplyMessage(header, CopyFile(
+            header->misc_string(0),
+            header->misc_string(1)));
+        break;
+
+      // EXTERNAL file rename
+      case WireID("RENAME_FILE"):
+        machine()->SendReplyMessage(header, RenameFile(
+            header->misc_string(0),
+            header->misc_string(1)));
+        break;
+
+      // Callback for background requests that don't record latency stats:
+      // frees their capacity.
+      case WireID("DONE"):
+        if (header->status() != Header::OK) {
+          ++rejected_;
+        }
+        ++capacity_;
+        delete header;
+        delete message;
+        break;
+
+      // Callback for recording latency stats
+      case WireID("CB"): {
+        double end = GetTime();
+        if (header->status() != Header::OK) {
+          // Rejected requests didn't run, so they have no latency to record.
+          ++rejected_;
           delete header;
           delete message;
-          return;
+          break;
         }
-        MetadataEntry result;
-        result.ParseFromArray((*message)[0].data(), (*message)[0].size());
-        CHECK(result.has_type());
+        int misc_size = header->misc_string_size();
+        string category = header->misc_string(misc_size-1);
+        if (category == "cat") {
+          if ((*message)[0] == "metadata lookup error\n") {
+            latencies_["cat0"]->Push(
+                end - header->misc_double(0));
+            delete header;
+            delete message;
+            return;
+          }
+          MetadataEntry result;
+          result.ParseFromArray((*message)[0].data(), (*message)[0].size());
+          CHECK(result.has_type());
 
-        if (result.file_parts_size() == 0) {
-          category.append("0");
+          if (result.file_parts_size() == 0) {
+            category.append("0");
 
-        } else if (result.file_parts_size() == 1) {
-          category.append("1");
+          } else if (result.file_parts_size() == 1) {
+            category.append("1");
 
-        } else if (result.file_parts_size() <= 10) {
-          category.append("10");
+          } else if (result.file_parts_size() <= 10) {
+            category.append("10");
 
-        } else {
-          category.append("100");
+          } else {
+            category.append("100");
+          }
         }
-      }
 
-      latencies_[category]->Push(
-          end - header->misc_double(0));
+        latencies_[category]->Push(
+            end - header->misc_double(0));
 
-      delete header;
-      delete message;
+        delete header;
+        delete message;
+        break;
+      }
 
-    } else {
-      LOG(FATAL) << "unknown RPC: " << header->rpc();
+      default:
+        LOG(FATAL) << "unknown RPC: " << header->rpc();
     }
   }
 
@@ -756,6 +790,7 @@ void LatencyExperimentAppend() {
         report.append(it->first + " " + DoubleToString(d) + "\n");
       }
     }
+    report.append("rejected " + IntToString(rejected_.load()) + "\n");
     string filename =
         "/tmp/report." + UInt64ToString(machine()->machine_id());
     leveldb::Status s = leveldb::WriteStringToFile(
@@ -774,6 +809,18 @@ void LatencyExperimentAppend() {
   // Returns serialized MetadataEntry protobuf.
   MessageBuffer* GetMetadataEntry(const Slice& path);
 
+  // Runs LOOKUP action '*a' (whose read set is set) at the machine in this
+  // replica that stores the entry it reads, leaving the result in '*a'. If
+  // that machine rejects the request, the lookup fails.
+  void LookupMetadataEntry(Action* a);
+
+  // Appends 'action' (whose read/write sets are set) to the log, waits for it
+  // to run, and sets '*result' to the completed action. Under inode keys, an
+  // action that failed because its paths were resolved through stale dentries
+  // is resolved afresh and appended once more (see
+  // MetadataStore::ForgetStaleResolutions). Takes ownership of 'action'.
+  void AppendAndWait(Action* action, Action* result);
+
   // Returns client-side printable output.
   MessageBuffer* CreateFile(const Slice& path, FileType type = DATA);
   MessageBuffer* AppendStringToFile(const Slice& data, const Slice& path);
@@ -782,6 +829,10 @@ void LatencyExperimentAppend() {
   MessageBuffer* CopyFile(const Slice& from_path, const Slice& to_path);
   MessageBuffer* RenameFile(const Slice& from_path, const Slice& to_path);
 
+  // Like ReadFile, but sets '*missing_block' if some block of the file could
+  // not be fetched.
+  MessageBuffer* ReadFileOnce(const Slice& path, bool* missing_block);
+
   void BackgroundCreateFile(const Slice& path, FileType type = DATA) {
     Header* header = new Header();
     header->set_from(machine()->machine_id());
@@ -797,7 +848,8 @@ void LatencyExperimentAppend() {
       header->add_misc_string((type == DIR) ? "mkdir" : "touch");
       header->add_misc_double(GetTime());
     } else {
-      header->set_ack_counter(reinterpret_cast<uint64>(&capacity_));
+      header->set_callback_app(name());
+      header->set_callback_rpc("DONE");
       while (capacity_.load() <= 0) {
         // Wait for some old operations to complete.
         usleep(100);
@@ -821,7 +873,8 @@ void LatencyExperimentAppend() {
       header->add_misc_string("append");
       header->add_misc_double(GetTime());
     } else {
-      header->set_ack_counter(reinterpret_cast<uint64>(&capacity_));
+      header->set_callback_app(name());
+      header->set_callback_rpc("DONE");
       while (capacity_.load() <= 0) {
         // Wait for some old operations to complete.
         usleep(100);
@@ -845,7 +898,8 @@ void LatencyExperimentAppend() {
       header->add_misc_string("cat");
       header->add_misc_double(GetTime());
     } else {
-      header->set_ack_counter(reinterpret_cast<uint64>(&capacity_));
+      header->set_callback_app(name());
+      header->set_callback_rpc("DONE");
       while (capacity_.load() <= 0) {
         // Wait for some old operations to complete.
         usleep(100);
@@ -869,7 +923,8 @@ void LatencyExperimentAppend() {
       header->add_misc_string("ls");
       header->add_misc_double(GetTime());
     } else {
-      header->set_ack_counter(reinterpret_cast<uint64>(&capacity_));
+      header->set_callback_app(name());
+      header->set_callback_rpc("DONE");
       while (capacity_.load() <= 0) {
         // Wait for some old operations to complete.
         usleep(100);
@@ -894,7 +949,8 @@ void LatencyExperimentAppend() {
       header->add_misc_string("copy");
       header->add_misc_double(GetTime());
     } else {
-      header->set_ack_counter(reinterpret_cast<uint64>(&capacity_));
+      header->set_callback_app(name());
+      header->set_callback_rpc("DONE");
       while (capacity_.load() <= 0) {
         // Wait for some old operations to complete.
         usleep(100);
@@ -919,7 +975,8 @@ void LatencyExperimentAppend() {
       header->add_misc_string("rename");
       header->add_misc_double(GetTime());
     } else {
-      header->set_ack_counter(reinterpret_cast<uint64>(&capacity_));
+      header->set_callback_app(name());
+      header->set_callback_rpc("DONE");
       while (capacity_.load() <= 0) {
         // Wait for some old operations to complete.
         usleep(100);
@@ -944,6 +1001,9 @@ void LatencyExperimentAppend() {
   atomic<int> action_count_;
   atomic<int> capacity_;
 
+  // Number of background requests rejected as overloaded.
+  atomic<int> rejected_;
+
   string random_data_;
 
   map<string, AtomicQueue<double>*> latencies_;
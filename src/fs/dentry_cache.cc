@@ -0,0 +1,63 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+
+#include "fs/dentry_cache.h"
+
+#include <glog/logging.h>
+#include <string>
+
+#include "btree/btree_map.h"
+#include "common/mutex.h"
+#include "common/types.h"
+
+void EncodeInodeKey(uint64 inode, string* key) {
+  key->resize(8);
+  for (int i = 0; i < 8; i++) {
+    (*key)[i] = static_cast<char>(inode >> (8 * (7 - i)));
+  }
+}
+
+uint64 DecodeInodeKey(const Slice& key) {
+  CHECK(IsInodeKey(key));
+  uint64 inode = 0;
+  for (int i = 0; i < 8; i++) {
+    inode = (inode << 8) | static_cast<unsigned char>(key[i]);
+  }
+  return inode;
+}
+
+void EncodeDentryKey(uint64 parent, const Slice& name, string* key) {
+  CHECK(!name.empty());
+  EncodeInodeKey(parent, key);
+  key->append(name.data(), name.size());
+}
+
+bool DentryCache::Lookup(uint64 parent, const Slice& name, uint64* inode) {
+  string key;
+  EncodeDentryKey(parent, name, &key);
+  ReadLock l(&mutex_);
+  btree::btree_map<string, uint64>::iterator it = dentries_.find(key);
+  if (it == dentries_.end()) {
+    return false;
+  }
+  *inode = it->second;
+  return true;
+}
+
+void DentryCache::Insert(const string& dentry_key, uint64 inode) {
+  WriteLock l(&mutex_);
+  if (static_cast<int>(dentries_.size()) >= capacity_) {
+    dentries_.clear();
+  }
+  dentries_[dentry_key] = inode;
+}
+
+bool DentryCache::Erase(const string& dentry_key) {
+  WriteLock l(&mutex_);
+  return dentries_.erase(dentry_key) != 0;
+}
+
+int DentryCache::Size() {
+  ReadLock l(&mutex_);
+  return dentries_.size();
+}
@@ -0,0 +1,90 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+// Optional inode keying for the metadata store (see the 'inode_keys' field of
+// CalvinFSConfig). Every file is assigned a 64-bit inode id when it is created
+// (see MetadataStore::NewInode), and its MetadataEntry is stored under the
+// fixed 8-byte encoding of that id rather than under its full path. Names are
+// bound to inodes by directory entries ("dentries"), which are stored in the
+// same store under keys encoding (parent inode, name), with the child's
+// encoded inode key as their value.
+//
+// Paths are resolved to inodes one component at a time, starting at the root,
+// through a DentryCache that each MetadataStore keeps of the dentries it has
+// read (from its own partition or, via RESOLVE RPCs, from others).
+//
+// Inode ids are never reused, and an inode is only ever bound to the one
+// dentry created along with it (RENAME and COPY create new inodes). Non-empty
+// directories cannot be erased or renamed. So if an action finds the entry for
+// an inode it resolved, every dentry along the path it resolved is still
+// current; stale cache entries can only make actions fail with
+// FileDoesNotExist (see MetadataStore::ForgetStaleResolutions).
+
+#ifndef CALVIN_FS_DENTRY_CACHE_H_
+#define CALVIN_FS_DENTRY_CACHE_H_
+
+#include <string>
+#include "btree/btree_map.h"
+#include "common/mutex.h"
+#include "common/types.h"
+
+using std::string;
+
+// Inode id of the root directory (whose path is "").
+static const uint64 kRootInode = 0;
+
+// Inode id that is never allocated. Paths that fail to resolve are mapped to
+// it, so that actions on them find no entry.
+static const uint64 kNoInode = 1;
+
+// Sets '*key' to the 8-byte big-endian encoding of 'inode'.
+void EncodeInodeKey(uint64 inode, string* key);
+
+// Inverse of EncodeInodeKey.
+// Requires: IsInodeKey(key).
+uint64 DecodeInodeKey(const Slice& key);
+
+// Returns true iff 'key' is an encoded inode id rather than a dentry key.
+inline bool IsInodeKey(const Slice& key) {
+  return key.size() == 8;
+}
+
+// Sets '*key' to the store key of the dentry for 'name' in directory 'parent'.
+// Dentry keys are always longer than inode keys, since names are nonempty.
+void EncodeDentryKey(uint64 parent, const Slice& name, string* key);
+
+// Caches dentries, mapping (parent inode, name) to inode. Thread-safe.
+class DentryCache {
+ public:
+  // 'capacity' bounds the number of cached dentries. The cache is simply
+  // emptied whenever it fills up.
+  explicit DentryCache(int capacity = 1 << 20) : capacity_(capacity) {}
+  ~DentryCache() {}
+
+  // If a dentry for 'name' in directory 'parent' is cached, sets '*inode' to
+  // its inode and returns true, else returns false.
+  bool Lookup(uint64 parent, const Slice& name, uint64* inode);
+
+  // Caches the dentry with store key 'dentry_key' (see EncodeDentryKey),
+  // binding it to 'inode'.
+  void Insert(const string& dentry_key, uint64 inode);
+
+  // Drops the dentry with store key 'dentry_key', if cached. Returns true iff
+  // it was cached.
+  bool Erase(const string& dentry_key);
+
+  // Returns the number of cached dentries.
+  int Size();
+
+ private:
+  int capacity_;
+
+  // Dentry key -> inode id.
+  btree::btree_map<string, uint64> dentries_;
+  MutexRW mutex_;
+
+  // DISALLOW_COPY_AND_ASSIGN
+  DentryCache(const DentryCache&);
+  DentryCache& operator=(const DentryCache&);
+};
+
+#endif  // CALVIN_FS_DENTRY_CACHE_H_
@@ -0,0 +1,67 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+
+#include "fs/dentry_cache.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <string>
+
+#include "common/utils.h"
+
+TEST(DentryCacheTest, EncodeDecode) {
+  string key;
+  EncodeInodeKey(0x0102030405060708ULL, &key);
+  EXPECT_EQ(string("\x01\x02\x03\x04\x05\x06\x07\x08", 8), key);
+  EXPECT_TRUE(IsInodeKey(key));
+  EXPECT_EQ(0x0102030405060708ULL, DecodeInodeKey(key));
+
+  // Dentry keys are the parent's inode key followed by the name.
+  string dentry;
+  EncodeDentryKey(0x0102030405060708ULL, "foo", &dentry);
+  EXPECT_EQ(key + "foo", dentry);
+  EXPECT_FALSE(IsInodeKey(dentry));
+}
+
+TEST(DentryCacheTest, LookupInsertErase) {
+  DentryCache dentries;
+  uint64 inode;
+  EXPECT_FALSE(dentries.Lookup(kRootInode, "foo", &inode));
+
+  string foo;
+  EncodeDentryKey(kRootInode, "foo", &foo);
+  dentries.Insert(foo, 17);
+  EXPECT_TRUE(dentries.Lookup(kRootInode, "foo", &inode));
+  EXPECT_EQ(17, inode);
+  EXPECT_FALSE(dentries.Lookup(kRootInode, "bar", &inode));
+  EXPECT_FALSE(dentries.Lookup(17, "foo", &inode));
+
+  // Rebinding a name replaces its cached inode.
+  dentries.Insert(foo, 18);
+  EXPECT_TRUE(dentries.Lookup(kRootInode, "foo", &inode));
+  EXPECT_EQ(18, inode);
+  EXPECT_EQ(1, dentries.Size());
+
+  EXPECT_TRUE(dentries.Erase(foo));
+  EXPECT_FALSE(dentries.Erase(foo));
+  EXPECT_FALSE(dentries.Lookup(kRootInode, "foo", &inode));
+  EXPECT_EQ(0, dentries.Size());
+}
+
+TEST(DentryCacheTest, Capacity) {
+  DentryCache dentries(10);
+  for (int i = 0; i < 100; i++) {
+    string key;
+    EncodeDentryKey(kRootInode, "d" + IntToString(i), &key);
+    dentries.Insert(key, i + 2);
+    EXPECT_GE(10, dentries.Size());
+  }
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,246 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+
+#include "fs/erasure_code.h"
+
+#include <glog/logging.h>
+#include <string.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/types.h"
+
+namespace {
+
+// GF(2^8) arithmetic using the primitive polynomial x^8+x^4+x^3+x^2+1.
+class GaloisField {
+ public:
+  GaloisField() {
+    uint32 x = 1;
+    for (int i = 0; i < 255; i++) {
+      exp_[i] = exp_[i + 255] = x;
+      log_[x] = i;
+      x <<= 1;
+      if (x & 0x100) {
+        x ^= 0x11d;
+      }
+    }
+    log_[0] = 0;  // Never used.
+    for (int a = 0; a < 256; a++) {
+      for (int b = 0; b < 256; b++) {
+        mul_[a][b] = Mul(a, b);
+      }
+    }
+  }
+
+  uint8 Mul(uint8 a, uint8 b) const {
+    if (a == 0 || b == 0) {
+      return 0;
+    }
+    return exp_[log_[a] + log_[b]];
+  }
+
+  uint8 Inverse(uint8 a) const {
+    CHECK_NE(0, a);
+    return exp_[255 - log_[a]];
+  }
+
+  // Sets dst[i] ^= c * src[i] for 0 <= i < n.
+  void MulAdd(uint8 c, const uint8* src, uint8* dst, uint64 n) const {
+    if (c == 0) {
+      return;
+    }
+    uint64 i = 0;
+#ifdef __SSSE3__
+    // Multiply the low and high nibbles of each byte separately using 16-entry
+    // shuffle tables.
+    uint8 lo[16], hi[16];
+    for (int x = 0; x < 16; x++) {
+      lo[x] = mul_[c][x];
+      hi[x] = mul_[c][x << 4];
+    }
+    __m128i lo_table = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo));
+    __m128i hi_table = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hi));
+    __m128i mask = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= n; i += 16) {
+      __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+      __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+      __m128i l = _mm_shuffle_epi8(lo_table, _mm_and_si128(s, mask));
+      __m128i h = _mm_shuffle_epi8(
+          hi_table,
+          _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+      d = _mm_xor_si128(d, _mm_xor_si128(l, h));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), d);
+    }
+#endif
+    const uint8* row = mul_[c];
+    for (; i < n; i++) {
+      dst[i] ^= row[src[i]];
+    }
+  }
+
+ private:
+  uint8 exp_[510];
+  uint8 log_[256];
+  uint8 mul_[256][256];
+};
+
+const GaloisField& GF() {
+  static const GaloisField* gf = new GaloisField();
+  return *gf;
+}
+
+// Inverts the n x n matrix 'a' (row-major) in place by Gauss-Jordan
+// elimination. Returns false if it is singular.
+bool Invert(int n, vector<uint8>* a) {
+  const GaloisField& gf = GF();
+  vector<uint8> inv(n * n, 0);
+  for (int i = 0; i < n; i++) {
+    inv[i * n + i] = 1;
+  }
+  for (int col = 0; col < n; col++) {
+    // Find pivot.
+    int pivot = col;
+    while (pivot < n && (*a)[pivot * n + col] == 0) {
+      pivot++;
+    }
+    if (pivot == n) {
+      return false;
+    }
+    if (pivot != col) {
+      for (int j = 0; j < n; j++) {
+        std::swap((*a)[pivot * n + j], (*a)[col * n + j]);
+        std::swap(inv[pivot * n + j], inv[col * n + j]);
+      }
+    }
+
+    // Scale pivot row to 1.
+    uint8 scale = gf.Inverse((*a)[col * n + col]);
+    for (int j = 0; j < n; j++) {
+      (*a)[col * n + j] = gf.Mul((*a)[col * n + j], scale);
+      inv[col * n + j] = gf.Mul(inv[col * n + j], scale);
+    }
+
+    // Eliminate column from all other rows.
+    for (int row = 0; row < n; row++) {
+      uint8 factor = (*a)[row * n + col];
+      if (row != col && factor != 0) {
+        for (int j = 0; j < n; j++) {
+          (*a)[row * n + j] ^= gf.Mul(factor, (*a)[col * n + j]);
+          inv[row * n + j] ^= gf.Mul(factor, inv[col * n + j]);
+        }
+      }
+    }
+  }
+  a->swap(inv);
+  return true;
+}
+
+}  // namespace
+
+ReedSolomon::ReedSolomon(int data_fragments, int parity_fragments)
+    : k_(data_fragments), m_(parity_fragments) {
+  CHECK_GE(k_, 1);
+  CHECK_GE(m_, 0);
+  CHECK_LE(k_ + m_, 255);
+
+  // Identity on top, Cauchy matrix 1 / (i + j) below. Rows and columns use
+  // disjoint sets of field elements (k <= i < k+m, 0 <= j < k), so i + j
+  // (that is, i XOR j) is never zero.
+  const GaloisField& gf = GF();
+  matrix_.resize((k_ + m_) * k_, 0);
+  for (int i = 0; i < k_; i++) {
+    matrix_[i * k_ + i] = 1;
+  }
+  for (int i = k_; i < k_ + m_; i++) {
+    for (int j = 0; j < k_; j++) {
+      matrix_[i * k_ + j] = gf.Inverse(i ^ j);
+    }
+  }
+}
+
+void ReedSolomon::Encode(const Slice& data, vector<string>* fragments) const {
+  uint64 fragment_size = FragmentSize(data.size());
+  fragments->clear();
+  fragments->resize(k_ + m_, string(fragment_size, '\0'));
+
+  // Data fragments.
+  for (int i = 0; i < k_; i++) {
+    uint64 offset = i * fragment_size;
+    if (offset < data.size()) {
+      uint64 length = std::min<uint64>(fragment_size, data.size() - offset);
+      memcpy(&(*fragments)[i][0], data.data() + offset, length);
+    }
+  }
+
+  // Parity fragments.
+  const GaloisField& gf = GF();
+  for (int i = k_; i < k_ + m_; i++) {
+    uint8* parity = reinterpret_cast<uint8*>(&(*fragments)[i][0]);
+    for (int j = 0; j < k_; j++) {
+      gf.MulAdd(
+          matrix_[i * k_ + j],
+          reinterpret_cast<const uint8*>((*fragments)[j].data()),
+          parity,
+          fragment_size);
+    }
+  }
+}
+
+bool ReedSolomon::Decode(
+    const map<int, string>& fragments,
+    uint64 size,
+    string* data) const {
+  uint64 fragment_size = FragmentSize(size);
+
+  // Use the first k valid fragments.
+  vector<int> rows;
+  vector<const string*> inputs;
+  for (map<int, string>::const_iterator it = fragments.begin();
+       it != fragments.end() && static_cast<int>(rows.size()) < k_; ++it) {
+    if (it->first < 0 || it->first >= k_ + m_ ||
+        it->second.size() != fragment_size) {
+      return false;
+    }
+    rows.push_back(it->first);
+    inputs.push_back(&it->second);
+  }
+  if (static_cast<int>(rows.size()) < k_) {
+    return false;
+  }
+
+  data->assign(k_ * fragment_size, '\0');
+  if (rows[k_ - 1] == k_ - 1) {
+    // All data fragments present (since 'fragments' is sorted).
+    for (int i = 0; i < k_; i++) {
+      memcpy(&(*data)[i * fragment_size], inputs[i]->data(), fragment_size);
+    }
+  } else {
+    // Invert the rows of the generator matrix for the available fragments.
+    vector<uint8> decode(k_ * k_);
+    for (int i = 0; i < k_; i++) {
+      memcpy(&decode[i * k_], &matrix_[rows[i] * k_], k_);
+    }
+    CHECK(Invert(k_, &decode));
+
+    const GaloisField& gf = GF();
+    for (int i = 0; i < k_; i++) {
+      uint8* out = reinterpret_cast<uint8*>(&(*data)[i * fragment_size]);
+      for (int j = 0; j < k_; j++) {
+        gf.MulAdd(
+            decode[i * k_ + j],
+            reinterpret_cast<const uint8*>(inputs[j]->data()),
+            out,
+            fragment_size);
+      }
+    }
+  }
+  data->resize(size);
+  return true;
+}
@@ -0,0 +1,66 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+// Systematic Reed-Solomon erasure coding over GF(2^8).
+//
+// A block is split into k equal-sized data fragments (the last one zero-padded)
+// and m parity fragments are computed from them, such that the block can be
+// reconstructed from ANY k of the k+m fragments. The first k fragments are the
+// data itself, so when they are all available decoding is a simple
+// concatenation.
+//
+// Parity rows of the generator matrix form a Cauchy matrix, every square
+// submatrix of which is invertible; this is what guarantees that any k
+// fragments suffice.
+//
+// The inner loop (multiplying a region by a constant and adding it to
+// another) uses SSSE3 shuffles when compiled with SSSE3 support (e.g. with
+// -mssse3 or -march=native), and 256-entry lookup tables otherwise.
+
+#ifndef CALVIN_FS_ERASURE_CODE_H_
+#define CALVIN_FS_ERASURE_CODE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include "common/types.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+class ReedSolomon {
+ public:
+  // Requires: data_fragments >= 1, parity_fragments >= 0, and
+  //           data_fragments + parity_fragments <= 255.
+  ReedSolomon(int data_fragments, int parity_fragments);
+  ~ReedSolomon() {}
+
+  int data_fragments() const { return k_; }
+  int parity_fragments() const { return m_; }
+
+  // Sets '*fragments' to the k data fragments of 'data' followed by its m
+  // parity fragments. All fragments are FragmentSize(data.size()) bytes long.
+  void Encode(const Slice& data, vector<string>* fragments) const;
+
+  // Reconstructs the first 'size' bytes of the encoded block from
+  // 'fragments', which maps fragment indexes to fragment contents. Returns
+  // false if fewer than k fragments are given or any has the wrong size.
+  bool Decode(
+      const map<int, string>& fragments,
+      uint64 size,
+      string* data) const;
+
+  // Returns the size of each fragment of a 'size'-byte block.
+  uint64 FragmentSize(uint64 size) const { return (size + k_ - 1) / k_; }
+
+ private:
+  int k_;
+  int m_;
+
+  // (k+m) x k generator matrix, in row-major order.
+  vector<uint8> matrix_;
+
+  // Intentionally copyable.
+};
+
+#endif  // CALVIN_FS_ERASURE_CODE_H_
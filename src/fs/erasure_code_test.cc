@@ -0,0 +1,85 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+
+#include "fs/erasure_code.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/utils.h"
+
+TEST(ReedSolomonTest, Systematic) {
+  ReedSolomon rs(3, 2);
+  vector<string> fragments;
+  rs.Encode("abcdefgh", &fragments);
+  ASSERT_EQ(5, fragments.size());
+  EXPECT_EQ(string("abc"), fragments[0]);
+  EXPECT_EQ(string("def"), fragments[1]);
+  EXPECT_EQ(string("gh\0", 3), fragments[2]);
+  EXPECT_EQ(3, fragments[3].size());
+  EXPECT_EQ(3, fragments[4].size());
+}
+
+// Checks that every k-subset of the fragments of random blocks of various
+// sizes decodes correctly.
+void CheckAllSubsets(int k, int m) {
+  ReedSolomon rs(k, m);
+  int sizes[] = {0, 1, k, 100, 1000, 4097};
+  for (uint32 s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    string data = RandomBytes(sizes[s]);
+    vector<string> fragments;
+    rs.Encode(data, &fragments);
+    ASSERT_EQ(k + m, static_cast<int>(fragments.size()));
+
+    for (uint32 subset = 0; subset < (1U << (k + m)); subset++) {
+      if (__builtin_popcount(subset) != k) {
+        continue;
+      }
+      map<int, string> available;
+      for (int i = 0; i < k + m; i++) {
+        if (subset & (1 << i)) {
+          available[i] = fragments[i];
+        }
+      }
+      string decoded;
+      EXPECT_TRUE(rs.Decode(available, data.size(), &decoded));
+      EXPECT_EQ(data, decoded) << "k=" << k << " m=" << m
+                               << " size=" << data.size()
+                               << " subset=" << subset;
+    }
+  }
+}
+
+TEST(ReedSolomonTest, AnyKFragments) {
+  CheckAllSubsets(1, 2);
+  CheckAllSubsets(3, 2);
+  CheckAllSubsets(4, 3);
+  CheckAllSubsets(6, 3);
+}
+
+TEST(ReedSolomonTest, TooFewFragments) {
+  ReedSolomon rs(4, 2);
+  vector<string> fragments;
+  rs.Encode(RandomBytes(1000), &fragments);
+  map<int, string> available;
+  available[0] = fragments[0];
+  available[2] = fragments[2];
+  available[5] = fragments[5];
+  string decoded;
+  EXPECT_FALSE(rs.Decode(available, 1000, &decoded));
+
+  // Wrong fragment size.
+  available[1] = fragments[1] + "x";
+  EXPECT_FALSE(rs.Decode(available, 1000, &decoded));
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
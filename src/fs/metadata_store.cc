@@ -4,147 +4,431 @@
 #include "fs/metadata_store.h"
 
 #include <glog/logging.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <algorithm>
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 #include "btree/btree_map.h"
+#include "common/protobuf_reader.h"
 #include "common/utils.h"
+#include "components/scheduler/scheduler.h"
 #include "components/store/store_app.h"
 #include "components/store/versioned_kvstore.pb.h"
 #include "components/store/hybrid_versioned_kvstore.h"
 #include "machine/app/app.h"
 #include "machine/machine.h"
 #include "machine/message_buffer.h"
+#include "fs/block_store.h"
 #include "fs/calvinfs.h"
+#include "fs/dentry_cache.h"
 #include "fs/metadata.pb.h"
 #include "machine/app/app.h"
 #include "proto/action.pb.h"
 
 using std::map;
+using std::pair;
 using std::set;
 using std::string;
+using std::vector;
 
 REGISTER_APP(MetadataStoreApp) {
   return new StoreApp(new MetadataStore(new HybridVersionedKVStore()));
 }
+REGISTER_APP_NAMES(
+    MetadataStoreApp, "metadata", "REMOTE_READS", "REFERENCED_BLOCKS",
+    "GC_VERSIONS", "RESOLVE");
+
+// Defined below.
+string ParentDir(const string& path);
+string FileName(const string& path);
+
+// Sets '*paths' to the paths that 'action's input refers to, in the order in
+// which GetRWSets records their store keys in the action's input_keys:
+//
+//   CREATE_FILE, ERASE:  path, ParentDir(path)
+//   COPY:                from_path, to_path, ParentDir(to_path)
+//   RENAME:              from_path, ParentDir(from_path),
+//                        to_path, ParentDir(to_path)
+//   all others:          path
+//
+void InputPaths(const Action& action, vector<string>* paths) {
+  paths->clear();
+  MetadataAction::Type type =
+      static_cast<MetadataAction::Type>(action.action_type());
+
+  if (type == MetadataAction::CREATE_FILE) {
+    MetadataAction::CreateFileInput in;
+    in.ParseFromString(action.input());
+    paths->push_back(in.path());
+    paths->push_back(ParentDir(in.path()));
+
+  } else if (type == MetadataAction::ERASE) {
+    MetadataAction::EraseInput in;
+    in.ParseFromString(action.input());
+    paths->push_back(in.path());
+    paths->push_back(ParentDir(in.path()));
+
+  } else if (type == MetadataAction::COPY) {
+    MetadataAction::CopyInput in;
+    in.ParseFromString(action.input());
+    paths->push_back(in.from_path());
+    paths->push_back(in.to_path());
+    paths->push_back(ParentDir(in.to_path()));
+
+  } else if (type == MetadataAction::RENAME) {
+    MetadataAction::RenameInput in;
+    in.ParseFromString(action.input());
+    paths->push_back(in.from_path());
+    paths->push_back(ParentDir(in.from_path()));
+    paths->push_back(in.to_path());
+    paths->push_back(ParentDir(in.to_path()));
+
+  } else if (type == MetadataAction::LOOKUP) {
+    MetadataAction::LookupInput in;
+    in.ParseFromString(action.input());
+    paths->push_back(in.path());
+
+  } else if (type == MetadataAction::RESIZE) {
+    MetadataAction::ResizeInput in;
+    in.ParseFromString(action.input());
+    paths->push_back(in.path());
+
+  } else if (type == MetadataAction::WRITE) {
+    MetadataAction::WriteInput in;
+    in.ParseFromString(action.input());
+    paths->push_back(in.path());
+
+  } else if (type == MetadataAction::APPEND) {
+    MetadataAction::AppendInput in;
+    in.ParseFromString(action.input());
+    paths->push_back(in.path());
+
+  } else if (type == MetadataAction::CHANGE_PERMISSIONS) {
+    MetadataAction::ChangePermissionsInput in;
+    in.ParseFromString(action.input());
+    paths->push_back(in.path());
+
+  } else {
+    LOG(FATAL) << "invalid action type";
+  }
+}
+
+// Sets '*key' to the store key of the dentry that binds 'path' in its parent
+// directory, whose store key (an encoded inode id) is 'parent_key'.
+void PathDentryKey(const string& parent_key, const string& path, string* key) {
+  EncodeDentryKey(DecodeInodeKey(parent_key), FileName(path), key);
+}
+
+////////////////////////////        PathKeys        ////////////////////////////
+//
+// Maps the paths an action's input refers to to their store keys. Under inode
+// keys, these are the action's input_keys, as resolved by GetRWSets; otherwise
+// each path is its own key.
+//
+class PathKeys {
+ public:
+  explicit PathKeys(const Action& action) : action_(action) {
+    if (action.input_keys_size() != 0) {
+      InputPaths(action, &paths_);
+      CHECK_EQ(static_cast<int>(paths_.size()), action.input_keys_size());
+    }
+  }
+
+  // Returns the store key of 'path', which must be one of the action's input
+  // paths.
+  const string& Key(const string& path) const {
+    if (paths_.empty()) {
+      return path;
+    }
+    for (uint32 i = 0; i < paths_.size(); i++) {
+      if (paths_[i] == path) {
+        return action_.input_keys(i);
+      }
+    }
+    LOG(FATAL) << "path outside of action's input: " << path;
+    return path;
+  }
+
+  // Under inode keys, sets '*key' to the store key of the dentry binding
+  // 'path' (which, like its parent, must be one of the action's input paths)
+  // and returns true. Returns false otherwise.
+  bool DentryKey(const string& path, string* key) const {
+    if (paths_.empty()) {
+      return false;
+    }
+    PathDentryKey(Key(ParentDir(path)), path, key);
+    return true;
+  }
+
+ private:
+  const Action& action_;
+
+  // The action's input paths, if it has input_keys (else empty).
+  vector<string> paths_;
+};
 
 ///////////////////////        ExecutionContext        ////////////////////////
 //
-// TODO(agt): The implementation below is a LOCAL execution context.
-//            Extend this to be a DISTRIBUTED one.
+// Interface through which the *_Internal methods below read and write
+// metadata entries. Reads are performed when the context is constructed, and
+// writes are installed when it is destroyed (unless it was aborted).
+//
+// Entries are stored serialized. Handlers that only need one or two fields
+// (or that only add to the end of a repeated field) should use the *EntryData
+// methods together with ProtobufReader rather than parsing the whole entry.
+//
 // TODO(agt): Generalize and move to components/store/store.{h,cc}.
 //
 class ExecutionContext {
+ public:
+  virtual ~ExecutionContext() {}
+
+  virtual bool EntryExists(const string& path) = 0;
+  virtual bool GetEntry(const string& path, MetadataEntry* entry) = 0;
+  virtual void PutEntry(const string& path, const MetadataEntry& entry) = 0;
+  virtual void DeleteEntry(const string& path) = 0;
+
+  // Returns the serialized entry stored at 'path', or NULL if none exists.
+  // The result is invalidated by any subsequent write to 'path'.
+  virtual const string* GetEntryData(const string& path) = 0;
+
+  // Stores 'data', which must be a serialized MetadataEntry, at 'path'.
+  virtual void PutEntryData(const string& path, const string& data) = 0;
+
+  // Appends 'data' (serialized MetadataEntry fields) to the existing entry
+  // at 'path', which must exist.
+  virtual void AppendEntryData(const string& path, const Slice& data) = 0;
+
+  // Under inode keys, binds 'path' to its inode by writing the dentry for it
+  // in its parent directory (or, for Unlink, deletes that dentry). No-ops
+  // otherwise.
+  virtual void Link(const string& path) = 0;
+  virtual void Unlink(const string& path) = 0;
+
+  // Returns true iff any writes are at this partition.
+  virtual bool IsWriter() = 0;
+
+  virtual void Abort() = 0;
+};
+
+////////////////////////      LocalExecutionContext      ///////////////////////
+//
+// Execution context for an action whose keys ALL live at this partition. All
+// state is kept inline (keys point into the action's readset/writeset), so
+// the context can live on the stack and allocates no maps or sets.
+//
+class LocalExecutionContext : public ExecutionContext {
  public:
   // Constructor performs all reads.
-  ExecutionContext(VersionedKVStore* store, Action* action)
-      : store_(store), version_(action->version()), aborted_(false) {
+  LocalExecutionContext(
+      MetadataStore* metadata,
+      VersionedKVStore* store,
+      Action* action)
+      : metadata_(metadata), store_(store), keys_(*action),
+        version_(action->version()), aborted_(false),
+        writer_(action->writeset_size() > 0), entry_count_(0) {
+    CHECK_LE(action->readset_size() + action->writeset_size(), kMaxEntries);
     for (int i = 0; i < action->readset_size(); i++) {
-      if (!store_->Get(action->readset(i),
-                       version_,
-                       &reads_[action->readset(i)])) {
-        reads_.erase(action->readset(i));
+      if (Find(action->readset(i)) == NULL) {
+        Entry* e = Add(action->readset(i));
+        e->present = store_->Get(action->readset(i), version_, &e->value);
       }
     }
-
-    if (action->readset_size() > 0) {
-      reader_ = true;
-    } else {
-      reader_ = false;
-    }
-
-    if (action->writeset_size() > 0) {
-      writer_ = true;
-    } else {
-      writer_ = false;
+    for (int i = 0; i < action->writeset_size(); i++) {
+      if (Find(action->writeset(i)) == NULL) {
+        Add(action->writeset(i));
+      }
     }
-
   }
 
   // Destructor installs all writes.
-  ~ExecutionContext() {
+  virtual ~LocalExecutionContext() {
     if (!aborted_) {
-      for (auto it = writes_.begin(); it != writes_.end(); ++it) {
-        store_->Put(it->first, it->second, version_);
-      }
-      for (auto it = deletions_.begin(); it != deletions_.end(); ++it) {
-        store_->Delete(*it, version_);
+      for (int i = 0; i < entry_count_; i++) {
+        if (entries_[i].dirty) {
+          store_->Put(*entries_[i].key, entries_[i].value, version_);
+          metadata_->UpdateDentryCache(*entries_[i].key, &entries_[i].value);
+        } else if (entries_[i].deleted) {
+          store_->Delete(*entries_[i].key, version_);
+          metadata_->UpdateDentryCache(*entries_[i].key, NULL);
+        }
       }
     }
   }
 
-  bool EntryExists(const string& path) {
-    return reads_.count(path) != 0;
+  virtual bool EntryExists(const string& path) {
+    Entry* e = Find(keys_.Key(path));
+    return e != NULL && e->present;
   }
 
-  bool GetEntry(const string& path, MetadataEntry* entry) {
+  virtual bool GetEntry(const string& path, MetadataEntry* entry) {
     entry->Clear();
-    if (reads_.count(path) != 0) {
-      entry->ParseFromString(reads_[path]);
+    const string* data = GetEntryData(path);
+    if (data != NULL) {
+      entry->ParseFromString(*data);
       return true;
     }
     return false;
   }
 
-  void PutEntry(const string& path, const MetadataEntry& entry) {
-    deletions_.erase(path);
-    entry.SerializeToString(&writes_[path]);
-    if (reads_.count(path) != 0) {
-      entry.SerializeToString(&reads_[path]);
+  virtual void PutEntry(const string& path, const MetadataEntry& entry) {
+    entry.SerializeToString(&WriteTarget(keys_.Key(path))->value);
+  }
+
+  virtual const string* GetEntryData(const string& path) {
+    Entry* e = Find(keys_.Key(path));
+    if (e != NULL && e->present) {
+      return &e->value;
     }
+    return NULL;
   }
 
-  void DeleteEntry(const string& path) {
-    reads_.erase(path);
-    writes_.erase(path);
-    deletions_.insert(path);
+  virtual void PutEntryData(const string& path, const string& data) {
+    WriteTarget(keys_.Key(path))->value = data;
   }
 
-  bool IsWriter() {
-    if (writer_)
-      return true;
-    else
-      return false;
+  virtual void AppendEntryData(const string& path, const Slice& data) {
+    Entry* e = WriteTarget(keys_.Key(path));
+    CHECK(e->present) << "append to nonexistent entry: " << path;
+    e->value.append(data.data(), data.size());
+  }
+
+  virtual void DeleteEntry(const string& path) {
+    Delete(keys_.Key(path));
+  }
+
+  virtual void Link(const string& path) {
+    string dentry;
+    if (keys_.DentryKey(path, &dentry)) {
+      WriteTarget(dentry)->value = keys_.Key(path);
+    }
   }
 
-  void Abort() {
+  virtual void Unlink(const string& path) {
+    string dentry;
+    if (keys_.DentryKey(path, &dentry)) {
+      Delete(dentry);
+    }
+  }
+
+  virtual bool IsWriter() {
+    return writer_;
+  }
+
+  virtual void Abort() {
     aborted_ = true;
   }
 
- protected:
-  ExecutionContext() {}
+  // Largest total number of readset and writeset keys an action run in a
+  // LocalExecutionContext may have. (RENAME has the most: 7, plus 2 dentries
+  // under inode keys.)
+  static const int kMaxEntries = 9;
+
+ private:
+  struct Entry {
+    // Store key. Points into the action's readset or writeset.
+    const string* key;
+
+    // If 'present', the current value of the entry. If 'dirty', the value to
+    // be written. (Both hold whenever an existing entry is overwritten.)
+    string value;
+
+    // True iff the entry exists (as far as this action can see).
+    bool present;
+
+    // True iff 'value' is to be written back to the store.
+    bool dirty;
+
+    // True iff the entry is to be deleted from the store.
+    bool deleted;
+  };
+
+  Entry* Find(const string& key) {
+    for (int i = 0; i < entry_count_; i++) {
+      if (*entries_[i].key == key) {
+        return &entries_[i];
+      }
+    }
+    return NULL;
+  }
+
+  // Looks up the entry for store key 'key' and marks it to be written.
+  Entry* WriteTarget(const string& key) {
+    Entry* e = Find(key);
+    CHECK(e != NULL) << "write to key outside of action's rwsets: " << key;
+    e->dirty = true;
+    e->deleted = false;
+    return e;
+  }
+
+  // Looks up the entry for store key 'key' and marks it to be deleted.
+  void Delete(const string& key) {
+    Entry* e = Find(key);
+    CHECK(e != NULL) << "write to key outside of action's rwsets: " << key;
+    e->present = false;
+    e->dirty = false;
+    e->deleted = true;
+  }
+
+  Entry* Add(const string& key) {
+    Entry* e = &entries_[entry_count_++];
+    e->key = &key;
+    e->present = false;
+    e->dirty = false;
+    e->deleted = false;
+    return e;
+  }
+
+  // Keeps the dentry cache up to date with installed writes.
+  MetadataStore* metadata_;
+
   VersionedKVStore* store_;
+
+  // Maps paths to store keys.
+  PathKeys keys_;
+
   uint64 version_;
   bool aborted_;
-  map<string, string> reads_;
-  map<string, string> writes_;
-  set<string> deletions_;
-
-  // True iff any reads are at this partition.
-  bool reader_;
 
   // True iff any writes are at this partition.
   bool writer_;
+
+  Entry entries_[kMaxEntries];
+  int entry_count_;
 };
 
 ////////////////////      DistributedExecutionContext      /////////////////////
 //
+// Execution context for an action whose keys span multiple partitions. The
+// constructor performs local reads and sends them to every remote partition
+// that performs writes. Partitions that perform writes must then receive one
+// set of remote reads (see AddRemoteReads) from each remote reader before
+// running the action.
+//
+// Requires: the action's readset_shards and writeset_shards are populated
+// (see MetadataStore::CacheShards).
+//
 // TODO(agt): Generalize and move to components/store/store.{h,cc}.
 //
 class DistributedExecutionContext : public ExecutionContext {
  public:
-  // Constructor performs all reads.
+  // Constructor performs all local reads. Remote reads are sent as
+  // REMOTE_READS RPCs to the app named 'app' at each remote writer.
   DistributedExecutionContext(
       Machine* machine,
       CalvinFSConfigMap* config,
+      const vector<bool>& local_shards,
+      MetadataStore* metadata,
       VersionedKVStore* store,
-      Action* action)
-        : machine_(machine), config_(config) {
-    // Initialize parent class variables.
-    store_ = store;
-    version_ = action->version();
-    aborted_ = false;
-
+      Action* action,
+      const string& app)
+        : machine_(machine), config_(config), local_shards_(local_shards),
+          metadata_(metadata), store_(store), action_(action),
+          keys_(*action), version_(action->version()), aborted_(false) {
     // Look up what replica we're at.
     replica_ = config_->LookupReplica(machine_->machine_id());
 
@@ -152,9 +436,8 @@ class DistributedExecutionContext : public ExecutionContext {
     reader_ = false;
     set<uint64> remote_readers;
     for (int i = 0; i < action->readset_size(); i++) {
-      uint64 mds = config_->HashFileName(action->readset(i));
-      uint64 machine = config_->LookupMetadataShard(mds, replica_);
-      if (machine == machine_->machine_id()) {
+      uint64 mds = action->readset_shards(i);
+      if (local_shards_[mds]) {
         // Local read.
         if (!store_->Get(action->readset(i),
                          version_,
@@ -163,24 +446,24 @@ class DistributedExecutionContext : public ExecutionContext {
         }
         reader_ = true;
       } else {
-        remote_readers.insert(machine);
+        remote_readers.insert(config_->LookupMetadataShard(mds, replica_));
       }
     }
+    remote_reader_count_ = remote_readers.size();
 
     // Figure out what machines are writers.
     writer_ = false;
     set<uint64> remote_writers;
     for (int i = 0; i < action->writeset_size(); i++) {
-      uint64 mds = config_->HashFileName(action->writeset(i));
-      uint64 machine = config_->LookupMetadataShard(mds, replica_);
-      if (machine == machine_->machine_id()) {
+      uint64 mds = action->writeset_shards(i);
+      if (local_shards_[mds]) {
         writer_ = true;
       } else {
-        remote_writers.insert(machine);
+        remote_writers.insert(config_->LookupMetadataShard(mds, replica_));
       }
     }
 
-    // If any reads were performed locally, broadcast them to writers.
+    // If any reads were performed locally, send them to writers.
     if (reader_) {
       MapProto local_reads;
       for (auto it = reads_.begin(); it != reads_.end(); ++it) {
@@ -192,55 +475,126 @@ class DistributedExecutionContext : public ExecutionContext {
         Header* header = new Header();
         header->set_from(machine_->machine_id());
         header->set_to(*it);
-        header->set_type(Header::DATA);
-        header->set_data_channel("action-" + UInt64ToString(version_));
+        header->set_type(Header::RPC);
+        header->set_app(app);
+        header->set_rpc("REMOTE_READS");
+        header->add_misc_int(version_);
         machine_->SendMessage(header, new MessageBuffer(local_reads));
       }
     }
-
-    // If any writes will be performed locally, wait for all remote reads.
-    if (writer_) {
-      // Get channel.
-      AtomicQueue<MessageBuffer*>* channel =
-          machine_->DataChannel("action-" + UInt64ToString(version_));
-      for (uint32 i = 0; i < remote_readers.size(); i++) {
-        MessageBuffer* m = NULL;
-        // Get results.
-        while (!channel->Pop(&m)) {
-          usleep(10);
-        }
-        MapProto remote_read;
-        remote_read.ParseFromArray((*m)[0].data(), (*m)[0].size());
-        for (int j = 0; j < remote_read.entries_size(); j++) {
-          CHECK(reads_.count(remote_read.entries(j).key()) == 0);
-          reads_[remote_read.entries(j).key()] = remote_read.entries(j).value();
-        }
-      }
-      // Close channel.
-      machine_->CloseDataChannel("action-" + UInt64ToString(version_));
-    }
   }
 
   // Destructor installs all LOCAL writes.
-  ~DistributedExecutionContext() {
+  virtual ~DistributedExecutionContext() {
     if (!aborted_) {
-      for (auto it = writes_.begin(); it != writes_.end(); ++it) {
-        uint64 mds = config_->HashFileName(it->first);
-        uint64 machine = config_->LookupMetadataShard(mds, replica_);
-        if (machine == machine_->machine_id()) {
-          store_->Put(it->first, it->second, version_);
+      for (int i = 0; i < action_->writeset_size(); i++) {
+        if (!local_shards_[action_->writeset_shards(i)]) {
+          continue;
         }
-      }
-      for (auto it = deletions_.begin(); it != deletions_.end(); ++it) {
-        uint64 mds = config_->HashFileName(*it);
-        uint64 machine = config_->LookupMetadataShard(mds, replica_);
-        if (machine == machine_->machine_id()) {
-          store_->Delete(*it, version_);
+        // Entries are erased once installed, since a key may appear in the
+        // writeset more than once.
+        const string& key = action_->writeset(i);
+        auto it = writes_.find(key);
+        if (it != writes_.end()) {
+          store_->Put(key, it->second, version_);
+          metadata_->UpdateDentryCache(key, &it->second);
+          writes_.erase(it);
+        } else if (deletions_.erase(key) != 0) {
+          store_->Delete(key, version_);
+          metadata_->UpdateDentryCache(key, NULL);
         }
       }
     }
   }
 
+  // Merges one remote reader's reads into the context.
+  void AddRemoteReads(const MapProto& remote_read) {
+    for (int j = 0; j < remote_read.entries_size(); j++) {
+      CHECK(reads_.count(remote_read.entries(j).key()) == 0);
+      reads_[remote_read.entries(j).key()] = remote_read.entries(j).value();
+    }
+  }
+
+  // Returns the number of remote machines from which reads are expected.
+  int remote_reader_count() {
+    return remote_reader_count_;
+  }
+
+  virtual bool EntryExists(const string& path) {
+    return reads_.count(keys_.Key(path)) != 0;
+  }
+
+  virtual bool GetEntry(const string& path, MetadataEntry* entry) {
+    entry->Clear();
+    const string* data = GetEntryData(path);
+    if (data != NULL) {
+      entry->ParseFromString(*data);
+      return true;
+    }
+    return false;
+  }
+
+  virtual void PutEntry(const string& path, const MetadataEntry& entry) {
+    string data;
+    entry.SerializeToString(&data);
+    PutEntryData(path, data);
+  }
+
+  virtual const string* GetEntryData(const string& path) {
+    auto it = reads_.find(keys_.Key(path));
+    return it != reads_.end() ? &it->second : NULL;
+  }
+
+  virtual void PutEntryData(const string& path, const string& data) {
+    const string& key = keys_.Key(path);
+    deletions_.erase(key);
+    writes_[key] = data;
+    auto it = reads_.find(key);
+    if (it != reads_.end()) {
+      it->second = data;
+    }
+  }
+
+  virtual void AppendEntryData(const string& path, const Slice& data) {
+    const string& key = keys_.Key(path);
+    auto it = reads_.find(key);
+    CHECK(it != reads_.end()) << "append to nonexistent entry: " << path;
+    it->second.append(data.data(), data.size());
+    deletions_.erase(key);
+    writes_[key] = it->second;
+  }
+
+  virtual void DeleteEntry(const string& path) {
+    const string& key = keys_.Key(path);
+    reads_.erase(key);
+    writes_.erase(key);
+    deletions_.insert(key);
+  }
+
+  virtual void Link(const string& path) {
+    string dentry;
+    if (keys_.DentryKey(path, &dentry)) {
+      deletions_.erase(dentry);
+      writes_[dentry] = keys_.Key(path);
+    }
+  }
+
+  virtual void Unlink(const string& path) {
+    string dentry;
+    if (keys_.DentryKey(path, &dentry)) {
+      writes_.erase(dentry);
+      deletions_.insert(dentry);
+    }
+  }
+
+  virtual bool IsWriter() {
+    return writer_;
+  }
+
+  virtual void Abort() {
+    aborted_ = true;
+  }
+
  private:
   // Local machine.
   Machine* machine_;
@@ -248,9 +602,35 @@ class DistributedExecutionContext : public ExecutionContext {
   // Deployment configuration.
   CalvinFSConfigMap* config_;
 
+  // Which metadata shards are stored at this machine.
+  const vector<bool>& local_shards_;
+
   // Local replica id.
   uint64 replica_;
 
+  // Keeps the dentry cache up to date with installed writes.
+  MetadataStore* metadata_;
+
+  VersionedKVStore* store_;
+  Action* action_;
+
+  // Maps paths to store keys.
+  PathKeys keys_;
+
+  uint64 version_;
+  bool aborted_;
+  map<string, string> reads_;
+  map<string, string> writes_;
+  set<string> deletions_;
+
+  // True iff any reads are at this partition.
+  bool reader_;
+
+  // True iff any writes are at this partition.
+  bool writer_;
+
+  // Number of remote machines that perform reads for this action.
+  int remote_reader_count_;
 };
 
 ///////////////////////          MetadataStore          ///////////////////////
@@ -277,32 +657,326 @@ string FileName(const string& path) {
   return string(path, offset + 1);
 }
 
+// Returns the type of serialized MetadataEntry 'data' without parsing any of
+// its other fields.
+FileType EntryType(const string& data) {
+  uint32 type = DATA;
+  ProtobufReader(data).ReadField<uint32>(
+      MetadataEntry::kTypeFieldNumber, &type);
+  return static_cast<FileType>(type);
+}
+
+// Returns true iff serialized MetadataEntry 'data' lists 'filename' among its
+// dir_contents.
+bool DirContains(const string& data, const string& filename) {
+  return ProtobufReader(data).FindRepeatedField<Slice>(
+      MetadataEntry::kDirContentsFieldNumber, Slice(filename)) != -1;
+}
+
+// Adds 'filename' to the dir_contents of the entry for 'path' by splicing it
+// onto the serialized entry.
+void AddDirContents(
+    ExecutionContext* context,
+    const string& path,
+    const string& filename) {
+  string field;
+  AppendLengthDelimitedField(
+      MetadataEntry::kDirContentsFieldNumber,
+      filename,
+      &field);
+  context->AppendEntryData(path, field);
+}
+
 MetadataStore::MetadataStore(VersionedKVStore* store)
-    : store_(store), machine_(NULL), config_(NULL) {
+    : store_(store), machine_(NULL), config_(NULL), replica_(0),
+      dentries_(NULL), executed_version_(0) {
 }
 
 MetadataStore::~MetadataStore() {
   delete store_;
+  delete dentries_;
+}
+
+// Seconds to wait for a RESOLVE reply before failing the resolution.
+static const double kResolveTimeout = 5;
+
+bool MetadataStore::ResolvePath(const string& path, string* key) {
+  if (dentries_ == NULL) {
+    *key = path;
+    return true;
+  }
+
+  // Walk down from the root one component at a time.
+  uint64 inode = kRootInode;
+  for (size_t begin = 0; begin < path.size(); ) {
+    CHECK_EQ('/', path[begin]) << "bad path: " << path;
+    size_t end = path.find('/', begin + 1);
+    if (end == string::npos) {
+      end = path.size();
+    }
+    Slice name(path.data() + begin + 1, end - begin - 1);
+    uint64 child;
+    if (!dentries_->Lookup(inode, name, &child)) {
+      string dentry;
+      EncodeDentryKey(inode, name, &dentry);
+      if (!ReadDentry(dentry, &child)) {
+        EncodeInodeKey(kNoInode, key);
+        return false;
+      }
+      dentries_->Insert(dentry, child);
+    }
+    inode = child;
+    begin = end;
+  }
+  EncodeInodeKey(inode, key);
+  return true;
+}
+
+bool MetadataStore::ReadDentry(const string& dentry_key, uint64* inode) {
+  string value;
+  if (IsLocal(dentry_key)) {
+    if (!store_->Get(dentry_key, ~0ULL, &value)) {
+      return false;
+    }
+  } else {
+    // Ask the shard's machine in our own replica.
+    uint64 owner = config_->LookupMetadataShard(
+        config_->HashMetadataKey(dentry_key),
+        replica_);
+    Header* header = new Header();
+    header->set_from(machine_->machine_id());
+    header->set_to(owner);
+    header->set_type(Header::RPC);
+    header->set_app(app_name_);
+    header->set_rpc("RESOLVE");
+    Future<MessageBuffer*> reply =
+        machine_->Call(header, new MessageBuffer(new string(dentry_key)));
+    if (!reply.Wait(kResolveTimeout)) {
+      reply.Cancel();
+      LOG(ERROR) << "RESOLVE timed out at machine " << owner;
+      return false;
+    }
+    MessageBuffer* m = reply.Get();
+    if (m == NULL) {
+      return false;
+    }
+    if (m->size() != 0) {
+      value = (*m)[0].ToString();
+    }
+    delete m;
+  }
+  if (!IsInodeKey(value)) {
+    return false;
+  }
+  *inode = DecodeInodeKey(value);
+  return true;
+}
+
+uint64 MetadataStore::NewInode(uint64 unique, const string& dentry_key) {
+  // Ids below 2 * shard_count are never allocated, leaving room for kRootInode
+  // and kNoInode.
+  uint64 shards = config_->config().metadata_shard_count();
+  return (unique + 2) * shards + config_->HashMetadataKey(dentry_key);
+}
+
+bool MetadataStore::ForgetStaleResolutions(const Action& action) {
+  if (dentries_ == NULL || action.input_keys_size() == 0) {
+    return false;
+  }
+
+  // All outputs share the success and errors fields.
+  MetadataAction::EraseOutput out;
+  out.ParseFromString(action.output());
+  bool missing = false;
+  for (int i = 0; i < out.errors_size(); i++) {
+    if (out.errors(i) == MetadataAction::FileDoesNotExist) {
+      missing = true;
+    }
+  }
+  if (!missing) {
+    return false;
+  }
+
+  // Drop every cached dentry along the action's paths, so that they are read
+  // afresh from their shards.
+  vector<string> paths;
+  InputPaths(action, &paths);
+  for (uint32 i = 0; i < paths.size(); i++) {
+    uint64 inode = kRootInode;
+    for (size_t begin = 0; begin < paths[i].size(); ) {
+      size_t end = paths[i].find('/', begin + 1);
+      if (end == string::npos) {
+        end = paths[i].size();
+      }
+      Slice name(paths[i].data() + begin + 1, end - begin - 1);
+      uint64 child;
+      if (!dentries_->Lookup(inode, name, &child)) {
+        break;
+      }
+      string dentry;
+      EncodeDentryKey(inode, name, &dentry);
+      dentries_->Erase(dentry);
+      inode = child;
+      begin = end;
+    }
+  }
+  return true;
+}
+
+void MetadataStore::UpdateDentryCache(const string& key, const string* value) {
+  if (dentries_ == NULL || IsInodeKey(key)) {
+    return;
+  }
+  if (value != NULL && IsInodeKey(*value)) {
+    dentries_->Insert(key, DecodeInodeKey(*value));
+  } else {
+    dentries_->Erase(key);
+  }
 }
 
-void MetadataStore::SetMachine(Machine* m) {
+void MetadataStore::SetMachine(Machine* m, const string& app_name) {
   machine_ = m;
   config_ = new CalvinFSConfigMap(machine_);
+  app_name_ = app_name;
+  replica_ = config_->LookupReplica(machine_->machine_id());
+  if (config_->config().inode_keys()) {
+    dentries_ = new DentryCache();
+  }
+
+  // Resolve shard placement once so that IsLocal is a hash plus an index.
+  local_shards_.clear();
+  for (uint64 i = 0; i < config_->config().metadata_shard_count(); i++) {
+    local_shards_.push_back(
+        config_->LookupMetadataShard(i, replica_) == machine_->machine_id());
+  }
 
   // Initialize by inserting an entry for the root directory "/" (actual
   // representation is "" since trailing slashes are always removed).
-  if (IsLocal("")) {
+  string root;
+  ResolvePath("", &root);
+  if (IsLocal(root)) {
     MetadataEntry entry;
     entry.mutable_permissions();
     entry.set_type(DIR);
     string serialized_entry;
     entry.SerializeToString(&serialized_entry);
-    store_->Put("", serialized_entry, 0);
+    store_->Put(root, serialized_entry, 0);
   }
 }
 
-int RandomSize() {
-  return 1 + rand() % 2047;
+int RandomSize(unsigned int* seed) {
+  return 1 + rand_r(seed) % 2047;
+}
+
+// Work assignment for one MetadataStore::Init thread: subdirectories
+// [begin, end) of the benchmark namespace, numbered i * bsize + j for
+// subdirectory "/a<i>/b<j>".
+struct InitRun {
+  MetadataStore* store;
+  int asize;
+  int bsize;
+  int csize;
+  int begin;
+  int end;
+  unsigned int seed;
+
+  // Local entries generated by the thread, sorted by key.
+  vector<pair<string, string> > records;
+};
+
+// Orders records by key only, since keys within a load are unique.
+static bool RecordKeyLess(
+    const pair<string, string>& a,
+    const pair<string, string>& b) {
+  return a.first < b.first;
+}
+
+void* MetadataStore::InitThread(void* arg) {
+  InitRun* run = reinterpret_cast<InitRun*>(arg);
+  MetadataStore* store = run->store;
+
+  // Every directory at a given depth has identical contents, so their
+  // entries only need to be serialized once.
+  string dir_entry;
+  {
+    MetadataEntry entry;
+    entry.mutable_permissions();
+    entry.set_type(DIR);
+    for (int j = 0; j < run->bsize; j++) {
+      entry.add_dir_contents("b" + IntToString(j));
+    }
+    entry.SerializeToString(&dir_entry);
+  }
+  string subdir_entry;
+  {
+    MetadataEntry entry;
+    entry.mutable_permissions();
+    entry.set_type(DIR);
+    for (int k = 0; k < run->csize; k++) {
+      entry.add_dir_contents("c" + IntToString(k));
+    }
+    entry.SerializeToString(&subdir_entry);
+  }
+  MetadataEntry file_entry;
+  file_entry.mutable_permissions();
+  file_entry.set_type(DATA);
+  FilePart* fp = file_entry.add_file_parts();
+  fp->set_block_id(0);
+  fp->set_block_offset(0);
+
+  // Files are numbered (for InitKeys) directories first, then
+  // subdirectories, then data files.
+  uint64 subdir_seq = 1 + run->asize;
+  uint64 file_seq = subdir_seq + static_cast<uint64>(run->asize) * run->bsize;
+
+  string root_key;
+  store->ResolvePath("", &root_key);
+  string dir_key;
+  string subdir_key;
+  string key;
+  string dentry;
+  for (int n = run->begin; n < run->end; n++) {
+    int i = n / run->bsize;
+    int j = n % run->bsize;
+    string dir("/a" + IntToString(i));
+    store->InitKeys(root_key, dir, 1 + i, &dir_key, &dentry);
+    if (j == 0) {
+      if (store->IsLocal(dir_key)) {
+        run->records.push_back(make_pair(dir_key, dir_entry));
+      }
+      if (!dentry.empty() && store->IsLocal(dentry)) {
+        run->records.push_back(make_pair(dentry, dir_key));
+      }
+    }
+    string subdir(dir + "/b" + IntToString(j));
+    store->InitKeys(dir_key, subdir, subdir_seq + n, &subdir_key, &dentry);
+    if (store->IsLocal(subdir_key)) {
+      run->records.push_back(make_pair(subdir_key, subdir_entry));
+    }
+    if (!dentry.empty() && store->IsLocal(dentry)) {
+      run->records.push_back(make_pair(dentry, subdir_key));
+    }
+    for (int k = 0; k < run->csize; k++) {
+      string file(subdir + "/c" + IntToString(k));
+      store->InitKeys(
+          subdir_key,
+          file,
+          file_seq + static_cast<uint64>(n) * run->csize + k,
+          &key,
+          &dentry);
+      if (store->IsLocal(key)) {
+        fp->set_length(RandomSize(&run->seed));
+        run->records.push_back(make_pair(key, string()));
+        file_entry.SerializeToString(&run->records.back().second);
+      }
+      if (!dentry.empty() && store->IsLocal(dentry)) {
+        run->records.push_back(make_pair(dentry, key));
+      }
+    }
+  }
+
+  std::sort(run->records.begin(), run->records.end(), RecordKeyLess);
+  return NULL;
 }
 
 void MetadataStore::Init() {
@@ -313,7 +987,9 @@ void MetadataStore::Init() {
   double start = GetTime();
 
   // Update root dir.
-  if (IsLocal("")) {
+  string root_key;
+  ResolvePath("", &root_key);
+  if (IsLocal(root_key)) {
     MetadataEntry entry;
     entry.mutable_permissions();
     entry.set_type(DIR);
@@ -322,60 +998,77 @@ void MetadataStore::Init() {
     }
     string serialized_entry;
     entry.SerializeToString(&serialized_entry);
-    store_->Put("", serialized_entry, 0);
+    store_->Put(root_key, serialized_entry, 0);
   }
 
-  // Add dirs.
-  for (int i = 0; i < asize; i++) {
-    string dir("/a" + IntToString(i));
-    if (IsLocal(dir)) {
-      MetadataEntry entry;
-      entry.mutable_permissions();
-      entry.set_type(DIR);
-      for (int j = 0; j < bsize; j++) {
-        entry.add_dir_contents("b" + IntToString(j));
+  // Split the subdirectories (and the files they contain) evenly across one
+  // thread per core. Each thread filters out non-local paths and produces a
+  // sorted run of serialized entries.
+  int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+  if (thread_count < 1) {
+    thread_count = 1;
+  } else if (thread_count > 16) {
+    thread_count = 16;
+  }
+  int subdir_count = asize * bsize;
+  vector<InitRun> runs(thread_count);
+  vector<pthread_t> threads(thread_count);
+  for (int t = 0; t < thread_count; t++) {
+    runs[t].store = this;
+    runs[t].asize = asize;
+    runs[t].bsize = bsize;
+    runs[t].csize = csize;
+    runs[t].begin = static_cast<int64>(subdir_count) * t / thread_count;
+    runs[t].end = static_cast<int64>(subdir_count) * (t + 1) / thread_count;
+    runs[t].seed = machine_->machine_id() * thread_count + t;
+    pthread_create(&threads[t], NULL, InitThread, &runs[t]);
+  }
+
+  for (int t = 0; t < thread_count; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  LOG(ERROR) << "[" << machine_->machine_id() << "] "
+             << "MDS::Init() generated entries on " << thread_count
+             << " threads. Elapsed time: " << GetTime() - start << " seconds";
+
+  // Merge the sorted runs, loading the merged output into the store a chunk at
+  // a time. Each entry's strings are moved out of its run as it is merged, so
+  // entries are never held in memory twice.
+  static const size_t kLoadChunk = 1 << 16;
+  vector<size_t> next(thread_count, 0);
+  vector<pair<string, string> > chunk;
+  chunk.reserve(kLoadChunk);
+  uint64 loaded = 0;
+  while (true) {
+    int min = -1;
+    for (int t = 0; t < thread_count; t++) {
+      if (next[t] < runs[t].records.size() &&
+          (min == -1 || runs[t].records[next[t]].first <
+                        runs[min].records[next[min]].first)) {
+        min = t;
       }
-      string serialized_entry;
-      entry.SerializeToString(&serialized_entry);
-      store_->Put(dir, serialized_entry, 0);
     }
-    // Add subdirs.
-    for (int j = 0; j < bsize; j++) {
-      string subdir(dir + "/b" + IntToString(j));
-      if (IsLocal(subdir)) {
-        MetadataEntry entry;
-        entry.mutable_permissions();
-        entry.set_type(DIR);
-        for (int k = 0; k < csize; k++) {
-          entry.add_dir_contents("c" + IntToString(k));
-        }
-        string serialized_entry;
-        entry.SerializeToString(&serialized_entry);
-        store_->Put(subdir, serialized_entry, 0);
-      }
-      // Add files.
-      for (int k = 0; k < csize; k++) {
-        string file(subdir + "/c" + IntToString(k));
-        if (IsLocal(file)) {
-          MetadataEntry entry;
-          entry.mutable_permissions();
-          entry.set_type(DATA);
-          FilePart* fp = entry.add_file_parts();
-          fp->set_length(RandomSize());
-          fp->set_block_id(0);
-          fp->set_block_offset(0);
-          string serialized_entry;
-          entry.SerializeToString(&serialized_entry);
-          store_->Put(file, serialized_entry, 0);
-        }
-      }
-      if (j % 100 == 0) {
-        LOG(ERROR) << "[" << machine_->machine_id() << "] "
-                   << "MDS::Init() progress: " << (i * bsize + j) / 100 + 1
-                   << "/" << asize * bsize / 100;
+    if (min != -1) {
+      pair<string, string>* record = &runs[min].records[next[min]++];
+      chunk.push_back(pair<string, string>());
+      chunk.back().first.swap(record->first);
+      chunk.back().second.swap(record->second);
+      if (next[min] == runs[min].records.size()) {
+        vector<pair<string, string> >().swap(runs[min].records);
       }
     }
+    if (chunk.size() == kLoadChunk || (min == -1 && !chunk.empty())) {
+      loaded += chunk.size();
+      store_->BulkLoad(&chunk, 0);
+      chunk.clear();
+    }
+    if (min == -1) {
+      break;
+    }
   }
+  LOG(ERROR) << "[" << machine_->machine_id() << "] "
+             << "MDS::Init() loaded " << loaded << " entries.";
+
   LOG(ERROR) << "[" << machine_->machine_id() << "] "
              << "MDS::Init() complete. Elapsed time: "
              << GetTime() - start << " seconds";
@@ -388,7 +1081,9 @@ void MetadataStore::InitSmall() {
   double start = GetTime();
 
   // Update root dir.
-  if (IsLocal("")) {
+  string root_key;
+  ResolvePath("", &root_key);
+  if (IsLocal(root_key)) {
     MetadataEntry entry;
     entry.mutable_permissions();
     entry.set_type(DIR);
@@ -397,13 +1092,23 @@ void MetadataStore::InitSmall() {
     }
     string serialized_entry;
     entry.SerializeToString(&serialized_entry);
-    store_->Put("", serialized_entry, 0);
+    store_->Put(root_key, serialized_entry, 0);
   }
 
+  // Files are numbered (for InitKeys) directories first, then
+  // subdirectories, then data files.
+  uint64 subdir_seq = 1 + asize;
+  uint64 file_seq = subdir_seq + static_cast<uint64>(asize) * bsize;
+
   // Add dirs.
+  string dir_key;
+  string subdir_key;
+  string key;
+  string dentry;
   for (int i = 0; i < asize; i++) {
     string dir("/a" + IntToString(i));
-    if (IsLocal(dir)) {
+    InitKeys(root_key, dir, 1 + i, &dir_key, &dentry);
+    if (IsLocal(dir_key)) {
       MetadataEntry entry;
       entry.mutable_permissions();
       entry.set_type(DIR);
@@ -412,29 +1117,41 @@ void MetadataStore::InitSmall() {
       }
       string serialized_entry;
       entry.SerializeToString(&serialized_entry);
-      store_->Put(dir, serialized_entry, 0);
+      store_->Put(dir_key, serialized_entry, 0);
+    }
+    if (!dentry.empty() && IsLocal(dentry)) {
+      store_->Put(dentry, dir_key, 0);
     }
     // Add subdirs.
     for (int j = 0; j < bsize; j++) {
+      uint64 n = static_cast<uint64>(i) * bsize + j;
       string subdir(dir + "/b" + IntToString(j));
-      if (IsLocal(subdir)) {
+      InitKeys(dir_key, subdir, subdir_seq + n, &subdir_key, &dentry);
+      if (IsLocal(subdir_key)) {
         MetadataEntry entry;
         entry.mutable_permissions();
         entry.set_type(DIR);
         entry.add_dir_contents("c");
         string serialized_entry;
         entry.SerializeToString(&serialized_entry);
-        store_->Put(subdir, serialized_entry, 0);
+        store_->Put(subdir_key, serialized_entry, 0);
+      }
+      if (!dentry.empty() && IsLocal(dentry)) {
+        store_->Put(dentry, subdir_key, 0);
       }
       // Add files.
       string file(subdir + "/c");
-      if (IsLocal(file)) {
+      InitKeys(subdir_key, file, file_seq + n, &key, &dentry);
+      if (IsLocal(key)) {
         MetadataEntry entry;
         entry.mutable_permissions();
         entry.set_type(DATA);
         string serialized_entry;
         entry.SerializeToString(&serialized_entry);
-        store_->Put(file, serialized_entry, 0);
+        store_->Put(key, serialized_entry, 0);
+      }
+      if (!dentry.empty() && IsLocal(dentry)) {
+        store_->Put(dentry, key, 0);
       }
     }
   }
@@ -443,11 +1160,26 @@ void MetadataStore::InitSmall() {
              << GetTime() - start << " seconds";
 }
 
-bool MetadataStore::IsLocal(const string& path) {
-  return machine_->machine_id() ==
-         config_->LookupMetadataShard(
-            config_->HashFileName(path),
-            config_->LookupReplica(machine_->machine_id()));
+bool MetadataStore::IsLocal(const string& key) {
+  return local_shards_[config_->HashMetadataKey(key)];
+}
+
+void MetadataStore::InitKeys(
+    const string& parent_key,
+    const string& path,
+    uint64 seq,
+    string* key,
+    string* dentry) {
+  if (dentries_ == NULL) {
+    *key = path;
+    dentry->clear();
+    return;
+  }
+  PathDentryKey(parent_key, path, dentry);
+
+  // Generated files are numbered far above the GUIDs that NewInode is passed
+  // at runtime.
+  EncodeInodeKey(NewInode((1ULL << 48) + seq, *dentry), key);
 }
 
 void MetadataStore::GetRWSets(Action* action) {
@@ -457,90 +1189,359 @@ void MetadataStore::GetRWSets(Action* action) {
   MetadataAction::Type type =
       static_cast<MetadataAction::Type>(action->action_type());
 
-  if (type == MetadataAction::CREATE_FILE) {
-    MetadataAction::CreateFileInput in;
-    in.ParseFromString(action->input());
-    action->add_readset(in.path());
-    action->add_writeset(in.path());
-    action->add_readset(ParentDir(in.path()));
-    action->add_writeset(ParentDir(in.path()));
+  // Store keys of the action's input paths (see InputPaths).
+  vector<string> paths;
+  InputPaths(*action, &paths);
+  vector<string> keys(paths);
+  if (dentries_ != NULL) {
+    // Resolve the paths to inodes, and allocate one for the file created by
+    // CREATE_FILE, COPY or RENAME. Actions that already carry input_keys keep
+    // them, so that recomputing their read/write sets allocates nothing new.
+    int created = -1;
+    if (type == MetadataAction::CREATE_FILE) {
+      created = 0;
+    } else if (type == MetadataAction::COPY) {
+      created = 1;
+    } else if (type == MetadataAction::RENAME) {
+      created = 2;
+    }
+    if (action->input_keys_size() == 0) {
+      for (uint32 i = 0; i < paths.size(); i++) {
+        string* key = action->add_input_keys();
+        if (static_cast<int>(i) != created) {
+          ResolvePath(paths[i], key);
+        }
+      }
+      if (created != -1) {
+        // The created file's parent directory always follows it.
+        string dentry;
+        PathDentryKey(action->input_keys(created + 1), paths[created], &dentry);
+        EncodeInodeKey(
+            NewInode(machine_->GetGUID(), dentry),
+            action->mutable_input_keys(created));
+      }
+    }
+    CHECK_EQ(static_cast<int>(paths.size()), action->input_keys_size());
+    for (uint32 i = 0; i < paths.size(); i++) {
+      keys[i] = action->input_keys(i);
+    }
+  }
 
-  } else if (type == MetadataAction::ERASE) {
-    MetadataAction::EraseInput in;
-    in.ParseFromString(action->input());
-    action->add_readset(in.path());
-    action->add_writeset(in.path());
-    action->add_readset(ParentDir(in.path()));
-    action->add_writeset(ParentDir(in.path()));
+  if (type == MetadataAction::CREATE_FILE ||
+      type == MetadataAction::ERASE) {
+    // paths: [path, parent]
+    action->add_readset(keys[0]);
+    action->add_writeset(keys[0]);
+    action->add_readset(keys[1]);
+    action->add_writeset(keys[1]);
+    if (dentries_ != NULL) {
+      PathDentryKey(keys[1], paths[0], action->add_writeset());
+    }
 
   } else if (type == MetadataAction::COPY) {
-    MetadataAction::CopyInput in;
-    in.ParseFromString(action->input());
-    action->add_readset(in.from_path());
-    action->add_writeset(in.to_path());
-    action->add_readset(ParentDir(in.to_path()));
-    action->add_writeset(ParentDir(in.to_path()));
+    // paths: [from, to, parent(to)]
+    action->add_readset(keys[0]);
+    action->add_writeset(keys[1]);
+    action->add_readset(keys[2]);
+    action->add_writeset(keys[2]);
+    if (dentries_ != NULL) {
+      PathDentryKey(keys[2], paths[1], action->add_writeset());
+    }
 
   } else if (type == MetadataAction::RENAME) {
-    MetadataAction::RenameInput in;
-    in.ParseFromString(action->input());
-    action->add_readset(in.from_path());
-    action->add_writeset(in.from_path());
-    action->add_readset(ParentDir(in.from_path()));
-    action->add_writeset(ParentDir(in.from_path()));
-    action->add_writeset(in.to_path());
-    action->add_readset(ParentDir(in.to_path()));
-    action->add_writeset(ParentDir(in.to_path()));
+    // paths: [from, parent(from), to, parent(to)]
+    action->add_readset(keys[0]);
+    action->add_writeset(keys[0]);
+    action->add_readset(keys[1]);
+    action->add_writeset(keys[1]);
+    action->add_writeset(keys[2]);
+    action->add_readset(keys[3]);
+    action->add_writeset(keys[3]);
+    if (dentries_ != NULL) {
+      PathDentryKey(keys[1], paths[0], action->add_writeset());
+      PathDentryKey(keys[3], paths[2], action->add_writeset());
+    }
 
   } else if (type == MetadataAction::LOOKUP) {
-    MetadataAction::LookupInput in;
-    in.ParseFromString(action->input());
-    action->add_readset(in.path());
-
-  } else if (type == MetadataAction::RESIZE) {
-    MetadataAction::ResizeInput in;
-    in.ParseFromString(action->input());
-    action->add_readset(in.path());
-    action->add_writeset(in.path());
+    // paths: [path]
+    action->add_readset(keys[0]);
 
-  } else if (type == MetadataAction::WRITE) {
-    MetadataAction::WriteInput in;
-    in.ParseFromString(action->input());
-    action->add_readset(in.path());
-    action->add_writeset(in.path());
+  } else {
+    // RESIZE, WRITE, APPEND, CHANGE_PERMISSIONS; paths: [path]
+    action->add_readset(keys[0]);
+    action->add_writeset(keys[0]);
+  }
 
-  } else if (type == MetadataAction::APPEND) {
-    MetadataAction::AppendInput in;
-    in.ParseFromString(action->input());
-    action->add_readset(in.path());
-    action->add_writeset(in.path());
+  // Resolve each key's shard once here so that neither routing nor execution
+  // needs to rehash paths.
+  CacheShards(action);
+}
 
-  } else if (type == MetadataAction::CHANGE_PERMISSIONS) {
-    MetadataAction::ChangePermissionsInput in;
-    in.ParseFromString(action->input());
-    action->add_readset(in.path());
-    action->add_writeset(in.path());
+void MetadataStore::CacheShards(Action* action) {
+  action->clear_readset_shards();
+  action->clear_writeset_shards();
+  if (config_ == NULL) {
+    return;
+  }
+  for (int i = 0; i < action->readset_size(); i++) {
+    action->add_readset_shards(config_->HashMetadataKey(action->readset(i)));
+  }
+  for (int i = 0; i < action->writeset_size(); i++) {
+    action->add_writeset_shards(
+        config_->HashMetadataKey(action->writeset(i)));
+  }
+}
 
-  } else {
-    LOG(FATAL) << "invalid action type";
+bool MetadataStore::AllKeysLocal(Action* action) {
+  // Actions normally arrive with shards cached by GetRWSets.
+  if (action->readset_shards_size() != action->readset_size() ||
+      action->writeset_shards_size() != action->writeset_size()) {
+    CacheShards(action);
+  }
+  for (int i = 0; i < action->readset_shards_size(); i++) {
+    if (!local_shards_[action->readset_shards(i)]) {
+      return false;
+    }
   }
+  for (int i = 0; i < action->writeset_shards_size(); i++) {
+    if (!local_shards_[action->writeset_shards(i)]) {
+      return false;
+    }
+  }
+  return true;
 }
 
 void MetadataStore::Run(Action* action) {
-  // Prepare by performing all reads.
-  ExecutionContext* context;
-  if (machine_ == NULL) {
-    context = new ExecutionContext(store_, action);
-  } else {
-    context =
-        new DistributedExecutionContext(machine_, config_, store_, action);
+  CHECK(machine_ == NULL || AllKeysLocal(action))
+      << "multi-partition actions must be run via RunAsync";
+
+  // Fast path: this partition is the action's only participant, so it always
+  // executes the action (including read-only ones such as LOOKUP).
+  LocalExecutionContext context(this, store_, action);
+  Execute(&context, action);
+}
+
+void MetadataStore::RunAsync(
+    Action* action,
+    AtomicQueue<Action*>* queue,
+    StoreApp* app) {
+  if (machine_ == NULL || AllKeysLocal(action)) {
+    Run(action);
+    app->ActionDone(action, queue);
+    return;
   }
 
+  // Perform local reads and send them to remote writers.
+  DistributedExecutionContext* context = new DistributedExecutionContext(
+      machine_, config_, local_shards_, this, store_, action, app->name());
   if (!context->IsWriter()) {
     delete context;
+    app->ActionDone(action, queue);
     return;
   }
 
+  // Apply any remote reads that arrived before the action did. If more are
+  // still expected, park the action; the REMOTE_READS handler that receives
+  // the last of them will finish it.
+  {
+    Lock l(&pending_mutex_);
+    PendingAction* pending = &pending_[action->version()];
+    for (uint32 i = 0; i < pending->early_reads.size(); i++) {
+      context->AddRemoteReads(*pending->early_reads[i]);
+      delete pending->early_reads[i];
+    }
+    pending->remaining = context->remote_reader_count() -
+                         static_cast<int>(pending->early_reads.size());
+    pending->early_reads.clear();
+    if (pending->remaining > 0) {
+      pending->context = context;
+      pending->action = action;
+      pending->queue = queue;
+      pending->app = app;
+      return;
+    }
+    pending_.erase(action->version());
+  }
+  Finish(context, action, queue, app);
+}
+
+void MetadataStore::HandleMessage(
+    Header* header,
+    MessageBuffer* message,
+    StoreApp* app) {
+  switch (RpcID(*header)) {
+    case WireID("REMOTE_READS"): {
+      uint64 version = header->misc_int(0);
+      MapProto* reads = new MapProto();
+      reads->ParseFromArray((*message)[0].data(), (*message)[0].size());
+      delete header;
+      delete message;
+
+      PendingAction resumed;
+      {
+        Lock l(&pending_mutex_);
+        PendingAction* pending = &pending_[version];
+        if (pending->context == NULL) {
+          // The action itself has not been run at this partition yet.
+          pending->early_reads.push_back(reads);
+          return;
+        }
+        pending->context->AddRemoteReads(*reads);
+        delete reads;
+        if (--pending->remaining > 0) {
+          return;
+        }
+        resumed = *pending;
+        pending_.erase(version);
+      }
+      // These were the last outstanding reads, so resume the action here.
+      Finish(resumed.context, resumed.action, resumed.queue, resumed.app);
+      break;
+    }
+
+    case WireID("RESOLVE"): {
+      // Reply with the inode key the requested dentry binds, or with an empty
+      // string if there is no such dentry.
+      string* inode_key = new string();
+      if (!store_->Get((*message)[0].ToString(), ~0ULL, inode_key)) {
+        inode_key->clear();
+      }
+      message->clear();
+      message->Append(inode_key);
+      machine_->SendReplyMessage(header, message);
+      break;
+    }
+
+    case WireID("REFERENCED_BLOCKS"): {
+      vector<uint64> block_ids;
+      CHECK(DecodeBlockIDList((*message)[0], &block_ids));
+      string* referenced = new string();
+      FindReferencedBlocks(block_ids, referenced);
+      message->clear();
+      message->Append(referenced);
+      machine_->SendReplyMessage(header, message);
+      break;
+    }
+
+    case WireID("GC_VERSIONS"): {
+      // Reply with the local low- and high-water versions (see
+      // DistributedBlockStoreApp::CollectGarbage).
+      uint64 versions[2] = {LowWaterVersion(), HighWaterVersion()};
+      message->clear();
+      message->Append(new string(reinterpret_cast<char*>(versions),
+                                 sizeof(versions)));
+      machine_->SendReplyMessage(header, message);
+      break;
+    }
+
+    default:
+      LOG(FATAL) << "unknown RPC type: " << header->rpc();
+  }
+}
+
+namespace {
+
+struct ReferenceScan {
+  const vector<uint64>* block_ids;
+  string* referenced;
+
+  // True iff the store also holds dentries (see fs/dentry_cache.h).
+  bool inode_keys;
+};
+
+void MarkReferencedBlocks(const Slice& key, const Slice& value, void* arg) {
+  ReferenceScan* scan = reinterpret_cast<ReferenceScan*>(arg);
+  if (scan->inode_keys && !IsInodeKey(key)) {
+    // Dentry, not an entry.
+    return;
+  }
+  MetadataEntry entry;
+  entry.ParseFromArray(value.data(), value.size());
+  for (int i = 0; i < entry.file_parts_size(); i++) {
+    vector<uint64>::const_iterator it = std::lower_bound(
+        scan->block_ids->begin(),
+        scan->block_ids->end(),
+        entry.file_parts(i).block_id());
+    if (it != scan->block_ids->end() &&
+        *it == entry.file_parts(i).block_id()) {
+      uint64 index = it - scan->block_ids->begin();
+      (*scan->referenced)[index / 8] |= (1 << (index % 8));
+    }
+  }
+}
+
+}  // namespace
+
+void MetadataStore::FindReferencedBlocks(
+    const vector<uint64>& block_ids,
+    string* referenced) {
+  referenced->assign((block_ids.size() + 7) / 8, '\0');
+  if (block_ids.empty()) {
+    return;
+  }
+  ReferenceScan scan = {&block_ids, referenced, dentries_ != NULL};
+  store_->Scan(~0ULL, &MarkReferencedBlocks, &scan);
+}
+
+uint64 MetadataStore::SafeVersion() {
+  Scheduler* scheduler = NULL;
+  if (machine_ != NULL) {
+    scheduler = reinterpret_cast<Scheduler*>(machine_->GetApp("scheduler"));
+  }
+  if (scheduler != NULL) {
+    return scheduler->SafeVersion();
+  }
+  return executed_version_.load() + 1;
+}
+
+uint64 MetadataStore::PinWriteVersion() {
+  Lock l(&pins_mutex_);
+  uint64 version = SafeVersion();
+  pinned_versions_.insert(version);
+  return version;
+}
+
+void MetadataStore::UnpinWriteVersion(uint64 version) {
+  Lock l(&pins_mutex_);
+  std::multiset<uint64>::iterator it = pinned_versions_.find(version);
+  CHECK(it != pinned_versions_.end());
+  pinned_versions_.erase(it);
+}
+
+uint64 MetadataStore::LowWaterVersion() {
+  // Read under pins_mutex_, so that a concurrent pin is either counted or
+  // pins a version no lower than the one returned.
+  Lock l(&pins_mutex_);
+  uint64 version = SafeVersion();
+  if (!pinned_versions_.empty() && *pinned_versions_.begin() < version) {
+    version = *pinned_versions_.begin();
+  }
+  return version;
+}
+
+uint64 MetadataStore::HighWaterVersion() {
+  uint64 safe = SafeVersion();
+  uint64 executed = executed_version_.load();
+  return safe > executed ? safe : executed;
+}
+
+void MetadataStore::Finish(
+    DistributedExecutionContext* context,
+    Action* action,
+    AtomicQueue<Action*>* queue,
+    StoreApp* app) {
+  Execute(context, action);
+  delete context;
+  app->ActionDone(action, queue);
+}
+
+void MetadataStore::Execute(ExecutionContext* context, Action* action) {
+  uint64 executed = executed_version_.load();
+  while (action->version() > executed &&
+         !executed_version_.compare_exchange_weak(executed,
+                                                  action->version())) {
+  }
+
   // Execute action.
   MetadataAction::Type type =
       static_cast<MetadataAction::Type>(action->action_type());
@@ -611,8 +1612,6 @@ void MetadataStore::Run(Action* action) {
   } else {
     LOG(FATAL) << "invalid action type";
   }
-
-  delete context;
 }
 
 void MetadataStore::CreateFile_Internal(
@@ -628,8 +1627,8 @@ void MetadataStore::CreateFile_Internal(
 
   // Look up parent dir.
   string parent_path = ParentDir(in.path());
-  MetadataEntry parent_entry;
-  if (!context->GetEntry(parent_path, &parent_entry)) {
+  const string* parent_data = context->GetEntryData(parent_path);
+  if (parent_data == NULL) {
     // Parent doesn't exist!
     out->set_success(false);
     out->add_errors(MetadataAction::FileDoesNotExist);
@@ -641,24 +1640,22 @@ void MetadataStore::CreateFile_Internal(
   // If file already exists, fail.
   // TODO(agt): Look up file directly instead of looking through parent dir?
   string filename = FileName(in.path());
-  for (int i = 0; i < parent_entry.dir_contents_size(); i++) {
-    if (parent_entry.dir_contents(i) == filename) {
-      out->set_success(false);
-      out->add_errors(MetadataAction::FileAlreadyExists);
-      return;
-    }
+  if (DirContains(*parent_data, filename)) {
+    out->set_success(false);
+    out->add_errors(MetadataAction::FileAlreadyExists);
+    return;
   }
 
   // Update parent.
   // TODO(agt): Keep dir_contents sorted?
-  parent_entry.add_dir_contents(filename);
-  context->PutEntry(parent_path, parent_entry);
+  AddDirContents(context, parent_path, filename);
 
   // Add entry.
   MetadataEntry entry;
   entry.mutable_permissions()->CopyFrom(in.permissions());
   entry.set_type(in.type());
   context->PutEntry(in.path(), entry);
+  context->Link(in.path());
 }
 
 void MetadataStore::Erase_Internal(
@@ -683,14 +1680,15 @@ void MetadataStore::Erase_Internal(
   }
 
   // Look up target file.
-  MetadataEntry entry;
-  if (!context->GetEntry(in.path(), &entry)) {
+  const string* data = context->GetEntryData(in.path());
+  if (data == NULL) {
     // File doesn't exist!
     out->set_success(false);
     out->add_errors(MetadataAction::FileDoesNotExist);
     return;
   }
-  if (entry.type() == DIR && entry.dir_contents_size() != 0) {
+  if (EntryType(*data) == DIR &&
+      ProtobufReader(*data).HasField(MetadataEntry::kDirContentsFieldNumber)) {
     // Trying to delete a non-empty directory!
     out->set_success(false);
     out->add_errors(MetadataAction::DirectoryNotEmpty);
@@ -701,6 +1699,7 @@ void MetadataStore::Erase_Internal(
 
   // Delete target file entry.
   context->DeleteEntry(in.path());
+  context->Unlink(in.path());
 
   // Find file and remove it from parent directory.
   string filename = FileName(in.path());
@@ -724,17 +1723,25 @@ void MetadataStore::Copy_Internal(
     MetadataAction::CopyOutput* out) {
 
   // Currently only support Copy: (non-recursive: only succeeds for DATA files and EMPTY directory)
-  MetadataEntry from_entry;
-  if (!context->GetEntry(in.from_path(), &from_entry)) {
+  const string* from_data = context->GetEntryData(in.from_path());
+  if (from_data == NULL) {
     // File doesn't exist!
     out->set_success(false);
     out->add_errors(MetadataAction::FileDoesNotExist);
     return;
   }
+  if (EntryType(*from_data) == DIR &&
+      ProtobufReader(*from_data).HasField(
+          MetadataEntry::kDirContentsFieldNumber)) {
+    // Trying to copy a non-empty directory!
+    out->set_success(false);
+    out->add_errors(MetadataAction::DirectoryNotEmpty);
+    return;
+  }
 
   string parent_to_path = ParentDir(in.to_path());
-  MetadataEntry parent_to_entry;
-  if (!context->GetEntry(parent_to_path, &parent_to_entry)) {
+  const string* parent_to_data = context->GetEntryData(parent_to_path);
+  if (parent_to_data == NULL) {
     // File doesn't exist!
     out->set_success(false);
     out->add_errors(MetadataAction::FileDoesNotExist);
@@ -743,22 +1750,18 @@ void MetadataStore::Copy_Internal(
 
   // If file already exists, fail.
   string filename = FileName(in.to_path());
-  for (int i = 0; i < parent_to_entry.dir_contents_size(); i++) {
-    if (parent_to_entry.dir_contents(i) == filename) {
-      out->set_success(false);
-      out->add_errors(MetadataAction::FileAlreadyExists);
-      return;
-    }
+  if (DirContains(*parent_to_data, filename)) {
+    out->set_success(false);
+    out->add_errors(MetadataAction::FileAlreadyExists);
+    return;
   }
 
+  // Add entry (copied before updating the parent, which may be from_path).
+  context->PutEntryData(in.to_path(), *from_data);
+  context->Link(in.to_path());
+
   // Update parent
-  parent_to_entry.add_dir_contents(filename);
-  context->PutEntry(parent_to_path, parent_to_entry);
-  
-  // Add entry
-  MetadataEntry to_entry;
-  to_entry.CopyFrom(from_entry);
-  context->PutEntry(in.to_path(), to_entry);
+  AddDirContents(context, parent_to_path, filename);
 }
 
 void MetadataStore::Rename_Internal(
@@ -766,17 +1769,24 @@ void MetadataStore::Rename_Internal(
     const MetadataAction::RenameInput& in,
     MetadataAction::RenameOutput* out) {
   // Currently only support Copy: (non-recursive: only succeeds for DATA files and EMPTY directory)
-  MetadataEntry from_entry;
-  if (!context->GetEntry(in.from_path(), &from_entry)) {
+  const string* from_data = context->GetEntryData(in.from_path());
+  if (from_data == NULL) {
     // File doesn't exist!
     out->set_success(false);
     out->add_errors(MetadataAction::FileDoesNotExist);
     return;
   }
+  if (EntryType(*from_data) == DIR &&
+      ProtobufReader(*from_data).HasField(
+          MetadataEntry::kDirContentsFieldNumber)) {
+    // Trying to move a non-empty directory!
+    out->set_success(false);
+    out->add_errors(MetadataAction::DirectoryNotEmpty);
+    return;
+  }
 
   string parent_from_path = ParentDir(in.from_path());
-  MetadataEntry parent_from_entry;
-  if (!context->GetEntry(parent_from_path, &parent_from_entry)) {
+  if (!context->EntryExists(parent_from_path)) {
     // File doesn't exist!
     out->set_success(false);
     out->add_errors(MetadataAction::FileDoesNotExist);
@@ -784,8 +1794,8 @@ void MetadataStore::Rename_Internal(
   }
 
   string parent_to_path = ParentDir(in.to_path());
-  MetadataEntry parent_to_entry;
-  if (!context->GetEntry(parent_to_path, &parent_to_entry)) {
+  const string* parent_to_data = context->GetEntryData(parent_to_path);
+  if (parent_to_data == NULL) {
     // File doesn't exist!
     out->set_success(false);
     out->add_errors(MetadataAction::FileDoesNotExist);
@@ -794,24 +1804,24 @@ void MetadataStore::Rename_Internal(
 
   // If file already exists, fail.
   string to_filename = FileName(in.to_path());
-  for (int i = 0; i < parent_to_entry.dir_contents_size(); i++) {
-    if (parent_to_entry.dir_contents(i) == to_filename) {
-      out->set_success(false);
-      out->add_errors(MetadataAction::FileAlreadyExists);
-      return;
-    }
+  if (DirContains(*parent_to_data, to_filename)) {
+    out->set_success(false);
+    out->add_errors(MetadataAction::FileAlreadyExists);
+    return;
   }
 
-  // Update to_parent (add new dir content)
-  parent_to_entry.add_dir_contents(to_filename);
-  context->PutEntry(parent_to_path, parent_to_entry);
-  
   // Add to_entry
-  MetadataEntry to_entry;
-  to_entry.CopyFrom(from_entry);
-  context->PutEntry(in.to_path(), to_entry);
+  context->PutEntryData(in.to_path(), *from_data);
+  context->Link(in.to_path());
 
-  // Update from_parent(Find file and remove it from parent directory.)
+  // Update to_parent (add new dir content)
+  AddDirContents(context, parent_to_path, to_filename);
+
+  // Update from_parent(Find file and remove it from parent directory.) This
+  // is read only now so that it reflects the update above when both parents
+  // are the same directory.
+  MetadataEntry parent_from_entry;
+  context->GetEntry(parent_from_path, &parent_from_entry);
   string from_filename = FileName(in.from_path());
   for (int i = 0; i < parent_from_entry.dir_contents_size(); i++) {
     if (parent_from_entry.dir_contents(i) == from_filename) {
@@ -828,6 +1838,7 @@ void MetadataStore::Rename_Internal(
 
   // Erase the from_entry
   context->DeleteEntry(in.from_path());
+  context->Unlink(in.from_path());
 }
 
 void MetadataStore::Lookup_Internal(
@@ -835,8 +1846,8 @@ void MetadataStore::Lookup_Internal(
     const MetadataAction::LookupInput& in,
     MetadataAction::LookupOutput* out) {
   // Look up existing entry.
-  MetadataEntry entry;
-  if (!context->GetEntry(in.path(), &entry)) {
+  const string* data = context->GetEntryData(in.path());
+  if (data == NULL) {
     // File doesn't exist!
     out->set_success(false);
     out->add_errors(MetadataAction::FileDoesNotExist);
@@ -846,7 +1857,7 @@ void MetadataStore::Lookup_Internal(
   // TODO(agt): Check permissions.
 
   // Return entry.
-  out->mutable_entry()->CopyFrom(entry);
+  out->mutable_entry()->ParseFromString(*data);
 }
 
 void MetadataStore::Resize_Internal(
@@ -854,8 +1865,8 @@ void MetadataStore::Resize_Internal(
     const MetadataAction::ResizeInput& in,
     MetadataAction::ResizeOutput* out) {
   // Look up existing entry.
-  MetadataEntry entry;
-  if (!context->GetEntry(in.path(), &entry)) {
+  const string* data = context->GetEntryData(in.path());
+  if (data == NULL) {
     // File doesn't exist!
     out->set_success(false);
     out->add_errors(MetadataAction::FileDoesNotExist);
@@ -863,7 +1874,7 @@ void MetadataStore::Resize_Internal(
   }
 
   // Only resize DATA files.
-  if (entry.type() != DATA) {
+  if (EntryType(*data) != DATA) {
     out->set_success(false);
     out->add_errors(MetadataAction::WrongFileType);
     return;
@@ -871,6 +1882,9 @@ void MetadataStore::Resize_Internal(
 
   // TODO(agt): Check permissions.
 
+  MetadataEntry entry;
+  entry.ParseFromString(*data);
+
   // If we're resizing to size 0, just clear all file part.
   if (in.size() == 0) {
     entry.clear_file_parts();
@@ -915,8 +1929,8 @@ void MetadataStore::Append_Internal(
     const MetadataAction::AppendInput& in,
     MetadataAction::AppendOutput* out) {
   // Look up existing entry.
-  MetadataEntry entry;
-  if (!context->GetEntry(in.path(), &entry)) {
+  const string* data = context->GetEntryData(in.path());
+  if (data == NULL) {
     // File doesn't exist!
     out->set_success(false);
     out->add_errors(MetadataAction::FileDoesNotExist);
@@ -924,7 +1938,7 @@ void MetadataStore::Append_Internal(
   }
 
   // Only append to DATA files.
-  if (entry.type() != DATA) {
+  if (EntryType(*data) != DATA) {
     out->set_success(false);
     out->add_errors(MetadataAction::WrongFileType);
     return;
@@ -932,13 +1946,19 @@ void MetadataStore::Append_Internal(
 
   // TODO(agt): Check permissions.
 
-  // Append data to end of file.
+  // Append data to end of file. New file parts are encoded on their own and
+  // spliced onto the end of the serialized entry, so appending costs the same
+  // no matter how many parts the file already has.
+  string parts;
+  string part;
   for (int i = 0; i < in.data_size(); i++) {
-    entry.add_file_parts()->CopyFrom(in.data(i));
+    in.data(i).SerializeToString(&part);
+    AppendLengthDelimitedField(
+        MetadataEntry::kFilePartsFieldNumber,
+        part,
+        &parts);
   }
-
-  // Write out new version of entry.
-  context->PutEntry(in.path(), entry);
+  context->AppendEntryData(in.path(), parts);
 }
 
 void MetadataStore::ChangePermissions_Internal(
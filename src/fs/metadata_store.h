@@ -6,7 +6,11 @@
 #ifndef CALVIN_FS_METADATA_STORE_H_
 #define CALVIN_FS_METADATA_STORE_H_
 
+#include <atomic>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 #include "btree/btree_map.h"
 #include "common/types.h"
 #include "common/mutex.h"
@@ -14,7 +18,10 @@
 #include "fs/metadata.pb.h"
 
 class CalvinFSConfigMap;
+class DentryCache;
+class DistributedExecutionContext;
 class Machine;
+class MapProto;
 class VersionedKVStore;
 class ExecutionContext;
 class MetadataStore : public Store {
@@ -28,11 +35,97 @@ class MetadataStore : public Store {
   virtual void GetRWSets(Action* action);
   virtual void Run(Action* action);
 
-  void SetMachine(Machine* m);
+  // Actions that span multiple partitions must be run with RunAsync. Such an
+  // action is parked (without blocking the calling thread) until reads from
+  // all other partitions have arrived via REMOTE_READS RPCs, and is then
+  // finished by the thread that handles the last of those RPCs.
+  virtual void RunAsync(
+      Action* action,
+      AtomicQueue<Action*>* queue,
+      StoreApp* app);
+  virtual void HandleMessage(
+      Header* header,
+      MessageBuffer* message,
+      StoreApp* app);
+
+  // 'app_name' is the name under which this store's StoreApp is registered
+  // (for RESOLVE RPCs to other shards).
+  void SetMachine(Machine* m, const string& app_name = "metadata");
   void Init();
   void InitSmall();
 
+  // Sets '*key' to the store key under which the entry for 'path' is kept,
+  // and returns true. This is 'path' itself unless the deployment uses inode
+  // keys (see fs/dentry_cache.h), in which case 'path' is resolved to its
+  // current inode through the dentry cache (reading uncached dentries from
+  // their shards). If some component of 'path' does not exist, '*key' is set
+  // to the encoding of kNoInode and false is returned.
+  //
+  // Read and write sets of actions contain keys, not paths. GetRWSets records
+  // the keys it resolved in the action's input_keys, and execution uses those
+  // rather than resolving paths again.
+  bool ResolvePath(const string& path, string* key);
+
+  // Under inode keys, if 'action' failed with FileDoesNotExist (possibly
+  // because its paths were resolved through stale cached dentries), forgets
+  // the cached dentries along its paths and returns true: resubmitting the
+  // action may then succeed. To resubmit, clear the action's input_keys and
+  // rerun GetRWSets. Returns false otherwise.
+  bool ForgetStaleResolutions(const Action& action);
+
+  // Keeps the dentry cache consistent with a write of 'value' (or a deletion,
+  // if 'value' is NULL) being installed at store key 'key'. Called by
+  // execution contexts.
+  void UpdateDentryCache(const string& key, const string* value);
+
+  // Sets '*referenced' to a bitmap with one bit per block in 'block_ids'
+  // (bit i%8 of byte i/8 for block_ids[i]), set iff the latest version of some
+  // local entry refers to that block. 'block_ids' must be sorted. Serves the
+  // REFERENCED_BLOCKS RPC used by block garbage collection (see
+  // DistributedBlockStoreApp::CollectGarbage).
+  void FindReferencedBlocks(
+      const std::vector<uint64>& block_ids,
+      string* referenced);
+
+  // Returns the version at which local reads currently run: the local
+  // scheduler's SafeVersion, or (if there is no scheduler) one past the
+  // newest version executed here.
+  uint64 SafeVersion();
+
+  // Clients storing a block that a metadata update will then refer to hold a
+  // pin from before the block is written until the update has committed, so
+  // that garbage collection spares the block in between. PinWriteVersion
+  // pins (and returns) the current SafeVersion; UnpinWriteVersion releases
+  // a pin it returned.
+  uint64 PinWriteVersion();
+  void UnpinWriteVersion(uint64 version);
+
+  // Returns the minimum of SafeVersion and all pinned write versions.
+  uint64 LowWaterVersion();
+
+  // Returns the maximum of SafeVersion and the newest version executed here.
+  uint64 HighWaterVersion();
+
  private:
+  // Sets action's readset_shards and writeset_shards to the metadata shards
+  // of its readset and writeset keys (or clears them if config_ is not set).
+  void CacheShards(Action* action);
+
+  // Returns true iff all of action's keys are stored at this machine.
+  // Requires: machine_ != NULL.
+  bool AllKeysLocal(Action* action);
+
+  // Runs 'action' against the reads/writes buffered by 'context'.
+  void Execute(ExecutionContext* context, Action* action);
+
+  // Executes a multi-partition action once all its remote reads are in,
+  // installs its writes, and hands it back to 'app'.
+  void Finish(
+      DistributedExecutionContext* context,
+      Action* action,
+      AtomicQueue<Action*>* queue,
+      StoreApp* app);
+
   void CreateFile_Internal(
       ExecutionContext* context,
       const MetadataAction::CreateFileInput& in,
@@ -78,7 +171,35 @@ class MetadataStore : public Store {
       const MetadataAction::ChangePermissionsInput& in,
       MetadataAction::ChangePermissionsOutput* out);
 
-  virtual bool IsLocal(const string& path);
+  // Returns true iff the entry with store key 'key' is stored at this
+  // machine.
+  virtual bool IsLocal(const string& key);
+
+  // Returns a newly allocated inode id for a file to be bound by the dentry
+  // with store key 'dentry_key'. The inode is placed on the same shard as its
+  // dentry, and is unique given a 'unique' value no other file uses.
+  uint64 NewInode(uint64 unique, const string& dentry_key);
+
+  // Reads the dentry with store key 'dentry_key' (from the local store or via
+  // a RESOLVE RPC to its shard). Returns false if it does not exist or the
+  // RPC times out.
+  bool ReadDentry(const string& dentry_key, uint64* inode);
+
+  // Sets '*key' (and, under inode keys, '*dentry') to the store keys of the
+  // entry for 'path' (and of the dentry binding it in its parent, whose key
+  // is 'parent_key') as generated by Init(). Under inode keys, 'seq' numbers
+  // the file uniquely within the generated namespace.
+  void InitKeys(
+      const string& parent_key,
+      const string& path,
+      uint64 seq,
+      string* key,
+      string* dentry);
+
+  // Generates one sorted run of the local entries created by Init(), into
+  // the InitRun (see metadata_store.cc) that 'arg' points to. The caller
+  // retains ownership of the run.
+  static void* InitThread(void* arg);
 
   // Map of file paths to serialized MetadataEntries.
   VersionedKVStore* store_;
@@ -88,6 +209,51 @@ class MetadataStore : public Store {
 
   // Partitioning/replication configuration. Must be set if machine_ != NULL.
   CalvinFSConfigMap* config_;
+
+  // local_shards_[i] is true iff this machine stores metadata shard i (in its
+  // own replica). Set along with config_.
+  std::vector<bool> local_shards_;
+
+  // Name of this store's StoreApp. Set along with config_.
+  string app_name_;
+
+  // This machine's replica. Set along with config_.
+  uint64 replica_;
+
+  // Cache of (parent inode, name) -> inode dentries. NULL unless config_
+  // specifies inode keys.
+  DentryCache* dentries_;
+
+  // A multi-partition action waiting on remote reads, or remote reads that
+  // arrived before their action did.
+  struct PendingAction {
+    PendingAction()
+        : context(NULL), action(NULL), queue(NULL), app(NULL), remaining(0) {
+    }
+
+    // Set once the action is parked (NULL while only early reads are here).
+    DistributedExecutionContext* context;
+    Action* action;
+    AtomicQueue<Action*>* queue;
+    StoreApp* app;
+
+    // Number of remote reads still expected (once the action is parked).
+    int remaining;
+
+    // Remote reads received before the action was parked.
+    std::vector<MapProto*> early_reads;
+  };
+
+  // Pending multi-partition actions, indexed by version.
+  std::map<uint64, PendingAction> pending_;
+  Mutex pending_mutex_;
+
+  // Newest version of any action executed here.
+  std::atomic<uint64> executed_version_;
+
+  // Versions pinned by PinWriteVersion.
+  std::multiset<uint64> pinned_versions_;
+  Mutex pins_mutex_;
 };
 
 #endif  // CALVIN_FS_METADATA_STORE_H_
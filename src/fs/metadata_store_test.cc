@@ -329,14 +329,127 @@ TEST(MetadataStoreTest, CreateAppendResizeRead) {
   EXPECT_FALSE(lo.entry().file_parts(2).has_block_offset());
 }
 
+TEST(MetadataStoreTest, FindReferencedBlocks) {
+  VersionedKVStore* base = new VersionedKVStore(new BTreeStore());
+  MetadataStore md(base);
+
+  // /a refers to blocks 0 and 7.
+  MetadataEntry e;
+  e.set_type(DATA);
+  e.add_file_parts()->set_block_id(0);
+  e.add_file_parts()->set_block_id(7);
+  string s;
+  e.SerializeToString(&s);
+  base->Put("/a", s, 1);
+
+  // /b referred to block 9, but now refers to block 11.
+  e.mutable_file_parts(1)->set_block_id(9);
+  e.SerializeToString(&s);
+  base->Put("/b", s, 1);
+  e.mutable_file_parts(1)->set_block_id(11);
+  e.SerializeToString(&s);
+  base->Put("/b", s, 2);
+
+  // /c referred to block 13, but has been deleted.
+  e.mutable_file_parts(1)->set_block_id(13);
+  e.SerializeToString(&s);
+  base->Put("/c", s, 1);
+  base->Delete("/c", 3);
+
+  vector<uint64> block_ids;
+  for (uint64 i = 5; i < 25; i += 2) {
+    block_ids.push_back(i);
+  }
+  string referenced;
+  md.FindReferencedBlocks(block_ids, &referenced);
+  ASSERT_EQ(2, referenced.size());
+  EXPECT_EQ(0x2 | 0x8, referenced[0]);  // 7 and 11
+  EXPECT_EQ(0, referenced[1]);
+}
+
+TEST(MetadataStoreTest, RenameWithinDir) {
+  VersionedKVStore* base = new VersionedKVStore(new BTreeStore());
+  MetadataStore md(base);
+
+  // create /foo and /bar
+  Action a;
+  MetadataAction::CreateFileInput ci;
+  for (int i = 0; i < 2; i++) {
+    a.Clear();
+    a.set_action_type(MetadataAction::CREATE_FILE);
+    a.set_version(1 + i);
+    ci.Clear();
+    ci.set_path(i == 0 ? "/foo" : "/bar");
+    ci.mutable_permissions();
+    ci.set_type(DATA);
+    ci.SerializeToString(a.mutable_input());
+    md.GetRWSets(&a);
+    md.Run(&a);
+  }
+
+  // creating /foo again fails
+  a.Clear();
+  a.set_action_type(MetadataAction::CREATE_FILE);
+  a.set_version(3);
+  ci.set_path("/foo");
+  ci.SerializeToString(a.mutable_input());
+  md.GetRWSets(&a);
+  md.Run(&a);
+  MetadataAction::CreateFileOutput co;
+  co.ParseFromString(a.output());
+  EXPECT_FALSE(co.success());
+
+  // rename /foo to /baz
+  a.Clear();
+  a.set_action_type(MetadataAction::RENAME);
+  a.set_version(4);
+  MetadataAction::RenameInput rn;
+  rn.set_from_path("/foo");
+  rn.set_to_path("/baz");
+  rn.SerializeToString(a.mutable_input());
+  md.GetRWSets(&a);
+  md.Run(&a);
+  MetadataAction::RenameOutput rno;
+  rno.ParseFromString(a.output());
+  EXPECT_TRUE(rno.success());
+
+  // root dir lists /bar and /baz, but not /foo
+  a.Clear();
+  a.set_action_type(MetadataAction::LOOKUP);
+  a.set_version(5);
+  MetadataAction::LookupInput li;
+  li.set_path("");
+  li.mutable_permissions();
+  li.SerializeToString(a.mutable_input());
+  md.GetRWSets(&a);
+  md.Run(&a);
+  MetadataAction::LookupOutput lo;
+  lo.ParseFromString(a.output());
+  EXPECT_TRUE(lo.success());
+  set<string> contents(lo.entry().dir_contents().begin(),
+                       lo.entry().dir_contents().end());
+  EXPECT_EQ(2, static_cast<int>(contents.size()));
+  EXPECT_EQ(1, static_cast<int>(contents.count("bar")));
+  EXPECT_EQ(1, static_cast<int>(contents.count("baz")));
+  EXPECT_FALSE(base->Exists("/foo", 5));
+  EXPECT_TRUE(base->Exists("/baz", 5));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // DISTRIBUTED TESTS
 
+CalvinFSConfig MakeTestConfig(int n, int r, bool inode_keys) {
+  CalvinFSConfig config = MakeCalvinFSConfig(n, r);
+  config.set_inode_keys(inode_keys);
+  return config;
+}
+
 class MetadataStoreTest {
  public:
-  MetadataStoreTest(int n, int r) : config_(MakeCalvinFSConfig(n, r)) {
+  MetadataStoreTest(int n, int r, bool inode_keys = false)
+      : config_(MakeTestConfig(n, r, inode_keys)) {
     string fsconfig;
-    MakeCalvinFSConfig(n, r).SerializeToString(&fsconfig);
+    MakeTestConfig(n, r, inode_keys).SerializeToString(&fsconfig);
 
     // Create machines; Start blockstore app.
     for (int i = 0; i < n*r; i++) {
@@ -344,7 +457,8 @@ class MetadataStoreTest {
       m_[i]->AppData()->Put("calvinfs-config", fsconfig);
       m_[i]->AddApp("MetadataStoreApp", "mds");
       mds_.push_back(reinterpret_cast<StoreApp*>(m_[i]->GetApp("mds")));
-      reinterpret_cast<MetadataStore*>(mds_[i]->store())->SetMachine(m_[i]);
+      reinterpret_cast<MetadataStore*>(mds_[i]->store())
+          ->SetMachine(m_[i], "mds");
     }
   }
 
@@ -359,13 +473,13 @@ class MetadataStoreTest {
     // Compute readers and writers.
     set<uint64> participants;
     for (int i = 0; i < action->readset_size(); i++) {
-      uint64 mds = config_.HashFileName(action->readset(i));
+      uint64 mds = config_.HashMetadataKey(action->readset(i));
       for (uint32 r = 0; r < config_.config().metadata_replication_factor(); r++) {
         participants.insert(config_.LookupMetadataShard(mds, r));
       }
     }
     for (int i = 0; i < action->writeset_size(); i++) {
-      uint64 mds = config_.HashFileName(action->writeset(i));
+      uint64 mds = config_.HashMetadataKey(action->writeset(i));
       for (uint32 r = 0; r < config_.config().metadata_replication_factor(); r++) {
         participants.insert(config_.LookupMetadataShard(mds, r));
       }
@@ -421,6 +535,8 @@ TEST(MetadataStoreTest, OneMachine) {
   ci.SerializeToString(a.mutable_input());
 
   t.mds_[0]->GetRWSets(&a);
+  EXPECT_EQ(a.readset_size(), a.readset_shards_size());
+  EXPECT_EQ(a.writeset_size(), a.writeset_shards_size());
   EXPECT_EQ(1, t.RunAction(&a));
 
   EXPECT_TRUE(a.has_output());
@@ -473,6 +589,157 @@ TEST(MetadataStoreTest, TwoPartitionsTwoReplicas) {
   EXPECT_TRUE(co.success());
 }
 
+TEST(MetadataStoreTest, InodeKeys) {
+  MetadataStoreTest t(3, 1, true);
+  MetadataStore* md = reinterpret_cast<MetadataStore*>(t.mds_[0]->store());
+
+  // mkdir /foo
+  Action a;
+  a.set_action_type(MetadataAction::CREATE_FILE);
+  a.set_version(1);
+  MetadataAction::CreateFileInput ci;
+  ci.set_path("/foo");
+  ci.mutable_permissions();
+  ci.set_type(DIR);
+  ci.SerializeToString(a.mutable_input());
+
+  t.mds_[0]->GetRWSets(&a);
+  EXPECT_EQ(2, a.input_keys_size());
+  for (int i = 0; i < a.readset_size(); i++) {
+    EXPECT_EQ(static_cast<size_t>(8), a.readset(i).size());
+  }
+  t.RunAction(&a);
+
+  EXPECT_TRUE(a.has_output());
+  MetadataAction::CreateFileOutput co;
+  co.ParseFromString(a.output());
+  EXPECT_TRUE(co.success());
+
+  // /foo now resolves to the inode allocated for it, from any machine.
+  string foo;
+  EXPECT_TRUE(md->ResolvePath("/foo", &foo));
+  EXPECT_EQ(a.input_keys(0), foo);
+  string key;
+  EXPECT_TRUE(reinterpret_cast<MetadataStore*>(t.mds_[2]->store())
+                  ->ResolvePath("/foo", &key));
+  EXPECT_EQ(foo, key);
+  EXPECT_FALSE(md->ResolvePath("/bar", &key));
+
+  // lookup /foo
+  a.Clear();
+  a.set_action_type(MetadataAction::LOOKUP);
+  a.set_version(2);
+  MetadataAction::LookupInput li;
+  li.set_path("/foo");
+  li.mutable_permissions();
+  li.SerializeToString(a.mutable_input());
+
+  t.mds_[0]->GetRWSets(&a);
+  EXPECT_EQ(1, t.RunAction(&a));
+
+  EXPECT_TRUE(a.has_output());
+  MetadataAction::LookupOutput lo;
+  lo.ParseFromString(a.output());
+  EXPECT_TRUE(lo.success());
+  EXPECT_EQ(DIR, lo.entry().type());
+
+  // rename /foo to /baz
+  a.Clear();
+  a.set_action_type(MetadataAction::RENAME);
+  a.set_version(3);
+  MetadataAction::RenameInput rn;
+  rn.set_from_path("/foo");
+  rn.set_to_path("/baz");
+  rn.SerializeToString(a.mutable_input());
+  t.mds_[0]->GetRWSets(&a);
+  t.RunAction(&a);
+  MetadataAction::RenameOutput rno;
+  rno.ParseFromString(a.output());
+  EXPECT_TRUE(rno.success());
+
+  // /baz has a new inode.
+  string baz;
+  EXPECT_TRUE(md->ResolvePath("/baz", &baz));
+  EXPECT_NE(foo, baz);
+
+  // A LOOKUP of /foo resolved before the rename (e.g. through a stale cached
+  // dentry) fails. Once stale dentries are forgotten, /foo does not resolve.
+  a.Clear();
+  a.set_action_type(MetadataAction::LOOKUP);
+  a.set_version(4);
+  li.set_path("/foo");
+  li.SerializeToString(a.mutable_input());
+  a.add_input_keys(foo);
+  t.mds_[0]->GetRWSets(&a);
+  t.RunAction(&a);
+  lo.ParseFromString(a.output());
+  EXPECT_FALSE(lo.success());
+  EXPECT_TRUE(md->ForgetStaleResolutions(a));
+  EXPECT_FALSE(md->ResolvePath("/foo", &key));
+
+  // lookup /baz
+  a.Clear();
+  a.set_action_type(MetadataAction::LOOKUP);
+  a.set_version(5);
+  li.set_path("/baz");
+  li.SerializeToString(a.mutable_input());
+  t.mds_[0]->GetRWSets(&a);
+  t.RunAction(&a);
+  lo.ParseFromString(a.output());
+  EXPECT_TRUE(lo.success());
+  EXPECT_EQ(DIR, lo.entry().type());
+
+  // touch /baz/x; /baz can then no longer be renamed.
+  a.Clear();
+  a.set_action_type(MetadataAction::CREATE_FILE);
+  a.set_version(6);
+  ci.set_path("/baz/x");
+  ci.set_type(DATA);
+  ci.SerializeToString(a.mutable_input());
+  t.mds_[0]->GetRWSets(&a);
+  t.RunAction(&a);
+  co.ParseFromString(a.output());
+  EXPECT_TRUE(co.success());
+  EXPECT_TRUE(md->ResolvePath("/baz/x", &key));
+
+  a.Clear();
+  a.set_action_type(MetadataAction::RENAME);
+  a.set_version(7);
+  rn.set_from_path("/baz");
+  rn.set_to_path("/qux");
+  rn.SerializeToString(a.mutable_input());
+  t.mds_[0]->GetRWSets(&a);
+  t.RunAction(&a);
+  rno.ParseFromString(a.output());
+  EXPECT_FALSE(rno.success());
+  EXPECT_EQ(MetadataAction::DirectoryNotEmpty, rno.errors(0));
+
+  // rm /baz/x
+  a.Clear();
+  a.set_action_type(MetadataAction::ERASE);
+  a.set_version(8);
+  MetadataAction::EraseInput ei;
+  ei.set_path("/baz/x");
+  ei.SerializeToString(a.mutable_input());
+  t.mds_[0]->GetRWSets(&a);
+  t.RunAction(&a);
+  MetadataAction::EraseOutput eo;
+  eo.ParseFromString(a.output());
+  EXPECT_TRUE(eo.success());
+
+  // /baz is empty again.
+  a.Clear();
+  a.set_action_type(MetadataAction::LOOKUP);
+  a.set_version(9);
+  li.set_path("/baz");
+  li.SerializeToString(a.mutable_input());
+  t.mds_[0]->GetRWSets(&a);
+  t.RunAction(&a);
+  lo.ParseFromString(a.output());
+  EXPECT_TRUE(lo.success());
+  EXPECT_EQ(0, lo.entry().dir_contents_size());
+}
+
 TEST(MetadataStoreTest, MoreActions) {
   MetadataStoreTest t(3, 3);
 
@@ -7,6 +7,7 @@
 #include <map>
 #include <string>
 #include "common/mutex.h"
+#include "machine/wire_header.h"
 
 using std::atomic;
 using std::map;
@@ -25,6 +26,9 @@ bool AddStartableApp(const string& app, StartApp* startapp) {
   if (state->startable_apps_.count(app) == 0) {
     state->startable_apps_[app] = startapp;
   }
+
+  // Apps are started by type name, so send it compactly.
+  RegisterWireName(app);
   return true;
 }
 
@@ -23,6 +23,7 @@
 #include "machine/machine.h"
 #include "machine/message_buffer.h"
 #include "machine/message_handler.h"
+#include "machine/wire_header.h"
 #include "proto/header.pb.h"
 #include "proto/report.pb.h"
 
@@ -101,6 +102,18 @@ bool StartApp_##APP::_UNUSED_CLASS_VARIABLE_ =              \
     AddStartableApp(#APP, new StartApp_##APP());            \
 App* StartApp_##APP::Go(const string& ARG)
 
+// Registers the RPC names an app handles or sends, and the instance names
+// under which it (or the apps it calls) are usually added, so that message
+// headers carry them as numeric ids (see machine/wire_header.h). E.g.:
+//
+//   REGISTER_APP_NAMES(LogApp, "log", "NEW_READER", "GET");
+//
+#define REGISTER_APP_NAMES(APP, ...)                        \
+const char* const _WIRE_NAMES_##APP##_[] = { __VA_ARGS__ }; \
+bool _UNUSED_WIRE_NAMES_##APP##_ = RegisterWireNames(       \
+    _WIRE_NAMES_##APP##_,                                   \
+    sizeof(_WIRE_NAMES_##APP##_) / sizeof(_WIRE_NAMES_##APP##_[0]))
+
 struct SAState {
   Mutex mutex_;
   map<string, StartApp*> startable_apps_;
@@ -1,21 +1,134 @@
 // Author: Alexander Thomson <thomson@cs.yale.edu>
 // Author: Kun Ren <kun@cs.yale.edu>
 
+#include <glog/logging.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include <map>
+#include <vector>
 
 #include "machine/cluster_config.h"
 #include "machine/connection/connection_zmq.h"
 #include "machine/connection/zmq_cpp.h"
 #include "machine/message_buffer.h"
 #include "machine/message_handler.h"
+#include "machine/wire_header.h"
 #include "common/atomic.h"
 #include "common/mutex.h"
 #include "common/types.h"
 #include "common/utils.h"
+#include "common/varint.h"
 #include "proto/header.pb.h"
 
 using std::map;
+using std::vector;
+
+namespace {
+
+// Number of zmq I/O threads, and of receiver threads per connection.
+const int kIOThreads = 2;
+const int kReceiverThreads = 4;
+
+// Milliseconds that listener and receiver threads block in zmq_poll before
+// rechecking whether they should stop.
+const int kPollTimeout = 100;
+
+// Messages at most this large (in total, including the header) are coalesced
+// with others to the same peer, into batches of at most kBatchBytes.
+const uint64 kCoalesceBytes = 1024;
+const uint64 kBatchBytes = 64 * 1024;
+
+// A batch is a single-frame ZMQ message laid out as
+//
+//    kBatchMagic, sender id (8 bytes), varint message count, and then for
+//    each message: varint part count, and for each part: varint length, data
+//
+// where the last part of each message is its encoded header. The first byte
+// distinguishes batches from headers of unbatched messages.
+const uint8 kBatchMagic = 0xCB;
+
+uint64 MessageBytes(const MessageBuffer& message) {
+  uint64 bytes = 0;
+  for (uint32 i = 0; i < message.size(); i++) {
+    bytes += message[i].size();
+  }
+  return bytes;
+}
+
+bool IsBatch(const zmq::message_t& frame) {
+  return frame.size() >= 9 &&
+         *reinterpret_cast<const uint8*>(frame.data()) == kBatchMagic;
+}
+
+// Returns the sender of a message whose final frame is 'last'.
+uint64 PeekSender(const zmq::message_t& last) {
+  const char* data = reinterpret_cast<const char*>(last.data());
+  if (IsBatch(last)) {
+    uint64 from;
+    memcpy(&from, data + 1, sizeof(from));
+    return from;
+  }
+  return PeekHeaderSender(data, last.size());
+}
+
+// Reads a varint at '*pos' (advancing '*pos' past it). Returns false if it
+// runs past 'end'.
+bool ReadVarint(const char** pos, const char* end, uint64* x) {
+  // Parse64 doesn't bounds-check, so make sure the varint is complete.
+  const char* last = *pos;
+  while (last < end && last - *pos < 8 && (*last & 0x80)) {
+    last++;
+  }
+  if (last >= end) {
+    return false;
+  }
+  *pos = varint::Parse64(*pos, x);
+  return true;
+}
+
+// A received batch frame, shared by the message parts pointing into it.
+struct SharedFrame {
+  explicit SharedFrame(zmq::message_t* f) : frame(f), refs(1) {}
+  zmq::message_t* frame;
+  atomic<int> refs;
+};
+
+void ReleaseSharedFrame(void* arg) {
+  SharedFrame* shared = reinterpret_cast<SharedFrame*>(arg);
+  if (--shared->refs == 0) {
+    delete shared->frame;
+    delete shared;
+  }
+}
+
+// Returns an empty zmq message, reusing one from '*spare' if possible.
+zmq::message_t* NewFrame(vector<zmq::message_t*>* spare) {
+  if (spare->empty()) {
+    return new zmq::message_t();
+  }
+  zmq::message_t* frame = spare->back();
+  spare->pop_back();
+  return frame;
+}
+
+// Connections in this process, keyed by their advertised host and port (which
+// no two live connections can share, since each binds its port).
+MutexRW local_peers_lock;
+map<string, ConnectionZMQ*> local_peers;
+
+string PeerKey(const string& host, int port) {
+  return host + ":" + IntToString(port);
+}
+
+// Sets '*endpoint' to the ipc endpoint of the machine listening on 'port' of
+// this host.
+void IPCEndpoint(int port, char* endpoint, int size) {
+  snprintf(endpoint, size, "ipc:///tmp/calvin-%d.ipc", port);
+}
+
+}  // namespace
 
 // Per-process zmq context.
 // TODO(agt): Initialize in process-wide init function? Deallocate eventually?
@@ -26,7 +139,7 @@ Mutex context_lock_;
 zmq::context_t* GetZMQContext() {
   Lock l(&context_lock_);
   if (context_ == NULL) {
-    context_ = new zmq::context_t(1);
+    context_ = new zmq::context_t(kIOThreads);
   }
   connection_count_++;
   return context_;
@@ -40,6 +153,8 @@ ConnectionZMQ::ConnectionZMQ(
   config_ = config;
   handler_ = handler;
   destructor_called_ = false;
+  listener_stopped_ = false;
+  next_receiver_ = 0;
 
   // Lookup and set host/port.
   MachineInfo machine_info;
@@ -47,6 +162,28 @@ ConnectionZMQ::ConnectionZMQ(
   hostname_ = machine_info.host();
   port_ = machine_info.port();
 
+  // Set up receiver state and inbound queues for co-located peers, then make
+  // this connection visible to them.
+  for (int i = 0; i < kReceiverThreads; i++) {
+    receivers_.push_back(new Receiver());
+    receivers_[i]->wake_fd = eventfd(0, EFD_NONBLOCK);
+    CHECK(receivers_[i]->wake_fd >= 0);
+  }
+  for (map<uint64, MachineInfo>::const_iterator it =
+          config_.machines().begin();
+       it != config_.machines().end(); ++it) {
+    uint64 peer = it->second.id();
+    if (peer != id_) {
+      local_queues_[peer] = new SPSCQueue<MessageBuffer*>();
+      receivers_[peer % kReceiverThreads]->queues.push_back(
+          local_queues_[peer]);
+    }
+  }
+  {
+    WriteLock l(&local_peers_lock);
+    local_peers[PeerKey(hostname_, port_)] = this;
+  }
+
   // Setup sockets and start main loop running.
   //
   // TODO(agt): This should actually happen using the Machine's ThreadPool!
@@ -54,7 +191,14 @@ ConnectionZMQ::ConnectionZMQ(
 }
 
 ConnectionZMQ::~ConnectionZMQ() {
-  // Stop the main listener loop.
+  // Once unregistered, no co-located peer touches this connection again.
+  {
+    WriteLock l(&local_peers_lock);
+    local_peers.erase(PeerKey(hostname_, port_));
+  }
+
+  // Stop the main listener loop (which in turn stops and joins the receiver
+  // threads).
   destructor_called_ = true;
   pthread_join(thread_, NULL);
 
@@ -64,36 +208,43 @@ ConnectionZMQ::~ConnectionZMQ() {
        it != sockets_out_.end(); ++it) {
     delete it->second;
   }
-  for (map<uint64, Mutex*>::iterator it = mutexes_.begin();
-       it != mutexes_.end(); ++it) {
+  for (map<uint64, Outbox*>::iterator it = outboxes_.begin();
+       it != outboxes_.end(); ++it) {
+    for (uint32 i = 0; i < it->second->queue.size(); i++) {
+      delete it->second->queue[i];
+    }
+    delete it->second;
+  }
+
+  // Free undelivered messages from co-located peers.
+  for (map<uint64, SPSCQueue<MessageBuffer*>*>::iterator it =
+          local_queues_.begin();
+       it != local_queues_.end(); ++it) {
+    MessageBuffer* message;
+    while (it->second->Pop(&message)) {
+      delete message;
+    }
     delete it->second;
   }
+  for (uint32 i = 0; i < receivers_.size(); i++) {
+    close(receivers_[i]->wake_fd);
+    delete receivers_[i];
+  }
 }
 
 // Helper deletion function called by zmq::~message_t after it is done sending
-// in SendMessage() below.
+// in SendParts() below.
 void DeleteMessagePart(void *data, void *hint) {
   delete reinterpret_cast<MessagePart*>(hint);
 }
 
-void ConnectionZMQ::SendMessageExternal(
-    Header* header,
-    MessageBuffer* message) {
-  char endpoint[256];
-  snprintf(endpoint, sizeof(endpoint), "tcp://%s:%d",
-           header->external_host().c_str(), header->external_port());
-  zmq::socket_t temp_socket(*GetZMQContext(), ZMQ_PUSH);
-  temp_socket.connect(endpoint);
-
-  // Add header to message.
-  message->Append(*header);
-  delete header;
-
-  // Send.
+// Sends each part of '*message' (without copying) as a frame of one ZMQ
+// message on 'socket'. Deletes '*message'.
+void SendParts(zmq::socket_t* socket, MessageBuffer* message) {
   for (uint32 i = 0; i < message->size(); i++) {
     // Create message.
     void* data = reinterpret_cast<void*>(const_cast<char*>(
-                       (*message)[i].data()));
+                         (*message)[i].data()));
     int size = (*message)[i].size();
     MessagePart* part = message->StealPart(i);
     zmq::message_t msg(data, size,
@@ -102,45 +253,172 @@ void ConnectionZMQ::SendMessageExternal(
 
     // Send message. All but the last are sent with ZMQ's SNDMORE flag.
     if (i == message->size() - 1) {
-      temp_socket.send(msg);
+      socket->send(msg);
     } else {
-      temp_socket.send(msg, ZMQ_SNDMORE);
+      socket->send(msg, ZMQ_SNDMORE);
     }
   }
-
   delete message;
 }
 
+void ConnectionZMQ::SendMessageExternal(
+    Header* header,
+    MessageBuffer* message) {
+  char endpoint[256];
+  snprintf(endpoint, sizeof(endpoint), "tcp://%s:%d",
+           header->external_host().c_str(), header->external_port());
+  zmq::socket_t temp_socket(*GetZMQContext(), ZMQ_PUSH);
+  temp_socket.connect(endpoint);
+
+  // Add header to message.
+  message->Append(*header);
+  delete header;
+
+  // Send.
+  SendParts(&temp_socket, message);
+}
+
 void ConnectionZMQ::SendMessage(uint64 recipient, MessageBuffer* message) {
   // Local messages can be given directly to the handler.
   if (recipient == id_) {
     MessagePart* part = message->PopBack();
     Header* header = new Header();
-    header->ParseFromArray(part->buffer().data(), part->buffer().size());
+    CHECK(DecodeHeader(part->buffer().data(), part->buffer().size(), header));
     delete part;
     handler_->HandleMessage(header, message);
     return;
   }
 
-  Lock l(mutexes_[recipient]);
-  for (uint32 i = 0; i < message->size(); i++) {
-    // Create message.
-    void* data = reinterpret_cast<void*>(const_cast<char*>(
-                         (*message)[i].data()));
-    int size = (*message)[i].size();
-    MessagePart* part = message->StealPart(i);
-    zmq::message_t msg(data, size,
-                       DeleteMessagePart,
-                       part);
+  // Queue the message. If another thread is already sending to this peer, it
+  // will send this message too before it stops.
+  Outbox* outbox = outboxes_[recipient];
+  {
+    Lock l(&outbox->mutex);
+    outbox->queue.push_back(message);
+  }
+  while (!outbox->sending.exchange(true)) {
+    vector<MessageBuffer*> messages;
+    {
+      Lock l(&outbox->mutex);
+      messages.swap(outbox->queue);
+    }
+    SendQueued(recipient, messages);
+    outbox->sending = false;
 
-    // Send message. All but the last are sent with ZMQ's SNDMORE flag.
-    if (i == message->size() - 1) {
-      sockets_out_[recipient]->send(msg);
-    } else {
-      sockets_out_[recipient]->send(msg, ZMQ_SNDMORE);
+    // Messages queued by threads that saw us sending must not be stranded.
+    Lock l(&outbox->mutex);
+    if (outbox->queue.empty()) {
+      break;
     }
   }
-  delete message;
+}
+
+void ConnectionZMQ::SendQueued(
+    uint64 recipient,
+    const vector<MessageBuffer*>& messages) {
+  // Co-located peers get the messages themselves.
+  {
+    ReadLock l(&local_peers_lock);
+    ConnectionZMQ* peer = LocalPeer(recipient);
+    if (peer != NULL) {
+      peer->EnqueueLocal(id_, messages);
+      return;
+    }
+  }
+
+  zmq::socket_t* socket = sockets_out_[recipient];
+  vector<MessageBuffer*> pending;
+  uint64 pending_bytes = 0;
+  for (uint32 i = 0; i <= messages.size(); i++) {
+    uint64 bytes = i < messages.size() ? MessageBytes(*messages[i]) : 0;
+    bool small = i < messages.size() && bytes <= kCoalesceBytes;
+
+    // Flush pending small messages before a large one, at the end, or when
+    // the batch is full.
+    if (!small || pending_bytes + bytes > kBatchBytes) {
+      if (pending.size() == 1) {
+        SendParts(socket, pending[0]);
+      } else if (pending.size() > 1) {
+        string* batch = new string();
+        batch->reserve(pending_bytes + 16 * pending.size() + 16);
+        batch->append(1, kBatchMagic);
+        batch->append(reinterpret_cast<const char*>(&id_), sizeof(id_));
+        varint::Append64(batch, pending.size());
+        for (uint32 j = 0; j < pending.size(); j++) {
+          varint::Append64(batch, pending[j]->size());
+          for (uint32 k = 0; k < pending[j]->size(); k++) {
+            varint::Append64(batch, (*pending[j])[k].size());
+            batch->append((*pending[j])[k].data(), (*pending[j])[k].size());
+          }
+          delete pending[j];
+        }
+        SendParts(socket, new MessageBuffer(batch));
+      }
+      pending.clear();
+      pending_bytes = 0;
+    }
+
+    if (small) {
+      pending.push_back(messages[i]);
+      pending_bytes += bytes;
+    } else if (i < messages.size()) {
+      SendParts(socket, messages[i]);
+    }
+  }
+}
+
+ConnectionZMQ* ConnectionZMQ::LocalPeer(uint64 id) {
+  MachineInfo info;
+  if (!config_.lookup_machine(id, &info)) {
+    return NULL;
+  }
+  map<string, ConnectionZMQ*>::iterator it =
+      local_peers.find(PeerKey(info.host(), info.port()));
+  if (it == local_peers.end() || it->second->id_ != id) {
+    return NULL;
+  }
+  return it->second;
+}
+
+void ConnectionZMQ::EnqueueLocal(
+    uint64 sender,
+    const vector<MessageBuffer*>& messages) {
+  map<uint64, SPSCQueue<MessageBuffer*>*>::iterator it =
+      local_queues_.find(sender);
+  if (it == local_queues_.end()) {
+    LOG(ERROR) << "[" << id_ << "] dropping messages from unknown machine "
+               << sender;
+    for (uint32 i = 0; i < messages.size(); i++) {
+      delete messages[i];
+    }
+    return;
+  }
+  for (uint32 i = 0; i < messages.size(); i++) {
+    it->second->Push(messages[i]);
+  }
+
+  // Wake the receiver if it may have missed the messages. Pairs with the
+  // fence in ReceiverLoop: either it sees the messages, or we see it parked.
+  Receiver* receiver = receivers_[sender % kReceiverThreads];
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (receiver->parked.load(std::memory_order_relaxed)) {
+    uint64 one = 1;
+    CHECK(write(receiver->wake_fd, &one, sizeof(one)) == sizeof(one));
+  }
+}
+
+bool ConnectionZMQ::DrainLocal(Receiver* receiver) {
+  bool drained = false;
+  for (uint32 i = 0; i < receiver->queues.size(); i++) {
+    MessageBuffer* message;
+    while (receiver->queues[i]->Pop(&message)) {
+      MessagePart* header = message->PopBack();
+      Deliver(header->buffer(), message);
+      delete header;
+      drained = true;
+    }
+  }
+  return drained;
 }
 
 void ConnectionZMQ::Init() {
@@ -149,62 +427,184 @@ void ConnectionZMQ::Init() {
   snprintf(endpoint, sizeof(endpoint), "tcp://*:%d", port_);
   socket_in_ = new zmq::socket_t(*GetZMQContext(), ZMQ_PULL);
   socket_in_->bind(endpoint);
+  IPCEndpoint(port_, endpoint, sizeof(endpoint));
+  socket_in_->bind(endpoint);
 
-  // Initialize mutexes.
+  // Initialize outbound queues.
   for (map<uint64, MachineInfo>::const_iterator it =
           config_.machines().begin();
        it != config_.machines().end(); ++it) {
-      mutexes_[it->second.id()] = new Mutex();
+      outboxes_[it->second.id()] = new Outbox();
   }
 
   // Wait a bit for other nodes to bind sockets before connecting to them.
   Spin(2);
 
-  // Connect to remote outgoing sockets.
+  // Connect to remote outgoing sockets. (Peers on this host are reached over
+  // ipc, unless they turn out to be in this process.)
   for (map<uint64, MachineInfo>::const_iterator it =
           config_.machines().begin();
        it != config_.machines().end(); ++it) {
     if (it->second.id() != id_) {  // Only connect to remote nodes.
-      snprintf(endpoint, sizeof(endpoint), "tcp://%s:%d",
-               it->second.host().c_str(), it->second.port());
+      if (it->second.host() == hostname_) {
+        IPCEndpoint(it->second.port(), endpoint, sizeof(endpoint));
+      } else {
+        snprintf(endpoint, sizeof(endpoint), "tcp://%s:%d",
+                 it->second.host().c_str(), it->second.port());
+      }
       sockets_out_[it->second.id()] =
           new zmq::socket_t(*GetZMQContext(), ZMQ_PUSH);
       sockets_out_[it->second.id()]->connect(endpoint);
     }
   }
+
+  // Bind inproc sockets for forwarding messages to receiver threads, then
+  // start the receivers (which connect to them).
+  for (int i = 0; i < kReceiverThreads; i++) {
+    ReceiverEndpoint(i, endpoint, sizeof(endpoint));
+    sockets_forward_.push_back(new zmq::socket_t(*GetZMQContext(), ZMQ_PUSH));
+    sockets_forward_[i]->bind(endpoint);
+  }
+  receiver_threads_.resize(kReceiverThreads);
+  for (int i = 0; i < kReceiverThreads; i++) {
+    pthread_create(&receiver_threads_[i], NULL, ReceiverLoop,
+                   reinterpret_cast<void*>(this));
+  }
+}
+
+void ConnectionZMQ::ReceiverEndpoint(int i, char* endpoint, int size) {
+  // Several connections may share the process-wide zmq context (e.g. in
+  // tests), so qualify the endpoint by this connection's address.
+  snprintf(endpoint, size, "inproc://connection-%llu-%p-%d",
+           static_cast<unsigned long long>(id_), this, i);
 }
 
 void* ConnectionZMQ::ListenerLoop(void* arg) {
   ConnectionZMQ* connection = reinterpret_cast<ConnectionZMQ*>(arg);
   connection->Init();
 
-  zmq::message_t* msg_part = new zmq::message_t();
-  MessageBuffer* message = new MessageBuffer();
+  zmq::pollitem_t item = { *connection->socket_in_, 0, ZMQ_POLLIN, 0 };
+  vector<zmq::message_t*> parts;
+  // Forwarding a frame leaves its message_t empty, ready for reuse.
+  vector<zmq::message_t*> spare;
   while (!connection->destructor_called_) {
-    // Get the next message. (Non-blocking.)
-    if (connection->socket_in_->recv(msg_part, ZMQ_DONTWAIT)) {
+    // Block until something arrives (or the timeout elapses).
+    if (zmq::poll(&item, 1, kPollTimeout) <= 0) {
+      continue;
+    }
+
+    // Drain everything that is ready.
+    zmq::message_t* msg_part = NewFrame(&spare);
+    while (connection->socket_in_->recv(msg_part, ZMQ_DONTWAIT)) {
+      parts.push_back(msg_part);
+      msg_part = NewFrame(&spare);
+
       // See if that was the final message part for this message.
       int more;
       size_t moresize = sizeof(more);
       connection->socket_in_->getsockopt(ZMQ_RCVMORE, &more, &moresize);
       if (!more) {
-        // Final message part. Decode as header.
-        Header* header = new Header();
-        header->ParseFromArray(msg_part->data(), msg_part->size());
-        delete msg_part;
+        // The final part is the header. Forward the whole message to the
+        // receiver responsible for its sender.
+        zmq::socket_t* out = connection->sockets_forward_[
+            PeekSender(*parts.back()) % kReceiverThreads];
+        for (uint32 i = 0; i < parts.size(); i++) {
+          out->send(*parts[i], i == parts.size() - 1 ? 0 : ZMQ_SNDMORE);
+          spare.push_back(parts[i]);
+        }
+        parts.clear();
+      }
+    }
+    spare.push_back(msg_part);
+  }
+
+  // Stop receivers.
+  connection->listener_stopped_ = true;
+  for (int i = 0; i < kReceiverThreads; i++) {
+    pthread_join(connection->receiver_threads_[i], NULL);
+    delete connection->sockets_forward_[i];
+  }
+
+  // Delete unused message parts.
+  for (uint32 i = 0; i < parts.size(); i++) {
+    delete parts[i];
+  }
+  for (uint32 i = 0; i < spare.size(); i++) {
+    delete spare[i];
+  }
+  return NULL;
+}
+
+void* ConnectionZMQ::ReceiverLoop(void* arg) {
+  ConnectionZMQ* connection = reinterpret_cast<ConnectionZMQ*>(arg);
+  int index = connection->next_receiver_++;
+  Receiver* receiver = connection->receivers_[index];
+  char endpoint[256];
+  connection->ReceiverEndpoint(index, endpoint, sizeof(endpoint));
+  zmq::socket_t socket(*GetZMQContext(), ZMQ_PULL);
+  socket.connect(endpoint);
+
+  zmq::pollitem_t items[2] = {
+    { socket, 0, ZMQ_POLLIN, 0 },
+    { NULL, receiver->wake_fd, ZMQ_POLLIN, 0 }
+  };
+  zmq::message_t* msg_part = new zmq::message_t();
+  MessageBuffer* message = new MessageBuffer();
+  while (!connection->listener_stopped_) {
+    // Deliver messages from co-located peers, then park until something
+    // arrives (or the timeout elapses). Senders write to wake_fd if they see
+    // the receiver parked.
+    if (connection->DrainLocal(receiver)) {
+      continue;
+    }
+    receiver->parked.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (connection->DrainLocal(receiver)) {
+      receiver->parked = false;
+      continue;
+    }
+    int ready = zmq::poll(items, 2, kPollTimeout);
+    receiver->parked = false;
+    if (items[1].revents & ZMQ_POLLIN) {
+      uint64 count;
+      if (read(receiver->wake_fd, &count, sizeof(count)) < 0) {
+        // Already reset by an earlier read.
+      }
+    }
+    if (ready <= 0 || !(items[0].revents & ZMQ_POLLIN)) {
+      continue;
+    }
 
-        // Pass decoded header and message to the handler.
-        connection->handler_->HandleMessage(header, message);
+    // Get the next message. (Non-blocking, since poll may return spuriously.)
+    while (socket.recv(msg_part, ZMQ_DONTWAIT)) {
+      // See if that was the final message part for this message.
+      int more;
+      size_t moresize = sizeof(more);
+      socket.getsockopt(ZMQ_RCVMORE, &more, &moresize);
+      if (!more) {
+        // Final message part. Either a batch of complete messages, or the
+        // header of the message received so far.
+        if (message->empty() && IsBatch(*msg_part)) {
+          delete message;
+          connection->DeliverBatch(msg_part);
+          msg_part = new zmq::message_t();
+        } else {
+          // The header is decoded before Deliver returns, so its frame is
+          // reused for the next part received.
+          connection->Deliver(
+              Slice(reinterpret_cast<char*>(msg_part->data()),
+                    msg_part->size()),
+              message);
+        }
 
         // Get a new empty message ready for the next message received.
         message = new MessageBuffer();
       } else {
         // More parts remain for this message. Just add this one to the output
-        // message.
+        // message, and get a new empty msg_part ready for the next part.
         message->Append(msg_part);
+        msg_part = new zmq::message_t();
       }
-      // Get a new empty msg_part ready for next part received.
-      msg_part = new zmq::message_t();
     }
   }
 
@@ -214,3 +614,51 @@ void* ConnectionZMQ::ListenerLoop(void* arg) {
   return NULL;
 }
 
+void ConnectionZMQ::Deliver(const Slice& header, MessageBuffer* message) {
+  Header* decoded = new Header();
+  if (DecodeHeader(header.data(), header.size(), decoded)) {
+    handler_->HandleMessage(decoded, message);
+  } else {
+    LOG(ERROR) << "[" << id_ << "] dropping message with malformed header";
+    delete decoded;
+    delete message;
+  }
+}
+
+void ConnectionZMQ::DeliverBatch(zmq::message_t* batch) {
+  // Message parts point into the batch frame, which is freed once the last
+  // of them (and this function) releases it.
+  SharedFrame* shared = new SharedFrame(batch);
+  const char* pos = reinterpret_cast<const char*>(batch->data()) + 9;
+  const char* end = reinterpret_cast<const char*>(batch->data()) +
+                    batch->size();
+  uint64 count;
+  bool valid = ReadVarint(&pos, end, &count);
+  for (uint64 i = 0; valid && i < count; i++) {
+    uint64 parts;
+    valid = ReadVarint(&pos, end, &parts) && parts > 0;
+    MessageBuffer* message = new MessageBuffer();
+    for (uint64 j = 0; valid && j < parts; j++) {
+      uint64 size;
+      valid = ReadVarint(&pos, end, &size) &&
+              size <= static_cast<uint64>(end - pos);
+      if (!valid) {
+        break;
+      }
+      if (j == parts - 1) {
+        Deliver(Slice(pos, size), message);
+        message = NULL;
+      } else {
+        shared->refs++;
+        message->AppendPart(
+            new MessagePart(Slice(pos, size), &ReleaseSharedFrame, shared));
+      }
+      pos += size;
+    }
+    delete message;
+  }
+  if (!valid || pos != end) {
+    LOG(ERROR) << "[" << id_ << "] malformed message batch";
+  }
+  ReleaseSharedFrame(shared);
+}
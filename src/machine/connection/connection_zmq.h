@@ -1,11 +1,34 @@
 // Author: Alex Thomson
 //
 // ZeroMQ-based Connection implementation.
+//
+// Inbound traffic arrives on a single ZMQ_PULL socket (so that external
+// clients can keep PUSHing to the machine's advertised port). A listener
+// thread blocks in zmq_poll on that socket and forwards each complete
+// multi-part message, without decoding it, over an inproc socket to one of
+// several receiver threads. The receiver is chosen by sender machine id, so
+// messages from any one peer are still delivered in the order they were sent.
+// Receiver threads decode headers and hand messages to the handler.
+//
+// Outbound messages to each peer go through a per-peer queue. Whichever
+// sending thread finds no other send to that peer in progress drains the
+// queue, so a message never waits longer than one in-flight send. Small
+// messages drained together are coalesced into a single ZMQ frame (a
+// "batch"), which receiver threads unpack without copying.
+//
+// Peers in the same process (e.g. several Machines in a test, or a local
+// cluster) bypass zmq entirely: the sender hands MessageBuffer pointers to
+// the peer's receiver thread through a single-producer, single-consumer queue
+// per sender, so payloads are neither copied nor serialized. Peers on the
+// same host but in other processes are reached over an ipc:// socket rather
+// than loopback TCP.
 
 #ifndef CALVIN_MACHINE_CONNECTION_CONNECTION_ZMQ_H_
 #define CALVIN_MACHINE_CONNECTION_CONNECTION_ZMQ_H_
 
+#include <atomic>
 #include <map>
+#include <vector>
 
 #include "machine/cluster_config.h"
 #include "machine/connection/connection.h"
@@ -16,6 +39,9 @@
 #include "common/types.h"
 #include "proto/header.pb.h"
 
+using std::atomic;
+using std::vector;
+
 class ConnectionZMQ : public Connection {
  public:
   ConnectionZMQ(
@@ -30,24 +56,102 @@ class ConnectionZMQ : public Connection {
   // Socket initialization function called by constructor.
   void Init();
 
-  // Main listener loop.
+  // Main listener loop. Forwards inbound messages to receiver threads.
   static void* ListenerLoop(void* arg);
 
+  // Receiver loop. Decodes headers of messages forwarded by the listener and
+  // passes them to the handler.
+  static void* ReceiverLoop(void* arg);
+
+  // Sets '*endpoint' to the inproc endpoint connecting the listener to
+  // receiver thread 'i'.
+  void ReceiverEndpoint(int i, char* endpoint, int size);
+
+  // Sends all queued messages to 'recipient', in order, coalescing small
+  // ones. Takes ownership of the messages.
+  void SendQueued(uint64 recipient, const vector<MessageBuffer*>& messages);
+
+  // Decodes 'header' and passes it and '*message' to the handler (or drops
+  // the message if the header is malformed). Takes ownership of '*message'.
+  void Deliver(const Slice& header, MessageBuffer* message);
+
+  // Delivers each message in a batch. Takes ownership of '*batch'.
+  void DeliverBatch(zmq::message_t* batch);
+
+  // Returns the connection of machine 'id' if it lives in this process, else
+  // NULL. Must be called with the registry read lock held.
+  ConnectionZMQ* LocalPeer(uint64 id);
+
+  // Hands 'messages' from co-located machine 'sender' to the receiver thread
+  // responsible for it. Only one thread may send from 'sender' at a time.
+  void EnqueueLocal(uint64 sender, const vector<MessageBuffer*>& messages);
+
+  // State of a receiver thread.
+  struct Receiver {
+    Receiver() : parked(false) {}
+
+    // Queues of messages from co-located peers that map to this receiver.
+    vector<SPSCQueue<MessageBuffer*>*> queues;
+
+    // eventfd written by co-located senders to wake the receiver from
+    // zmq_poll while it is parked.
+    int wake_fd;
+    atomic<bool> parked;
+  };
+
+  // Delivers all messages waiting in '*receiver's local queues. Returns true
+  // if there were any.
+  bool DrainLocal(Receiver* receiver);
+
+  // Per-peer outbound message queue.
+  struct Outbox {
+    Outbox() : sending(false) {}
+
+    // Guards 'queue'.
+    Mutex mutex;
+
+    // Messages waiting to be sent, in order.
+    vector<MessageBuffer*> queue;
+
+    // True while some thread is sending to this peer. That thread has
+    // exclusive use of the peer's socket.
+    atomic<bool> sending;
+  };
+
   // False until destructor is called. Signals ListenerLoop to stop and return.
   bool destructor_called_;
 
+  // False until ListenerLoop is done forwarding messages. Signals receiver
+  // threads to stop and return.
+  bool listener_stopped_;
+
   // Thread in which to run the main loop.
   pthread_t thread_;
 
+  // Receiver threads, and the index of the next one to start. Owned by the
+  // listener thread.
+  vector<pthread_t> receiver_threads_;
+  atomic<int> next_receiver_;
+
   // Socket listening for messages from other machines. Type = ZMQ_PULL.
   zmq::socket_t* socket_in_;
 
+  // Inproc sockets over which the listener forwards messages to receiver
+  // threads. Type = ZMQ_PUSH.
+  vector<zmq::socket_t*> sockets_forward_;
+
   // Sockets for outgoing traffic to other machines. Keyed by machine_id.
   // Type = ZMQ_PUSH.
   map<uint64, zmq::socket_t*> sockets_out_;
 
-  // Mutexes guarding out-bound sockets.
-  map<uint64, Mutex*> mutexes_;
+  // Outbound queues for other machines. Keyed by machine_id.
+  map<uint64, Outbox*> outboxes_;
+
+  // Receiver thread state, created before the connection is registered.
+  vector<Receiver*> receivers_;
+
+  // Inbound queues from co-located machines. Keyed by sender machine_id.
+  map<uint64, SPSCQueue<MessageBuffer*>*> local_queues_;
 
   // DISALLOW_COPY_AND_ASSIGN
   ConnectionZMQ(const ConnectionZMQ&);
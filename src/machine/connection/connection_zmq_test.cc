@@ -9,6 +9,205 @@
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <map>
+#include <vector>
+
+#include "machine/message_handler.h"
+#include "machine/wire_header.h"
+#include "common/mutex.h"
+#include "common/utils.h"
+
+using std::map;
+using std::vector;
+
+// Returns the payload of the i-th message of a sequence. Every seventh one
+// is too large to be coalesced with others.
+string Payload(int i) {
+  if (i % 7 == 0) {
+    return string(5000, 'a' + i % 26);
+  }
+  return "payload" + IntToString(i);
+}
+
+// Records the sequence numbers (stored in misc_int) of received messages, by
+// sender and stream, and counts messages with unexpected payloads.
+class RecordingHandler : public MessageHandler {
+ public:
+  RecordingHandler() : count_(0), bad_payloads_(0) {}
+  virtual ~RecordingHandler() {}
+  virtual void HandleMessage(Header* header, MessageBuffer* message) {
+    Lock l(&mutex_);
+    uint64 stream = header->from() * 1000 + header->misc_int(1);
+    received_[stream].push_back(header->misc_int(0));
+    if (message->size() != 1 ||
+        (*message)[0] != Payload(header->misc_int(0))) {
+      bad_payloads_++;
+    }
+    count_++;
+    delete header;
+    delete message;
+  }
+  int count() {
+    Lock l(&mutex_);
+    return count_;
+  }
+  int bad_payloads() {
+    Lock l(&mutex_);
+    return bad_payloads_;
+  }
+  map<uint64, vector<uint64> > received() {
+    Lock l(&mutex_);
+    return received_;
+  }
+
+ private:
+  Mutex mutex_;
+  map<uint64, vector<uint64> > received_;
+  int count_;
+  int bad_payloads_;
+};
+
+void SendSequence(
+    ConnectionZMQ* connection,
+    uint64 from,
+    uint64 to,
+    int n,
+    int stream = 0) {
+  for (int i = 0; i < n; i++) {
+    Header header;
+    header.set_from(from);
+    header.set_to(to);
+    header.set_type(Header::DATA);
+    header.add_misc_int(i);
+    header.add_misc_int(stream);
+    MessageBuffer* message = new MessageBuffer(new string(Payload(i)));
+    string* encoded = new string();
+    EncodeHeader(header, encoded);
+    message->Append(encoded);
+    connection->SendMessage(to, message);
+  }
+}
+
+// Checks that 'expected' streams of 'n' messages each were received, each in
+// order.
+void ExpectStreams(RecordingHandler* handler, uint32 expected, int n) {
+  while (handler->count() < static_cast<int>(expected) * n) {
+    usleep(1000);
+  }
+  map<uint64, vector<uint64> > received = handler->received();
+  EXPECT_EQ(expected, received.size());
+  for (auto it = received.begin(); it != received.end(); ++it) {
+    ASSERT_EQ(n, it->second.size());
+    for (int i = 0; i < n; i++) {
+      EXPECT_EQ(i, it->second[i]);
+    }
+  }
+  EXPECT_EQ(0, handler->bad_payloads());
+}
+
+TEST(ConnectionZMQTest, PerPeerOrdering) {
+  ClusterConfig config = ClusterConfig::LocalCluster(3);
+  RecordingHandler handlers[3];
+  ConnectionZMQ c0(0, config, &handlers[0]);
+  ConnectionZMQ c1(1, config, &handlers[1]);
+  ConnectionZMQ c2(2, config, &handlers[2]);
+  Spin(3);
+
+  // Messages from several peers, including this machine itself.
+  const int kMessages = 2000;
+  SendSequence(&c0, 0, 0, kMessages);
+  SendSequence(&c1, 1, 0, kMessages);
+  SendSequence(&c2, 2, 0, kMessages);
+  ExpectStreams(&handlers[0], 3, kMessages);
+  EXPECT_EQ(0, handlers[1].count());
+  EXPECT_EQ(0, handlers[2].count());
+}
+
+struct SenderArgs {
+  ConnectionZMQ* connection;
+  int stream;
+  int messages;
+};
+
+void* RunSender(void* arg) {
+  SenderArgs* args = reinterpret_cast<SenderArgs*>(arg);
+  SendSequence(args->connection, 1, 0, args->messages, args->stream);
+  return NULL;
+}
+
+TEST(ConnectionZMQTest, ConcurrentSenders) {
+  // Concurrent senders to the same peer have their small messages coalesced.
+  // Each sender's messages must still arrive intact and in order.
+  ClusterConfig config = ClusterConfig::LocalCluster(2);
+  RecordingHandler handlers[2];
+  ConnectionZMQ c0(0, config, &handlers[0]);
+  ConnectionZMQ c1(1, config, &handlers[1]);
+  Spin(3);
+
+  const int kSenders = 8;
+  const int kMessages = 5000;
+  pthread_t threads[kSenders];
+  SenderArgs args[kSenders];
+  for (int i = 0; i < kSenders; i++) {
+    args[i].connection = &c1;
+    args[i].stream = i;
+    args[i].messages = kMessages;
+    pthread_create(&threads[i], NULL, RunSender, &args[i]);
+  }
+  for (int i = 0; i < kSenders; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  ExpectStreams(&handlers[0], kSenders, kMessages);
+}
+
+// Records the address of the first part of each received message.
+class AddressHandler : public MessageHandler {
+ public:
+  virtual ~AddressHandler() {}
+  virtual void HandleMessage(Header* header, MessageBuffer* message) {
+    Lock l(&mutex_);
+    addresses_.push_back((*message)[0].data());
+    delete header;
+    delete message;
+  }
+  vector<const char*> addresses() {
+    Lock l(&mutex_);
+    return addresses_;
+  }
+
+ private:
+  Mutex mutex_;
+  vector<const char*> addresses_;
+};
+
+TEST(ConnectionZMQTest, LocalPeersShareBuffers) {
+  // Machines in the same process receive the sender's buffers themselves.
+  ClusterConfig config = ClusterConfig::LocalCluster(2);
+  AddressHandler handlers[2];
+  ConnectionZMQ c0(0, config, &handlers[0]);
+  ConnectionZMQ c1(1, config, &handlers[1]);
+  Spin(3);
+
+  const int kMessages = 100;
+  vector<const char*> sent;
+  for (int i = 0; i < kMessages; i++) {
+    Header header;
+    header.set_from(1);
+    header.set_to(0);
+    header.set_type(Header::DATA);
+    string* payload = new string(Payload(i));
+    sent.push_back(payload->data());
+    MessageBuffer* message = new MessageBuffer(payload);
+    string* encoded = new string();
+    EncodeHeader(header, encoded);
+    message->Append(encoded);
+    c1.SendMessage(0, message);
+  }
+  while (handlers[0].addresses().size() < kMessages) {
+    usleep(1000);
+  }
+  EXPECT_TRUE(sent == handlers[0].addresses());
+}
 
 int main(int argc, char** argv) {
   google::InitGoogleLogging(argv[0]);
@@ -0,0 +1,328 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+// A Future<T> is a handle to a value that becomes available later, typically
+// the reply to an RPC sent with Machine::Call:
+//
+//   Future<MessageBuffer*> reply = machine()->Call(header, message);
+//   ...
+//   MessageBuffer* m = reply.Get();  // Blocks until the reply arrives.
+//
+// Waiting threads block on a condition variable rather than polling. A
+// future can also be waited on with a timeout, cancelled, or given
+// continuation callbacks that run when it completes, and WhenAll() combines
+// the futures of fanned-out requests into one.
+//
+// Futures are completed through a Promise. Copies of a Future share state.
+//
+// Values of pointer type are owned by the future until taken with Get(). If
+// nobody takes one (e.g. because the future was cancelled, or its waiter
+// timed out and gave up), it is deleted once the promise and every copy of
+// the future are gone.
+
+#ifndef CALVIN_MACHINE_FUTURE_H_
+#define CALVIN_MACHINE_FUTURE_H_
+
+#include <glog/logging.h>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include "common/mutex.h"
+#include "common/types.h"
+#include "common/utils.h"
+
+using std::pair;
+using std::vector;
+
+template<typename T> class Future;
+template<typename T> class Promise;
+
+// Disposes of a future's value that nobody took. Pointers are deleted,
+// vectors have their elements disposed of, and anything else is dropped.
+template<typename T>
+struct FutureValue {
+  static void Discard(T* value) {}
+};
+template<typename T>
+struct FutureValue<T*> {
+  static void Discard(T** value) {
+    delete *value;
+  }
+};
+template<typename T>
+struct FutureValue<vector<T> > {
+  static void Discard(vector<T>* values) {
+    for (uint32 i = 0; i < values->size(); i++) {
+      FutureValue<T>::Discard(&(*values)[i]);
+    }
+  }
+};
+
+// State shared by a Promise and its Futures. (Internal; use Future/Promise.)
+template<typename T>
+class FutureState {
+ public:
+  typedef void (*Callback)(Future<T>* future, void* arg);
+
+  enum Status {
+    PENDING,
+    READY,
+    CANCELLED,
+  };
+
+  FutureState() : refs_(1), status_(PENDING), taken_(false), value_() {}
+
+  void Ref() {
+    ++refs_;
+  }
+  void Unref() {
+    if (--refs_ == 0) {
+      delete this;
+    }
+  }
+
+  // Moves from PENDING to 'status' (setting the value if READY), then runs
+  // callbacks. Returns false (discarding 'value') if no longer PENDING.
+  bool Complete(Status status, const T& value) {
+    vector<pair<Callback, void*> > callbacks;
+    {
+      Lock l(&mutex_);
+      if (status_ != PENDING) {
+        T discarded = value;
+        FutureValue<T>::Discard(&discarded);
+        return false;
+      }
+      status_ = status;
+      value_ = value;
+      callbacks.swap(callbacks_);
+      cond_.SignalAll();
+    }
+    for (uint32 i = 0; i < callbacks.size(); i++) {
+      Future<T> future(this);
+      callbacks[i].first(&future, callbacks[i].second);
+    }
+    return true;
+  }
+
+  // Waits until no longer PENDING, or until 'deadline' (if nonnegative).
+  Status Wait(double deadline) {
+    Lock l(&mutex_);
+    while (status_ == PENDING) {
+      if (deadline < 0) {
+        cond_.Wait(&mutex_);
+      } else if (!cond_.WaitUntil(&mutex_, deadline) &&
+                 GetTime() >= deadline) {
+        break;
+      }
+    }
+    return status_;
+  }
+
+  Status status() {
+    Lock l(&mutex_);
+    return status_;
+  }
+
+  // Takes the value (after Wait returned READY).
+  T Take() {
+    Lock l(&mutex_);
+    CHECK(status_ == READY) << "future has no value";
+    CHECK(!taken_) << "future value taken twice";
+    taken_ = true;
+    return value_;
+  }
+
+  // Runs 'callback' when no longer PENDING (right away if already done).
+  void AddCallback(Callback callback, void* arg) {
+    {
+      Lock l(&mutex_);
+      if (status_ == PENDING) {
+        callbacks_.push_back(std::make_pair(callback, arg));
+        return;
+      }
+    }
+    Future<T> future(this);
+    callback(&future, arg);
+  }
+
+ private:
+  ~FutureState() {
+    if (status_ == READY && !taken_) {
+      FutureValue<T>::Discard(&value_);
+    }
+  }
+
+  std::atomic<int> refs_;
+  Mutex mutex_;
+  CondVar cond_;
+  Status status_;
+  bool taken_;
+  T value_;
+  vector<pair<Callback, void*> > callbacks_;
+
+  // DISALLOW_COPY_AND_ASSIGN
+  FutureState(const FutureState<T>&);
+  FutureState& operator=(const FutureState<T>&);
+};
+
+template<typename T>
+class Future {
+ public:
+  // Callbacks are passed the (completed) future and the 'arg' given to Then.
+  typedef typename FutureState<T>::Callback Callback;
+
+  // An invalid future, to be assigned to.
+  Future() : state_(NULL) {}
+
+  // Shares 'state'.
+  explicit Future(FutureState<T>* state) : state_(state) {
+    state_->Ref();
+  }
+
+  Future(const Future<T>& other) : state_(other.state_) {
+    if (state_ != NULL) {
+      state_->Ref();
+    }
+  }
+  Future& operator=(const Future<T>& other) {
+    if (other.state_ != NULL) {
+      other.state_->Ref();
+    }
+    if (state_ != NULL) {
+      state_->Unref();
+    }
+    state_ = other.state_;
+    return *this;
+  }
+  ~Future() {
+    if (state_ != NULL) {
+      state_->Unref();
+    }
+  }
+
+  bool valid() const {
+    return state_ != NULL;
+  }
+
+  // Returns true if the value is available, or the future was cancelled.
+  bool done() {
+    return state_->status() != FutureState<T>::PENDING;
+  }
+  bool cancelled() {
+    return state_->status() == FutureState<T>::CANCELLED;
+  }
+
+  // Blocks until the future is done, or until 'timeout' seconds have passed
+  // if 'timeout' is nonnegative. Returns true if the value is available.
+  bool Wait(double timeout = -1) {
+    double deadline = timeout < 0 ? -1 : GetTime() + timeout;
+    return state_->Wait(deadline) == FutureState<T>::READY;
+  }
+
+  // Blocks until the future is done, then takes and returns its value
+  // (ownership passes to the caller). Returns T() if the future was
+  // cancelled. The value can only be taken once.
+  T Get() {
+    if (!Wait()) {
+      return T();
+    }
+    return state_->Take();
+  }
+
+  // Cancels the future, unless it is already done. Waiters wake up and find
+  // no value, and a value set later is discarded. (For Machine::Call, this
+  // does not stop the remote RPC from running.) Returns true if the future
+  // was cancelled by this call.
+  bool Cancel() {
+    return state_->Complete(FutureState<T>::CANCELLED, T());
+  }
+
+  // Runs 'callback(future, arg)' once the future is done: immediately (on the
+  // calling thread) if it is already done, otherwise on the thread that
+  // completes or cancels it. For Machine::Call replies, that is a connection
+  // thread, so callbacks must not block.
+  void Then(Callback callback, void* arg) {
+    state_->AddCallback(callback, arg);
+  }
+
+ private:
+  FutureState<T>* state_;
+};
+
+// The producer side of a Future.
+template<typename T>
+class Promise {
+ public:
+  Promise() : state_(new FutureState<T>()) {}
+
+  // A promise destroyed without being set cancels its futures.
+  ~Promise() {
+    state_->Complete(FutureState<T>::CANCELLED, T());
+    state_->Unref();
+  }
+
+  Future<T> future() {
+    return Future<T>(state_);
+  }
+
+  // Completes the future with 'value'. Returns false (and discards 'value')
+  // if it was already cancelled.
+  bool Set(const T& value) {
+    return state_->Complete(FutureState<T>::READY, value);
+  }
+
+ private:
+  FutureState<T>* state_;
+
+  // DISALLOW_COPY_AND_ASSIGN
+  Promise(const Promise<T>&);
+  Promise& operator=(const Promise<T>&);
+};
+
+// Returns a future that completes once all 'futures' are done. Its value
+// holds their values in order (taking ownership of them), with T() in place
+// of any that were cancelled.
+template<typename T>
+Future<vector<T> > WhenAll(const vector<Future<T> >& futures) {
+  struct Combined {
+    Promise<vector<T> > promise;
+    vector<T> values;
+    std::atomic<int> remaining;
+  };
+  struct Part {
+    Combined* combined;
+    int index;
+
+    static void Done(Future<T>* future, void* arg) {
+      Part* part = reinterpret_cast<Part*>(arg);
+      Combined* combined = part->combined;
+      if (!future->cancelled()) {
+        combined->values[part->index] = future->Get();
+      }
+      delete part;
+      if (--combined->remaining == 0) {
+        combined->promise.Set(combined->values);
+        delete combined;
+      }
+    }
+  };
+
+  Combined* combined = new Combined();
+  Future<vector<T> > result = combined->promise.future();
+  combined->values.resize(futures.size());
+  combined->remaining = futures.size();
+  if (futures.empty()) {
+    combined->promise.Set(combined->values);
+    delete combined;
+    return result;
+  }
+  for (uint32 i = 0; i < futures.size(); i++) {
+    Part* part = new Part();
+    part->combined = combined;
+    part->index = i;
+    Future<T>(futures[i]).Then(&Part::Done, part);
+  }
+  return result;
+}
+
+#endif  // CALVIN_MACHINE_FUTURE_H_
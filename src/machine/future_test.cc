@@ -0,0 +1,181 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+
+#include "machine/future.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+#include "common/utils.h"
+
+using std::atomic;
+using std::vector;
+
+// Counts live instances, so tests can check that unclaimed values are freed.
+atomic<int> live_values(0);
+class Value {
+ public:
+  explicit Value(int x) : x_(x) { ++live_values; }
+  ~Value() { --live_values; }
+  int x() { return x_; }
+
+ private:
+  int x_;
+};
+
+struct SetLaterArgs {
+  Promise<Value*>* promise;
+  double delay;
+  int x;
+};
+
+// Sets a promise (and deletes it) from another thread after a delay.
+void* SetLater(void* arg) {
+  SetLaterArgs* args = reinterpret_cast<SetLaterArgs*>(arg);
+  Spin(args->delay);
+  args->promise->Set(new Value(args->x));
+  delete args->promise;
+  delete args;
+  return NULL;
+}
+
+pthread_t StartSetLater(Promise<Value*>* promise, double delay, int x) {
+  SetLaterArgs* args = new SetLaterArgs();
+  args->promise = promise;
+  args->delay = delay;
+  args->x = x;
+  pthread_t thread;
+  pthread_create(&thread, NULL, SetLater, args);
+  return thread;
+}
+
+TEST(FutureTest, GetBlocksUntilSet) {
+  Promise<Value*>* promise = new Promise<Value*>();
+  Future<Value*> future = promise->future();
+  EXPECT_FALSE(future.done());
+  pthread_t thread = StartSetLater(promise, 0.05, 7);
+
+  Value* v = future.Get();
+  EXPECT_TRUE(future.done());
+  EXPECT_FALSE(future.cancelled());
+  EXPECT_EQ(7, v->x());
+  delete v;
+  pthread_join(thread, NULL);
+  EXPECT_EQ(0, live_values.load());
+}
+
+TEST(FutureTest, Timeout) {
+  Promise<Value*>* promise = new Promise<Value*>();
+  Future<Value*> future = promise->future();
+  pthread_t thread = StartSetLater(promise, 0.2, 1);
+
+  double start = GetTime();
+  EXPECT_FALSE(future.Wait(0.05));
+  EXPECT_GE(GetTime() - start, 0.05);
+  EXPECT_TRUE(future.Wait(10));
+  pthread_join(thread, NULL);
+
+  // Nobody took the value; it is freed with the future.
+  EXPECT_EQ(1, live_values.load());
+  future = Future<Value*>();
+  EXPECT_EQ(0, live_values.load());
+}
+
+TEST(FutureTest, Cancel) {
+  Promise<Value*>* promise = new Promise<Value*>();
+  Future<Value*> future = promise->future();
+  EXPECT_TRUE(future.Cancel());
+  EXPECT_FALSE(future.Cancel());
+  EXPECT_TRUE(future.done());
+  EXPECT_TRUE(future.cancelled());
+  EXPECT_FALSE(future.Wait());
+  EXPECT_EQ(NULL, future.Get());
+
+  // A late value is discarded.
+  EXPECT_FALSE(promise->Set(new Value(1)));
+  EXPECT_EQ(0, live_values.load());
+  delete promise;
+
+  // Dropping an unset promise cancels its futures.
+  promise = new Promise<Value*>();
+  future = promise->future();
+  delete promise;
+  EXPECT_TRUE(future.cancelled());
+}
+
+void AddToSum(Future<Value*>* future, void* arg) {
+  Value* v = future->Get();
+  *reinterpret_cast<int*>(arg) += v->x();
+  delete v;
+}
+
+TEST(FutureTest, Then) {
+  int sum = 0;
+  Promise<Value*>* promise = new Promise<Value*>();
+  promise->future().Then(AddToSum, &sum);
+  EXPECT_EQ(0, sum);
+  promise->Set(new Value(3));
+  EXPECT_EQ(3, sum);
+
+  // Callbacks on completed futures run right away.
+  delete promise;
+  promise = new Promise<Value*>();
+  promise->Set(new Value(4));
+  promise->future().Then(AddToSum, &sum);
+  EXPECT_EQ(7, sum);
+  delete promise;
+  EXPECT_EQ(0, live_values.load());
+}
+
+TEST(FutureTest, WhenAll) {
+  const int kCount = 10;
+  vector<Future<Value*> > futures;
+  vector<pthread_t> threads;
+  for (int i = 0; i < kCount; i++) {
+    Promise<Value*>* promise = new Promise<Value*>();
+    futures.push_back(promise->future());
+    if (i == 3) {
+      // Cancelled ones yield NULL.
+      futures.back().Cancel();
+      delete promise;
+    } else {
+      threads.push_back(StartSetLater(promise, 0.001 * (kCount - i), i));
+    }
+  }
+  vector<Value*> values = WhenAll(futures).Get();
+  ASSERT_EQ(kCount, values.size());
+  for (int i = 0; i < kCount; i++) {
+    if (i == 3) {
+      EXPECT_EQ(NULL, values[i]);
+    } else {
+      EXPECT_EQ(i, values[i]->x());
+      delete values[i];
+    }
+  }
+  for (uint32 i = 0; i < threads.size(); i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  EXPECT_EQ(0, WhenAll(vector<Future<Value*> >()).Get().size());
+
+  // Values of a combined future that nobody takes are freed.
+  Promise<Value*>* promise = new Promise<Value*>();
+  futures.clear();
+  futures.push_back(promise->future());
+  WhenAll(futures);
+  promise->Set(new Value(1));
+  delete promise;
+  futures.clear();
+  EXPECT_EQ(0, live_values.load());
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -10,6 +10,7 @@
 #include "machine/connection/connection_zmq.h"
 #include "machine/app/app.h"
 #include "machine/thread_pool/thread_pool.h"
+#include "machine/wire_header.h"
 #include "common/atomic.h"
 #include "common/types.h"
 #include "common/utils.h"
@@ -17,6 +18,8 @@
 
 using std::atomic;
 
+REGISTER_APP_NAMES(Machine, "addapp");
+
 class ConnectionLoopMessageHandler : public MessageHandler {
  public:
   explicit ConnectionLoopMessageHandler(Machine* machine, ThreadPool* tp)
@@ -37,16 +40,33 @@ class ConnectionLoopMessageHandler : public MessageHandler {
         tp_->HandleMessage(header, message);
         break;
 
-      // Ack: increment ack counter
+      // Ack: increment ack counter, unless the request was rejected. (Senders
+      // that may be rejected should request a callback or data instead.)
       case Header::ACK:
-        ++(*reinterpret_cast<atomic<int>*>(header->ack_counter()));
+        if (header->status() == Header::OK) {
+          ++(*reinterpret_cast<atomic<int>*>(header->ack_counter()));
+        } else {
+          LOG(WARNING) << "dropping ack for rejected request: "
+                       << Header::Status_Name(header->status());
+        }
         delete header;
         delete message;
         break;
 
       // Data packets can be delivered directly.
       case Header::DATA:
-        if (header->has_data_ptr()) {
+        if (header->has_call_id()) {
+          // Replies to calls that were cancelled are dropped. Calls that were
+          // rejected complete with NULL, like cancelled ones.
+          Promise<MessageBuffer*>* promise =
+              machine_->TakePendingCall(header->call_id());
+          if (promise != NULL && header->status() == Header::OK) {
+            promise->Set(message);
+          } else {
+            delete message;
+          }
+          delete promise;
+        } else if (header->has_data_ptr()) {
           *reinterpret_cast<MessageBuffer**>(header->data_ptr()) = message;
         } else if (header->has_data_channel()) {
           machine_->DataChannel(header->data_channel())->Push(message);
@@ -56,6 +76,7 @@ class ConnectionLoopMessageHandler : public MessageHandler {
         }
 
         // Send (non-data) response if requested (either ack or callback).
+        header->clear_call_id();
         header->clear_data_ptr();
         header->clear_data_channel();
         machine_->SendReplyMessage(header, new MessageBuffer());
@@ -63,7 +84,7 @@ class ConnectionLoopMessageHandler : public MessageHandler {
 
       case Header::SYSTEM:
         // LOCAL AddApp() calls.
-        if (header->rpc() == "addapp") {
+        if (RpcID(*header) == WireID("addapp")) {
           StartAppProto sap;
           sap.ParseFromArray((*message)[0].data(), (*message)[0].size());
           machine_->AddAppInternal(sap);
@@ -81,6 +102,22 @@ class ConnectionLoopMessageHandler : public MessageHandler {
   ThreadPool* tp_;
 };
 
+// Answers RPC requests rejected by the ThreadPool's admission control with an
+// empty reply whose status is OVERLOADED.
+class OverloadMessageHandler : public MessageHandler {
+ public:
+  explicit OverloadMessageHandler(Machine* machine) : machine_(machine) {}
+  virtual ~OverloadMessageHandler() {}
+  virtual void HandleMessage(Header* header, MessageBuffer* message) {
+    delete message;
+    header->set_status(Header::OVERLOADED);
+    machine_->SendReplyMessage(header, new MessageBuffer());
+  }
+
+ private:
+  Machine* machine_;
+};
+
 class WorkerThreadMessageHandler : public MessageHandler {
  public:
   explicit WorkerThreadMessageHandler(Machine* machine) : machine_(machine) {}
@@ -88,7 +125,7 @@ class WorkerThreadMessageHandler : public MessageHandler {
   virtual void HandleMessage(Header* header, MessageBuffer* message) {
     // Handle system messages specially.
     if (header->type() == Header::SYSTEM) {
-      if (header->rpc() == "addapp") {
+      if (RpcID(*header) == WireID("addapp")) {
         StartAppProto sap;
         sap.ParseFromArray((*message)[0].data(), (*message)[0].size());
 
@@ -116,7 +153,7 @@ class WorkerThreadMessageHandler : public MessageHandler {
 Machine::Machine(uint64 machine_id, const ClusterConfig& config)
     : machine_id_(machine_id), config_(config),
       next_guid_(1000), stop_(false),
-      next_barrier_(0) {
+      next_barrier_(0), next_call_id_(1) {
   InitializeComponents();
   Spin(3);
 }
@@ -128,13 +165,13 @@ Machine::Machine(
     Connection* connection)
       : machine_id_(machine_id), config_(config), thread_pool_(tp),
         connection_(connection), next_guid_(1000),
-        stop_(false), next_barrier_(0) {
+        stop_(false), next_barrier_(0), next_call_id_(1) {
   Spin(3);
 }
 
 Machine::Machine()
     : machine_id_(0), config_(ClusterConfig::LocalCluster(1)),
-      next_guid_(1000), stop_(false), next_barrier_(0) {
+      next_guid_(1000), stop_(false), next_barrier_(0), next_call_id_(1) {
   InitializeComponents();
   Spin(3);
 }
@@ -146,6 +183,19 @@ Machine::~Machine() {
   }
   delete connection_;
   delete thread_pool_;
+
+  // Cancel calls whose replies never arrived. This runs their callbacks, so
+  // it must happen while the apps are still alive.
+  map<uint64, Promise<MessageBuffer*>*> pending;
+  {
+    Lock l(&pending_calls_mutex_);
+    pending.swap(pending_calls_);
+  }
+  for (map<uint64, Promise<MessageBuffer*>*>::iterator it = pending.begin();
+       it != pending.end(); ++it) {
+    delete it->second;
+  }
+
   for (map<string, App*>::iterator it = apps_.begin(); it != apps_.end();
        ++it) {
     delete it->second;
@@ -154,11 +204,69 @@ Machine::~Machine() {
 
 void Machine::SendMessage(Header* header, MessageBuffer* message) {
   // TODO(agt): Check header validity.
-  message->Append(*header);
+  string* encoded = new string();
+  EncodeHeader(*header, encoded);
+  message->Append(encoded);
   connection_->SendMessage(header->to(), message);
   delete header;
 }
 
+namespace {
+
+// Identifies a pending call to Machine::OnCallDone.
+struct PendingCallRef {
+  Machine* machine;
+  uint64 id;
+};
+
+}  // namespace
+
+Future<MessageBuffer*> Machine::Call(Header* header, MessageBuffer* message) {
+  // The promise is deleted by whichever thread removes it from
+  // pending_calls_: the connection thread that receives the reply, or the
+  // thread that cancels the future.
+  uint64 id = next_call_id_++;
+  Promise<MessageBuffer*>* promise = new Promise<MessageBuffer*>();
+  Future<MessageBuffer*> reply = promise->future();
+  {
+    Lock l(&pending_calls_mutex_);
+    pending_calls_[id] = promise;
+  }
+  PendingCallRef* ref = new PendingCallRef();
+  ref->machine = this;
+  ref->id = id;
+  reply.Then(&OnCallDone, ref);
+
+  header->clear_callback_app();
+  header->clear_callback_rpc();
+  header->clear_ack_counter();
+  header->clear_data_ptr();
+  header->set_call_id(id);
+  SendMessage(header, message);
+  return reply;
+}
+
+Promise<MessageBuffer*>* Machine::TakePendingCall(uint64 id) {
+  Lock l(&pending_calls_mutex_);
+  map<uint64, Promise<MessageBuffer*>*>::iterator it = pending_calls_.find(id);
+  if (it == pending_calls_.end()) {
+    return NULL;
+  }
+  Promise<MessageBuffer*>* promise = it->second;
+  pending_calls_.erase(it);
+  return promise;
+}
+
+void Machine::OnCallDone(Future<MessageBuffer*>* future, void* arg) {
+  PendingCallRef* ref = reinterpret_cast<PendingCallRef*>(arg);
+  if (future->cancelled()) {
+    // Unless a racing reply has already taken it, the promise is still in
+    // pending_calls_.
+    delete ref->machine->TakePendingCall(ref->id);
+  }
+  delete ref;
+}
+
 void Machine::SendReplyMessage(Header* header, MessageBuffer* message) {
   header->set_to(header->from());
   header->set_from(machine_id());
@@ -166,7 +274,8 @@ void Machine::SendReplyMessage(Header* header, MessageBuffer* message) {
     connection_->SendMessageExternal(header, message);
     return;
   }
-  if (header->has_data_ptr() || header->has_data_channel()) {
+  if (header->has_call_id() || header->has_data_ptr() ||
+      header->has_data_channel()) {
     header->set_type(Header::DATA);
     SendMessage(header, message);
   } else if (header->has_callback_app() && header->has_callback_rpc()) {
@@ -217,22 +326,14 @@ void Machine::AddApp(const StartAppProto& sap) {
   header->set_rpc("addapp");
   // App's Start() method should run with high priority.
   header->set_priority(Header::HIGH);
-  // Request ack.
-  atomic<int> ack(0);
-  header->set_ack_counter(reinterpret_cast<uint64>(&ack));
-
-  // Send message.
-  SendMessage(header, new MessageBuffer(sap));
 
-  // Wait for ack.
-  usleep(100);
-  while (ack.load() == 0) {
-    usleep(10);
-  }
+  // Send message and wait for the reply.
+  delete Call(header, new MessageBuffer(sap)).Get();
 }
 
 void Machine::InitializeComponents() {
   thread_pool_ = new ThreadPool(new WorkerThreadMessageHandler(this));
+  thread_pool_->SetRejectHandler(new OverloadMessageHandler(this));
   connection_ = new ConnectionZMQ(
       machine_id_,
       config_,
@@ -289,3 +390,15 @@ void Machine::GlobalBarrier() {
   Spin(0.1);
 }
 
+void Machine::AddRpcClass(
+    const string& name,
+    const RpcClassOptions& options) {
+  thread_pool_->AddClass(name, options);
+}
+
+void Machine::AssignRpcClass(
+    const string& app,
+    const string& rpc,
+    const string& rpc_class) {
+  thread_pool_->AssignClass(app, rpc, rpc_class);
+}
@@ -17,8 +17,10 @@
 #include <string>
 
 #include "common/atomic.h"
+#include "common/mutex.h"
 #include "common/types.h"
 #include "machine/cluster_config.h"
+#include "machine/future.h"
 #include "proto/header.pb.h"
 #include "proto/start_app.pb.h"
 
@@ -26,6 +28,7 @@ class App;
 class Connection;
 class MessageBuffer;
 class ThreadPool;
+struct RpcClassOptions;
 
 class Machine {
  public:
@@ -57,6 +60,19 @@ class Machine {
   // '*header'. Takes ownership of both args.
   void SendMessage(Header* header, MessageBuffer* message);
 
+  // Sends an RPC request like SendMessage, and returns a future for its reply
+  // (which completes with an empty MessageBuffer if the RPC just acks, or
+  // with NULL if the destination rejects it as overloaded).
+  // Replaces any callback, ack or data_ptr response requested in '*header'
+  // (a data_channel may still be set, e.g. to identify a session, but the
+  // reply goes to the future). Takes ownership of both args.
+  //
+  // If the reply never arrives (e.g. the destination died), a waiter can use
+  // Future::Wait(timeout) and Future::Cancel() to give up on it. Waiters that
+  // give up must cancel, which frees the call's state; a reply arriving after
+  // that is dropped.
+  Future<MessageBuffer*> Call(Header* header, MessageBuffer* message);
+
   // TODO(kun): Please document this method!
   void SendReplyClient(Header* header, MessageBuffer* message);
 
@@ -105,12 +121,21 @@ class Machine {
     stop_ = true;
   }
 
-  AtomicMap<string, string>* AppData() {
+  AtomicHashMap<string, string>* AppData() {
     return &app_data_;
   }
 
   void GlobalBarrier();
 
+  // Adds an RPC class to this Machine's thread pool, and assigns an app's RPCs
+  // (or all of them, if 'rpc' is empty) to a class. See
+  // machine/thread_pool/thread_pool.h.
+  void AddRpcClass(const string& name, const RpcClassOptions& options);
+  void AssignRpcClass(
+      const string& app,
+      const string& rpc,
+      const string& rpc_class);
+
  private:
   friend class AppStarter;
   friend class Reporter;
@@ -120,6 +145,15 @@ class Machine {
   // Initialization method called by constructor.
   void InitializeComponents();
 
+  // Removes pending call 'id' (see Call) from pending_calls_ and returns its
+  // promise, which the caller must delete. Returns NULL if the call is no
+  // longer pending.
+  Promise<MessageBuffer*>* TakePendingCall(uint64 id);
+
+  // Frees a pending call once its future is cancelled ('arg' is a
+  // PendingCallRef*).
+  static void OnCallDone(Future<MessageBuffer*>* future, void* arg);
+
   // Locally adds app to the app list..
   void AddAppInternal(const StartAppProto& sap);
 
@@ -133,7 +167,7 @@ class Machine {
   ClusterConfig config_;
 
   // Apps can store shared (but machine-local) config data here.
-  AtomicMap<string, string> app_data_;
+  AtomicHashMap<string, string> app_data_;
 
   // Pool of RPC execution threads. Owned by the Machine object.
   ThreadPool* thread_pool_;
@@ -148,7 +182,7 @@ class Machine {
 
   // Collection of data message queues, each associated with a string 'channel'
   // identifier.
-  AtomicMap<string, AtomicQueue<MessageBuffer*>*> inboxes_;
+  AtomicHashMap<string, AtomicQueue<MessageBuffer*>*> inboxes_;
 
   // Globally unique ID source.
   std::atomic<uint64> next_guid_;
@@ -159,6 +193,12 @@ class Machine {
 
   uint64 next_barrier_;
 
+  // Promises for the replies to outstanding Calls, indexed by the call_id
+  // sent in each request's header.
+  map<uint64, Promise<MessageBuffer*>*> pending_calls_;
+  Mutex pending_calls_mutex_;
+  std::atomic<uint64> next_call_id_;
+
   // DISALLOW_COPY_AND_ASSIGN
   Machine(const Machine&);
   Machine& operator=(const Machine&);
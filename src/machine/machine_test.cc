@@ -93,6 +93,71 @@ REGISTER_APP(SynchronousNoop) {
   return new SynchronousNoop();
 }
 
+TEST(MachineTest, CallRemote) {
+  Machine a(0, ClusterConfig::LocalCluster(2));
+  Machine b(1, ClusterConfig::LocalCluster(2));
+  b.AddApp("SynchronousNoop", "Noop");
+
+  vector<Future<MessageBuffer*> > calls;
+  for (int i = 0; i < 10; i++) {
+    Header* header = new Header();
+    header->set_from(0);
+    header->set_to(1);
+    header->set_type(Header::RPC);
+    header->set_app("Noop");
+    header->set_rpc("noop");
+    MessageBuffer* message = new MessageBuffer(new string(IntToString(i)));
+    calls.push_back(a.Call(header, message));
+  }
+  vector<MessageBuffer*> results = WhenAll(calls).Get();
+  ASSERT_EQ(10, results.size());
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(MessageBuffer(IntToString(i)), *results[i]);
+    delete results[i];
+  }
+}
+
+// Like SynchronousNoop, but replies only after a tenth of a second.
+class DelayedNoop : public SynchronousNoop {
+ public:
+  virtual ~DelayedNoop() {}
+  virtual void HandleMessage(Header* header, MessageBuffer* message) {
+    usleep(100000);
+    SynchronousNoop::HandleMessage(header, message);
+  }
+};
+REGISTER_APP(DelayedNoop) {
+  return new DelayedNoop();
+}
+
+TEST(MachineTest, CallCancelled) {
+  Machine a(0, ClusterConfig::LocalCluster(2));
+  Machine b(1, ClusterConfig::LocalCluster(2));
+  b.AddApp("DelayedNoop", "Noop");
+
+  for (int i = 0; i < 2; i++) {
+    Header* header = new Header();
+    header->set_from(0);
+    header->set_to(1);
+    header->set_type(Header::RPC);
+    header->set_app("Noop");
+    header->set_rpc("noop");
+    Future<MessageBuffer*> reply =
+        a.Call(header, new MessageBuffer(new string(IntToString(i))));
+    if (i == 0) {
+      // Give up on the first call. Its reply is dropped when it arrives.
+      EXPECT_FALSE(reply.Wait(0.01));
+      EXPECT_TRUE(reply.Cancel());
+      EXPECT_TRUE(reply.Get() == NULL);
+    } else {
+      MessageBuffer* result = reply.Get();
+      ASSERT_TRUE(result != NULL);
+      EXPECT_EQ(MessageBuffer(IntToString(i)), *result);
+      delete result;
+    }
+  }
+}
+
 void LocalRPCBenchmark1() {
   Machine a(0, ClusterConfig::LocalCluster(1));
 
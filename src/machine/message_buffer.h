@@ -11,24 +11,32 @@
 // Data pointed to by the MessagePart, may not be deleted or modified for
 // the lifetime of the MessagePart, regardless of memory ownership.
 //
-// There are four ways to create a MessagePart:
+// There are five ways to create a MessagePart:
 //    1) give it a pointer to a buffer of which it does NOT take ownership
 //    2) give it ownership of a buffer
 //    3) give it ownership of a string (which owns a byte buffer)
 //    4) give it ownership of a zmq::message_t (which owns a byte buffer)
+//    5) give it a pointer to a buffer plus a function to call when the part
+//       is destroyed (e.g. to unpin a memory-mapped file region)
 //
 // MessageBuffers are simple collections of MessageParts. They are not
 // immutable once created since you can always append new parts to the end.
+//
+// Both are allocated from pools (see common/pool.h), and a
+// MessageBuffer stores pointers to its first few parts inline, so building
+// and freeing typical one- or two-part messages does not reach malloc.
 
 #ifndef CALVIN_MACHINE_MESSAGE_BUFFER_H_
 #define CALVIN_MACHINE_MESSAGE_BUFFER_H_
 
 #include <glog/logging.h>
 #include <google/protobuf/message.h>
+#include <string.h>
 #include <string>
 #include <vector>
 
 #include "machine/connection/zmq_cpp.h"
+#include "common/pool.h"
 #include "common/types.h"
 
 using std::vector;
@@ -38,13 +46,16 @@ enum MessagePartType {
   OWNS_BUFFER = 2,
   OWNS_STRING = 3,
   OWNS_ZMQ_MSG = 4,
+  CALLS_RELEASE = 5,
 };
 
 class MessagePart {
  public:
+  typedef void (*ReleaseFunction)(void* arg);
+
   // Constructor 1: MessagePart does NOT take ownership of the Slice.
   explicit MessagePart(const Slice& s)
-      : type_(NO_OWNERSHIP), buffer_(s), object_(NULL) {
+      : type_(NO_OWNERSHIP), buffer_(s), object_(NULL), release_(NULL) {
   }
 
   // Constructor 2: MessagePart takes ownership of (heap-allocated) buffer
@@ -52,18 +63,26 @@ class MessagePart {
   //
   // Requires: Buffer was created by a call to 'malloc', which returned 'ptr'.
   MessagePart(char* ptr, int len)
-      : type_(OWNS_BUFFER), buffer_(ptr, len), object_(NULL) {
+      : type_(OWNS_BUFFER), buffer_(ptr, len), object_(NULL), release_(NULL) {
   }
 
   // Constructor 3: MessagePart takes ownership of (heap-allocated) string.
   explicit MessagePart(string* s)
-      : type_(OWNS_STRING), buffer_(*s), object_(reinterpret_cast<void*>(s)) {
+      : type_(OWNS_STRING), buffer_(*s), object_(reinterpret_cast<void*>(s)),
+        release_(NULL) {
   }
 
   // Constructor 4: MessagePart takes ownership of (heap-allocated) zmq message.
   explicit MessagePart(zmq::message_t* m)
       : type_(OWNS_ZMQ_MSG), buffer_((const char*)m->data(), m->size()),
-        object_(reinterpret_cast<void*>(m)) {
+        object_(reinterpret_cast<void*>(m)), release_(NULL) {
+  }
+
+  // Constructor 5: MessagePart does NOT take ownership of the Slice, but
+  // calls 'release(arg)' when destroyed. The Slice must remain valid until
+  // then.
+  MessagePart(const Slice& s, ReleaseFunction release, void* arg)
+      : type_(CALLS_RELEASE), buffer_(s), object_(arg), release_(release) {
   }
 
   ~MessagePart() {
@@ -79,6 +98,9 @@ class MessagePart {
       case OWNS_ZMQ_MSG:
         delete reinterpret_cast<zmq::message_t*>(object_);
         break;
+      case CALLS_RELEASE:
+        release_(object_);
+        break;
       default:
         break;
     }
@@ -89,6 +111,13 @@ class MessagePart {
     return buffer_;
   }
 
+  static void* operator new(size_t size) {
+    return Pool<MessagePart>::Allocate(size);
+  }
+  static void operator delete(void* p, size_t size) {
+    Pool<MessagePart>::Release(p, size);
+  }
+
  private:
   // Specifies whether this message part owns memory or not, and in what form.
   MessagePartType type_;
@@ -98,9 +127,13 @@ class MessagePart {
   Slice buffer_;
 
   // Points to the string or zmq::message_t owned by the MessagePart iff
-  // constructor 3 or 4 was used. NULL otherwise.
+  // constructor 3 or 4 was used, or to the release argument iff constructor 5
+  // was used. NULL otherwise.
   void* object_;
 
+  // Function called on destruction iff constructor 5 was used.
+  ReleaseFunction release_;
+
   // DISALLOW_DEFAULT_CONSTRUCTOR
   MessagePart();
 
@@ -112,68 +145,85 @@ class MessagePart {
 class MessageBuffer {
  public:
   // Default: MessageBuffer containing no parts.
-  MessageBuffer() {}
+  MessageBuffer() {
+    Init();
+  }
 
   // 1-arg constructors for single-part MessageBuffers.
   explicit MessageBuffer(const Slice& s) {
-    parts_.push_back(new MessagePart(s));
+    Init();
+    PushPart(new MessagePart(s));
   }
   explicit MessageBuffer(char* ptr, int len) {
-    parts_.push_back(new MessagePart(ptr, len));
+    Init();
+    PushPart(new MessagePart(ptr, len));
   }
   explicit MessageBuffer(string* s) {
-    parts_.push_back(new MessagePart(s));
+    Init();
+    PushPart(new MessagePart(s));
   }
   explicit MessageBuffer(zmq::message_t* m) {
-    parts_.push_back(new MessagePart(m));
+    Init();
+    PushPart(new MessagePart(m));
   }
   explicit MessageBuffer(const google::protobuf::Message& m) {
+    Init();
     string* s = new string();
     m.SerializeToString(s);
-    parts_.push_back(new MessagePart(s));
+    PushPart(new MessagePart(s));
   }
 
   ~MessageBuffer() {
-    for (uint32 i = 0; i < parts_.size(); i++) {
+    for (uint32 i = 0; i < size_; i++) {
       if (parts_[i] != NULL) {
         delete parts_[i];
       }
     }
+    if (parts_ != inline_parts_) {
+      delete[] parts_;
+    }
+  }
+
+  static void* operator new(size_t size) {
+    return Pool<MessageBuffer>::Allocate(size);
+  }
+  static void operator delete(void* p, size_t size) {
+    Pool<MessageBuffer>::Release(p, size);
   }
 
   // Adds a part to the end of the MessageBuffer.
   inline void Append(const Slice& s) {
-    parts_.push_back(new MessagePart(s));
+    PushPart(new MessagePart(s));
   }
   inline void Append(char* ptr, int len) {
-    parts_.push_back(new MessagePart(ptr, len));
+    PushPart(new MessagePart(ptr, len));
   }
   inline void Append(string* s) {
-    parts_.push_back(new MessagePart(s));
+    PushPart(new MessagePart(s));
   }
   inline void Append(zmq::message_t* m) {
-    parts_.push_back(new MessagePart(m));
+    PushPart(new MessagePart(m));
   }
   inline void Append(const google::protobuf::Message& m) {
     string* s = new string();
     m.SerializeToString(s);
-    parts_.push_back(new MessagePart(s));
+    PushPart(new MessagePart(s));
   }
 
   // This MessageBuffer takes ownership of '*part'.
   inline void AppendPart(MessagePart* part) {
-    parts_.push_back(part);
+    PushPart(part);
   }
 
   // Returns the number of parts contained in the MessageBuffer.
   inline uint32 size() const {
-    return parts_.size();
+    return size_;
   }
 
   // Returns false iff message contains at least one part (even if that part is
   // of length 0).
   inline bool empty() const {
-    return parts_.empty();
+    return size_ == 0;
   }
 
   // Erases and removes all message parts.
@@ -185,14 +235,14 @@ class MessageBuffer {
 
   // Returns the ith message part.
   inline const Slice& operator[](uint32 i) const {
-    CHECK(i < parts_.size());
+    CHECK(i < size_);
     CHECK(parts_[i] != NULL);
     return parts_[i]->buffer();
   }
 
   // Returns the explicit MessagePart object constituting the ith part.
   inline const MessagePart& GetPart(uint32 i) const {
-    CHECK(i < parts_.size());
+    CHECK(i < size_);
     CHECK(parts_[i] != NULL);
     return *parts_[i];
   }
@@ -200,7 +250,7 @@ class MessageBuffer {
   // Caller takes ownership of the ith MessagePart. That part can no longer be
   // accessed from the MessageBuffer.
   inline MessagePart* StealPart(uint32 i) {
-    CHECK(i < parts_.size());
+    CHECK(i < size_);
     CHECK(parts_[i] != NULL);
     MessagePart* part = parts_[i];
     parts_[i] = NULL;
@@ -210,10 +260,8 @@ class MessageBuffer {
   // Caller takes ownership of the last MessagePart. That part is removed from
   // the MessageBuffer.
   inline MessagePart* PopBack() {
-    CHECK(!parts_.empty());
-    MessagePart* part = parts_.back();
-    parts_.resize(parts_.size() - 1);
-    return part;
+    CHECK(size_ != 0);
+    return parts_[--size_];
   }
 
   inline bool operator==(const MessageBuffer& other) const {
@@ -229,8 +277,34 @@ class MessageBuffer {
   }
 
  private:
-  // Parts of message.
-  vector<MessagePart*> parts_;
+  // Number of part pointers stored inline.
+  static const uint32 kInlineParts = 4;
+
+  inline void Init() {
+    parts_ = inline_parts_;
+    size_ = 0;
+    capacity_ = kInlineParts;
+  }
+
+  inline void PushPart(MessagePart* part) {
+    if (size_ == capacity_) {
+      MessagePart** parts = new MessagePart*[2 * capacity_];
+      memcpy(parts, parts_, size_ * sizeof(MessagePart*));
+      if (parts_ != inline_parts_) {
+        delete[] parts_;
+      }
+      parts_ = parts;
+      capacity_ *= 2;
+    }
+    parts_[size_++] = part;
+  }
+
+  // Parts of message. Points to 'inline_parts_' until the message has more
+  // than kInlineParts parts.
+  MessagePart** parts_;
+  uint32 size_;
+  uint32 capacity_;
+  MessagePart* inline_parts_[kInlineParts];
 
   // DISALLOW_COPY_AND_ASSIGN
   MessageBuffer(const MessageBuffer&);
@@ -5,27 +5,174 @@
 #include "machine/thread_pool/thread_pool.h"
 
 #include <glog/logging.h>
+#include <linux/futex.h>
+#include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
 #include <atomic>
-#include <queue>
+#include <climits>
+#include <deque>
+#include <string>
 #include <vector>
 #include <map>
 
 #include "machine/message_buffer.h"
+#include "machine/wire_header.h"
 #include "common/atomic.h"
 #include "common/types.h"
 #include "common/utils.h"
 #include "proto/header.pb.h"
 
+using std::deque;
 using std::make_pair;
 using std::pair;
 using std::map;
 using std::atomic;
 
+namespace {
+
+// Upper bound on the time a parked worker sleeps before rechecking whether
+// it has been stopped.
+const int kParkTimeoutUs = 100000;
+
+// Blocks while '*word' equals 'value', for at most 'timeout_us' microseconds
+// or until woken by FutexWake.
+void FutexWait(atomic<int>* word, int value, int timeout_us) {
+  struct timespec timeout;
+  timeout.tv_sec = timeout_us / 1000000;
+  timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+  syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_PRIVATE, value,
+          &timeout, NULL, 0);
+}
+
+// Wakes up to 'count' threads blocked in FutexWait on 'word'.
+void FutexWake(atomic<int>* word, int count) {
+  syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE_PRIVATE, count,
+          NULL, NULL, 0);
+}
+
+// Parses a sysfs cpu list such as "0-3,8-11" into 'cpus'.
+void ParseCpuList(const string& list, vector<int>* cpus) {
+  vector<string> ranges = SplitString(list, ',');
+  for (uint32 i = 0; i < ranges.size(); i++) {
+    int first, last;
+    int fields = sscanf(ranges[i].c_str(), "%d-%d", &first, &last);
+    if (fields == 1) {
+      last = first;
+    } else if (fields != 2) {
+      continue;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus->push_back(cpu);
+    }
+  }
+}
+
+// Returns the NUMA node of each CPU this process may run on (honoring
+// taskset/cgroup restrictions), read from the machine's topology in sysfs.
+// Every CPU is on node 0 if the kernel doesn't expose NUMA nodes.
+map<int, int> CpuNodes() {
+  map<int, int> nodes;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        nodes[cpu] = 0;
+      }
+    }
+  }
+  if (nodes.empty()) {
+    int count = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int cpu = 0; cpu < count && cpu < CPU_SETSIZE; cpu++) {
+      nodes[cpu] = 0;
+    }
+  }
+
+  for (int node = 0; node < CPU_SETSIZE; node++) {
+    string path = "/sys/devices/system/node/node" + IntToString(node) +
+                  "/cpulist";
+    FILE* f = fopen(path.c_str(), "r");
+    if (f == NULL) {
+      // Node ids can have holes; give up after a run of missing ones.
+      if (node >= 64) {
+        break;
+      }
+      continue;
+    }
+    char buf[4096];
+    string list;
+    if (fgets(buf, sizeof(buf), f) != NULL) {
+      list = buf;
+    }
+    fclose(f);
+
+    vector<int> cpus;
+    ParseCpuList(list, &cpus);
+    for (uint32 i = 0; i < cpus.size(); i++) {
+      if (nodes.count(cpus[i]) != 0) {
+        nodes[cpus[i]] = node;
+      }
+    }
+  }
+  return nodes;
+}
+
+// Returns the CPUs (and their nodes) that a pool of the given priority runs
+// on. High priority workers may use every CPU. Low priority workers leave
+// the first CPU of each node to high priority work (and to the network
+// threads), unless that would leave them nothing.
+map<int, int> PoolCpus(int priority) {
+  map<int, int> cpus = CpuNodes();
+  if (priority == 0) {
+    return cpus;
+  }
+  CHECK_EQ(1, priority) << "Bad priority";
+
+  map<int, int> low;
+  map<int, bool> seen_node;
+  for (map<int, int>::iterator it = cpus.begin(); it != cpus.end(); ++it) {
+    if (seen_node[it->second]) {
+      low.insert(*it);
+    }
+    seen_node[it->second] = true;
+  }
+  return low.empty() ? cpus : low;
+}
+
+// Returns the nice value whose Linux scheduler weight is closest to 'weight'
+// (each nice level is worth a factor of 1.25, and nice 0 is worth 1024).
+int NiceValue(int weight) {
+  CHECK_GT(weight, 0) << "Bad weight";
+  int nice = static_cast<int>(floor(log(1024.0 / weight) / log(1.25) + 0.5));
+  return std::max(-20, std::min(19, nice));
+}
+
+}  // namespace
+
+// A deque of pending messages. Workers pop from the front, whether it is their
+// home deque or one they are stealing from, so the oldest messages run first.
+struct WorkDeque {
+  Mutex mutex;
+  deque<pair<Header*, MessageBuffer*> > messages;
+
+  // NUMA node this deque's workers run on, and the pool's CPUs on it.
+  int node;
+  cpu_set_t cpus;
+};
+
 class SubPool : public MessageHandler {
  public:
-  SubPool(MessageHandler* handler, int priority);
+  SubPool(
+      MessageHandler* handler,
+      const string& name,
+      const RpcClassOptions& options);
   virtual ~SubPool();
   virtual void HandleMessage(Header* header, MessageBuffer* message);
 
@@ -37,6 +184,40 @@ class SubPool : public MessageHandler {
   // Function executed by each pthread.
   static void* RunThread(void* arg);
 
+  // Creates worker thread number 'thread'.
+  void CreateThread(int thread);
+
+  // Queues 'message'. Messages sent by one of this pool's workers go to that
+  // worker's own deque, others are spread round-robin over all deques. Wakes
+  // a parked worker if there is one.
+  void Push(const pair<Header*, MessageBuffer*>& message);
+
+  // Reserves one of the class's max_running_ slots for the calling worker.
+  // Returns false if they are all in use.
+  bool AcquireSlot();
+
+  // Frees a slot reserved by AcquireSlot, waking a worker if messages are
+  // waiting for it.
+  void ReleaseSlot();
+
+  // Asks one worker to exit, and returns its thread number once it has.
+  int KillThread();
+
+  // Pops a message from deque 'home' or, if it is empty, steals one from
+  // another deque (on the same NUMA node first). Returns false if there are
+  // no queued messages.
+  bool Take(int home, pair<Header*, MessageBuffer*>* message);
+
+  // Blocks the calling worker until a message it may run is pushed, a slot
+  // frees up, or a worker is asked to exit (or a timeout).
+  void Park();
+
+  // Wakes all parked workers.
+  void WakeAll();
+
+  // Total number of queued messages.
+  int Queued();
+
   // Total number of threads.
   int Thread_count();
 
@@ -50,6 +231,9 @@ class SubPool : public MessageHandler {
   // Handler used by worker threads.
   MessageHandler* handler_;
 
+  // Name of the RPC class this pool serves.
+  string name_;
+
   int thread_count_;
   // Idle thread count of the subPool
   atomic<int> idle_thread_count_;
@@ -63,14 +247,47 @@ class SubPool : public MessageHandler {
   // The priority of the subPool, 0: high, 1: low
   int priority_;
 
+  // Nice value of the pool's workers, derived from the class weight.
+  int nice_;
+
+  // Concurrency and queue limits (0: unlimited), the number of messages
+  // currently running, and the number of messages rejected.
+  int max_running_;
+  int max_queued_;
+  atomic<int> running_;
+  atomic<int64> rejected_;
+
+  // Number of workers asked to exit but not yet exiting.
+  atomic<int> kill_requests_;
+
   bool stopped_all_;
 
   int assigned_thread_count_;
 
-  // RPC/message queue.
-  AtomicQueue<pair<Header*, MessageBuffer*> > queue_;
+  // RPC/message deques, grouped by NUMA node. Worker thread i's home is
+  // deques_[i % deques_.size()].
+  vector<WorkDeque*> deques_;
+
+  // steal_order_[d] lists every deque index, starting with d, then the
+  // other deques on d's node, then deques on other nodes.
+  vector<vector<int> > steal_order_;
+
+  // Round-robin cursor for messages pushed by non-worker threads.
+  atomic<uint32> next_deque_;
+
+  // Number of messages pushed but not yet taken. Incremented before the
+  // message is pushed, so a worker that sees zero after announcing itself
+  // in sleepers_ can't miss a concurrent Push's wakeup.
+  atomic<int> pending_;
 
+  // Number of parked workers, and the futex word they park on.
+  atomic<int> sleepers_;
+  atomic<int> wake_seq_;
+
+  // Workers that exited at a KillThread request, and a futex word bumped
+  // after each is pushed, on which KillThread parks.
   AtomicQueue<int> deleted_threads_;
+  atomic<int> deleted_seq_;
 
   // DISALLOW_DEFAULT_CONSTRUCTOR
   SubPool();
@@ -80,12 +297,30 @@ class SubPool : public MessageHandler {
   SubPool& operator=(const SubPool&);
 };
 
+namespace {
+
+// The pool (if any) whose worker is the calling thread, and that worker's
+// home deque.
+__thread SubPool* current_pool = NULL;
+__thread int current_deque = 0;
+
+}  // namespace
+
 /////////////////////ThreadPool implementation/////////////////////////////
 
 ThreadPool::ThreadPool(MessageHandler* handler) {
   handler_ = handler;
-  high_ = new SubPool(handler, 0);
-  low_ = new SubPool(handler, 1);
+  reject_handler_ = NULL;
+  assignment_count_ = 0;
+  RpcClassOptions options;
+  options.min_idle = 32;
+  options.max_idle = 48;
+  options.priority = 0;
+  high_ = new SubPool(handler, "high", options);
+  options.priority = 1;
+  low_ = new SubPool(handler, "low", options);
+  classes_["high"] = high_;
+  classes_["low"] = low_;
 
   stopped_all_ = false;
 
@@ -95,57 +330,137 @@ ThreadPool::ThreadPool(MessageHandler* handler) {
   pthread_attr_init(&attr);
   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
   CPU_ZERO(&cpuset);
-  for (int i = 0; i < 8; i++) {
-    CPU_SET(i, &cpuset);
+  map<int, int> cpus = PoolCpus(0);
+  for (map<int, int>::iterator it = cpus.begin(); it != cpus.end(); ++it) {
+    CPU_SET(it->first, &cpuset);
   }
   pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
   pthread_create(&monitor_thread_,
                  &attr,
                  MonitorThread,
                  reinterpret_cast<void*>(this));
+  pthread_attr_destroy(&attr);
 }
 
 void ThreadPool::HandleMessage(Header* header, MessageBuffer* message) {
-  switch (header->priority()) {
+  SubPool* pool = Classify(*header);
+
+  // Admission control.
+  if (pool->max_queued_ > 0 && header->type() == Header::RPC &&
+      pool->Queued() >= pool->max_queued_) {
+    ++pool->rejected_;
+    if (reject_handler_ != NULL) {
+      reject_handler_->HandleMessage(header, message);
+    } else {
+      delete header;
+      delete message;
+    }
+    return;
+  }
+  pool->HandleMessage(header, message);
+}
+
+SubPool* ThreadPool::Classify(const Header& header) {
+  if (assignment_count_ > 0 && (header.has_app() || header.has_app_id())) {
+    uint64 app = static_cast<uint64>(AppID(header)) << 32;
+    SubPool* pool;
+    if (assignments_.Lookup(app | RpcID(header), &pool) ||
+        assignments_.Lookup(app | WireID(""), &pool)) {
+      return pool;
+    }
+  }
+  switch (header.priority()) {
     case Header::HIGH:
-      high_->HandleMessage(header, message);
-      break;
+      return high_;
     case Header::LOW:
-      low_->HandleMessage(header, message);
-      break;
+      return low_;
     default:
       LOG(FATAL) << "Bad priority";
-      break;
+      return NULL;
   }
 }
 
+void ThreadPool::AddClass(
+    const string& name,
+    const RpcClassOptions& options) {
+  Lock l(&classes_mutex_);
+  CHECK_EQ(0, classes_.count(name)) << "RPC class exists: " << name;
+  classes_[name] = new SubPool(handler_, name, options);
+}
+
+void ThreadPool::AssignClass(
+    const string& app,
+    const string& rpc,
+    const string& rpc_class) {
+  SubPool* pool;
+  {
+    Lock l(&classes_mutex_);
+    CHECK_NE(0, classes_.count(rpc_class)) << "No RPC class: " << rpc_class;
+    pool = classes_[rpc_class];
+  }
+  assignments_.Put(
+      (static_cast<uint64>(WireID(app.c_str())) << 32) | WireID(rpc.c_str()),
+      pool);
+  ++assignment_count_;
+}
+
+void ThreadPool::SetRejectHandler(MessageHandler* handler) {
+  CHECK(reject_handler_ == NULL);
+  reject_handler_ = handler;
+}
+
+int ThreadPool::Queued(const string& rpc_class) {
+  Lock l(&classes_mutex_);
+  CHECK_NE(0, classes_.count(rpc_class)) << "No RPC class: " << rpc_class;
+  return classes_[rpc_class]->Queued();
+}
+
 ThreadPool::~ThreadPool() {
   // Stop Monitor thread
   stopped_all_ = true;
   pthread_join(monitor_thread_, NULL);
   // Delete subPools
-  delete high_;
-  delete low_;
-  // Delete handler.
+  for (map<string, SubPool*>::iterator it = classes_.begin();
+       it != classes_.end(); ++it) {
+    delete it->second;
+  }
+  // Delete handlers.
   delete handler_;
+  delete reject_handler_;
 }
 
 ////////////////////////SubPool implementation/////////////////////////////
 
 void SubPool::HandleMessage(Header* header, MessageBuffer* message) {
   CHECK(!stopped_all_) << "Stopped thread pool asked to handle message.";
-  queue_.Push(make_pair(header, message));
+  Push(make_pair(header, message));
 }
 
-SubPool::SubPool(MessageHandler* handler, int priority) {
+SubPool::SubPool(
+    MessageHandler* handler,
+    const string& name,
+    const RpcClassOptions& options) {
   handler_ = handler;
-  priority_ = priority;
-  min_idle_ = 32;
-  max_idle_ = 48;
+  name_ = name;
+  priority_ = options.priority;
+  nice_ = NiceValue(options.weight);
+  max_running_ = options.max_running;
+  max_queued_ = options.max_queued;
+  running_ = 0;
+  rejected_ = 0;
+  kill_requests_ = 0;
+  min_idle_ = options.min_idle;
+  max_idle_ = options.max_idle;
+  CHECK(min_idle_ > 0 && max_idle_ >= min_idle_) << "Bad idle thread bounds";
   thread_count_ = min_idle_;
   idle_thread_count_ = 0;
   assigned_thread_count_ = thread_count_;
   stopped_all_ = false;
+  next_deque_ = 0;
+  pending_ = 0;
+  sleepers_ = 0;
+  wake_seq_ = 0;
+  deleted_seq_ = 0;
   for (int i = 0; i < thread_count_; i++) {
     stopped_[i] = false;
   }
@@ -159,49 +474,176 @@ SubPool::~SubPool() {
   for (int i = 0; i < assigned_thread_count_; i++) {
     if (stopped_.count(i) > 0) {
       stopped_[i] = true;
+    }
+  }
+  WakeAll();
+  for (int i = 0; i < assigned_thread_count_; i++) {
+    if (stopped_.count(i) > 0) {
       pthread_join(threads_[i], NULL);
     }
   }
+  for (uint32 i = 0; i < deques_.size(); i++) {
+    delete deques_[i];
+  }
 }
 
 void SubPool::Start() {
-  cpu_set_t cpuset;
-  pthread_attr_t attr;
-  pthread_attr_init(&attr);
-  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-  switch (priority_) {
-    case 0:
-      // High priority threads can use all 8 cores
-      CPU_ZERO(&cpuset);
-      for (int i = 0; i < 8; i++) {
-        CPU_SET(i, &cpuset);
-      }
-      break;
-    case 1:
-      // Low priority threads can use 6 cores
-      CPU_ZERO(&cpuset);
-      for (int i = 1; i < 4; i++) {
-        CPU_SET(i, &cpuset);
+  // One deque per CPU the pool runs on (but no more deques than the pool
+  // keeps idle threads, so each starts out with a worker), spread over NUMA
+  // nodes in proportion to their CPUs.
+  map<int, int> cpu_nodes = PoolCpus(priority_);
+  vector<pair<int, int> > cpus;  // (node, cpu)
+  for (map<int, int>::iterator it = cpu_nodes.begin();
+       it != cpu_nodes.end(); ++it) {
+    cpus.push_back(make_pair(it->second, it->first));
+  }
+  sort(cpus.begin(), cpus.end());
+
+  int deque_count = std::min(static_cast<int>(cpus.size()), min_idle_);
+  for (int i = 0; i < deque_count; i++) {
+    WorkDeque* d = new WorkDeque();
+    d->node = cpus[i * cpus.size() / deque_count].first;
+    CPU_ZERO(&d->cpus);
+    for (uint32 j = 0; j < cpus.size(); j++) {
+      if (cpus[j].first == d->node) {
+        CPU_SET(cpus[j].second, &d->cpus);
       }
-      for (int i = 5; i < 8; i++) {
-        CPU_SET(i, &cpuset);
+    }
+    deques_.push_back(d);
+  }
+
+  // Steal from neighbors on the same node (starting with the next one, so
+  // thieves spread out) before going to remote nodes.
+  steal_order_.resize(deque_count);
+  for (int i = 0; i < deque_count; i++) {
+    for (int remote = 0; remote < 2; remote++) {
+      for (int j = 0; j < deque_count; j++) {
+        int d = (i + j) % deque_count;
+        if ((deques_[d]->node != deques_[i]->node) == remote) {
+          steal_order_[i].push_back(d);
+        }
       }
-      break;
-    default:
-      LOG(FATAL) << "Bad priority";
-      break;
+    }
   }
 
-  pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
   for (int i = 0; i < thread_count_; i++) {
-    threads_[i] = (pthread_t)0;
-    pthread_create(&threads_[i],
-                   &attr,
-                   RunThread,
-                   new pair<int, SubPool*>(i, this));
+    CreateThread(i);
   }
 }
 
+void SubPool::CreateThread(int thread) {
+  // Workers run anywhere on their home deque's node.
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+  pthread_attr_setaffinity_np(&attr,
+                              sizeof(cpu_set_t),
+                              &deques_[thread % deques_.size()]->cpus);
+  threads_[thread] = (pthread_t)0;
+  stopped_[thread] = false;
+  pthread_create(&threads_[thread],
+                 &attr,
+                 RunThread,
+                 new pair<int, SubPool*>(thread, this));
+  pthread_attr_destroy(&attr);
+}
+
+void SubPool::Push(const pair<Header*, MessageBuffer*>& message) {
+  int d;
+  if (current_pool == this) {
+    d = current_deque;
+  } else {
+    d = next_deque_++ % deques_.size();
+  }
+
+  ++pending_;
+  {
+    Lock l(&deques_[d]->mutex);
+    deques_[d]->messages.push_back(message);
+  }
+  if (sleepers_ > 0) {
+    ++wake_seq_;
+    FutexWake(&wake_seq_, 1);
+  }
+}
+
+bool SubPool::AcquireSlot() {
+  if (max_running_ == 0) {
+    return true;
+  }
+  int running = running_;
+  while (running < max_running_) {
+    if (running_.compare_exchange_weak(running, running + 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void SubPool::ReleaseSlot() {
+  if (max_running_ == 0) {
+    return;
+  }
+  --running_;
+  if (pending_ > 0 && sleepers_ > 0) {
+    ++wake_seq_;
+    FutexWake(&wake_seq_, 1);
+  }
+}
+
+int SubPool::KillThread() {
+  ++kill_requests_;
+  ++wake_seq_;
+  FutexWake(&wake_seq_, 1);
+  int deleted_thread;
+  while (true) {
+    int seq = deleted_seq_;
+    if (deleted_threads_.Pop(&deleted_thread)) {
+      return deleted_thread;
+    }
+    // Wait for a thread to die.
+    FutexWait(&deleted_seq_, seq, kParkTimeoutUs);
+  }
+}
+
+bool SubPool::Take(int home, pair<Header*, MessageBuffer*>* message) {
+  if (pending_ == 0) {
+    return false;
+  }
+  const vector<int>& order = steal_order_[home];
+  for (uint32 i = 0; i < order.size(); i++) {
+    WorkDeque* d = deques_[order[i]];
+    Lock l(&d->mutex);
+    if (!d->messages.empty()) {
+      *message = d->messages.front();
+      d->messages.pop_front();
+      --pending_;
+      return true;
+    }
+  }
+  return false;
+}
+
+void SubPool::Park() {
+  int seq = wake_seq_;
+  ++sleepers_;
+  bool blocked = pending_ == 0 ||
+                 (max_running_ > 0 && running_ >= max_running_);
+  if (blocked && kill_requests_ == 0 && !stopped_all_) {
+    FutexWait(&wake_seq_, seq, kParkTimeoutUs);
+  }
+  --sleepers_;
+}
+
+void SubPool::WakeAll() {
+  ++wake_seq_;
+  FutexWake(&wake_seq_, INT_MAX);
+}
+
+int SubPool::Queued() {
+  return pending_;
+}
+
 int SubPool::Thread_count() {
   return thread_count_;
 }
@@ -218,42 +660,50 @@ void SubPool::Resize_thread_count(int n) {
 void* SubPool::RunThread(void* arg) {
   int thread = reinterpret_cast<pair<int, SubPool*>*>(arg)->first;
   SubPool* tp = reinterpret_cast<pair<int, SubPool*>*>(arg)->second;
+  delete reinterpret_cast<pair<int, SubPool*>*>(arg);
+  int home = thread % tp->deques_.size();
+  current_pool = tp;
+  current_deque = home;
   pair<Header*, MessageBuffer*> message;
-  int sleep_duration = 1;  // in microseconds
+
+  // Apply the class weight. (Fails harmlessly for weights above normal
+  // without CAP_SYS_NICE.)
+  if (tp->nice_ != 0) {
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), tp->nice_);
+  }
 
   ++tp->idle_thread_count_;
   while (!tp->stopped_[thread]) {
-    if (tp->queue_.Pop(&message)) {
-      if (message.first == NULL) {
-        // Tell the monitor thread that I am going to die and should be deleted.
-        tp->deleted_threads_.Push(thread);
-        // Die.
+    int kill_requests = tp->kill_requests_;
+    if (kill_requests > 0 &&
+        tp->kill_requests_.compare_exchange_strong(kill_requests,
+                                                   kill_requests - 1)) {
+      // Tell the monitor thread that I am going to die and should be deleted.
+      tp->deleted_threads_.Push(thread);
+      ++tp->deleted_seq_;
+      FutexWake(&tp->deleted_seq_, INT_MAX);
+      // Die.
+      --tp->idle_thread_count_;
+      return NULL;
+    }
+    if (tp->AcquireSlot()) {
+      if (tp->Take(home, &message)) {
         --tp->idle_thread_count_;
-        return NULL;
+        tp->handler_->HandleMessage(message.first, message.second);
+        ++tp->idle_thread_count_;
+        tp->ReleaseSlot();
+        continue;
       }
-      --tp->idle_thread_count_;
-      tp->handler_->HandleMessage(message.first, message.second);
-      // Reset backoff.
-      sleep_duration = 1;
-      ++tp->idle_thread_count_;
-    } else {
-      usleep(sleep_duration);
-      // Back off exponentially.
-      if (sleep_duration < 64)
-        sleep_duration *= 2;
+      tp->ReleaseSlot();
     }
+    tp->Park();
   }
 
   // Go through ALL queues looking for remaining requests until there are none.
   if (tp->stopped_all_) {
-    bool found_request = false;
-    do {
-      found_request = false;
-      if (tp->queue_.Pop(&message)) {
-        found_request = true;
-        tp->handler_->HandleMessage(message.first, message.second);
-      }
-    } while (found_request);
+    while (tp->Take(home, &message)) {
+      tp->handler_->HandleMessage(message.first, message.second);
+    }
   }
   --tp->idle_thread_count_;
   return NULL;
@@ -262,19 +712,21 @@ void* SubPool::RunThread(void* arg) {
 // Show the current SubPool status(total threads, idle threads count and
 // queue size).
 void ThreadPool::ShowStatus() {
-  LOG(ERROR) << "Status H:   idle threads: " << high_->idle_thread_count_.load()
-             << ", total threads: " << high_->thread_count_ << ", queue size: "
-             << high_->queue_.Size();
-  LOG(ERROR) << "Status L:   idle threads: " << low_->idle_thread_count_.load()
-             << ", total threads: " << low_->thread_count_ << ", queue size: "
-             << low_->queue_.Size();
+  Lock l(&classes_mutex_);
+  for (map<string, SubPool*>::iterator it = classes_.begin();
+       it != classes_.end(); ++it) {
+    SubPool* pool = it->second;
+    LOG(ERROR) << "Status " << it->first << ":   idle threads: "
+               << pool->idle_thread_count_.load() << ", total threads: "
+               << pool->thread_count_ << ", queue size: " << pool->Queued()
+               << ", running: " << pool->running_.load() << ", rejected: "
+               << pool->rejected_.load();
+  }
   LOG(ERROR) << "";
 }
 
 void* ThreadPool::MonitorThread(void* arg) {
   ThreadPool* tp = reinterpret_cast<ThreadPool*>(arg);
-  SubPool* high = tp->high_;
-  SubPool* low = tp->low_;
 
   usleep(1000*400);
 
@@ -282,92 +734,34 @@ void* ThreadPool::MonitorThread(void* arg) {
     // Show the SubPools status.
 //  tp->ShowStatus();
 
-    // Check high priority threads
-    if (high->idle_thread_count_ < high->min_idle_) {
-      // Need to create some threads
-      int add_thread_count = 4;
-      // Set affinity
-      cpu_set_t cpuset;
-      pthread_attr_t attr;
-      pthread_attr_init(&attr);
-      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-      CPU_ZERO(&cpuset);
-      for (int i = 0; i < 8; i++) {
-        CPU_SET(i, &cpuset);
-      }
-      pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
-
-      for (int i = 0; i < add_thread_count; i++) {
-        high->threads_[high->assigned_thread_count_ + i] = (pthread_t)0;
-        high->stopped_[high->assigned_thread_count_ + i] = false;
-        pthread_create(&high->threads_[high->assigned_thread_count_ + i],
-                       &attr,
-                       SubPool::RunThread,
-                       new pair<int, SubPool*>(high->assigned_thread_count_ + i,
-                                               high));
-      }
-      high->Resize_thread_count(high->Thread_count() + add_thread_count);
-      high->assigned_thread_count_ += add_thread_count;
-
-    } else if (high->idle_thread_count_ > high->max_idle_) {
-      // Need to delete some threads
-      int delete_thread_count = 4;
-      for (int i = 0; i < delete_thread_count; i++) {
-        high->queue_.Push(pair<Header*, MessageBuffer*>(NULL, NULL));
-        int deleted_thread;
-        while (!high->deleted_threads_.Pop(&deleted_thread)) {
-          // wait for a thread to die
+    {
+      Lock l(&tp->classes_mutex_);
+      for (map<string, SubPool*>::iterator it = tp->classes_.begin();
+           it != tp->classes_.end(); ++it) {
+        SubPool* pool = it->second;
+        if (pool->idle_thread_count_ < pool->min_idle_) {
+          // Need to create some threads
+          int add_thread_count = 4;
+          for (int i = 0; i < add_thread_count; i++) {
+            pool->CreateThread(pool->assigned_thread_count_ + i);
+          }
+          pool->Resize_thread_count(pool->Thread_count() + add_thread_count);
+          pool->assigned_thread_count_ += add_thread_count;
+
+        } else if (pool->idle_thread_count_ > pool->max_idle_) {
+          // Need to delete some threads (but keep at least min_idle_).
+          int delete_thread_count =
+              std::min(4, pool->idle_thread_count_ - pool->min_idle_);
+          for (int i = 0; i < delete_thread_count; i++) {
+            int deleted_thread = pool->KillThread();
+            pthread_join(pool->threads_[deleted_thread], NULL);
+            pool->threads_.erase(deleted_thread);
+            pool->stopped_.erase(deleted_thread);
+          }
+          pool->Resize_thread_count(
+              pool->thread_count_ - delete_thread_count);
         }
-        pthread_join(high->threads_[deleted_thread], NULL);
-        high->threads_.erase(deleted_thread);
-        high->stopped_.erase(deleted_thread);
       }
-      high->Resize_thread_count(high->thread_count_ - delete_thread_count);
-    }
-
-    // Check low priority threads
-    if (low->idle_thread_count_ < low->min_idle_) {
-      // Need to create some threads
-      int add_thread_count = 4;
-
-      cpu_set_t cpuset;
-      pthread_attr_t attr;
-      pthread_attr_init(&attr);
-      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-      CPU_ZERO(&cpuset);
-      for (int i = 1; i < 4; i++) {
-        CPU_SET(i, &cpuset);
-      }
-      for (int i = 5; i < 8; i++) {
-        CPU_SET(i, &cpuset);
-      }
-      pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
-
-      for (int i = 0; i < add_thread_count; i++) {
-        low->threads_[low->assigned_thread_count_ + i] = (pthread_t)0;
-        low->stopped_[low->assigned_thread_count_ + i] = false;
-        pthread_create(&low->threads_[low->assigned_thread_count_ + i],
-                       &attr,
-                       SubPool::RunThread,
-                       new pair<int, SubPool*>(low->assigned_thread_count_ + i,
-                                               low));
-      }
-      low->Resize_thread_count(low->Thread_count() + add_thread_count);
-      low->assigned_thread_count_ += add_thread_count;
-    } else if (low->idle_thread_count_ > low->max_idle_) {
-      // Need to delete some threads
-      int delete_thread_count = 4;
-      for (int i = 0; i < delete_thread_count; i++) {
-        low->queue_.Push(pair<Header*, MessageBuffer*>(NULL, NULL));
-        int deleted_thread;
-        while (!low->deleted_threads_.Pop(&deleted_thread)) {
-          // wait for a thread to die
-        }
-        pthread_join(low->threads_[deleted_thread], NULL);
-        low->threads_.erase(deleted_thread);
-        low->stopped_.erase(deleted_thread);
-      }
-      low->Resize_thread_count(low->thread_count_ - delete_thread_count);
     }
 
     // sleep for 1/100th of a second
@@ -375,4 +769,3 @@ void* ThreadPool::MonitorThread(void* arg) {
   }
   return NULL;
 }
-
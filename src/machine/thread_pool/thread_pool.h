@@ -5,38 +5,139 @@
 // executing RPCs. Since the number of threads can grow dynamically, there is
 // no risk ofdeadlock.
 //
+// Each priority level's workers share a set of work-stealing deques, one per
+// CPU (up to the minimum idle thread count), grouped by NUMA node. Workers
+// pop from their home deque and steal from others when it is empty, first
+// on their own node. Idle workers park on a futex and are woken by Push, so
+// an idle pool costs no CPU and a new RPC starts running without waiting out
+// a polling interval. Worker threads are pinned to the CPUs of their home
+// deque's node, as read from the machine's topology.
+//
+// Each sub-pool serves one RPC class. Two classes always exist: "high" and
+// "low", which serve messages by Header::priority. Further classes, each with
+// its own queue, workers, CPU weight, concurrency limit and queue limit, can
+// be added, and individual apps or RPCs assigned to them, e.g. so that Paxos
+// and lock-release traffic doesn't wait behind client reads:
+//
+//   RpcClassOptions critical;
+//   critical.weight = 4096;
+//   tp->AddClass("critical", critical);
+//   tp->AssignClass("paxos2", "", "critical");
+//
+//   RpcClassOptions clients;
+//   clients.max_running = 16;
+//   clients.max_queued = 1000;
+//   tp->AddClass("clients", clients);
+//   tp->AssignClass("client", "READ_FILE", "clients");
+//
+// When a class's queue is full, new RPC requests of that class are not
+// queued but passed to the reject handler (if one is set), which should tell
+// the sender that the machine is overloaded. (Machines reply with status
+// Header::OVERLOADED.)
+//
 
 #ifndef CALVIN_MACHINE_THREAD_POOL_THREAD_POOL_H_
 #define CALVIN_MACHINE_THREAD_POOL_THREAD_POOL_H_
 
 #include <pthread.h>
+#include <atomic>
+#include <map>
+#include <string>
 #include <vector>
 #include <utility>
 
 #include "machine/message_handler.h"
 #include "common/atomic.h"
+#include "common/mutex.h"
 #include "common/types.h"
 
+using std::atomic;
+using std::map;
 using std::pair;
+using std::string;
 using std::vector;
 
 class Header;
 class MessageBuffer;
 class SubPool;
 
+// Scheduling parameters of an RPC class.
+struct RpcClassOptions {
+  RpcClassOptions()
+      : priority(0), weight(1024), max_running(0), max_queued(0),
+        min_idle(8), max_idle(16) {
+  }
+
+  // CPU placement, as for the default classes. 0: any CPU; 1: leaves the
+  // first CPU of each NUMA node to priority-0 classes.
+  int priority;
+
+  // Relative CPU share of the class's workers when CPUs are contended, in
+  // Linux scheduler units: 1024 is a normal thread's share, 256 a quarter of
+  // it. Weights above 1024 require CAP_SYS_NICE (and act as 1024 without it).
+  int weight;
+
+  // Maximum number of the class's messages handled at once. 0: no limit.
+  //
+  // NOTE: A limited class must not contain RPCs that block waiting for other
+  // RPCs of the same class on this machine, or it can deadlock.
+  int max_running;
+
+  // Maximum number of the class's messages waiting to be handled. Further RPC
+  // requests are rejected. (Callbacks are always queued.) 0: no limit.
+  int max_queued;
+
+  // Bounds on the number of idle workers the class keeps.
+  int min_idle;
+  int max_idle;
+};
+
 class ThreadPool : public MessageHandler {
  public:
   explicit ThreadPool(MessageHandler* handler);
   virtual ~ThreadPool();
   virtual void HandleMessage(Header* header, MessageBuffer* message);
 
+  // Adds an RPC class named 'name' and starts its workers. Dies if the class
+  // already exists.
+  void AddClass(const string& name, const RpcClassOptions& options);
+
+  // Handles RPC 'rpc' of app instance 'app' (or all of its RPCs and callbacks
+  // if 'rpc' is empty) in the class named 'rpc_class'. Assignments of single
+  // RPCs take precedence over whole apps.
+  void AssignClass(
+      const string& app,
+      const string& rpc,
+      const string& rpc_class);
+
+  // Sets the handler to which messages rejected by admission control are
+  // passed (instead of being deleted). Takes ownership of 'handler'.
+  void SetRejectHandler(MessageHandler* handler);
+
+  // Returns the number of messages queued in class 'rpc_class'.
+  int Queued(const string& rpc_class);
+
  private:
   static void* MonitorThread(void* arg);
   void ShowStatus();
+
+  // Returns the class that handles '*header'.
+  SubPool* Classify(const Header& header);
+
   SubPool* high_;
   SubPool* low_;
 
+  // All classes, by name. Guarded by 'classes_mutex_'.
+  map<string, SubPool*> classes_;
+  Mutex classes_mutex_;
+
+  // Class assignments, keyed by app id and rpc id (see Classify), and their
+  // number.
+  AtomicHashMap<uint64, SubPool*> assignments_;
+  atomic<int> assignment_count_;
+
   MessageHandler* handler_;
+  MessageHandler* reject_handler_;
   bool stopped_all_;
 
   pthread_t monitor_thread_;
@@ -6,6 +6,7 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 #include <atomic>
+#include <map>
 #include <set>
 #include <string>
 #include <algorithm>
@@ -17,6 +18,7 @@
 #include "proto/scalar.pb.h"
 
 using std::atomic;
+using std::map;
 using std::set;
 
 DEFINE_bool(benchmark, false, "Run benchmarks instead of unit tests.");
@@ -245,6 +247,93 @@ class BenchmarkMessageHandler : public MessageHandler {
   double low_duration_;
 };
 
+// This MessageHandler is used by Nested submission test. Each "fork" message
+// with depth d > 0 submits two messages of depth d - 1 to the pool from the
+// worker running it.
+class ForkMessageHandler : public MessageHandler {
+ public:
+  ForkMessageHandler() : tp_(NULL), counter_(0) {}
+  virtual ~ForkMessageHandler() {}
+  virtual void HandleMessage(Header* header, MessageBuffer* message) {
+    int depth = header->misc_int(0);
+    if (depth > 0) {
+      for (int i = 0; i < 2; i++) {
+        Header* child = new Header(*header);
+        child->set_misc_int(0, depth - 1);
+        tp_->HandleMessage(child, new MessageBuffer());
+      }
+    }
+    ++counter_;
+    delete header;
+    delete message;
+  }
+  void set_thread_pool(ThreadPool* tp) {
+    tp_ = tp;
+  }
+  int counter() const {
+    return counter_;
+  }
+
+ private:
+  ThreadPool* tp_;
+  atomic<int> counter_;
+};
+
+// This MessageHandler is used by RPC class tests. It records how many
+// messages of each RPC it handled, and the most "slow" messages that ran at
+// once. "slow" messages wait until released.
+class ClassTestHandler : public MessageHandler {
+ public:
+  ClassTestHandler() : hold_(true), running_(0), max_running_(0) {}
+  virtual ~ClassTestHandler() {}
+  virtual void HandleMessage(Header* header, MessageBuffer* message) {
+    if (header->rpc() == "slow") {
+      int running = ++running_;
+      int max = max_running_;
+      while (running > max &&
+             !max_running_.compare_exchange_weak(max, running)) {
+      }
+      while (hold_.load()) {
+        usleep(100);
+      }
+      --running_;
+    }
+    {
+      Lock l(&mutex_);
+      counts_[header->rpc()]++;
+    }
+    delete header;
+    delete message;
+  }
+  int count(const string& rpc) {
+    Lock l(&mutex_);
+    return counts_[rpc];
+  }
+  int running() const {
+    return running_;
+  }
+  int max_running() const {
+    return max_running_;
+  }
+  void release() {
+    hold_ = false;
+  }
+
+ private:
+  atomic<bool> hold_;
+  atomic<int> running_;
+  atomic<int> max_running_;
+  map<string, int> counts_;
+  Mutex mutex_;
+};
+
+Header* ClassTestHeader(const string& app, const string& rpc) {
+  Header* header = new Header();
+  header->set_type(Header::RPC);
+  header->set_app(app);
+  header->set_rpc(rpc);
+  return header;
+}
 
 ///////////////////////////Correctness test///////////////////////////////////
 
@@ -355,6 +444,100 @@ TEST(ThreadPoolTest, ThreadPoolDeleteCreateTest) {
   delete tp_3;
 }
 
+///////////////////Nested submission test///////////////////////////////////
+
+TEST(ThreadPoolTest, NestedSubmission) {
+  // Messages pushed by workers go to their own deques and must be stolen by
+  // other workers, including ones that parked while the pool was idle.
+  ForkMessageHandler* handler = new ForkMessageHandler();
+  ThreadPool* tp = new ThreadPool(handler);
+  handler->set_thread_pool(tp);
+  usleep(100000);
+
+  int depth = 12;
+  for (int i = 0; i < 2; i++) {
+    Header* header = new Header();
+    header->set_priority(i == 0 ? Header::HIGH : Header::LOW);
+    header->add_misc_int(depth);
+    tp->HandleMessage(header, new MessageBuffer());
+  }
+
+  // Each root message results in 2^(depth+1) - 1 messages.
+  int expected = 2 * ((2 << depth) - 1);
+  while (handler->counter() < expected) {
+    usleep(10);
+  }
+  usleep(100000);
+  EXPECT_EQ(expected, handler->counter());
+  delete tp;
+}
+
+///////////////////////////RPC class tests///////////////////////////////////
+
+TEST(ThreadPoolTest, ClassConcurrencyLimit) {
+  ClassTestHandler* handler = new ClassTestHandler();
+  ThreadPool* tp = new ThreadPool(handler);
+  RpcClassOptions options;
+  options.max_running = 2;
+  tp->AddClass("limited", options);
+  tp->AssignClass("app", "slow", "limited");
+
+  for (int i = 0; i < 20; i++) {
+    tp->HandleMessage(ClassTestHeader("app", "slow"), new MessageBuffer());
+  }
+  // Other RPCs of the app are not limited, and don't wait behind "slow" ones.
+  for (int i = 0; i < 20; i++) {
+    tp->HandleMessage(ClassTestHeader("app", "fast"), new MessageBuffer());
+  }
+  while (handler->count("fast") < 20) {
+    usleep(100);
+  }
+  EXPECT_EQ(2, handler->running());
+  EXPECT_EQ(18, tp->Queued("limited"));
+
+  handler->release();
+  while (handler->count("slow") < 20) {
+    usleep(100);
+  }
+  EXPECT_EQ(2, handler->max_running());
+  delete tp;
+}
+
+TEST(ThreadPoolTest, AdmissionControl) {
+  ClassTestHandler* handler = new ClassTestHandler();
+  ClassTestHandler* rejected = new ClassTestHandler();
+  rejected->release();
+  ThreadPool* tp = new ThreadPool(handler);
+  tp->SetRejectHandler(rejected);
+  RpcClassOptions options;
+  options.max_running = 1;
+  options.max_queued = 5;
+  tp->AddClass("clients", options);
+  tp->AssignClass("client", "", "clients");
+
+  tp->HandleMessage(ClassTestHeader("client", "slow"), new MessageBuffer());
+  while (handler->running() == 0) {
+    usleep(100);
+  }
+  for (int i = 0; i < 10; i++) {
+    tp->HandleMessage(ClassTestHeader("client", "slow"), new MessageBuffer());
+  }
+  EXPECT_EQ(5, tp->Queued("clients"));
+  EXPECT_EQ(5, rejected->count("slow"));
+
+  // Callbacks are always admitted.
+  Header* callback = ClassTestHeader("client", "cb");
+  callback->set_type(Header::CALLBACK);
+  tp->HandleMessage(callback, new MessageBuffer());
+
+  handler->release();
+  while (handler->count("slow") < 6 || handler->count("cb") < 1) {
+    usleep(100);
+  }
+  EXPECT_EQ(5, rejected->count("slow"));
+  delete tp;
+}
+
 ///////////////////Deadlock freedom test/////////////////////////////////////
 
 TEST(ThreadPoolTest, DeadlockFreedom) {
@@ -0,0 +1,388 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+
+#include "machine/wire_header.h"
+
+#include <glog/logging.h>
+#include <string.h>
+#include <map>
+#include <string>
+
+#include "common/types.h"
+#include "common/varint.h"
+#include "proto/header.pb.h"
+
+using std::map;
+
+namespace {
+
+// First byte of a compact header. (Protobuf headers start with 0x08.)
+const uint8 kMagic = 0xC7;
+
+// Size of the fixed part of a compact header.
+const int kFixedSize = 44;
+
+// Name id meaning "not present", and name id meaning "sent inline in the
+// tail".
+const uint32 kNoName = 0;
+const uint32 kInlineName = 0xFFFFFFFF;
+
+// Flag bits.
+const uint8 kHasAckCounter = 1;
+const uint8 kHasDataPtr = 2;
+const uint8 kHasDataChannel = 4;
+const uint8 kHasMiscInt = 8;
+const uint8 kHasMiscString = 16;
+const uint8 kHasMiscBool = 32;
+const uint8 kHasMiscDouble = 64;
+const uint8 kHasCallId = 128;
+
+// Field offsets in the fixed part. All multi-byte fields are in host byte
+// order (every machine we deploy on is little-endian).
+const int kTypeOffset = 1;
+const int kPriorityOffset = 2;
+const int kFlagsOffset = 3;
+const int kFromOffset = 4;
+const int kToOffset = 12;
+const int kAppOffset = 20;
+const int kRpcOffset = 24;
+const int kCallbackAppOffset = 28;
+const int kCallbackRpcOffset = 32;
+const int kReplyOffset = 36;
+
+// Registered names, keyed by id. Only written during static initialization,
+// so reads need no locking.
+map<uint32, string>* Names() {
+  static map<uint32, string>* names = new map<uint32, string>();
+  return names;
+}
+
+// Returns the id under which 'name' is sent: kNoName if 'present' is false,
+// kInlineName if 'name' is not registered.
+uint32 NameID(bool present, const string& name) {
+  if (!present) {
+    return kNoName;
+  }
+  uint32 id = WireID(name.c_str());
+  map<uint32, string>::const_iterator it = Names()->find(id);
+  if (it == Names()->end() || it->second != name) {
+    return kInlineName;
+  }
+  return id;
+}
+
+template<typename T>
+void Put(char* dst, T value) {
+  memcpy(dst, &value, sizeof(value));
+}
+
+template<typename T>
+T Get(const char* src) {
+  T value;
+  memcpy(&value, src, sizeof(value));
+  return value;
+}
+
+void AppendString(string* out, const string& s) {
+  varint::Append64(out, s.size());
+  out->append(s);
+}
+
+// Reads a varint at '*pos' (advancing '*pos' past it). Returns false if it
+// runs past 'end'.
+bool ReadVarint(const char** pos, const char* end, uint64* x) {
+  // Parse64 doesn't bounds-check, so make sure the varint is complete.
+  const char* last = *pos;
+  while (last < end && last - *pos < 8 && (*last & 0x80)) {
+    last++;
+  }
+  if (last >= end) {
+    return false;
+  }
+  *pos = varint::Parse64(*pos, x);
+  return true;
+}
+
+bool ReadString(const char** pos, const char* end, string* s) {
+  uint64 size;
+  if (!ReadVarint(pos, end, &size) ||
+      size > static_cast<uint64>(end - *pos)) {
+    return false;
+  }
+  s->assign(*pos, size);
+  *pos += size;
+  return true;
+}
+
+// Sets a name field of 'header' from 'id', reading it from the tail if it
+// was sent inline. Returns false on malformed input or an unknown id.
+bool ReadName(
+    uint32 id,
+    const char** pos,
+    const char* end,
+    string* name) {
+  if (id == kInlineName) {
+    return ReadString(pos, end, name);
+  }
+  map<uint32, string>::const_iterator it = Names()->find(id);
+  if (it == Names()->end()) {
+    LOG(ERROR) << "unregistered wire name id: " << id;
+    return false;
+  }
+  *name = it->second;
+  return true;
+}
+
+// Returns true if 'header' can be sent in the compact layout.
+bool Compactable(const Header& header) {
+  // At most one of the fields sharing the reply slot.
+  int replies = (header.has_ack_counter() ? 1 : 0) +
+                (header.has_data_ptr() ? 1 : 0) +
+                (header.has_call_id() ? 1 : 0);
+  return header.misc_scalar_size() == 0 &&
+         header.status() == Header::OK &&
+         !header.has_external_host() &&
+         !header.has_external_port() &&
+         replies <= 1;
+}
+
+// Returns the value of whichever field uses the reply slot.
+uint64 ReplySlot(const Header& header) {
+  if (header.has_data_ptr()) {
+    return header.data_ptr();
+  }
+  if (header.has_call_id()) {
+    return header.call_id();
+  }
+  return header.ack_counter();
+}
+
+}  // namespace
+
+bool RegisterWireName(const string& name) {
+  uint32 id = WireID(name.c_str());
+  CHECK(id != kNoName && id != kInlineName) << "reserved wire id: " << name;
+  map<uint32, string>::iterator it = Names()->find(id);
+  if (it == Names()->end()) {
+    (*Names())[id] = name;
+  } else {
+    CHECK_EQ(it->second, name) << "wire id collision";
+  }
+  return true;
+}
+
+bool RegisterWireNames(const char* const* names, int count) {
+  for (int i = 0; i < count; i++) {
+    RegisterWireName(names[i]);
+  }
+  return true;
+}
+
+void EncodeHeader(const Header& header, string* out) {
+  out->clear();
+  if (!Compactable(header)) {
+    header.SerializeToString(out);
+    return;
+  }
+
+  uint8 flags = 0;
+  if (header.has_ack_counter()) flags |= kHasAckCounter;
+  if (header.has_data_ptr()) flags |= kHasDataPtr;
+  if (header.has_call_id()) flags |= kHasCallId;
+  if (header.has_data_channel()) flags |= kHasDataChannel;
+  if (header.misc_int_size() > 0) flags |= kHasMiscInt;
+  if (header.misc_string_size() > 0) flags |= kHasMiscString;
+  if (header.misc_bool_size() > 0) flags |= kHasMiscBool;
+  if (header.misc_double_size() > 0) flags |= kHasMiscDouble;
+
+  uint32 app = NameID(header.has_app(), header.app());
+  uint32 rpc = NameID(header.has_rpc(), header.rpc());
+  uint32 callback_app =
+      NameID(header.has_callback_app(), header.callback_app());
+  uint32 callback_rpc =
+      NameID(header.has_callback_rpc(), header.callback_rpc());
+
+  out->resize(kFixedSize);
+  char* fixed = &(*out)[0];
+  Put<uint8>(fixed, kMagic);
+  Put<uint8>(fixed + kTypeOffset, header.type());
+  Put<uint8>(fixed + kPriorityOffset, header.priority());
+  Put<uint8>(fixed + kFlagsOffset, flags);
+  Put<uint64>(fixed + kFromOffset, header.from());
+  Put<uint64>(fixed + kToOffset, header.to());
+  Put<uint32>(fixed + kAppOffset, app);
+  Put<uint32>(fixed + kRpcOffset, rpc);
+  Put<uint32>(fixed + kCallbackAppOffset, callback_app);
+  Put<uint32>(fixed + kCallbackRpcOffset, callback_rpc);
+  Put<uint64>(fixed + kReplyOffset, ReplySlot(header));
+
+  // Tail.
+  if (app == kInlineName) AppendString(out, header.app());
+  if (rpc == kInlineName) AppendString(out, header.rpc());
+  if (callback_app == kInlineName) AppendString(out, header.callback_app());
+  if (callback_rpc == kInlineName) AppendString(out, header.callback_rpc());
+  if (flags & kHasDataChannel) {
+    AppendString(out, header.data_channel());
+  }
+  if (flags & kHasMiscInt) {
+    varint::Append64(out, header.misc_int_size());
+    for (int i = 0; i < header.misc_int_size(); i++) {
+      varint::Append64(out, header.misc_int(i));
+    }
+  }
+  if (flags & kHasMiscString) {
+    varint::Append64(out, header.misc_string_size());
+    for (int i = 0; i < header.misc_string_size(); i++) {
+      AppendString(out, header.misc_string(i));
+    }
+  }
+  if (flags & kHasMiscBool) {
+    varint::Append64(out, header.misc_bool_size());
+    for (int i = 0; i < header.misc_bool_size(); i++) {
+      out->append(1, header.misc_bool(i) ? 1 : 0);
+    }
+  }
+  if (flags & kHasMiscDouble) {
+    varint::Append64(out, header.misc_double_size());
+    for (int i = 0; i < header.misc_double_size(); i++) {
+      double x = header.misc_double(i);
+      out->append(reinterpret_cast<const char*>(&x), sizeof(x));
+    }
+  }
+}
+
+bool DecodeHeader(const char* data, int size, Header* header) {
+  header->Clear();
+  if (size <= 0 || static_cast<uint8>(data[0]) != kMagic) {
+    // Compatibility mode: protobuf header.
+    if (!header->ParseFromArray(data, size)) {
+      return false;
+    }
+    if (header->has_app()) {
+      header->set_app_id(WireID(header->app().c_str()));
+    }
+    if (header->has_rpc()) {
+      header->set_rpc_id(WireID(header->rpc().c_str()));
+    }
+    return true;
+  }
+
+  if (size < kFixedSize) {
+    return false;
+  }
+  uint8 type = Get<uint8>(data + kTypeOffset);
+  uint8 priority = Get<uint8>(data + kPriorityOffset);
+  if (!Header::Type_IsValid(type) || !Header::Priority_IsValid(priority)) {
+    return false;
+  }
+  header->set_type(static_cast<Header::Type>(type));
+  header->set_priority(static_cast<Header::Priority>(priority));
+  header->set_from(Get<uint64>(data + kFromOffset));
+  header->set_to(Get<uint64>(data + kToOffset));
+
+  uint8 flags = Get<uint8>(data + kFlagsOffset);
+  uint64 reply = Get<uint64>(data + kReplyOffset);
+  if (flags & kHasAckCounter) {
+    header->set_ack_counter(reply);
+  }
+  if (flags & kHasDataPtr) {
+    header->set_data_ptr(reply);
+  }
+  if (flags & kHasCallId) {
+    header->set_call_id(reply);
+  }
+
+  const char* pos = data + kFixedSize;
+  const char* end = data + size;
+  uint32 app = Get<uint32>(data + kAppOffset);
+  uint32 rpc = Get<uint32>(data + kRpcOffset);
+  uint32 callback_app = Get<uint32>(data + kCallbackAppOffset);
+  uint32 callback_rpc = Get<uint32>(data + kCallbackRpcOffset);
+  if (app != kNoName) {
+    if (!ReadName(app, &pos, end, header->mutable_app())) {
+      return false;
+    }
+    header->set_app_id(WireID(header->app().c_str()));
+  }
+  if (rpc != kNoName) {
+    if (!ReadName(rpc, &pos, end, header->mutable_rpc())) {
+      return false;
+    }
+    header->set_rpc_id(WireID(header->rpc().c_str()));
+  }
+  if (callback_app != kNoName &&
+      !ReadName(callback_app, &pos, end, header->mutable_callback_app())) {
+    return false;
+  }
+  if (callback_rpc != kNoName &&
+      !ReadName(callback_rpc, &pos, end, header->mutable_callback_rpc())) {
+    return false;
+  }
+  if ((flags & kHasDataChannel) &&
+      !ReadString(&pos, end, header->mutable_data_channel())) {
+    return false;
+  }
+  if (flags & kHasMiscInt) {
+    uint64 count;
+    if (!ReadVarint(&pos, end, &count) ||
+        count > static_cast<uint64>(end - pos)) {
+      return false;
+    }
+    for (uint64 i = 0; i < count; i++) {
+      uint64 x;
+      if (!ReadVarint(&pos, end, &x)) {
+        return false;
+      }
+      header->add_misc_int(x);
+    }
+  }
+  if (flags & kHasMiscString) {
+    uint64 count;
+    if (!ReadVarint(&pos, end, &count) ||
+        count > static_cast<uint64>(end - pos)) {
+      return false;
+    }
+    for (uint64 i = 0; i < count; i++) {
+      if (!ReadString(&pos, end, header->add_misc_string())) {
+        return false;
+      }
+    }
+  }
+  if (flags & kHasMiscBool) {
+    uint64 count;
+    if (!ReadVarint(&pos, end, &count) ||
+        count > static_cast<uint64>(end - pos)) {
+      return false;
+    }
+    for (uint64 i = 0; i < count; i++) {
+      header->add_misc_bool(*pos++ != 0);
+    }
+  }
+  if (flags & kHasMiscDouble) {
+    uint64 count;
+    if (!ReadVarint(&pos, end, &count) ||
+        count > static_cast<uint64>(end - pos) / sizeof(double)) {
+      return false;
+    }
+    for (uint64 i = 0; i < count; i++) {
+      header->add_misc_double(Get<double>(pos));
+      pos += sizeof(double);
+    }
+  }
+  return pos == end;
+}
+
+uint64 PeekHeaderSender(const char* data, int size) {
+  if (size >= kFixedSize && static_cast<uint8>(data[0]) == kMagic) {
+    return Get<uint64>(data + kFromOffset);
+  }
+
+  // Protobuf serializes fields in field number order, so 'from' (field 1, a
+  // varint) is always encoded first.
+  const char* pos = data + 1;
+  uint64 from;
+  if (size < 2 || data[0] != 0x08 || !ReadVarint(&pos, data + size, &from)) {
+    return 0;
+  }
+  return from;
+}
@@ -0,0 +1,81 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+// Compact binary wire encoding of message Headers.
+//
+// Machines exchange Headers in a fixed 44-byte layout in which app and RPC
+// names are replaced by 32-bit ids (FNV-1a hashes of the names), followed by
+// a variable-length tail only for fields that need one (data channel names,
+// misc fields, and names that were never registered). Headers with fields
+// the compact layout can't express (misc_scalar, external_*, and any status
+// other than OK, which only rejected RPCs' replies carry) fall back to
+// protobuf encoding, which DecodeHeader also accepts. Since 'from' is the
+// required field 1, a serialized protobuf Header always starts with the byte
+// 0x08, so the two encodings are told apart by their first byte. External
+// clients keep using plain protobuf Headers.
+//
+// A name is only sent as an id if it was registered (in every process of the
+// deployment) during static initialization: REGISTER_APP registers the app
+// type name, and REGISTER_APP_NAMES registers the RPC and app instance names
+// an app uses. Unregistered names are sent inline in the tail.
+//
+// Apps can dispatch on RPC ids instead of comparing strings:
+//
+//   switch (RpcID(*header)) {
+//     case WireID("GET"):
+//       ...
+//     case WireID("PUT"):
+//       ...
+//   }
+//
+// (Two RPC names whose ids collide in one switch fail to compile.)
+
+#ifndef CALVIN_MACHINE_WIRE_HEADER_H_
+#define CALVIN_MACHINE_WIRE_HEADER_H_
+
+#include <string>
+#include "common/types.h"
+#include "proto/header.pb.h"
+
+using std::string;
+
+// Returns the 32-bit FNV-1a hash of 's', starting from hash 'h'.
+constexpr uint32 WireIDHelper(const char* s, uint32 h) {
+  return *s == '\0'
+      ? h
+      : WireIDHelper(s + 1, (h ^ static_cast<uint8>(*s)) * 16777619u);
+}
+
+// Returns the wire id of the name 's'. Usable in case labels.
+constexpr uint32 WireID(const char* s) {
+  return WireIDHelper(s, 2166136261u);
+}
+
+// Registers 'name' (or each of the 'count' names in 'names') for compact
+// encoding. Must be called during static initialization; dies if a name's
+// id collides with a different registered name. Always returns true.
+bool RegisterWireName(const string& name);
+bool RegisterWireNames(const char* const* names, int count);
+
+// Sets '*out' to the wire encoding of 'header'.
+void EncodeHeader(const Header& header, string* out);
+
+// Parses a compact or protobuf encoded header from 'data', also setting its
+// app_id and rpc_id fields. Returns false if it is malformed.
+bool DecodeHeader(const char* data, int size, Header* header);
+
+// Returns the id of 'header's RPC. Cheap for decoded headers; hashes the RPC
+// name otherwise.
+inline uint32 RpcID(const Header& header) {
+  return header.has_rpc_id() ? header.rpc_id() : WireID(header.rpc().c_str());
+}
+
+// Returns the id of 'header's app, likewise.
+inline uint32 AppID(const Header& header) {
+  return header.has_app_id() ? header.app_id() : WireID(header.app().c_str());
+}
+
+// Returns the sender of an encoded header (compact or protobuf) without
+// decoding the rest of it, or 0 if it can't be determined.
+uint64 PeekHeaderSender(const char* data, int size);
+
+#endif  // CALVIN_MACHINE_WIRE_HEADER_H_
@@ -0,0 +1,147 @@
+// Author: Alexander Thomson <thomson@cs.yale.edu>
+//
+
+#include "machine/wire_header.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <string>
+
+#include "proto/header.pb.h"
+
+bool registered_ = RegisterWireName("registered") &&
+                   RegisterWireName("REGISTERED_RPC");
+
+void ExpectRoundTrip(const Header& header) {
+  string encoded;
+  EncodeHeader(header, &encoded);
+  Header decoded;
+  EXPECT_TRUE(DecodeHeader(encoded.data(), encoded.size(), &decoded));
+  EXPECT_EQ(header.from(), PeekHeaderSender(encoded.data(), encoded.size()));
+
+  // Decoding also sets the app and rpc ids (and priority, which the compact
+  // layout always carries).
+  Header expected(header);
+  expected.set_priority(header.priority());
+  if (expected.has_app()) {
+    expected.set_app_id(WireID(expected.app().c_str()));
+  }
+  if (expected.has_rpc()) {
+    expected.set_rpc_id(WireID(expected.rpc().c_str()));
+  }
+  EXPECT_EQ(expected.SerializeAsString(), decoded.SerializeAsString())
+      << expected.DebugString() << decoded.DebugString();
+}
+
+TEST(WireHeaderTest, WireID) {
+  // FNV-1a test vectors.
+  EXPECT_EQ(2166136261u, WireID(""));
+  EXPECT_EQ(0xe40c292cu, WireID("a"));
+  EXPECT_EQ(0xbf9cf968u, WireID("foobar"));
+
+  Header header;
+  header.set_rpc("GET");
+  EXPECT_EQ(WireID("GET"), RpcID(header));
+  header.set_rpc_id(12345);
+  EXPECT_EQ(12345, RpcID(header));
+}
+
+TEST(WireHeaderTest, RoundTrip) {
+  Header header;
+  header.set_from(3);
+  header.set_to(1ULL << 40);
+  header.set_type(Header::RPC);
+  ExpectRoundTrip(header);
+
+  // Registered names.
+  header.set_app("registered");
+  header.set_rpc("REGISTERED_RPC");
+  header.set_priority(Header::LOW);
+  ExpectRoundTrip(header);
+
+  // Unregistered names are sent inline.
+  header.set_callback_app("unregistered");
+  header.set_callback_rpc("registered");
+  header.set_ack_counter(0xdeadbeef);
+  ExpectRoundTrip(header);
+
+  // Misc fields.
+  header.clear_ack_counter();
+  header.set_data_ptr(77);
+  header.add_misc_int(0);
+  header.add_misc_int(~0ULL);
+  header.add_misc_string("");
+  header.add_misc_string(string(300, 'x'));
+  header.add_misc_bool(true);
+  header.add_misc_bool(false);
+  header.add_misc_double(1.5);
+  ExpectRoundTrip(header);
+
+  header.clear_data_ptr();
+  header.set_data_channel("channel");
+  ExpectRoundTrip(header);
+
+  header.set_call_id(0x7f0012345678ULL);
+  ExpectRoundTrip(header);
+  header.clear_call_id();
+
+  // Falls back to protobuf.
+  header.set_external_host("localhost");
+  header.set_external_port(1234);
+  ExpectRoundTrip(header);
+  header.clear_external_host();
+  header.clear_external_port();
+  header.set_ack_counter(1);
+  header.set_data_ptr(2);
+  ExpectRoundTrip(header);
+  header.clear_data_ptr();
+  header.set_status(Header::OVERLOADED);
+  ExpectRoundTrip(header);
+}
+
+TEST(WireHeaderTest, Compact) {
+  Header header;
+  header.set_from(1);
+  header.set_to(2);
+  header.set_type(Header::RPC);
+  header.set_app("registered");
+  header.set_rpc("REGISTERED_RPC");
+  header.set_callback_app("registered");
+  header.set_callback_rpc("REGISTERED_RPC");
+  header.set_ack_counter(12345);
+  string encoded;
+  EncodeHeader(header, &encoded);
+  EXPECT_EQ(44, encoded.size());
+  EXPECT_GT(header.ByteSize(), encoded.size());
+}
+
+TEST(WireHeaderTest, Malformed) {
+  Header header;
+  header.set_from(1);
+  header.set_to(2);
+  header.set_type(Header::DATA);
+  header.set_app("unregistered");
+  header.add_misc_string("asdf");
+  string encoded;
+  EncodeHeader(header, &encoded);
+
+  Header decoded;
+  for (uint32 i = 1; i < encoded.size(); i++) {
+    EXPECT_FALSE(DecodeHeader(encoded.data(), i, &decoded));
+  }
+  EXPECT_FALSE(DecodeHeader((encoded + "x").data(), encoded.size() + 1,
+                            &decoded));
+
+  // Unknown name id.
+  encoded[20] ^= 1;
+  encoded[21] ^= 1;
+  EXPECT_FALSE(DecodeHeader(encoded.data(), encoded.size(), &decoded));
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
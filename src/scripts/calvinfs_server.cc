@@ -6,6 +6,7 @@
 
 #include "machine/cluster_config.h"
 #include "machine/machine.h"
+#include "machine/thread_pool/thread_pool.h"
 #include "components/log/log.h"
 #include "components/log/log_app.h"
 #include "components/log/paxos.h"
@@ -31,6 +32,13 @@ DEFINE_int32(experiment, 0, "experiment that you want to run");
 DEFINE_int32(clients, 20, "number of concurrent clients on each machine");
 DEFINE_int32(max_active, 1000, "max active actions for locking scheduler");
 DEFINE_int32(max_running, 100, "max running actions for locking scheduler");
+DEFINE_int32(block_cache_mb, 256, "size of each machine's remote block cache");
+DEFINE_double(block_gc_interval, 0,
+              "seconds between block garbage collection rounds (0 = never)");
+DEFINE_int32(client_max_running, 64,
+             "max concurrently running client requests (0 = no limit)");
+DEFINE_int32(client_max_queued, 1000,
+             "max queued client requests before rejecting more (0 = no limit)");
 
 int main(int argc, char** argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
@@ -71,8 +79,39 @@ int main(int argc, char** argv) {
   Machine m(FLAGS_machine_id, cc);
   Spin(1);
 
+  // Paxos, log, lock-release (RUNLOCAL completion) and scheduler traffic runs
+  // in its own, heavier weighted RPC class, so it never waits behind client
+  // requests. Client requests are limited, and rejected once too many are
+  // queued.
+  RpcClassOptions critical;
+  critical.weight = 4096;
+  m.AddRpcClass("critical", critical);
+  m.AssignRpcClass("paxos2", "", "critical");
+  m.AssignRpcClass("blocklog", "", "critical");
+  m.AssignRpcClass("scheduler", "", "critical");
+  m.AssignRpcClass("metadata", "RUNLOCAL", "critical");
+  m.AssignRpcClass("metadata", "REMOTE_READS", "critical");
+  // Client requests wait on dentry lookups, so these must never queue behind
+  // them.
+  m.AssignRpcClass("metadata", "RESOLVE", "critical");
+
+  RpcClassOptions clients;
+  clients.weight = 512;
+  clients.max_running = FLAGS_client_max_running;
+  clients.max_queued = FLAGS_client_max_queued;
+  m.AddRpcClass("clients", clients);
+  const char* client_rpcs[] = {
+    "LS", "READ_FILE", "CREATE_FILE", "APPEND", "COPY_FILE", "RENAME_FILE"
+  };
+  for (uint32 i = 0; i < sizeof(client_rpcs) / sizeof(client_rpcs[0]); i++) {
+    m.AssignRpcClass("client", client_rpcs[i], "clients");
+  }
+
   string fsconfig;
-  MakeCalvinFSConfig(partitions, replicas).SerializeToString(&fsconfig);
+  CalvinFSConfig config = MakeCalvinFSConfig(partitions, replicas);
+  config.set_block_cache_bytes(static_cast<uint64>(FLAGS_block_cache_mb) << 20);
+  config.set_block_gc_interval(FLAGS_block_gc_interval);
+  config.SerializeToString(&fsconfig);
   m.AppData()->Put("calvinfs-config", fsconfig);
   Spin(1);
 
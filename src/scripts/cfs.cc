@@ -37,44 +37,42 @@ int main(int argc, char** argv) {
 
   vector<pair<Header*, MessageBuffer*> > results(1);
 
-  Header* h;
-  MessageBuffer* m;
   if (FLAGS_command == "ls") {
     header->set_rpc("LS");
     connection.SendMessage(header, new MessageBuffer());
-    connection.GetMessage(&h, &m);
-    std::cout << *m;
 
   } else if (FLAGS_command == "cat") {
     header->set_rpc("READ_FILE");
     connection.SendMessage(header, new MessageBuffer());
-    connection.GetMessage(&h, &m);
-    std::cout << *m;
 
   } else if (FLAGS_command == "mkdir") {
     header->set_rpc("CREATE_FILE");
     header->add_misc_bool(true);  // DIR
     connection.SendMessage(header, new MessageBuffer());
-    connection.GetMessage(&h, &m);
-    std::cout << *m;
 
   } else if (FLAGS_command == "touch") {
     header->set_rpc("CREATE_FILE");
     header->add_misc_bool(false);  // DATA
     connection.SendMessage(header, new MessageBuffer());
-    connection.GetMessage(&h, &m);
-    std::cout << *m;
 
   } else if (FLAGS_command == "append") {
     header->set_rpc("APPEND");
     connection.SendMessage(header, new MessageBuffer(FLAGS_data));
-    connection.GetMessage(&h, &m);
-    std::cout << *m;
 
   } else {
     LOG(FATAL) << "unknown command: " << FLAGS_command;
   }
 
+  Header* h;
+  MessageBuffer* m;
+  connection.GetMessage(&h, &m);
+  if (h->status() == Header::OVERLOADED) {
+    std::cerr << "machine " << machine_id << " is overloaded; try again later"
+              << std::endl;
+    return 1;
+  }
+  std::cout << *m;
+
   return 0;
 }
 